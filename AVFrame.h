@@ -32,6 +32,7 @@
   CGFrameBuffer *m_cgFrameBuffer;
   CVImageBufferRef m_cvBufferRef;
   BOOL m_isDuplicate;
+  CGRect m_dirtyRect;
 }
 
 #if TARGET_OS_IPHONE
@@ -56,6 +57,13 @@
 
 @property (nonatomic, assign) BOOL     isDuplicate;
 
+// The region of the framebuffer that changed since the previous frame returned
+// by the decoder, so that a consumer can upload or composite just that region.
+// A duplicate frame has an empty rect. The default value is CGRectNull, which
+// means the decoder does not track changes and the whole frame must be used.
+
+@property (nonatomic, assign) CGRect   dirtyRect;
+
 // Constructor
 
 + (AVFrame*) aVFrame;
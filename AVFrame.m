@@ -15,6 +15,15 @@
 @synthesize cgFrameBuffer = m_cgFrameBuffer;
 @synthesize cvBufferRef = m_cvBufferRef;
 @synthesize isDuplicate = m_isDuplicate;
+@synthesize dirtyRect = m_dirtyRect;
+
+- (id) init
+{
+  if ((self = [super init]) != nil) {
+    self->m_dirtyRect = CGRectNull;
+  }
+  return self;
+}
 
 // Constructor
 
@@ -32,12 +32,25 @@
   FILE *maxvidOutFile;
 
   off_t offset;
+  off_t writeOffset;
+  
+  // Write behind state, the pending buffer collects appended bytes
+  // until it is full and then it is written on the write queue.
+  
+  int   writeBehindFd;
+  char *pendingBuffer;
+  uint32_t pendingNumBytes;
+  off_t pendingOffset;
+  dispatch_queue_t writeQueue;
+  dispatch_semaphore_t writeSemaphore;
+  volatile int writeBehindErrno;
   CGSize m_movieSize;
 
   BOOL  isOpen;
   BOOL  m_genAdler;
   BOOL  m_isAllKeyframes;
   BOOL  m_genV3;
+  BOOL  m_writeBehind;
 #if MV_ENABLE_DELTAS
   BOOL  m_isDeltas;
 #endif // MV_ENABLE_DELTAS
@@ -65,6 +78,15 @@
 
 @property (nonatomic, assign) BOOL          genV3;
 
+// Set this property to TRUE before invoking open to write file data on
+// a dedicated I/O queue so that encoding the next frame overlaps with
+// writing the previous one. Frame data is copied into large page aligned
+// buffers and a bounded number of buffers can be waiting to be written,
+// so the encoder blocks only when the disk cannot keep up. A write error
+// is reported by the next write or by rewriteHeader.
+
+@property (nonatomic, assign) BOOL          writeBehind;
+
 #if MV_ENABLE_DELTAS
 
 // FALSE by default, if the mvid file was created with the
@@ -125,6 +147,12 @@
 
 - (BOOL) writeDeltaframe:(char*)ptr bufferSize:(int)bufferSize adler:(uint32_t)adler;
 
+// This version of writeDeltaframe also records the bounding box of the pixels
+// changed by the delta. Pass CGRectNull if the changed region is not known.
+// The rect is only stored in a V3 file.
+
+- (BOOL) writeDeltaframe:(char*)ptr bufferSize:(int)bufferSize adler:(uint32_t)adler dirtyRect:(CGRect)dirtyRect;
+
 - (BOOL) rewriteHeader;
 
 @end
@@ -7,6 +7,10 @@
 
 #import "AVMvidFileWriter.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
 //#define LOGGING
 
 #ifndef __OPTIMIZE__
@@ -18,12 +22,26 @@
 #define ALWAYS_GENERATE_ADLER
 #endif // EXTRA_CHECKS
 
+// In write behind mode, file data is written in chunks of this size and
+// at most WRITE_BEHIND_MAX_PENDING chunks can be waiting to be written.
+
+#define WRITE_BEHIND_CHUNK_SIZE (256 * MV_PAGESIZE)
+#define WRITE_BEHIND_MAX_PENDING 8
+
 @interface AVMvidFileWriter ()
 
 - (void) saveOffset;
 
 - (uint32_t) validateFileOffset:(BOOL)isKeyFrame;
 
+- (BOOL) appendBytes:(const void*)ptr length:(size_t)length;
+
+- (BOOL) writeBytes:(const void*)ptr length:(size_t)length atOffset:(off_t)fileOffset;
+
+- (void) submitPendingBuffer;
+
+- (BOOL) drainWriteBehind;
+
 @end
 
 // AVMvidFileWriter
@@ -39,16 +57,22 @@
 @synthesize movieSize = m_movieSize;
 @synthesize isAllKeyframes = m_isAllKeyframes;
 @synthesize genV3 = m_genV3;
+@synthesize writeBehind = m_writeBehind;
 
 #if MV_ENABLE_DELTAS
 @synthesize isDeltas = m_isDeltas;
 #endif // MV_ENABLE_DELTAS
 
-// Emit zero length words up to the next page bound after the keyframe data.
+// Emit zero bytes up to the next page bound after the keyframe data.
 // Pass in the current offset, function returns the new offset.
-// This method will emit zero words of padding if exactly on the page bound already.
+// This method will emit zero bytes of padding if exactly on the page bound already.
+// The padding is emitted with a single write from a static zero page, since
+// writing the padding one word at a time made up a significant portion of
+// the time needed to write an all keyframe movie.
+
+static const uint8_t zeroPage[MV_PAGESIZE];
 
-- (off_t) paddingAfterKeyframe:(FILE*)outFile offset:(off_t)_offset
+- (off_t) paddingAfterKeyframe:(off_t)_offset
 {
 #if defined(DEBUG)
   if (self.genV3) {
@@ -60,42 +84,26 @@
   
   const uint32_t boundSize = MV_PAGESIZE;
   uint32_t bytesToBound = UINTMOD((uint32_t)_offset, boundSize);
-  assert(bytesToBound >= 0 && bytesToBound <= boundSize);
-  
-  bytesToBound = boundSize - bytesToBound;
+  assert(bytesToBound >= 0 && bytesToBound < boundSize);
   
-  if (self.genV3) {
-    uint32_t nBytesToWordBound = bytesToBound % sizeof(uint32_t);
-    uint8_t zeroByte = 0;
-    while (nBytesToWordBound != 0) {
-      size_t size = fwrite(&zeroByte, sizeof(zeroByte), 1, outFile);
-      assert(size == 1);
-      nBytesToWordBound--;
-      bytesToBound--;
-    }
+  if (bytesToBound != 0) {
+    bytesToBound = boundSize - bytesToBound;
   }
   
-  uint32_t wordsToBound = bytesToBound >> 2;
-  wordsToBound &= ((MV_PAGESIZE >> 2) - 1);
-  
 #if defined(DEBUG)
-  if (wordsToBound > 0) {
-    assert(bytesToBound == (wordsToBound * 4));
-    assert(wordsToBound < (boundSize / 4));
+  if (self.genV3) {
+    // Nop
+  } else {
+    assert((bytesToBound % 4) == 0);
   }
 #endif // DEBUG
   
-  // write aligned words
-  
-  uint32_t zero = 0;
-  while (wordsToBound != 0) {
-    size_t size = fwrite(&zero, sizeof(zero), 1, outFile);
-    assert(size == 1);
-    wordsToBound--;
+  if (bytesToBound > 0) {
+    BOOL worked = [self appendBytes:zeroPage length:bytesToBound];
+    assert(worked);
   }
   
-  off_t offsetAfterOff = ftello(outFile);
-  assert(offsetAfterOff != -1);
+  off_t offsetAfterOff = self->writeOffset;
   
   if (self.genV3) {
     // Nop
@@ -120,12 +128,20 @@
     fclose(maxvidOutFile);
     maxvidOutFile = NULL;
   }
+  if (writeQueue) {
+    [self drainWriteBehind];
+    close(writeBehindFd);
+    dispatch_release(writeQueue);
+    writeQueue = NULL;
+    dispatch_release(writeSemaphore);
+    writeSemaphore = NULL;
+  }
   isOpen = FALSE;
 }
 
 - (void) dealloc
 {
-  if (maxvidOutFile) {
+  if (maxvidOutFile || writeQueue) {
     [self close];
   }
   
@@ -175,10 +191,24 @@
   
   char *mvidStr = (char*)[self.mvidPath UTF8String];
   
-  maxvidOutFile = fopen(mvidStr, "wb");
+  writeOffset = 0;
   
-  if (maxvidOutFile == NULL) {
-    return FALSE;
+  if (self.writeBehind) {
+    writeBehindFd = open(mvidStr, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (writeBehindFd == -1) {
+      return FALSE;
+    }
+    
+    writeQueue = dispatch_queue_create("mvidfilewriter.writebehind", DISPATCH_QUEUE_SERIAL);
+    writeSemaphore = dispatch_semaphore_create(WRITE_BEHIND_MAX_PENDING);
+    writeBehindErrno = 0;
+  } else {
+    maxvidOutFile = fopen(mvidStr, "wb");
+    
+    if (maxvidOutFile == NULL) {
+      return FALSE;
+    }
   }
   
   mvHeader = malloc(sizeof(MVFileHeader));
@@ -189,10 +219,7 @@
 
   // Write zeroed file header
   
-  int numWritten = 0;
-  
-  numWritten = (int) fwrite(mvHeader, sizeof(MVFileHeader), 1, maxvidOutFile);
-  if (numWritten != 1) {
+  if ([self appendBytes:mvHeader length:sizeof(MVFileHeader)] == FALSE) {
     return FALSE;
   }
   
@@ -211,8 +238,7 @@
     return FALSE;
   }
   memset(mvFramesArray, 0, numBytes);
-  numWritten = (int) fwrite(mvFramesArray, numBytes, 1, maxvidOutFile);
-  if (numWritten != 1) {
+  if ([self appendBytes:mvFramesArray length:numBytes] == FALSE) {
     return FALSE;
   }
   
@@ -354,13 +380,12 @@
 
 - (void) saveOffset
 {
-  offset = ftello(maxvidOutFile);
-  NSAssert(offset != -1, @"ftello returned -1");
+  offset = writeOffset;
   
   if (self.genV3) {
     // Nop
   } else {
-    NSAssert(offset < 0xFFFFFFFF, @"ftello offset must fit into 32 bits, got %qd", offset);
+    NSAssert(offset < 0xFFFFFFFF, @"file offset must fit into 32 bits, got %qd", offset);
   }
   
 #ifdef LOGGING
@@ -376,7 +401,7 @@
 
 - (void) skipToNextPageBound
 {
-  offset = [self paddingAfterKeyframe:maxvidOutFile offset:offset];
+  offset = [self paddingAfterKeyframe:offset];
  
   NSAssert(frameNum < self.totalNumFrames, @"totalNumFrames");
   
@@ -425,9 +450,7 @@
   
   [self skipToNextPageBound];
   
-  int numWritten = (int) fwrite(ptr, bufferSize, 1, maxvidOutFile);
-  
-  if (numWritten != 1) {
+  if ([self appendBytes:ptr length:bufferSize] == FALSE) {
     return FALSE;
   } else {
     // Finish emitting frame data
@@ -479,7 +502,7 @@
     
     // zero pad to next page bound
     
-    offset = [self paddingAfterKeyframe:maxvidOutFile offset:offset];
+    offset = [self paddingAfterKeyframe:offset];
     assert(offset > 0); // silence compiler/analyzer warning
     
 #ifdef LOGGING
@@ -540,28 +563,28 @@
   
 #endif // MV_ENABLE_DELTAS
   
-  (void)fseek(maxvidOutFile, 0L, SEEK_SET);
+  // In write behind mode, wait for all the frame data to be written
+  // before the header is written.
   
-  int numWritten = (int) fwrite(mvHeader, sizeof(MVFileHeader), 1, maxvidOutFile);
-  if (numWritten != 1) {
+  if (writeQueue && [self drainWriteBehind] == FALSE) {
     return FALSE;
   }
   
-  numWritten = (int) fwrite(mvFramesArray, framesArrayNumBytes, 1, maxvidOutFile);
-  if (numWritten != 1) {
+  if ([self writeBytes:mvHeader length:sizeof(MVFileHeader) atOffset:0] == FALSE) {
     return FALSE;
-  }  
+  }
+  
+  if ([self writeBytes:mvFramesArray length:framesArrayNumBytes atOffset:sizeof(MVFileHeader)] == FALSE) {
+    return FALSE;
+  }
   
   // Once all valid data and headers have been written, it is now safe to write the
   // file header magic number. This ensures that any threads reading the first word
   // of the file looking for a valid magic number will only ever get consistent
   // data in a read when a valid magic number is read.
   
-  (void)fseek(maxvidOutFile, 0L, SEEK_SET);
-  
   uint32_t magic = MV_FILE_MAGIC;
-  numWritten = (int) fwrite(&magic, sizeof(uint32_t), 1, maxvidOutFile);
-  if (numWritten != 1) {
+  if ([self writeBytes:&magic length:sizeof(uint32_t) atOffset:0] == FALSE) {
     return FALSE;
   }
   
@@ -571,6 +594,11 @@
 // write delta frame, non-zero adler must be passed if adler is enabled
 
 - (BOOL) writeDeltaframe:(char*)ptr bufferSize:(int)bufferSize adler:(uint32_t)adler
+{
+  return [self writeDeltaframe:ptr bufferSize:bufferSize adler:adler dirtyRect:CGRectNull];
+}
+
+- (BOOL) writeDeltaframe:(char*)ptr bufferSize:(int)bufferSize adler:(uint32_t)adler dirtyRect:(CGRect)dirtyRect
 {
 #ifdef LOGGING
   NSLog(@"writeDeltaframe %d : bufferSize %d", frameNum, bufferSize);
@@ -580,9 +608,7 @@
   
   [self saveOffset];
   
-  int numWritten = (int) fwrite(ptr, bufferSize, 1, maxvidOutFile);
-  
-  if (numWritten != 1) {
+  if ([self appendBytes:ptr length:bufferSize] == FALSE) {
     return FALSE;
   } else {
     // Finish writing the frame data
@@ -601,6 +627,18 @@
       maxvid_v3_frame_setlength(mvFrame, length);
       
       mvFrame->adler = adler;
+      
+      if (!CGRectIsNull(dirtyRect)) {
+        uint32_t width = (uint32_t) self.movieSize.width;
+        uint32_t height = (uint32_t) self.movieSize.height;
+        NSAssert(width > 0 && height > 0, @"movieSize must be set before writing a dirty rect");
+        
+        maxvid_v3_frame_setdirtyrect(mvFrame, width, height,
+                                     (uint32_t) CGRectGetMinX(dirtyRect),
+                                     (uint32_t) CGRectGetMinY(dirtyRect),
+                                     (uint32_t) CGRectGetMaxX(dirtyRect),
+                                     (uint32_t) CGRectGetMaxY(dirtyRect));
+      }
     } else {
       MVFrame *mvFrame = &(((MVFrame*)mvFramesArray)[frameNum]);
       
@@ -638,13 +676,12 @@
 - (uint32_t) validateFileOffset:(BOOL)isKeyFrame
 {
   off_t offsetBefore = self->offset;
-  offset = ftello(maxvidOutFile);
-  NSAssert(offset != -1, @"ftello returned -1");
+  offset = writeOffset;
   
   if (self.genV3) {
     // nop
   } else {
-    NSAssert(offset < 0xFFFFFFFF, @"ftello offset must fit into 32 bits, got %qd", offset);
+    NSAssert(offset < 0xFFFFFFFF, @"file offset must fit into 32 bits, got %qd", offset);
   }
   off_t lengthOff = offset - offsetBefore;
   assert(lengthOff < 0xFFFFFFFF);
@@ -671,11 +708,10 @@
     if ((length % 4) != 0) {
       // Write a zero half-word to the file so that additional padding is in terms of whole words.
       uint16_t zeroHalfword = 0;
-      size_t size = fwrite(&zeroHalfword, sizeof(zeroHalfword), 1, maxvidOutFile);
-      assert(size == 1);
-      offset = ftello(maxvidOutFile);
-      NSAssert(offset != -1, @"ftello returned -1");
-      NSAssert(offset < 0xFFFFFFFF, @"ftello offset must fit into 32 bits, got %qd", offset);
+      BOOL worked = [self appendBytes:&zeroHalfword length:sizeof(zeroHalfword)];
+      assert(worked);
+      offset = writeOffset;
+      NSAssert(offset < 0xFFFFFFFF, @"file offset must fit into 32 bits, got %qd", offset);
       // Note that length is not recalculated. If a delta frame appears after this
       // one, it must begin on a word bound. The frame length ignores the halfword padding.
       //length = ...;
@@ -687,4 +723,129 @@
   return length;
 }
 
+// Append bytes to the end of the file. In write behind mode the bytes are
+// copied into the pending buffer and full buffers are queued to be written.
+
+- (BOOL) appendBytes:(const void*)ptr length:(size_t)length
+{
+  if (writeQueue == NULL) {
+    size_t numWritten = fwrite(ptr, length, 1, maxvidOutFile);
+    if (numWritten != 1) {
+      return FALSE;
+    }
+    writeOffset += length;
+    return TRUE;
+  }
+  
+  if (writeBehindErrno != 0) {
+    return FALSE;
+  }
+  
+  const char *inPtr = (const char*) ptr;
+  
+  while (length > 0) {
+    if (pendingBuffer == NULL) {
+      pendingBuffer = valloc(WRITE_BEHIND_CHUNK_SIZE);
+      if (pendingBuffer == NULL) {
+        return FALSE;
+      }
+      pendingNumBytes = 0;
+      pendingOffset = writeOffset;
+    }
+    
+    size_t numBytes = MIN(length, WRITE_BEHIND_CHUNK_SIZE - pendingNumBytes);
+    memcpy(pendingBuffer + pendingNumBytes, inPtr, numBytes);
+    pendingNumBytes += numBytes;
+    writeOffset += numBytes;
+    inPtr += numBytes;
+    length -= numBytes;
+    
+    if (pendingNumBytes == WRITE_BEHIND_CHUNK_SIZE) {
+      [self submitPendingBuffer];
+    }
+  }
+  
+  return TRUE;
+}
+
+// Write bytes at a specific offset, this is used to rewrite the header
+// once all the frame data has been written.
+
+- (BOOL) writeBytes:(const void*)ptr length:(size_t)length atOffset:(off_t)fileOffset
+{
+  if (writeQueue == NULL) {
+    (void)fseeko(maxvidOutFile, fileOffset, SEEK_SET);
+    size_t numWritten = fwrite(ptr, length, 1, maxvidOutFile);
+    return (numWritten == 1);
+  }
+  
+  ssize_t numWritten = pwrite(writeBehindFd, ptr, length, fileOffset);
+  return (numWritten == (ssize_t)length);
+}
+
+// Hand the pending buffer over to the write queue, this blocks when
+// WRITE_BEHIND_MAX_PENDING buffers are already waiting to be written.
+// The buffer is freed on the write queue once it has been written.
+
+- (void) submitPendingBuffer
+{
+  char *buffer = pendingBuffer;
+  size_t bufferNumBytes = pendingNumBytes;
+  off_t bufferOffset = pendingOffset;
+  int fd = writeBehindFd;
+  dispatch_semaphore_t semaphore = writeSemaphore;
+  volatile int *errnoPtr = &writeBehindErrno;
+  
+  pendingBuffer = NULL;
+  pendingNumBytes = 0;
+  
+  dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+  
+  dispatch_async(writeQueue, ^{
+    const char *ptr = buffer;
+    size_t remaining = bufferNumBytes;
+    off_t fileOffset = bufferOffset;
+    
+    while (remaining > 0 && *errnoPtr == 0) {
+      ssize_t numWritten = pwrite(fd, ptr, remaining, fileOffset);
+      if (numWritten == -1) {
+        if (errno != EINTR) {
+          *errnoPtr = errno;
+        }
+        continue;
+      } else if (numWritten == 0) {
+        // No progress can be made, treat this as an error instead of
+        // trying the same write again forever.
+        *errnoPtr = EIO;
+        break;
+      }
+      ptr += numWritten;
+      remaining -= numWritten;
+      fileOffset += numWritten;
+    }
+    
+    free(buffer);
+    dispatch_semaphore_signal(semaphore);
+  });
+}
+
+// Queue any partially filled pending buffer and wait until all queued
+// buffers have been written. Returns FALSE if a write failed.
+
+- (BOOL) drainWriteBehind
+{
+  if (pendingBuffer) {
+    if (pendingNumBytes > 0) {
+      [self submitPendingBuffer];
+    } else {
+      free(pendingBuffer);
+      pendingBuffer = NULL;
+    }
+  }
+  
+  dispatch_sync(writeQueue, ^{});
+  
+  return (writeBehindErrno == 0);
+}
+
 @end
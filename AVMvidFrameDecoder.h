@@ -20,10 +20,71 @@
 @class SegmentedMappedData;
 #endif // USE_SEGMENTED_MMAP
 
+typedef struct FrameReadAhead FrameReadAhead;
+
+// A process wide cache of decoded frames that can be shared by every decoder
+// that plays the same file. Frames are keyed by the identity of the file
+// (device, inode, size, and modification time) and the frame index. A cached
+// frame holds an image of its framebuffer, so the pixels can't be written to
+// and a decoder can return the same frame that another decoder decoded. When
+// the cache holds more than maxNumBytes of pixels, the least recently used
+// frames are dropped. A dropped frame stays valid for as long as a caller
+// retains it. All methods are thread safe.
+
+@class AVMvidFrameCacheEntry;
+
+@interface AVMvidFrameCache : NSObject {
+@private
+  NSMutableDictionary *m_frames;
+  AVMvidFrameCacheEntry *m_leastRecentlyUsed;
+  AVMvidFrameCacheEntry *m_mostRecentlyUsed;
+  NSUInteger m_maxNumBytes;
+  NSUInteger m_numBytes;
+  NSUInteger m_numHits;
+  NSUInteger m_numMisses;
+}
+
+// Defaults to 64 MB
+
+@property (nonatomic, assign) NSUInteger maxNumBytes;
+
+// Number of pixel bytes currently held by the cache
+
+@property (nonatomic, readonly) NSUInteger numBytes;
+
+@property (nonatomic, readonly) NSUInteger numHits;
+@property (nonatomic, readonly) NSUInteger numMisses;
+
++ (AVMvidFrameCache*) aVMvidFrameCache;
+
+// The cache shared by all decoders in the process
+
++ (AVMvidFrameCache*) sharedFrameCache;
+
+// Return the cached frame for the key or nil
+
+- (AVFrame*) frameForKey:(NSString*)key;
+
+- (void) setFrame:(AVFrame*)frame forKey:(NSString*)key;
+
+- (void) removeAllFrames;
+
+// Fraction of lookups that found a cached frame, in the range 0.0 to 1.0
+
+- (float) hitRate;
+
+@end
+
+@class AVMvidResourceGovernor;
+
 @interface AVMvidFrameDecoder : AVFrameDecoder {
   NSString *m_filePath;
   MVFileHeader m_mvHeader;
   void *m_mvFrames;
+  void *m_frameTableMapping;
+  size_t m_frameTableMappingNumBytes;
+  BOOL m_lazyFrameTable;
+  BOOL m_frameTableUnreadable;
   BOOL m_isOpen;
   
 #if defined(USE_SEGMENTED_MMAP)
@@ -32,9 +93,37 @@
   NSData *m_mappedData;
 #endif // USE_SEGMENTED_MMAP
   
+  NSUInteger m_numFramebuffers;
+  NSUInteger m_maxFramebuffers;
+  uint32_t m_numFramebufferExhaustions;
+  
+  FrameReadAhead *m_readAhead;
+  
+  AVMvidFrameCache *m_frameCache;
+  AVMvidResourceGovernor *m_resourceGovernor;
+  
+  NSMutableDictionary *m_checkpoints;
+  NSUInteger m_checkpointSpacing;
+  NSUInteger m_maxCheckpointNumBytes;
+  NSUInteger m_checkpointNumBytes;
+  NSString *m_frameCacheFileKey;
+  BOOL m_readWithPread;
+  BOOL m_readNoCache;
+  
   CGFrameBuffer *m_currentFrameBuffer;  
   NSArray *m_cgFrameBuffers;
   
+  // Index of the frame that each framebuffer in m_cgFrameBuffers
+  // fully contains, or -1 when the contents are not known.
+  int *m_framebufferFrameIndexes;
+  
+  uint32_t m_numPartialDeltaCopies;
+  uint32_t m_numFullDeltaCopies;
+  
+  MVDeltaComposition m_deltaComposition;
+  BOOL m_composeDeltas;
+  uint32_t m_numComposedDeltas;
+  
   AVFrame *m_lastFrame;
   
 #if MV_ENABLE_DELTAS
@@ -52,6 +141,8 @@
 #endif // REGRESSION_TESTS
   
   BOOL m_upgradeFromV1;
+  BOOL m_reportAdlerMismatches;
+  uint32_t m_numAdlerMismatches;
 }
 
 @property (nonatomic, copy) NSString *filePath;
@@ -76,12 +167,111 @@
 
 @property (nonatomic, assign) BOOL upgradeFromV1;
 
+// When a decoded frame does not match the adler stored in the file, the
+// decoder asserts in builds that check the adler. Set this property to
+// count the mismatch in numAdlerMismatches and keep decoding instead, so
+// that a tool that verifies a file can report every bad frame.
+
+@property (nonatomic, assign) BOOL reportAdlerMismatches;
+@property (nonatomic, readonly) uint32_t numAdlerMismatches;
+
+// When lazyFrameTable is TRUE, openForReading reads only the file header. The
+// table of frame offsets that follows the header is mapped into memory the first
+// time a frame is accessed, so that opening a file to query the header costs one
+// small read no matter how many frames the file contains. If the table can't be
+// mapped or read at that point, advanceToFrame returns a frame with a nil image.
+
+@property (nonatomic, assign) BOOL lazyFrameTable;
+
+// Set this property before allocateDecodeResources to read frame data with
+// pread() instead of memory mapping the file. Each frame is read into one of
+// a small ring of page aligned buffers and the next few frames are read on a
+// background queue while the current frame is decoded, so that streaming many
+// large files does not keep all of them mapped.
+
+@property (nonatomic, assign) BOOL readWithPread;
+
+// When reading with pread(), do not keep the file data in the page cache.
+// This is F_NOCACHE on MacOSX, it has no effect where it is not supported.
+
+@property (nonatomic, assign) BOOL readNoCache;
+
+// Number of frames read by the caller thread and the number of frames
+// that had already been read ahead when readWithPread is enabled.
+
+@property (nonatomic, readonly) uint32_t numSyncReads;
+@property (nonatomic, readonly) uint32_t numReadAheadHits;
+
+// The number of framebuffers that decoded frames are written into, 3 by default.
+// A framebuffer can't be reused while a consumer still holds an image of the frame
+// in it, so a consumer that holds on to frames for a while (an upload queue or an
+// encoder) should set this before allocateDecodeResources.
+
+@property (nonatomic, assign) NSUInteger numFramebuffers;
+
+// When every framebuffer is in use, another one is allocated as long as the total
+// would not be larger than maxFramebuffers, 8 by default.
+
+@property (nonatomic, assign) NSUInteger maxFramebuffers;
+
+// Set this property to look up decoded frames in a cache shared with other
+// decoders before decoding and to add each decoded frame to the cache. Pass
+// [AVMvidFrameCache sharedFrameCache] so that N decoders playing the same file
+// decode each frame once. Note that a frame returned from the cache is a
+// copy of the decoded pixels, so each cache miss costs one extra copy.
+
+@property (nonatomic, retain) AVMvidFrameCache *frameCache;
+
+// When checkpointSpacing is larger than zero, a copy of the decoded frame is saved
+// for one frame in each run of checkpointSpacing frames as frames are decoded.
+// seekToFrame can then go back to an earlier frame by restoring the nearest saved
+// frame before it and applying the deltas after it, so that playing backwards
+// costs at most checkpointSpacing deltas per frame instead of decoding from
+// the previous keyframe. Defaults to zero.
+
+@property (nonatomic, assign) NSUInteger checkpointSpacing;
+
+// The saved frames are limited to this many bytes, 64 MB by default. When the limit
+// is reached, the saved frame furthest from the current frame is dropped.
+
+@property (nonatomic, assign) NSUInteger maxCheckpointNumBytes;
+
+// Number of bytes held by saved frames
+
+@property (nonatomic, readonly) NSUInteger checkpointNumBytes;
+
+// Move to any frame, including a frame before the current one. Moving forward is the
+// same as advanceToFrame. Moving backward restores the nearest checkpoint or decodes
+// from the keyframe before the frame, whichever is closer. A frame returned after
+// moving backward has a dirtyRect that covers the whole frame.
+
+- (AVFrame*) seekToFrame:(NSUInteger)newFrameIndex;
+
+// Set this property to have decode resources managed by a memory budget that is
+// shared with other decoders. See AVMvidResourceGovernor.
+
+@property (nonatomic, retain) AVMvidResourceGovernor *resourceGovernor;
+
+// Number of bytes currently allocated for decoding, this includes the framebuffers
+// and any read buffers but not the frame table.
+
+- (NSUInteger) decodeResourceNumBytes;
+
+// Number of times a framebuffer was needed but all framebuffers were in use
+
+@property (nonatomic, readonly) uint32_t numFramebufferExhaustions;
+
 + (AVMvidFrameDecoder*) aVMvidFrameDecoder;
 
 // Open resource identified by path
 
 - (BOOL) openForReading:(NSString*)path;
 
+// Open a file to query the values in the header, like the frame size and the
+// number of frames. This enables lazyFrameTable, so frames can still be decoded.
+
+- (BOOL) openHeaderForReading:(NSString*)path;
+
 // Close resource opened earlier
 
 - (void) close;
@@ -139,6 +329,30 @@
 
 - (BOOL) isAllKeyframes;
 
+// Return the region of the indicated frame that differs from the frame before it.
+// A nop frame returns CGRectZero, a keyframe or a delta frame without a recorded
+// dirty rect returns the whole frame. Each AVFrame returned by advanceToFrame
+// has a dirtyRect that is the union of the regions for all the frames applied.
+// Returns CGRectNull when the frame table can't be read.
+
+- (CGRect) dirtyRectForFrame:(NSUInteger)index;
+
+// Before a delta is applied the previous frame must be copied into the next
+// framebuffer. When the next framebuffer already holds a recent frame and the
+// dirty rects of the frames in between are known, only the changed rows are
+// copied. These counters report how often each kind of copy was done.
+
+@property (nonatomic, readonly) uint32_t numPartialDeltaCopies;
+@property (nonatomic, readonly) uint32_t numFullDeltaCopies;
+
+// When composeDeltas is TRUE and advanceToFrame skips over a series of 24/32 bpp
+// delta frames, the deltas are merged into one set of changed pixels where later
+// frames win, so that each changed pixel is written once instead of once per frame.
+// numComposedDeltas counts the delta frames that were applied this way.
+
+@property (nonatomic, assign) BOOL composeDeltas;
+@property (nonatomic, readonly) uint32_t numComposedDeltas;
+
 #if MV_ENABLE_DELTAS
 
 // If the mvid file was created with the -deltas encoding
@@ -156,3 +370,58 @@
 #endif // MV_ENABLE_DELTAS
 
 @end
+
+// A resource governor enforces a memory budget across many decoders, for example
+// when hundreds of animations are open at once but only a few are visible. Each
+// time a decoder managed by the governor advances to a frame it becomes the most
+// recently used decoder. If the decode resources of all the managed decoders add
+// up to more than maxNumBytes, then releaseDecodeResources is invoked on the least
+// recently used decoders until the total fits. A decoder that had its resources
+// released allocates them again on the next advanceToFrame and decodes from the
+// keyframe before the requested frame. Because resources are released from the
+// thread that advances another decoder, all the decoders managed by one governor
+// must be used from the same thread.
+
+struct AVMvidGovernorEntry;
+
+@interface AVMvidResourceGovernor : NSObject {
+@private
+  CFMutableDictionaryRef m_entries;
+  struct AVMvidGovernorEntry *m_leastRecentlyUsed;
+  struct AVMvidGovernorEntry *m_mostRecentlyUsed;
+  NSUInteger m_numBytes;
+  NSUInteger m_maxNumBytes;
+  NSUInteger m_numEvictions;
+}
+
+// Defaults to 256 MB
+
+@property (nonatomic, assign) NSUInteger maxNumBytes;
+
+// Number of times the resources of a decoder were released to fit the budget
+
+@property (nonatomic, readonly) NSUInteger numEvictions;
+
++ (AVMvidResourceGovernor*) aVMvidResourceGovernor;
+
++ (AVMvidResourceGovernor*) sharedResourceGovernor;
+
+// Total decode resources of all the managed decoders
+
+- (NSUInteger) numBytes;
+
+// Number of managed decoders
+
+- (NSUInteger) numDecoders;
+
+// These methods are invoked by AVMvidFrameDecoder, a decoder is not retained.
+
+- (void) addDecoder:(AVMvidFrameDecoder*)decoder;
+
+- (void) removeDecoder:(AVMvidFrameDecoder*)decoder;
+
+- (void) decoderWasUsed:(AVMvidFrameDecoder*)decoder;
+
+- (void) decoderResourcesChanged:(AVMvidFrameDecoder*)decoder;
+
+@end
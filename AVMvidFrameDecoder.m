@@ -29,6 +29,12 @@
 #import "SegmentedMappedData.h"
 #endif // USE_SEGMENTED_MMAP
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #ifndef __OPTIMIZE__
 // Automatically define EXTRA_CHECKS when not optimizing (in debug mode)
 # define EXTRA_CHECKS
@@ -47,6 +53,37 @@
 #define ALWAYS_CHECK_ADLER
 #endif // TARGET_OS_IPHONE
 
+// The framebuffer ring starts with DEFAULT_NUM_FRAMEBUFFERS buffers and can grow
+// to DEFAULT_MAX_FRAMEBUFFERS when every buffer is held by a consumer.
+
+#define DEFAULT_NUM_FRAMEBUFFERS 3
+#define DEFAULT_MAX_FRAMEBUFFERS 8
+
+#define DEFAULT_FRAME_CACHE_MAX_NUM_BYTES (64 * 1024 * 1024)
+
+#define DEFAULT_GOVERNOR_MAX_NUM_BYTES (256 * 1024 * 1024)
+
+#define DEFAULT_MAX_CHECKPOINT_NUM_BYTES (64 * 1024 * 1024)
+
+// A decoded frame saved so that playback can go backwards from it
+
+@interface AVMvidCheckpoint : NSObject {
+@public
+  int frameIndex;
+  CGFrameBuffer *frameBuffer;
+}
+@end
+
+@implementation AVMvidCheckpoint
+
+- (void) dealloc
+{
+  [self->frameBuffer release];
+  [super dealloc];
+}
+
+@end
+
 // private properties declaration for class
 
 @interface AVMvidFrameDecoder ()
@@ -57,8 +94,218 @@
 
 @property (nonatomic, assign) void *mvFrames;
 
+- (AVFrame*) _advanceToFrame:(NSUInteger)newFrameIndex;
+
+- (AVFrame*) _unreadableFrame;
+
+- (void) _removeCheckpoints;
+
+- (void) _freeFrameTable;
+
+- (BOOL) _composeDeltasToFrame:(int)newFrameIndex
+               nextFrameBuffer:(CGFrameBuffer*)nextFrameBuffer
+                     dirtyRect:(CGRect*)dirtyRectPtr;
+
 @end
 
+// When readWithPread is enabled, frame data is read with pread() into a small
+// ring of page aligned buffers. After a frame has been read, the next few frames
+// that contain data are read on a serial queue while the current frame is decoded.
+// A slot is only ever modified by the caller thread while no read is pending on it.
+
+#define READ_AHEAD_NUM_BUFFERS 4
+
+typedef struct {
+  char *buffer;
+  uint32_t bufferSize;
+  uint32_t length;
+  int frameIndex;
+  BOOL isPending;
+  BOOL readFailed;
+  dispatch_semaphore_t readDone;
+} FrameReadSlot;
+
+struct FrameReadAhead {
+  int fd;
+  dispatch_queue_t queue;
+  FrameReadSlot slots[READ_AHEAD_NUM_BUFFERS];
+  uint32_t numSyncReads;
+  uint32_t numReadAheadHits;
+};
+
+static
+FrameReadAhead* frame_read_ahead_open(const char *path, BOOL noCache)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  
+#if defined(F_NOCACHE)
+  if (noCache) {
+    fcntl(fd, F_NOCACHE, 1);
+  }
+#endif // F_NOCACHE
+  
+  FrameReadAhead *ra = calloc(1, sizeof(FrameReadAhead));
+  assert(ra);
+  ra->fd = fd;
+  ra->queue = dispatch_queue_create("mvidframedecoder.readahead", DISPATCH_QUEUE_SERIAL);
+  
+  for (int i = 0; i < READ_AHEAD_NUM_BUFFERS; i++) {
+    ra->slots[i].frameIndex = -1;
+    ra->slots[i].readDone = dispatch_semaphore_create(0);
+  }
+  
+  return ra;
+}
+
+static
+void frame_read_ahead_wait(FrameReadSlot *slot)
+{
+  if (slot->isPending) {
+    dispatch_semaphore_wait(slot->readDone, DISPATCH_TIME_FOREVER);
+    slot->isPending = FALSE;
+  }
+}
+
+static
+void frame_read_ahead_close(FrameReadAhead *ra)
+{
+  for (int i = 0; i < READ_AHEAD_NUM_BUFFERS; i++) {
+    FrameReadSlot *slot = &ra->slots[i];
+    frame_read_ahead_wait(slot);
+    free(slot->buffer);
+    dispatch_release(slot->readDone);
+  }
+  dispatch_release(ra->queue);
+  close(ra->fd);
+  free(ra);
+}
+
+// Choose the slot with the smallest frame index, an empty slot or a slot that
+// holds a frame that has already been decoded is reused before a read ahead slot.
+
+static
+FrameReadSlot* frame_read_ahead_victim(FrameReadAhead *ra, FrameReadSlot *inUseSlot)
+{
+  FrameReadSlot *victim = NULL;
+  
+  for (int i = 0; i < READ_AHEAD_NUM_BUFFERS; i++) {
+    FrameReadSlot *slot = &ra->slots[i];
+    if (slot == inUseSlot) {
+      continue;
+    }
+    if (victim == NULL || slot->frameIndex < victim->frameIndex) {
+      victim = slot;
+    }
+  }
+  
+  frame_read_ahead_wait(victim);
+  return victim;
+}
+
+static
+FrameReadSlot* frame_read_ahead_find(FrameReadAhead *ra, int frameIndex)
+{
+  for (int i = 0; i < READ_AHEAD_NUM_BUFFERS; i++) {
+    if (ra->slots[i].frameIndex == frameIndex) {
+      return &ra->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static
+BOOL frame_read_ahead_pread(int fd, char *buffer, uint32_t length, off_t offset)
+{
+  while (length > 0) {
+    ssize_t numRead = pread(fd, buffer, length, offset);
+    if (numRead == -1 && errno == EINTR) {
+      continue;
+    } else if (numRead <= 0) {
+      return FALSE;
+    }
+    buffer += numRead;
+    length -= numRead;
+    offset += numRead;
+  }
+  return TRUE;
+}
+
+// Make sure the slot buffer can hold length bytes, buffers are a whole number of pages.
+
+static
+void frame_read_ahead_reserve(FrameReadSlot *slot, uint32_t length)
+{
+  if (slot->bufferSize < length) {
+    uint32_t pagesize = getpagesize();
+    uint32_t bufferSize = ((length + pagesize - 1) / pagesize) * pagesize;
+    free(slot->buffer);
+    slot->buffer = valloc(bufferSize);
+    assert(slot->buffer);
+    slot->bufferSize = bufferSize;
+  }
+}
+
+// Queue a read of a frame that will be needed soon, does nothing if the
+// frame has already been read or is being read.
+
+static
+void frame_read_ahead_prefetch(FrameReadAhead *ra, FrameReadSlot *inUseSlot, int frameIndex, off_t offset, uint32_t length)
+{
+  if (frame_read_ahead_find(ra, frameIndex) != NULL) {
+    return;
+  }
+  
+  FrameReadSlot *slot = frame_read_ahead_victim(ra, inUseSlot);
+  frame_read_ahead_reserve(slot, length);
+  
+  slot->frameIndex = frameIndex;
+  slot->length = length;
+  slot->readFailed = FALSE;
+  slot->isPending = TRUE;
+  
+  int fd = ra->fd;
+  
+  dispatch_async(ra->queue, ^{
+    slot->readFailed = !frame_read_ahead_pread(fd, slot->buffer, length, offset);
+    dispatch_semaphore_signal(slot->readDone);
+  });
+}
+
+// Return the slot that contains the data for a frame, the frame is read
+// right away if it was not read ahead. Returns NULL if the read failed.
+
+static
+FrameReadSlot* frame_read_ahead_get(FrameReadAhead *ra, int frameIndex, off_t offset, uint32_t length)
+{
+  FrameReadSlot *slot = frame_read_ahead_find(ra, frameIndex);
+  
+  if (slot != NULL && slot->length == length) {
+    frame_read_ahead_wait(slot);
+    ra->numReadAheadHits++;
+  } else {
+    if (slot == NULL) {
+      slot = frame_read_ahead_victim(ra, NULL);
+    } else {
+      frame_read_ahead_wait(slot);
+    }
+    frame_read_ahead_reserve(slot, length);
+    slot->frameIndex = frameIndex;
+    slot->length = length;
+    slot->readFailed = !frame_read_ahead_pread(ra->fd, slot->buffer, length, offset);
+    ra->numSyncReads++;
+  }
+  
+  if (slot->readFailed) {
+    slot->frameIndex = -1;
+    return NULL;
+  }
+  
+  return slot;
+}
+
 
 @implementation AVMvidFrameDecoder
 
@@ -68,26 +315,47 @@
 @synthesize cgFrameBuffers = m_cgFrameBuffers;
 @synthesize lastFrame = m_lastFrame;
 @synthesize mvFrames = m_mvFrames;
+@synthesize lazyFrameTable = m_lazyFrameTable;
 
 #if defined(REGRESSION_TESTS)
 @synthesize simulateMemoryMapFailure = m_simulateMemoryMapFailure;
 #endif // REGRESSION_TESTS
 
 @synthesize upgradeFromV1 = m_upgradeFromV1;
+@synthesize reportAdlerMismatches = m_reportAdlerMismatches;
+@synthesize numAdlerMismatches = m_numAdlerMismatches;
+@synthesize frameCache = m_frameCache;
+@synthesize checkpointSpacing = m_checkpointSpacing;
+@synthesize maxCheckpointNumBytes = m_maxCheckpointNumBytes;
+@synthesize checkpointNumBytes = m_checkpointNumBytes;
+@synthesize numPartialDeltaCopies = m_numPartialDeltaCopies;
+@synthesize numFullDeltaCopies = m_numFullDeltaCopies;
+@synthesize composeDeltas = m_composeDeltas;
+@synthesize numComposedDeltas = m_numComposedDeltas;
+@synthesize readWithPread = m_readWithPread;
+@synthesize readNoCache = m_readNoCache;
+@synthesize numFramebuffers = m_numFramebuffers;
+@synthesize maxFramebuffers = m_maxFramebuffers;
+@synthesize numFramebufferExhaustions = m_numFramebufferExhaustions;
 
 - (void) dealloc
 {
   [self close];
+  
+  self.resourceGovernor = nil;
+  
+  [self->m_checkpoints release];
+  self->m_checkpoints = nil;
+  
+  maxvid_delta_composition_free(&self->m_deltaComposition);
 
-  if (self->m_mvFrames) {
-    free(self->m_mvFrames);
-    self->m_mvFrames = NULL;
-  }
+  [self _freeFrameTable];
   
   self.filePath = nil;
   self.mappedData = nil;
   self.currentFrameBuffer = nil;
   self.lastFrame = nil;
+  self.frameCache = nil;
   
   /*
    for (CGFrameBuffer *aBuffer in self.cgFrameBuffers) {
@@ -113,6 +381,11 @@
    */
 
   self.cgFrameBuffers = nil;
+  
+  if (self->m_framebufferFrameIndexes) {
+    free(self->m_framebufferFrameIndexes);
+    self->m_framebufferFrameIndexes = NULL;
+  }
 
 #if MV_ENABLE_DELTAS
   
@@ -135,6 +408,9 @@
   if ((self = [super init]) != nil) {
     self->frameIndex = -1;
     self->m_resourceUsageLimit = TRUE;
+    self->m_numFramebuffers = DEFAULT_NUM_FRAMEBUFFERS;
+    self->m_maxFramebuffers = DEFAULT_MAX_FRAMEBUFFERS;
+    self->m_maxCheckpointNumBytes = DEFAULT_MAX_CHECKPOINT_NUM_BYTES;
   }
   return self;
 }
@@ -157,42 +433,31 @@
   return &self->m_mvHeader;
 }
 
-- (void) _allocFrameBuffers
+// Create a framebuffer with the movie dimensions. Under MacOSX, each framebuffer is
+// marked so that the RGB data is interpreted as sRGB instead of generic RGB.
+// http://www.pupuweb.com/blog/wwdc-2012-session-523-practices-color-management-ken-greenebaum-luke-wallis/
+
+- (CGFrameBuffer*) _makeFramebuffer
 {
-  // create buffers used for loading image data
-  
-  if (self.cgFrameBuffers != nil) {
-    // Already allocated the frame buffers
-    return;
-  }
-  
   int renderWidth  = (int) [self width];
   int renderHeight = (int) [self height];
   
   NSAssert(renderWidth > 0 && renderHeight > 0, @"renderWidth or renderHeight is zero");
-
-  uint32_t bitsPerPixel = [self header]->bpp;
   
-  CGFrameBuffer *cgFrameBuffer1 = [CGFrameBuffer cGFrameBufferWithBppDimensions:bitsPerPixel width:renderWidth height:renderHeight];
-  CGFrameBuffer *cgFrameBuffer2 = [CGFrameBuffer cGFrameBufferWithBppDimensions:bitsPerPixel width:renderWidth height:renderHeight];
-  CGFrameBuffer *cgFrameBuffer3 = [CGFrameBuffer cGFrameBufferWithBppDimensions:bitsPerPixel width:renderWidth height:renderHeight];
+  uint32_t bitsPerPixel = [self header]->bpp;
   
-  self.cgFrameBuffers = [NSArray arrayWithObjects:cgFrameBuffer1, cgFrameBuffer2, cgFrameBuffer3, nil];
+  CGFrameBuffer *cgFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bitsPerPixel width:renderWidth height:renderHeight];
   
   // Double check size assumptions
   
   if (bitsPerPixel == 16) {
-    NSAssert(cgFrameBuffer1.bytesPerPixel == 2, @"invalid bytesPerPixel");
+    NSAssert(cgFrameBuffer.bytesPerPixel == 2, @"invalid bytesPerPixel");
   } else if (bitsPerPixel == 24 || bitsPerPixel == 32) {
-    NSAssert(cgFrameBuffer1.bytesPerPixel == 4, @"invalid bytesPerPixel");
+    NSAssert(cgFrameBuffer.bytesPerPixel == 4, @"invalid bytesPerPixel");
   } else {
     NSAssert(FALSE, @"invalid bitsPerPixel");
   }
   
-  // If the input frames are in sRGB colorspace, then mark each frame so that RGB data is interpreted
-  // as sRGB instead of generic RGB.
-  // http://www.pupuweb.com/blog/wwdc-2012-session-523-practices-color-management-ken-greenebaum-luke-wallis/
-
 #if TARGET_OS_IPHONE
   // No-op
 #else
@@ -203,22 +468,165 @@
     CGColorSpaceRef colorSpace = NULL;
     colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
     NSAssert(colorSpace, @"colorSpace");
-    for (CGFrameBuffer *cgFrameBuffer in self.cgFrameBuffers) {
-      cgFrameBuffer.colorspace = colorSpace;
-    }
+    cgFrameBuffer.colorspace = colorSpace;
     CGColorSpaceRelease(colorSpace);
   }
 #endif // TARGET_OS_IPHONE
   
+  return cgFrameBuffer;
+}
+
+- (void) _allocFrameBuffers
+{
+  // create buffers used for loading image data
+  
+  if (self.cgFrameBuffers != nil) {
+    // Already allocated the frame buffers
+    return;
+  }
+  
+  // At least 2 buffers are needed, one for the current frame and one to decode into
+  
+  int numFramebuffers = MAX(2, (int) self.numFramebuffers);
+  
+  NSMutableArray *buffers = [NSMutableArray arrayWithCapacity:numFramebuffers];
+  
+  for (int i = 0; i < numFramebuffers; i++) {
+    [buffers addObject:[self _makeFramebuffer]];
+  }
+  
+  self.cgFrameBuffers = buffers;
+  
+  if (self->m_framebufferFrameIndexes) {
+    free(self->m_framebufferFrameIndexes);
+  }
+  self->m_framebufferFrameIndexes = malloc(sizeof(int) * self.cgFrameBuffers.count);
+  assert(self->m_framebufferFrameIndexes);
+  [self _forgetFramebufferContents];
+  
   self->m_resourceUsageLimit = FALSE;
 }
 
+// Add one more framebuffer to the ring, this is done when every framebuffer
+// is still in use by a consumer. Returns nil once maxFramebuffers is reached.
+
+- (CGFrameBuffer*) _growFrameBuffers
+{
+  int numFramebuffers = (int) self.cgFrameBuffers.count;
+  
+  if (numFramebuffers >= self.maxFramebuffers) {
+    return nil;
+  }
+  
+  CGFrameBuffer *cgFrameBuffer = [self _makeFramebuffer];
+  
+  self.cgFrameBuffers = [self.cgFrameBuffers arrayByAddingObject:cgFrameBuffer];
+  
+  self->m_framebufferFrameIndexes = realloc(self->m_framebufferFrameIndexes, sizeof(int) * (numFramebuffers + 1));
+  assert(self->m_framebufferFrameIndexes);
+  self->m_framebufferFrameIndexes[numFramebuffers] = -1;
+  
+  return cgFrameBuffer;
+}
+
 - (void) _freeFrameBuffers
 {
   self.currentFrameBuffer = nil;
   self.cgFrameBuffers = nil;
   // Drop AVFrame since it holds on to the image which holds on to a framebuffer
   self.lastFrame = nil;
+  
+  if (self->m_framebufferFrameIndexes) {
+    free(self->m_framebufferFrameIndexes);
+    self->m_framebufferFrameIndexes = NULL;
+  }
+}
+
+// Mark the contents of every framebuffer as unknown, this is needed
+// whenever decoding starts over from a keyframe after a rewind.
+
+- (void) _forgetFramebufferContents
+{
+  if (self->m_framebufferFrameIndexes == NULL) {
+    return;
+  }
+  for (int i = 0; i < self.cgFrameBuffers.count; i++) {
+    self->m_framebufferFrameIndexes[i] = -1;
+  }
+}
+
+// Record that aBuffer now holds the fully decoded contents of the
+// indicated frame, pass -1 if the contents can't be reused later.
+
+- (void) _setFramebuffer:(CGFrameBuffer*)aBuffer frameIndex:(int)index
+{
+  NSUInteger offset = [self.cgFrameBuffers indexOfObjectIdenticalTo:aBuffer];
+  if (offset != NSNotFound) {
+    self->m_framebufferFrameIndexes[offset] = index;
+  }
+}
+
+// Copy the pixels for the frame at currentIndex from srcBuffer into dstBuffer
+// so that a delta can be applied. If dstBuffer already holds an earlier frame
+// and every frame after that one is a delta with a known dirty rect, then only
+// the rows that changed in between need to be copied. Otherwise, the whole
+// framebuffer is copied.
+
+- (void) _copyPixels:(CGFrameBuffer*)dstBuffer
+          fromBuffer:(CGFrameBuffer*)srcBuffer
+        currentIndex:(int)currentIndex
+{
+  int dstIndex = -1;
+  int srcIndex = -1;
+  
+  NSUInteger offset = [self.cgFrameBuffers indexOfObjectIdenticalTo:dstBuffer];
+  if (offset != NSNotFound) {
+    dstIndex = self->m_framebufferFrameIndexes[offset];
+  }
+  offset = [self.cgFrameBuffers indexOfObjectIdenticalTo:srcBuffer];
+  if (offset != NSNotFound) {
+    srcIndex = self->m_framebufferFrameIndexes[offset];
+  }
+  
+  // The source must hold the current frame
+  
+  BOOL canCopyRows = (srcIndex == currentIndex) && (dstIndex >= 0) && (dstIndex < currentIndex) &&
+    (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE) && (self.mvFrames != NULL);
+  
+  CGRect changedRect = CGRectNull;
+  
+  for (int i = dstIndex + 1; canCopyRows && (i <= currentIndex); i++) {
+    MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, i);
+    
+    if (maxvid_v3_frame_isnopframe(frame)) {
+      continue;
+    } else if (maxvid_v3_frame_iskeyframe(frame) || !maxvid_v3_frame_hasdirtyrect(frame)) {
+      canCopyRows = FALSE;
+    } else {
+      changedRect = CGRectUnion(changedRect, [self dirtyRectForFrame:i]);
+    }
+  }
+  
+  [self _setFramebuffer:dstBuffer frameIndex:currentIndex];
+  
+  if (!canCopyRows) {
+    [dstBuffer copyPixels:srcBuffer];
+    self->m_numFullDeltaCopies++;
+    return;
+  }
+  
+  if (!CGRectIsNull(changedRect)) {
+    size_t bytesPerRow = dstBuffer.width * dstBuffer.bytesPerPixel;
+    size_t rowOffset = (size_t) CGRectGetMinY(changedRect) * bytesPerRow;
+    size_t numRows = (size_t) CGRectGetHeight(changedRect);
+    
+    assert(dstBuffer.numBytes == srcBuffer.numBytes);
+    assert((rowOffset + (numRows * bytesPerRow)) <= dstBuffer.numBytes);
+    
+    memcpy(dstBuffer.pixels + rowOffset, srcBuffer.pixels + rowOffset, numRows * bytesPerRow);
+  }
+  
+  self->m_numPartialDeltaCopies++;
 }
 
 // Return the next available framebuffer, this will be the framebuffer that the
@@ -243,11 +651,110 @@
     }
   }
   if (cgFrameBuffer == nil) {
-    NSAssert(FALSE, @"no cgFrameBuffer is available");
+    // Every framebuffer is locked by a consumer, grow the ring up to the cap
+    
+    self->m_numFramebufferExhaustions++;
+    
+    cgFrameBuffer = [self _growFrameBuffers];
+  }
+  if (cgFrameBuffer == nil) {
+    NSAssert(FALSE, @"no cgFrameBuffer is available, all %d are in use", (int)self.cgFrameBuffers.count);
   }
   return cgFrameBuffer;
 }
 
+// Size of the table of MVFrame or MVV3Frame entries that follows the header,
+// numFrames is checked when the header is read.
+
+- (size_t) _frameTableNumBytes
+{
+  MVFileHeader *hPtr = &self->m_mvHeader;
+  
+  NSUInteger numFrames = hPtr->numFrames;
+  
+  if (maxvid_file_version(hPtr) == MV_FILE_VERSION_THREE) {
+    return sizeof(MVV3Frame) * numFrames;
+  } else {
+    return sizeof(MVFrame) * numFrames;
+  }
+}
+
+// Map the frame table of a file opened in lazyFrameTable mode. The mapping starts
+// at the beginning of the file since the offset of a mapping must be page aligned.
+// If the file can't be mapped, the table is read into memory instead. Returns
+// FALSE if the table can't be mapped or read.
+
+- (BOOL) _mapFrameTable
+{
+  if (self->m_mvHeader.numFrames <= 1) {
+    return FALSE;
+  }
+  
+  const size_t tableNumBytes = [self _frameTableNumBytes];
+  const size_t mapNumBytes = sizeof(MVFileHeader) + tableNumBytes;
+  
+  int fd = open([self.filePath UTF8String], O_RDONLY);
+  if (fd == -1) {
+    return FALSE;
+  }
+  
+  // Accessing a mapping past the end of a truncated file would crash
+  
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size < (off_t)mapNumBytes) {
+    close(fd);
+    return FALSE;
+  }
+  
+  void *mappedPtr = mmap(NULL, mapNumBytes, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+  
+  if (mappedPtr != MAP_FAILED) {
+    self->m_frameTableMapping = mappedPtr;
+    self->m_frameTableMappingNumBytes = mapNumBytes;
+    self->m_mvFrames = (char*)mappedPtr + sizeof(MVFileHeader);
+  } else {
+    void *frames = malloc(tableNumBytes);
+    
+    if (frames && pread(fd, frames, tableNumBytes, sizeof(MVFileHeader)) == (ssize_t)tableNumBytes) {
+      self->m_mvFrames = frames;
+    } else {
+      free(frames);
+    }
+  }
+  
+  close(fd);
+  return (self->m_mvFrames != NULL);
+}
+
+- (void) _freeFrameTable
+{
+  if (self->m_frameTableMapping) {
+    munmap(self->m_frameTableMapping, self->m_frameTableMappingNumBytes);
+    self->m_frameTableMapping = NULL;
+    self->m_frameTableMappingNumBytes = 0;
+  } else if (self->m_mvFrames) {
+    free(self->m_mvFrames);
+  }
+  self->m_mvFrames = NULL;
+  self->m_frameTableUnreadable = FALSE;
+}
+
+// Return the table of frames, this is NULL when the file is not open or when
+// the table of a file opened in lazyFrameTable mode can't be mapped or read.
+// A failure is remembered so that the file is not opened again on each access,
+// until the file is opened again.
+
+- (void*) mvFrames
+{
+  if (self->m_mvFrames == NULL && self->m_isOpen && !self->m_frameTableUnreadable) {
+    if ([self _mapFrameTable] == FALSE) {
+      self->m_frameTableUnreadable = TRUE;
+    }
+  }
+  
+  return self->m_mvFrames;
+}
+
 // This utility method will read the header data from an mvid
 // file without mapping it into memory. The contents of the
 // header will be copied so that header metadata can be
@@ -314,23 +821,24 @@
         NSAssert(FALSE, @"only .mvid files version 2 or newer can be used, you must -upgrade this .mvid from version %d", maxvid_file_version(hPtr));
       }
     }
+    
+    if (worked) {
+      // The table of frames is checked here in both modes, it is not
+      // read until later when lazyFrameTable is TRUE.
+      
+      if (hPtr->numFrames <= 1) {
+        worked = FALSE;
+        NSAssert(FALSE, @"numFrames");
+      }
+    }
   }
   
-  if (worked) {
+  if (worked && self.lazyFrameTable) {
+    // The frame table is mapped when a frame is first accessed
+  } else if (worked) {
     // Read array of MVFrame objects into dynamically allocated array.
     
-    NSUInteger numFrames = hPtr->numFrames;
-    NSAssert(numFrames > 1, @"numFrames");
-    
-    int isV3 = (maxvid_file_version(hPtr) == MV_FILE_VERSION_THREE);
-
-    int numBytes;
-    
-    if (isV3) {
-      numBytes = (int) (sizeof(MVV3Frame) * numFrames);
-    } else {
-      numBytes = (int) (sizeof(MVFrame) * numFrames);
-    }
+    int numBytes = (int) [self _frameTableNumBytes];
     
     self->m_mvFrames = malloc(numBytes);
     
@@ -357,6 +865,20 @@
 // Otherwise, returns FALSE when memory map was not successful.
 
 - (BOOL) _mapFile {
+  if (self.readWithPread) {
+    if (self->m_readAhead == NULL) {
+      self->m_readAhead = frame_read_ahead_open([self.filePath UTF8String], self.readNoCache);
+      
+      if (self->m_readAhead == NULL) {
+        return FALSE;
+      }
+      
+      self->m_resourceUsageLimit = FALSE;
+    }
+    
+    return TRUE;
+  }
+  
   if (self.mappedData == nil) {
     // Might need to map a very large mvid file in terms of 24 Meg chunks,
     // would want to write it that way?
@@ -434,11 +956,64 @@
 
 - (void) _unmapFile {
   self.mappedData = nil;
+  
+  if (self->m_readAhead) {
+    frame_read_ahead_close(self->m_readAhead);
+    self->m_readAhead = NULL;
+  }
 }
 
-- (BOOL) openForReading:(NSString*)moviePath
+// Queue reads for the next few frames after the indicated frame that contain
+// frame data, nop frames are skipped since they do not need to be read.
+
+- (void) _readAheadAfterFrame:(int)actualFrameIndex inUseSlot:(FrameReadSlot*)inUseSlot
 {
-  if (self->m_isOpen) {
+  int isV3 = (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE);
+  int numFrames = (int) [self numFrames];
+  int numQueued = 0;
+  
+  if (self.mvFrames == NULL) {
+    return;
+  }
+  
+  for (int i = actualFrameIndex + 1; i < numFrames && numQueued < (READ_AHEAD_NUM_BUFFERS - 1); i++) {
+    off_t offset;
+    uint32_t length;
+    
+    if (isV3) {
+      MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, i);
+      if (maxvid_v3_frame_isnopframe(frame)) {
+        continue;
+      }
+      offset = maxvid_v3_frame_offset(frame);
+      length = maxvid_v3_frame_length(frame);
+    } else {
+      MVFrame *frame = maxvid_file_frame(self.mvFrames, i);
+      if (maxvid_frame_isnopframe(frame)) {
+        continue;
+      }
+      offset = maxvid_frame_offset(frame);
+      length = maxvid_frame_length(frame);
+    }
+    
+    frame_read_ahead_prefetch(self->m_readAhead, inUseSlot, i, offset, length);
+    numQueued++;
+  }
+}
+
+- (uint32_t) numSyncReads
+{
+  return (self->m_readAhead == NULL) ? 0 : self->m_readAhead->numSyncReads;
+}
+
+- (uint32_t) numReadAheadHits
+{
+  return (self->m_readAhead == NULL) ? 0 : self->m_readAhead->numReadAheadHits;
+}
+
+- (BOOL) openForReading:(NSString*)moviePath
+{
+  if (self->m_isOpen) {
     return FALSE;
   }
   
@@ -454,6 +1029,10 @@
   // into memory at this point. It is possible that many files could be open but the file
   // need not be mapped into memory until it is actually used.  
   
+  // A table left over from a file that was open before this one
+  
+  [self _freeFrameTable];
+  
   BOOL worked = [self _openAndCopyHeaders];
   if (!worked) {
     self.filePath = nil;
@@ -464,17 +1043,31 @@
   return TRUE;
 }
 
+- (BOOL) openHeaderForReading:(NSString*)moviePath
+{
+  self.lazyFrameTable = TRUE;
+  return [self openForReading:moviePath];
+}
+
 // Close resource opened earlier
 
 - (void) close
 {
   [self _unmapFile];
   
+  [self->m_frameCacheFileKey release];
+  self->m_frameCacheFileKey = nil;
+  
+  [self _removeCheckpoints];
+  
   frameIndex = -1;
   self.currentFrameBuffer = nil;
   self.lastFrame = nil;
+  [self _forgetFramebufferContents];
   
   self->m_isOpen = FALSE;  
+  
+  [self.resourceGovernor decoderResourcesChanged:self];
 }
 
 - (void) rewind
@@ -486,6 +1079,7 @@
   frameIndex = -1;
   self.currentFrameBuffer = nil;
   self.lastFrame = nil;
+  [self _forgetFramebufferContents];
 }
 
 // This module scoped method will assert that the adler calculated from
@@ -503,17 +1097,339 @@
   // If mvid file has adler checksum for frame, verify that it matches the decoded framebuffer contents
   if (expectedAdler != 0) {
     uint32_t frameAdler = maxvid_adler32(0, (unsigned char*)frameBuffer, frameBufferNumBytes);
-    NSAssert(frameAdler == expectedAdler, @"frameAdler");
+    if (self.reportAdlerMismatches) {
+      if (frameAdler != expectedAdler) {
+        self->m_numAdlerMismatches++;
+      }
+    } else {
+      NSAssert(frameAdler == expectedAdler, @"frameAdler");
+    }
   }
 }
 
 #endif // EXTRA_CHECKS || ALWAYS_CHECK_ADLER
 
+// Return the index of the frame that contains the data displayed at the
+// indicated frame, nop frames display the data of an earlier frame.
+
+- (int) _dataFrameIndex:(int)index
+{
+  int isV3 = (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE);
+  
+  if (self.mvFrames == NULL) {
+    return index;
+  }
+  
+  for ( ; index > 0; index--) {
+    if (isV3) {
+      if (!maxvid_v3_frame_isnopframe(maxvid_v3_file_frame(self.mvFrames, index))) {
+        break;
+      }
+    } else {
+      if (!maxvid_frame_isnopframe(maxvid_file_frame(self.mvFrames, index))) {
+        break;
+      }
+    }
+  }
+  
+  return index;
+}
+
+// Key for the indicated frame in the shared frame cache, the file is identified
+// by device, inode, size, and modification time so that two paths to the
+// same file share frames but a rewritten file does not.
+
+- (NSString*) _frameCacheKey:(int)index
+{
+  if (self->m_frameCacheFileKey == nil) {
+    struct stat sb;
+    if (stat([self.filePath UTF8String], &sb) != 0) {
+      return nil;
+    }
+    self->m_frameCacheFileKey = [[NSString alloc] initWithFormat:@"%llu:%llu:%lld:%ld",
+                                 (unsigned long long)sb.st_dev,
+                                 (unsigned long long)sb.st_ino,
+                                 (long long)sb.st_size,
+                                 (long)sb.st_mtime];
+  }
+  
+  return [NSString stringWithFormat:@"%@:%d", self->m_frameCacheFileKey, index];
+}
+
+// Add the decoded frame to the shared frame cache. The decoder would write over
+// the pixels of a framebuffer in the ring, so the framebuffer is handed over to
+// the cache and replaced in the ring with a new framebuffer instead of copying
+// the pixels. The image already made for the returned frame is shared, the image
+// holds the framebuffer lock so the cached pixels can't be written to.
+
+- (void) _addFrameToCache:(NSString*)key frame:(AVFrame*)frame
+{
+  CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+  
+  NSUInteger offset = [self.cgFrameBuffers indexOfObjectIdenticalTo:cgFrameBuffer];
+  if (offset == NSNotFound) {
+    return;
+  }
+  
+  NSMutableArray *buffers = [NSMutableArray arrayWithArray:self.cgFrameBuffers];
+  [buffers replaceObjectAtIndex:offset withObject:[self _makeFramebuffer]];
+  self.cgFrameBuffers = buffers;
+  self->m_framebufferFrameIndexes[offset] = -1;
+  
+  AVFrame *cachedFrame = [AVFrame aVFrame];
+  cachedFrame.image = frame.image;
+  cachedFrame.cgFrameBuffer = cgFrameBuffer;
+  cachedFrame.dirtyRect = CGRectMake(0, 0, [self width], [self height]);
+  
+  [self.frameCache setFrame:cachedFrame forKey:key];
+}
+
+- (AVMvidResourceGovernor*) resourceGovernor
+{
+  return self->m_resourceGovernor;
+}
+
+- (void) setResourceGovernor:(AVMvidResourceGovernor*)resourceGovernor
+{
+  if (resourceGovernor == self->m_resourceGovernor) {
+    return;
+  }
+  
+  [self->m_resourceGovernor removeDecoder:self];
+  [self->m_resourceGovernor release];
+  
+  self->m_resourceGovernor = [resourceGovernor retain];
+  [self->m_resourceGovernor addDecoder:self];
+}
+
+- (NSUInteger) decodeResourceNumBytes
+{
+  NSUInteger numBytes = 0;
+  
+  for (CGFrameBuffer *cgFrameBuffer in self.cgFrameBuffers) {
+    numBytes += cgFrameBuffer.numBytes;
+  }
+  
+  if (self->m_readAhead) {
+    for (int i = 0; i < READ_AHEAD_NUM_BUFFERS; i++) {
+      numBytes += self->m_readAhead->slots[i].bufferSize;
+    }
+  }
+  
+#if MV_ENABLE_DELTAS
+  numBytes += self->decompressionBufferSize;
+#endif // MV_ENABLE_DELTAS
+  
+  numBytes += self->m_checkpointNumBytes;
+  
+  return numBytes;
+}
+
+- (void) _removeCheckpoints
+{
+  [self->m_checkpoints removeAllObjects];
+  self->m_checkpointNumBytes = 0;
+}
+
+// Save a copy of the current frame if no frame has been saved for the run of
+// checkpointSpacing frames that the current frame is in.
+
+- (void) _saveCheckpoint
+{
+  if (frameIndex < 0 || self.currentFrameBuffer == nil) {
+    return;
+  }
+  
+  if (self->m_checkpoints == nil) {
+    self->m_checkpoints = [[NSMutableDictionary alloc] init];
+  }
+  
+  NSNumber *key = [NSNumber numberWithInt:(int)(frameIndex / self.checkpointSpacing)];
+  
+  if ([self->m_checkpoints objectForKey:key] != nil) {
+    return;
+  }
+  
+  CGFrameBuffer *cgFrameBuffer = self.currentFrameBuffer;
+  
+  if ((self->m_checkpointNumBytes + cgFrameBuffer.numBytes) > self.maxCheckpointNumBytes) {
+    // Drop the checkpoint that is furthest from the current frame
+    
+    AVMvidCheckpoint *furthest = nil;
+    
+    for (AVMvidCheckpoint *checkpoint in [self->m_checkpoints allValues]) {
+      if (furthest == nil || abs(checkpoint->frameIndex - frameIndex) > abs(furthest->frameIndex - frameIndex)) {
+        furthest = checkpoint;
+      }
+    }
+    
+    if (furthest == nil) {
+      return;
+    }
+    
+    [self->m_checkpoints removeObjectForKey:[NSNumber numberWithInt:(int)(furthest->frameIndex / self.checkpointSpacing)]];
+    self->m_checkpointNumBytes -= furthest->frameBuffer.numBytes;
+  }
+  
+  AVMvidCheckpoint *checkpoint = [[[AVMvidCheckpoint alloc] init] autorelease];
+  checkpoint->frameIndex = frameIndex;
+  checkpoint->frameBuffer = [[CGFrameBuffer cGFrameBufferWithBppDimensions:cgFrameBuffer.bitsPerPixel
+                                                                     width:cgFrameBuffer.width
+                                                                    height:cgFrameBuffer.height] retain];
+  [checkpoint->frameBuffer copyPixels:cgFrameBuffer];
+  
+  [self->m_checkpoints setObject:checkpoint forKey:key];
+  self->m_checkpointNumBytes += cgFrameBuffer.numBytes;
+}
+
+// Return the index of the last keyframe at or before the indicated frame,
+// or -1 if there is no keyframe before it.
+
+- (int) _keyframeIndex:(int)index
+{
+  int isV3 = (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE);
+  
+  if (self.mvFrames == NULL) {
+    return -1;
+  }
+  
+  for ( ; index >= 0; index--) {
+    if (isV3) {
+      MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, index);
+      if (!maxvid_v3_frame_isnopframe(frame) && maxvid_v3_frame_iskeyframe(frame)) {
+        break;
+      }
+    } else {
+      MVFrame *frame = maxvid_file_frame(self.mvFrames, index);
+      if (!maxvid_frame_isnopframe(frame) && maxvid_frame_iskeyframe(frame)) {
+        break;
+      }
+    }
+  }
+  
+  return index;
+}
+
+- (AVFrame*) seekToFrame:(NSUInteger)newFrameIndex
+{
+  if (self.mvFrames == NULL) {
+    return [self _unreadableFrame];
+  }
+  
+  if ((frameIndex == -1) || ((int)newFrameIndex >= frameIndex)) {
+    return [self advanceToFrame:newFrameIndex];
+  }
+  
+  if (self.mappedData == nil && self->m_readAhead == NULL) {
+    BOOL worked = [self allocateDecodeResources];
+    NSAssert(worked, @"allocateDecodeResources failed for %@", [self.filePath lastPathComponent]);
+  }
+  
+  // Find the checkpoint closest to the frame, decoding from a keyframe is
+  // used instead when the keyframe is closer.
+  
+  int keyframeIndex = [self _keyframeIndex:(int)newFrameIndex];
+  
+  AVMvidCheckpoint *nearest = nil;
+  
+  for (AVMvidCheckpoint *checkpoint in [self->m_checkpoints allValues]) {
+    if (checkpoint->frameIndex <= (int)newFrameIndex &&
+        (nearest == nil || checkpoint->frameIndex > nearest->frameIndex)) {
+      nearest = checkpoint;
+    }
+  }
+  
+  if (nearest == nil || nearest->frameIndex < keyframeIndex) {
+    [self rewind];
+  } else {
+    // Copy the checkpoint into a framebuffer and make it the current frame
+    
+    self.lastFrame = nil;
+    self.currentFrameBuffer = nil;
+    
+    CGFrameBuffer *cgFrameBuffer = [self _getNextFramebuffer];
+    [cgFrameBuffer copyPixels:nearest->frameBuffer];
+    
+    self.currentFrameBuffer = cgFrameBuffer;
+    [self _setFramebuffer:cgFrameBuffer frameIndex:nearest->frameIndex];
+    frameIndex = nearest->frameIndex;
+    
+    AVFrame *frame = [AVFrame aVFrame];
+    frame.cgFrameBuffer = cgFrameBuffer;
+    [frame makeImageFromFramebuffer];
+    self.lastFrame = frame;
+  }
+  
+  AVFrame *frame;
+  
+  if (frameIndex == (int)newFrameIndex) {
+    frame = self.lastFrame;
+  } else {
+    frame = [self advanceToFrame:newFrameIndex];
+  }
+  
+  // The frame is not a duplicate of the frame that was displayed before
+  
+  frame.isDuplicate = FALSE;
+  frame.dirtyRect = CGRectMake(0, 0, [self width], [self height]);
+  
+  return frame;
+}
+
+// Returned by advanceToFrame when the frame table can't be read. As with any
+// AVFrameDecoder, a frame that can't be loaded has a nil image. The decoder
+// state is not changed.
+
+- (AVFrame*) _unreadableFrame
+{
+  AVFrame *frame = [AVFrame aVFrame];
+  frame.isDuplicate = FALSE;
+  frame.dirtyRect = CGRectNull;
+  return frame;
+}
+
+// When the decoder is managed by a resource governor, the decode resources
+// could have been released to make room for other decoders. Allocate the
+// resources again and decode from the keyframe before the requested frame.
+
 - (AVFrame*) advanceToFrame:(NSUInteger)newFrameIndex
+{
+  AVMvidResourceGovernor *governor = self.resourceGovernor;
+  
+  if (self.mvFrames == NULL) {
+    return [self _unreadableFrame];
+  }
+  
+  if (governor == nil && self.checkpointSpacing == 0) {
+    return [self _advanceToFrame:newFrameIndex];
+  }
+  
+  if (governor && self.mappedData == nil && self->m_readAhead == NULL) {
+    BOOL worked = [self allocateDecodeResources];
+    NSAssert(worked, @"allocateDecodeResources failed for %@", [self.filePath lastPathComponent]);
+    
+    frameIndex = -1;
+    self.currentFrameBuffer = nil;
+    self.lastFrame = nil;
+    [self _forgetFramebufferContents];
+  }
+  
+  AVFrame *frame = [self _advanceToFrame:newFrameIndex];
+  
+  if (self.checkpointSpacing > 0) {
+    [self _saveCheckpoint];
+  }
+  
+  [governor decoderWasUsed:self];
+  
+  return frame;
+}
+
+- (AVFrame*) _advanceToFrame:(NSUInteger)newFrameIndex
 {
   // The movie data must have been mapped into memory by the time advanceToFrame is invoked
   
-  if (self.mappedData == nil) {
+  if (self.mappedData == nil && self->m_readAhead == NULL) {
     NSAssert(FALSE, @"file not mapped");
   }
   
@@ -548,12 +1464,48 @@
     NSAssert(FALSE, @"%@: %d", @"can't advance past last frame", (int) newFrameIndex);
   }
   
+  // When frames are shared with other decoders, look for the decoded frame in the
+  // cache unless the frames up to the new frame are all nop frames.
+  
+  NSString *frameCacheKey = nil;
+  
+  if (self.frameCache) {
+    int dataFrameIndex = [self _dataFrameIndex:(int)newFrameIndex];
+    
+    if (dataFrameIndex > frameIndex) {
+      frameCacheKey = [self _frameCacheKey:dataFrameIndex];
+    }
+    
+    AVFrame *cachedFrame = (frameCacheKey == nil) ? nil : [self.frameCache frameForKey:frameCacheKey];
+    
+    if (cachedFrame) {
+      // The cached framebuffer becomes the current framebuffer, the next delta
+      // frame is applied after copying the cached pixels into a framebuffer.
+      // Since the cached framebuffer is not in the ring, that copy is always
+      // a full copy and not only the rows that changed. Copying into the ring
+      // here instead would cost the same full copy on every hit, even when
+      // the next frame is found in the cache too.
+      
+      AVFrame *frame = [AVFrame aVFrame];
+      frame.image = cachedFrame.image;
+      frame.cgFrameBuffer = cachedFrame.cgFrameBuffer;
+      frame.dirtyRect = cachedFrame.dirtyRect;
+      
+      self.currentFrameBuffer = cachedFrame.cgFrameBuffer;
+      self.lastFrame = frame;
+      frameIndex = (int) newFrameIndex;
+      
+      return frame;
+    }
+  }
+  
   // Check for V3 format, each frame would need to be read in a specific way
   
   int isV3 = (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE);
   
   BOOL changeFrameData = FALSE;
   const int newFrameIndexSigned = (int) newFrameIndex;
+  CGRect dirtyRect = CGRectNull;
   
 #if defined(USE_SEGMENTED_MMAP)
 #else
@@ -583,7 +1535,7 @@
       int actualFrameIndex = i + 1;
       
       if (isV3) {
-        MVV3Frame *frame = maxvid_v3_file_frame(self->m_mvFrames, actualFrameIndex);
+        MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, actualFrameIndex);
         
         if (maxvid_v3_frame_isnopframe(frame)) {
           // This frame is a no-op, since it duplicates data from the previous frame.
@@ -597,7 +1549,7 @@
         NSLog(@"advance to frame %d : offset %llu : bufferSize %d : adler %08X", actualFrameIndex, maxvid_v3_frame_offset(frame), maxvid_v3_frame_length(frame), frame->adler);
 #endif // LOGGING
       } else {
-        MVFrame *frame = maxvid_file_frame(self->m_mvFrames, actualFrameIndex);
+        MVFrame *frame = maxvid_file_frame(self.mvFrames, actualFrameIndex);
         
         if (maxvid_frame_isnopframe(frame)) {
           // This frame is a no-op, since it duplicates data from the previous frame.
@@ -619,16 +1571,26 @@
 #ifdef EXTRA_CHECKS
       int actualFrameIndex = frameIndex + 1;
       if (isV3) {
-        MVV3Frame *frame = maxvid_v3_file_frame(self->m_mvFrames, actualFrameIndex);
+        MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, actualFrameIndex);
         NSAssert(maxvid_v3_frame_iskeyframe(frame) == 1, @"frame must be a keyframe");
       } else {
-        MVFrame *frame = maxvid_file_frame(self->m_mvFrames, actualFrameIndex);
+        MVFrame *frame = maxvid_file_frame(self.mvFrames, actualFrameIndex);
         NSAssert(maxvid_frame_iskeyframe(frame) == 1, @"frame must be a keyframe");
       }
 #endif // EXTRA_CHECKS      
     }
   }
   
+  // When skipping over a series of delta frames, merge the deltas so that
+  // each changed pixel is written once.
+  
+  if (self.composeDeltas && isV3 && (bpp != 16) && (frameIndex >= 0) && (self.currentFrameBuffer != nil) &&
+      ((newFrameIndexSigned - frameIndex) > 1)) {
+    if ([self _composeDeltasToFrame:newFrameIndexSigned nextFrameBuffer:nextFrameBuffer dirtyRect:&dirtyRect]) {
+      changeFrameData = TRUE;
+    }
+  }
+  
   // loop from current frame to target frame, applying deltas as we go.
   
   int inputMemoryMapped = TRUE;
@@ -639,9 +1601,9 @@
     MVV3Frame *frame = NULL;
 
     if (isV3) {
-      frame = maxvid_v3_file_frame(self->m_mvFrames, actualFrameIndex);
+      frame = maxvid_v3_file_frame(self.mvFrames, actualFrameIndex);
     } else {
-      framePre3 = maxvid_file_frame(self->m_mvFrames, actualFrameIndex);
+      framePre3 = maxvid_file_frame(self.mvFrames, actualFrameIndex);
     }
     
 #ifdef EXTRA_CHECKS
@@ -738,7 +1700,7 @@
         // Copy the previous frame buffer unless there was not one, or current is a keyframe
         
         if (isDeltaFrame && (self.currentFrameBuffer != nil)) {
-          [nextFrameBuffer copyPixels:self.currentFrameBuffer];
+          [self _copyPixels:nextFrameBuffer fromBuffer:self.currentFrameBuffer currentIndex:frameIndex];
         }
         self.currentFrameBuffer = nextFrameBuffer;
       } else {
@@ -804,46 +1766,64 @@
         inputBuffer32NumBytes = maxvid_frame_length(framePre3);
       }
 
-#if defined(USE_SEGMENTED_MMAP)
-      // Create a mapped segment using the frame offset and length for this frame.
-
       uint32_t *inputBuffer32 = NULL;
-        
-      SegmentedMappedData *mappedSeg = [self.mappedData subdataWithOffset:frameStartOffset len:inputBuffer32NumBytes];
+      NSData *mappedDataObj = nil;
       
-      if (mappedSeg == nil) {
-        inputMemoryMapped = FALSE;
+      if (self->m_readAhead) {
+        // Read the frame data, or wait for a read ahead of this frame to finish
+        
+        FrameReadSlot *slot = frame_read_ahead_get(self->m_readAhead, actualFrameIndex, frameStartOffset, inputBuffer32NumBytes);
+        
+        if (slot == NULL) {
+          inputMemoryMapped = FALSE;
+          
+          NSLog(@"pread failed for frame %d of %@", actualFrameIndex, [self.filePath lastPathComponent]);
+        } else {
+          inputBuffer32 = (uint32_t*) slot->buffer;
+          mappedDataObj = [NSData dataWithBytesNoCopy:slot->buffer length:inputBuffer32NumBytes freeWhenDone:FALSE];
+          
+          [self _readAheadAfterFrame:actualFrameIndex inUseSlot:slot];
+        }
       } else {
+#if defined(USE_SEGMENTED_MMAP)
+        // Create a mapped segment using the frame offset and length for this frame.
+
+        SegmentedMappedData *mappedSeg = [self.mappedData subdataWithOffset:frameStartOffset len:inputBuffer32NumBytes];
+      
+        if (mappedSeg == nil) {
+          inputMemoryMapped = FALSE;
+        } else {
         
 #if defined(REGRESSION_TESTS)
-        if (self.simulateMemoryMapFailure) {
-          inputMemoryMapped = FALSE;
-        } else
+          if (self.simulateMemoryMapFailure) {
+            inputMemoryMapped = FALSE;
+          } else
 #endif // REGRESSION_TESTS
         
-        if ([mappedSeg mapSegment] == FALSE) {
-          inputMemoryMapped = FALSE;
+          if ([mappedSeg mapSegment] == FALSE) {
+            inputMemoryMapped = FALSE;
           
-          NSLog(@"mapSegment failed for %@", [mappedSeg description]);
-        } else {
-          //NSLog(@"__mapSegment obj %p : %@", mappedSeg, [mappedSeg description]);
+            NSLog(@"mapSegment failed for %@", [mappedSeg description]);
+          } else {
+            //NSLog(@"__mapSegment obj %p : %@", mappedSeg, [mappedSeg description]);
           
-          inputBuffer32 = (uint32_t*) [mappedSeg bytes];
-        }        
-      }
+            inputBuffer32 = (uint32_t*) [mappedSeg bytes];
+          }        
+        }
       
-      NSData *mappedDataObj = mappedSeg;
+        mappedDataObj = mappedSeg;
 #else
-      uint32_t *inputBuffer32 = (uint32_t*) (mappedPtr + frameStartOffset);
-      NSData *mappedDataObj = self.mappedData;
+        inputBuffer32 = (uint32_t*) (mappedPtr + frameStartOffset);
+        mappedDataObj = self.mappedData;
         
 #if defined(REGRESSION_TESTS)
-      if (self.simulateMemoryMapFailure) {
-        inputMemoryMapped = FALSE;
-      }
+        if (self.simulateMemoryMapFailure) {
+          inputMemoryMapped = FALSE;
+        }
 #endif // REGRESSION_TESTS
         
 #endif // USE_SEGMENTED_MMAP
+      }
       
       if (inputMemoryMapped == FALSE) {
         // When input memory can't be mapped, it is likely the system is running low
@@ -913,6 +1893,9 @@
         }
         NSAssert(status == 0, @"status");
         
+        dirtyRect = CGRectUnion(dirtyRect, [self dirtyRectForFrame:actualFrameIndex]);
+        [self _setFramebuffer:nextFrameBuffer frameIndex:actualFrameIndex];
+        
 #if defined(EXTRA_CHECKS) || defined(ALWAYS_CHECK_ADLER)
         // Mvid file verison 0 would calculate a delta checksum and not include zero padding pixels
         // in the checksum. This is inconsistent with the keyframe calculation which includes the
@@ -957,6 +1940,8 @@
         // Input buffer is a compressed keyframe
         
         changeFrameData = TRUE;
+        dirtyRect = CGRectMake(0, 0, [self width], [self height]);
+        [self _setFramebuffer:nextFrameBuffer frameIndex:actualFrameIndex];
         
         [nextFrameBuffer doneZeroCopyPixels];
         
@@ -999,6 +1984,7 @@
         // Input buffer contains a complete keyframe, use zero copy optimization
         
         changeFrameData = TRUE;
+        dirtyRect = CGRectMake(0, 0, [self width], [self height]);
         
 #ifdef EXTRA_CHECKS
         // FIXME: use zero copy of pointer into mapped file, impl OS page copy in util class
@@ -1038,6 +2024,11 @@
 #endif // EXTRA_CHECKS
   
         [nextFrameBuffer zeroCopyPixels:inputBuffer32 mappedData:mappedDataObj];
+        
+        // zeroCopyPixels copies the keyframe into memory owned by the framebuffer,
+        // so the buffer holds the keyframe and can be the base of a partial copy.
+        
+        [self _setFramebuffer:nextFrameBuffer frameIndex:actualFrameIndex];
       }
     } // end for loop over indexes
     
@@ -1061,6 +2052,7 @@
     frame.cgFrameBuffer = cgFrameBuffer;
     
     frame.isDuplicate = TRUE;
+    frame.dirtyRect = CGRectZero;
     
     return frame;
   } else {
@@ -1078,15 +2070,130 @@
     
     CGFrameBuffer *cgFrameBuffer = self.currentFrameBuffer;
     frame.cgFrameBuffer = cgFrameBuffer;
+    frame.dirtyRect = dirtyRect;
     
     [frame makeImageFromFramebuffer];
     
     self.lastFrame = frame;
     
+    if (frameCacheKey && (frameIndex == newFrameIndexSigned)) {
+      [self _addFrameToCache:frameCacheKey frame:frame];
+    }
+    
     return frame;
   }
 }
 
+// Merge the delta frames after the current frame up to newFrameIndex and write
+// the result into nextFrameBuffer. Returns FALSE without changing the decoder state
+// when a frame can't be merged, for example a keyframe or a compressed frame, so
+// that the frames are applied one at a time instead.
+
+- (BOOL) _composeDeltasToFrame:(int)newFrameIndex
+               nextFrameBuffer:(CGFrameBuffer*)nextFrameBuffer
+                     dirtyRect:(CGRect*)dirtyRectPtr
+{
+#if MV_ENABLE_DELTAS
+  if ([self isDeltas]) {
+    return FALSE;
+  }
+#endif // MV_ENABLE_DELTAS
+  
+  // Read ahead slots are reused, so the pixels of earlier frames would not stay valid
+  
+  if (self->m_readAhead != NULL) {
+    return FALSE;
+  }
+  
+  MVDeltaComposition *composition = &self->m_deltaComposition;
+  maxvid_delta_composition_reset(composition);
+  
+  const uint32_t frameBufferSize = (uint32_t) ([self width] * [self height]);
+  
+  // Each segment stays mapped until the composition has been applied
+  
+  NSMutableArray *mappedSegments = [NSMutableArray array];
+  CGRect dirtyRect = CGRectNull;
+#if defined(EXTRA_CHECKS) || defined(ALWAYS_CHECK_ADLER)
+  int lastDeltaIndex = -1;
+#endif // EXTRA_CHECKS || ALWAYS_CHECK_ADLER
+  
+  for (int i = frameIndex + 1; i <= newFrameIndex; i++) {
+    MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, i);
+    
+    if (maxvid_v3_frame_isnopframe(frame)) {
+      continue;
+    }
+    
+    if (maxvid_v3_frame_iskeyframe(frame) || maxvid_v3_frame_iscompressed(frame)) {
+      return FALSE;
+    }
+    
+    off_t frameStartOffset = maxvid_v3_frame_offset(frame);
+    uint32_t numBytes = maxvid_v3_frame_length(frame);
+    uint32_t *inputBuffer32;
+    
+#if defined(USE_SEGMENTED_MMAP)
+    SegmentedMappedData *mappedSeg = [self.mappedData subdataWithOffset:frameStartOffset len:numBytes];
+    
+    if (mappedSeg == nil || [mappedSeg mapSegment] == FALSE) {
+      return FALSE;
+    }
+    
+    [mappedSegments addObject:mappedSeg];
+    inputBuffer32 = (uint32_t*) [mappedSeg bytes];
+#else
+    inputBuffer32 = (uint32_t*) ((char*)[self.mappedData bytes] + frameStartOffset);
+#endif // USE_SEGMENTED_MMAP
+    
+    uint32_t status = maxvid_delta_composition_add_c4_sample32(composition, inputBuffer32, numBytes >> 2, frameBufferSize);
+    
+    if (status != 0) {
+      return FALSE;
+    }
+    
+    dirtyRect = CGRectUnion(dirtyRect, [self dirtyRectForFrame:i]);
+#if defined(EXTRA_CHECKS) || defined(ALWAYS_CHECK_ADLER)
+    lastDeltaIndex = i;
+#endif // EXTRA_CHECKS || ALWAYS_CHECK_ADLER
+  }
+  
+  // A single delta is applied faster by the regular decode path
+  
+  if (composition->numDeltas < 2) {
+    return FALSE;
+  }
+  
+  if (self.currentFrameBuffer != nextFrameBuffer) {
+    [self _copyPixels:nextFrameBuffer fromBuffer:self.currentFrameBuffer currentIndex:frameIndex];
+    self.currentFrameBuffer = nextFrameBuffer;
+  } else {
+    [self.currentFrameBuffer zeroCopyToPixels];
+  }
+  
+  uint32_t *frameBuffer32 = (uint32_t*) nextFrameBuffer.pixels;
+  
+  maxvid_delta_composition_apply32(composition, frameBuffer32);
+  
+  self->m_numComposedDeltas += composition->numDeltas;
+  
+  // The runs point into the mapped segments, drop them before the segments are released
+  
+  maxvid_delta_composition_reset(composition);
+  
+  frameIndex = newFrameIndex;
+  [self _setFramebuffer:nextFrameBuffer frameIndex:newFrameIndex];
+  
+  *dirtyRectPtr = CGRectUnion(*dirtyRectPtr, dirtyRect);
+  
+#if defined(EXTRA_CHECKS) || defined(ALWAYS_CHECK_ADLER)
+  MVV3Frame *lastDeltaFrame = maxvid_v3_file_frame(self.mvFrames, lastDeltaIndex);
+  [self assertSameAdler:lastDeltaFrame->adler frameBuffer:frameBuffer32 frameBufferNumBytes:(uint32_t)nextFrameBuffer.numBytes];
+#endif // EXTRA_CHECKS || ALWAYS_CHECK_ADLER
+  
+  return TRUE;
+}
+
 - (AVFrame*) duplicateCurrentFrame
 {
   if (self.currentFrameBuffer == nil) {
@@ -1139,6 +2246,9 @@
   if (!worked) {
     return FALSE;
   }
+  
+  [self.resourceGovernor decoderResourcesChanged:self];
+  
   return TRUE;
 }
 
@@ -1148,6 +2258,19 @@
   
   [self _freeFrameBuffers];
   [self _unmapFile];
+  [self _removeCheckpoints];
+  
+  maxvid_delta_composition_free(&self->m_deltaComposition);
+  
+#if MV_ENABLE_DELTAS
+  if (decompressionBuffer) {
+    free(decompressionBuffer);
+    decompressionBuffer = NULL;
+    decompressionBufferSize = 0;
+  }
+#endif // MV_ENABLE_DELTAS
+  
+  [self.resourceGovernor decoderResourcesChanged:self];
 }
 
 - (BOOL) isResourceUsageLimit
@@ -1222,6 +2345,42 @@
   }
 }
 
+- (CGRect) dirtyRectForFrame:(NSUInteger)index
+{
+  NSAssert(index < [self numFrames], @"index out of range");
+  
+  uint32_t width = (uint32_t) [self width];
+  uint32_t height = (uint32_t) [self height];
+  
+  CGRect frameRect = CGRectMake(0, 0, width, height);
+  
+  if (self.mvFrames == NULL) {
+    return CGRectNull;
+  }
+  
+  if (maxvid_file_version([self header]) == MV_FILE_VERSION_THREE) {
+    MVV3Frame *frame = maxvid_v3_file_frame(self.mvFrames, (uint32_t)index);
+    
+    if (maxvid_v3_frame_isnopframe(frame)) {
+      return CGRectZero;
+    } else if (maxvid_v3_frame_iskeyframe(frame) || !maxvid_v3_frame_hasdirtyrect(frame)) {
+      return frameRect;
+    } else {
+      uint32_t x, y, x2, y2;
+      maxvid_v3_frame_dirtyrect(frame, width, height, &x, &y, &x2, &y2);
+      return CGRectMake(x, y, x2 - x, y2 - y);
+    }
+  } else {
+    MVFrame *frame = maxvid_file_frame(self.mvFrames, (uint32_t)index);
+    
+    if (maxvid_frame_isnopframe(frame)) {
+      return CGRectZero;
+    } else {
+      return frameRect;
+    }
+  }
+}
+
 - (NSString*) description
 {
   return [NSString stringWithFormat:@"AVMvidFrameDecoder %p, file %@, isOpen %d, isMapped %d, w/h %d x %d, numFrames %d",
@@ -1252,3 +2411,366 @@
 #endif // MV_ENABLE_DELTAS
 
 @end
+
+// AVMvidFrameCache
+
+// A cached frame and its place in the list of cached frames, which is ordered
+// from the least recently used frame to the most recently used one. The
+// dictionary of entries retains each entry, the list links are not retained.
+
+@interface AVMvidFrameCacheEntry : NSObject {
+@public
+  NSString *key;
+  AVFrame *frame;
+  AVMvidFrameCacheEntry *prev;
+  AVMvidFrameCacheEntry *next;
+}
+@end
+
+@implementation AVMvidFrameCacheEntry
+
+- (void) dealloc
+{
+  [self->key release];
+  [self->frame release];
+  [super dealloc];
+}
+
+@end
+
+@implementation AVMvidFrameCache
+
+@synthesize maxNumBytes = m_maxNumBytes;
+@synthesize numBytes = m_numBytes;
+@synthesize numHits = m_numHits;
+@synthesize numMisses = m_numMisses;
+
+- (id) init
+{
+  if ((self = [super init]) != nil) {
+    self->m_frames = [[NSMutableDictionary alloc] init];
+    self->m_maxNumBytes = DEFAULT_FRAME_CACHE_MAX_NUM_BYTES;
+  }
+  return self;
+}
+
+- (void) dealloc
+{
+  [self->m_frames release];
+  [super dealloc];
+}
+
++ (AVMvidFrameCache*) aVMvidFrameCache
+{
+  AVMvidFrameCache *obj = [[AVMvidFrameCache alloc] init];
+  return [obj autorelease];
+}
+
++ (AVMvidFrameCache*) sharedFrameCache
+{
+  static AVMvidFrameCache *cache = nil;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    cache = [[AVMvidFrameCache alloc] init];
+  });
+  return cache;
+}
+
+- (void) _unlinkEntry:(AVMvidFrameCacheEntry*)entry
+{
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    self->m_leastRecentlyUsed = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    self->m_mostRecentlyUsed = entry->prev;
+  }
+  entry->prev = nil;
+  entry->next = nil;
+}
+
+- (void) _appendEntry:(AVMvidFrameCacheEntry*)entry
+{
+  entry->prev = self->m_mostRecentlyUsed;
+  entry->next = nil;
+  if (self->m_mostRecentlyUsed) {
+    self->m_mostRecentlyUsed->next = entry;
+  } else {
+    self->m_leastRecentlyUsed = entry;
+  }
+  self->m_mostRecentlyUsed = entry;
+}
+
+- (AVFrame*) frameForKey:(NSString*)key
+{
+  AVFrame *frame = nil;
+  
+  @synchronized(self) {
+    AVMvidFrameCacheEntry *entry = [self->m_frames objectForKey:key];
+    
+    if (entry) {
+      // Move the entry to the end of the recently used list
+      
+      frame = [entry->frame retain];
+      
+      if (entry != self->m_mostRecentlyUsed) {
+        [self _unlinkEntry:entry];
+        [self _appendEntry:entry];
+      }
+      
+      self->m_numHits++;
+    } else {
+      self->m_numMisses++;
+    }
+  }
+  
+  return [frame autorelease];
+}
+
+// Drop least recently used frames until no more than maxNumBytes are held
+
+- (void) _evictFrames
+{
+  while (self->m_numBytes > self->m_maxNumBytes && self->m_leastRecentlyUsed) {
+    AVMvidFrameCacheEntry *entry = [[self->m_leastRecentlyUsed retain] autorelease];
+    self->m_numBytes -= entry->frame.cgFrameBuffer.numBytes;
+    [self _unlinkEntry:entry];
+    [self->m_frames removeObjectForKey:entry->key];
+  }
+}
+
+- (void) setFrame:(AVFrame*)frame forKey:(NSString*)key
+{
+  NSAssert(frame.cgFrameBuffer, @"cached frame must have a framebuffer");
+  
+  @synchronized(self) {
+    AVMvidFrameCacheEntry *entry = [self->m_frames objectForKey:key];
+    
+    if (entry) {
+      self->m_numBytes -= entry->frame.cgFrameBuffer.numBytes;
+      [self _unlinkEntry:entry];
+      [entry->frame autorelease];
+    } else {
+      entry = [[[AVMvidFrameCacheEntry alloc] init] autorelease];
+      entry->key = [key copy];
+      [self->m_frames setObject:entry forKey:entry->key];
+    }
+    
+    entry->frame = [frame retain];
+    [self _appendEntry:entry];
+    self->m_numBytes += frame.cgFrameBuffer.numBytes;
+    
+    [self _evictFrames];
+  }
+}
+
+- (void) setMaxNumBytes:(NSUInteger)maxNumBytes
+{
+  @synchronized(self) {
+    self->m_maxNumBytes = maxNumBytes;
+    [self _evictFrames];
+  }
+}
+
+- (void) removeAllFrames
+{
+  @synchronized(self) {
+    [self->m_frames removeAllObjects];
+    self->m_leastRecentlyUsed = nil;
+    self->m_mostRecentlyUsed = nil;
+    self->m_numBytes = 0;
+  }
+}
+
+- (float) hitRate
+{
+  @synchronized(self) {
+    NSUInteger numLookups = self->m_numHits + self->m_numMisses;
+    return (numLookups == 0) ? 0.0f : ((float)self->m_numHits / numLookups);
+  }
+}
+
+@end
+
+// AVMvidResourceGovernor
+
+// Each managed decoder has an entry in a doubly linked list ordered from the
+// least recently used decoder to the most recently used one. The entry holds
+// the decode resource size last counted for the decoder, so that the total
+// is updated from the one decoder that changed instead of all of them.
+
+typedef struct AVMvidGovernorEntry {
+  AVMvidFrameDecoder *decoder;
+  NSUInteger numBytes;
+  struct AVMvidGovernorEntry *prev;
+  struct AVMvidGovernorEntry *next;
+} AVMvidGovernorEntry;
+
+@implementation AVMvidResourceGovernor
+
+@synthesize maxNumBytes = m_maxNumBytes;
+@synthesize numEvictions = m_numEvictions;
+
+- (id) init
+{
+  if ((self = [super init]) != nil) {
+    // Maps a non-retained decoder pointer to its list entry
+    self->m_entries = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    self->m_maxNumBytes = DEFAULT_GOVERNOR_MAX_NUM_BYTES;
+  }
+  return self;
+}
+
+- (void) dealloc
+{
+  AVMvidGovernorEntry *entry = self->m_leastRecentlyUsed;
+  while (entry) {
+    AVMvidGovernorEntry *next = entry->next;
+    free(entry);
+    entry = next;
+  }
+  CFRelease(self->m_entries);
+  [super dealloc];
+}
+
++ (AVMvidResourceGovernor*) aVMvidResourceGovernor
+{
+  AVMvidResourceGovernor *obj = [[AVMvidResourceGovernor alloc] init];
+  return [obj autorelease];
+}
+
++ (AVMvidResourceGovernor*) sharedResourceGovernor
+{
+  static AVMvidResourceGovernor *governor = nil;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    governor = [[AVMvidResourceGovernor alloc] init];
+  });
+  return governor;
+}
+
+- (NSUInteger) numBytes
+{
+  return self->m_numBytes;
+}
+
+- (NSUInteger) numDecoders
+{
+  return (NSUInteger) CFDictionaryGetCount(self->m_entries);
+}
+
+- (void) _unlinkEntry:(AVMvidGovernorEntry*)entry
+{
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    self->m_leastRecentlyUsed = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    self->m_mostRecentlyUsed = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+- (void) _appendEntry:(AVMvidGovernorEntry*)entry
+{
+  entry->prev = self->m_mostRecentlyUsed;
+  entry->next = NULL;
+  if (self->m_mostRecentlyUsed) {
+    self->m_mostRecentlyUsed->next = entry;
+  } else {
+    self->m_leastRecentlyUsed = entry;
+  }
+  self->m_mostRecentlyUsed = entry;
+}
+
+- (void) addDecoder:(AVMvidFrameDecoder*)decoder
+{
+  if (CFDictionaryGetValue(self->m_entries, decoder) != NULL) {
+    return;
+  }
+  
+  AVMvidGovernorEntry *entry = calloc(1, sizeof(AVMvidGovernorEntry));
+  assert(entry);
+  entry->decoder = decoder;
+  entry->numBytes = [decoder decodeResourceNumBytes];
+  
+  CFDictionarySetValue(self->m_entries, decoder, entry);
+  [self _appendEntry:entry];
+  self->m_numBytes += entry->numBytes;
+}
+
+- (void) removeDecoder:(AVMvidFrameDecoder*)decoder
+{
+  AVMvidGovernorEntry *entry = (AVMvidGovernorEntry*) CFDictionaryGetValue(self->m_entries, decoder);
+  
+  if (entry == NULL) {
+    return;
+  }
+  
+  [self _unlinkEntry:entry];
+  CFDictionaryRemoveValue(self->m_entries, decoder);
+  self->m_numBytes -= entry->numBytes;
+  free(entry);
+}
+
+// Count the decode resources of one decoder again, this is invoked when the
+// decoder allocates or releases resources.
+
+- (void) decoderResourcesChanged:(AVMvidFrameDecoder*)decoder
+{
+  AVMvidGovernorEntry *entry = (AVMvidGovernorEntry*) CFDictionaryGetValue(self->m_entries, decoder);
+  
+  if (entry == NULL) {
+    return;
+  }
+  
+  NSUInteger numBytes = [decoder decodeResourceNumBytes];
+  self->m_numBytes = self->m_numBytes - entry->numBytes + numBytes;
+  entry->numBytes = numBytes;
+}
+
+- (void) decoderWasUsed:(AVMvidFrameDecoder*)decoder
+{
+  AVMvidGovernorEntry *entry = (AVMvidGovernorEntry*) CFDictionaryGetValue(self->m_entries, decoder);
+  
+  if (entry == NULL) {
+    return;
+  }
+  
+  // Decoding can allocate framebuffers and checkpoints, so count the
+  // resources of the decoder that was just used.
+  
+  [self decoderResourcesChanged:decoder];
+  
+  if (entry != self->m_mostRecentlyUsed) {
+    [self _unlinkEntry:entry];
+    [self _appendEntry:entry];
+  }
+  
+  // Release resources starting from the least recently used decoder, the
+  // decoder that was just used is last and is never released here. Releasing
+  // resources updates the entry of the released decoder via
+  // decoderResourcesChanged.
+  
+  AVMvidGovernorEntry *lruEntry = self->m_leastRecentlyUsed;
+  
+  while ((self->m_numBytes > self.maxNumBytes) && (lruEntry != entry)) {
+    AVMvidGovernorEntry *next = lruEntry->next;
+    
+    if (lruEntry->numBytes > 0) {
+      [lruEntry->decoder releaseDecodeResources];
+      self->m_numEvictions++;
+    }
+    
+    lruEntry = next;
+  }
+}
+
+@end
@@ -140,3 +140,46 @@
 - (void) rewriteOpaquePixels;
 
 @end
+
+// A pool of framebuffers that an encoder can draw from instead of allocating
+// and zero filling a new buffer for every frame. A buffer is checked out of the
+// pool and belongs to the caller until the caller explicitly returns it, the
+// pool never hands out a buffer that has not been returned. At most
+// maxNumBuffers returned buffers are kept, a buffer returned to a full pool is
+// released. The pixel contents of a checked out buffer are undefined, invoke
+// clear when a zeroed buffer is needed.
+
+@interface CGFrameBufferPool : NSObject
+{
+@protected
+  NSMutableArray *m_buffers;
+  NSUInteger m_maxNumBuffers;
+  NSUInteger m_numAllocated;
+  NSUInteger m_numReused;
+}
+
+// Defaults to 8
+
+@property (assign) NSUInteger maxNumBuffers;
+
+@property (readonly) NSUInteger numAllocated;
+@property (readonly) NSUInteger numReused;
+
++ (CGFrameBufferPool*) cGFrameBufferPool;
+
+// Return an autoreleased framebuffer with the indicated dimensions, this
+// method is thread safe.
+
+- (CGFrameBuffer*) checkoutFrameBufferWithBppDimensions:(NSInteger)bitsPerPixel width:(NSInteger)width height:(NSInteger)height;
+
+// Give a checked out framebuffer back to the pool, the caller must not read or
+// write the pixels after this. A buffer that is still locked by a CGImage data
+// provider is not kept. This method is thread safe.
+
+- (void) returnFrameBuffer:(CGFrameBuffer*)buffer;
+
+// Release every buffer held by the pool
+
+- (void) removeAllFrameBuffers;
+
+@end
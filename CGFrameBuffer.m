@@ -738,37 +738,25 @@ uint16_t abgr_to_rgb15(uint32_t pixel)
 
   assert(self.width <= anotherFrameBuffer.width);
   assert(self.height <= anotherFrameBuffer.height);
+  assert((cropX + self.width) <= anotherFrameBuffer.width);
+  assert((cropY + self.height) <= anotherFrameBuffer.height);
   
-  // Critically important to zero out memory before doing a paint of
-  // the other image data so that existing framebuffer is data is removed.
+  // Pixels are stored in the same format in both buffers, so the crop
+  // region is copied one row at a time.
   
-  [self clear];
+  assert(self.bitsPerPixel == anotherFrameBuffer.bitsPerPixel);
   
-  // Create a CGImage from anotherFrameBuffer that contains just the pixels
-  // indicated in the crop region. Then, render this image into the current
-  // framebuffer.
-
-  CGImageRef fullImage = nil;
-  CGImageRef croppedImage = nil;
-  
-  fullImage = [anotherFrameBuffer createCGImageRef];
-  
-  CGRect cropRect = CGRectMake(cropX, cropY, self.width, self.height);
-  
-  croppedImage = CGImageCreateWithImageInRect(fullImage, cropRect);
+  const size_t bytesPerPixel = self.bytesPerPixel;
+  const size_t srcBytesPerRow = anotherFrameBuffer.width * bytesPerPixel;
+  const size_t dstBytesPerRow = self.width * bytesPerPixel;
   
-  assert(croppedImage);
+  const char *srcPtr = anotherFrameBuffer.pixels + (cropY * srcBytesPerRow) + (cropX * bytesPerPixel);
+  char *dstPtr = self.pixels;
   
-  BOOL worked;
-  worked = [self renderCGImage:croppedImage];
-  assert(worked);
-  
-  if (fullImage) {
-    CGImageRelease(fullImage);
-  }
-
-  if (croppedImage) {
-    CGImageRelease(croppedImage);
+  for (size_t row = 0; row < self.height; row++) {
+    memcpy(dstPtr, srcPtr, dstBytesPerRow);
+    srcPtr += srcBytesPerRow;
+    dstPtr += dstBytesPerRow;
   }
 
   assert(anotherFrameBuffer.isLockedByDataProvider == FALSE);
@@ -803,3 +791,89 @@ void CGFrameBufferProviderReleaseData (void *info, const void *data, size_t size
 	CGFrameBuffer *cgBuffer = (CGFrameBuffer *) info;
 	cgBuffer.isLockedByDataProvider = FALSE;
 }
+
+@implementation CGFrameBufferPool
+
+@synthesize maxNumBuffers = m_maxNumBuffers;
+@synthesize numAllocated = m_numAllocated;
+@synthesize numReused = m_numReused;
+
++ (CGFrameBufferPool*) cGFrameBufferPool
+{
+  CGFrameBufferPool *obj = [[CGFrameBufferPool alloc] init];
+  return [obj autorelease];
+}
+
+- (id) init
+{
+  if ((self = [super init])) {
+    // Only buffers that were returned are held here
+    self->m_buffers = [[NSMutableArray alloc] init];
+    self->m_maxNumBuffers = 8;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [self->m_buffers release];
+  [super dealloc];
+}
+
+- (CGFrameBuffer*) checkoutFrameBufferWithBppDimensions:(NSInteger)bitsPerPixel width:(NSInteger)width height:(NSInteger)height
+{
+  CGFrameBuffer *cgBuffer = nil;
+  
+  @synchronized(self) {
+    // Search from the most recently returned buffer, its pixels are most likely
+    // to still be in the cache.
+    
+    for (NSInteger i = [self->m_buffers count] - 1; i >= 0; i--) {
+      CGFrameBuffer *buffer = [self->m_buffers objectAtIndex:i];
+      if (buffer.bitsPerPixel == bitsPerPixel &&
+          buffer.width == width &&
+          buffer.height == height) {
+        cgBuffer = [[buffer retain] autorelease];
+        [self->m_buffers removeObjectAtIndex:i];
+        break;
+      }
+    }
+    
+    if (cgBuffer) {
+      cgBuffer.useHighQualityInterpolation = FALSE;
+      cgBuffer.colorspace = NULL;
+      self->m_numReused++;
+    } else {
+      self->m_numAllocated++;
+    }
+  }
+  
+  if (cgBuffer == nil) {
+    cgBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bitsPerPixel width:width height:height];
+  }
+  
+  return cgBuffer;
+}
+
+- (void) returnFrameBuffer:(CGFrameBuffer*)buffer
+{
+  if (buffer == nil || buffer.isLockedByDataProvider) {
+    return;
+  }
+  
+  @synchronized(self) {
+    NSAssert([self->m_buffers indexOfObjectIdenticalTo:buffer] == NSNotFound, @"framebuffer was returned twice");
+    
+    if ([self->m_buffers count] < self->m_maxNumBuffers) {
+      [self->m_buffers addObject:buffer];
+    }
+  }
+}
+
+- (void) removeAllFrameBuffers
+{
+  @synchronized(self) {
+    [self->m_buffers removeAllObjects];
+  }
+}
+
+@end
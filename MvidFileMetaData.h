@@ -17,12 +17,30 @@
 
 #import <Foundation/Foundation.h>
 
+// A pixel value and the number of times it was found, see sortedPixelCounts
+
+typedef struct {
+  uint32_t pixel;
+  uint32_t padding;
+  uint64_t count;
+} MvidPixelCount;
+
 @interface MvidFileMetaData : NSObject
 {
   NSUInteger m_bpp;
   BOOL m_checkAlphaChannel;
   BOOL m_recordFramePixelValues;
-  NSMutableDictionary *m_allPixelOccurances;
+  
+  // 16 BPP pixels are counted in a table indexed by pixel value, 32 BPP pixels
+  // are counted in an open addressing hash table. A zero count marks an empty
+  // slot in the hash table.
+  
+  uint64_t *m_pixelCounts16;
+  uint32_t *m_hashPixels;
+  uint64_t *m_hashCounts;
+  uint32_t m_hashCapacity;
+  uint32_t m_hashNumEntries;
+  uint64_t m_numPixelsRecorded;
 }
 
 // The BPP value the caller assumes. Can be 16, 24, or 32 BPP. In the
@@ -43,10 +61,11 @@
 
 @property (nonatomic, assign) BOOL recordFramePixelValues;
 
-// This table tracks instances of specific pixel values in all the
-// frames of a movie.
+// The number of different pixel values and the total number of pixels recorded
+
+@property (nonatomic, readonly) NSUInteger numUniquePixels;
 
-@property (nonatomic, retain) NSMutableDictionary *allPixelOccurances;
+@property (nonatomic, readonly) uint64_t numPixelsRecorded;
 
 // constructor
 
@@ -63,4 +82,19 @@
 
 - (void) foundPixel16:(uint16_t)pixel;
 
+// Record all the pixels in a frame in one call, this is much faster than
+// invoking foundPixel32 or foundPixel16 for each pixel.
+
+- (void) foundPixels32:(const uint32_t*)pixels numPixels:(NSUInteger)numPixels;
+
+- (void) foundPixels16:(const uint16_t*)pixels numPixels:(NSUInteger)numPixels;
+
+// Return the number of times a specific pixel value was found
+
+- (uint64_t) countForPixel:(uint32_t)pixel;
+
+// Return a buffer of MvidPixelCount records sorted by descending count
+
+- (NSData*) sortedPixelCounts;
+
 @end
@@ -6,6 +6,16 @@
 
 #import "MvidFileMetaData.h"
 
+#define PIXEL_HASH_INITIAL_CAPACITY (64 * 1024)
+
+// Multiplicative hash of a 32 bit pixel value into a power of 2 sized table
+
+static inline
+uint32_t pixel_hash_index(uint32_t pixel, uint32_t mask)
+{
+  return (pixel * 0x9E3779B1) & mask;
+}
+
 @implementation MvidFileMetaData
 
 @synthesize bpp = m_bpp;
@@ -14,7 +24,7 @@
 
 @synthesize recordFramePixelValues = m_recordFramePixelValues;
 
-@synthesize allPixelOccurances = m_allPixelOccurances;
+@synthesize numPixelsRecorded = m_numPixelsRecorded;
 
 + (MvidFileMetaData*) mvidFileMetaData
 {
@@ -24,198 +34,282 @@
 
 - (void)dealloc
 {
-  self.allPixelOccurances = nil;
+  free(m_pixelCounts16);
+  free(m_hashPixels);
+  free(m_hashCounts);
   [super dealloc];
 }
 
-// FIXME: currently this table based logic only works with 32BPP pixels. Need
-// to find a way to support either 32 or 16 BPP with one function, otherwise
-// write 2 different ones.
+// Allocate a hash table with the indicated power of 2 capacity and insert
+// any existing entries into the new table.
+
+- (void) resizeHashTable:(uint32_t)capacity
+{
+  uint32_t *oldPixels = m_hashPixels;
+  uint64_t *oldCounts = m_hashCounts;
+  uint32_t oldCapacity = m_hashCapacity;
+
+  m_hashPixels = malloc(capacity * sizeof(uint32_t));
+  m_hashCounts = calloc(capacity, sizeof(uint64_t));
+  assert(m_hashPixels && m_hashCounts);
+  m_hashCapacity = capacity;
+
+  uint32_t mask = capacity - 1;
+
+  for (uint32_t i = 0; i < oldCapacity; i++) {
+    if (oldCounts[i] == 0) {
+      continue;
+    }
+    uint32_t index = pixel_hash_index(oldPixels[i], mask);
+    while (m_hashCounts[index] != 0) {
+      index = (index + 1) & mask;
+    }
+    m_hashPixels[index] = oldPixels[i];
+    m_hashCounts[index] = oldCounts[i];
+  }
+
+  free(oldPixels);
+  free(oldCounts);
+}
+
+// Add count to the entry for pixel in the hash table
+
+static inline
+void add_pixel32_count(MvidFileMetaData *obj, uint32_t pixel, uint64_t count)
+{
+  if (obj->m_hashNumEntries >= ((obj->m_hashCapacity / 4) * 3)) {
+    [obj resizeHashTable:(obj->m_hashCapacity == 0 ? PIXEL_HASH_INITIAL_CAPACITY : obj->m_hashCapacity * 2)];
+  }
+
+  uint32_t mask = obj->m_hashCapacity - 1;
+  uint32_t index = pixel_hash_index(pixel, mask);
+
+  while (1) {
+    uint64_t existing = obj->m_hashCounts[index];
+    if (existing == 0) {
+      obj->m_hashPixels[index] = pixel;
+      obj->m_hashCounts[index] = count;
+      obj->m_hashNumEntries++;
+      return;
+    } else if (obj->m_hashPixels[index] == pixel) {
+      obj->m_hashCounts[index] = existing + count;
+      return;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+static inline
+void add_pixel16_count(MvidFileMetaData *obj, uint16_t pixel, uint64_t count)
+{
+  if (obj->m_pixelCounts16 == NULL) {
+    obj->m_pixelCounts16 = calloc(0x10000, sizeof(uint64_t));
+    assert(obj->m_pixelCounts16);
+  }
+  obj->m_pixelCounts16[pixel] += count;
+}
+
+- (NSUInteger) numUniquePixels
+{
+  NSUInteger count = m_hashNumEntries;
+  if (m_pixelCounts16) {
+    for (uint32_t i = 0; i < 0x10000; i++) {
+      if (m_pixelCounts16[i] != 0) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+- (uint64_t) countForPixel:(uint32_t)pixel
+{
+  if (self.bpp == 16) {
+    if (m_pixelCounts16 == NULL || pixel > 0xFFFF) {
+      return 0;
+    }
+    return m_pixelCounts16[pixel];
+  }
+
+  if (m_hashCapacity == 0) {
+    return 0;
+  }
+
+  uint32_t mask = m_hashCapacity - 1;
+  uint32_t index = pixel_hash_index(pixel, mask);
+
+  while (m_hashCounts[index] != 0) {
+    if (m_hashPixels[index] == pixel) {
+      return m_hashCounts[index];
+    }
+    index = (index + 1) & mask;
+  }
+
+  return 0;
+}
 
 - (void) doneRecordingFramePixelValues
 {
   NSAssert(self.recordFramePixelValues, @"recording frame pixels must have been enabled");
   self.recordFramePixelValues = FALSE;
 
-  if (self.checkAlphaChannel && self.bpp == 24) @autoreleasepool {
+  if (self.checkAlphaChannel && self.bpp == 24 && m_hashCapacity > 0) {
     // In this case, the BPP of the input was unknown but now it is known to be 24BPP.
     // When rendered, each pixel will have the alpha channel set to zero instead of 0xFF
-    // since that compresses better. But, we need to update each key and value in the
-    // allPixelOccurances dictionary since these values include a 0xFF alpha channel value.
-    
-    NSArray *allKeys = [self.allPixelOccurances allKeys];
-    NSAssert(allKeys, @"must be at least 1 pixel in allPixelOccurances");
-    
-    for (NSNumber *key in allKeys) {
-      NSNumber *countThisPixel = [self.allPixelOccurances objectForKey:key];
-      NSAssert(countThisPixel != nil, @"countThisPixel is nil");
-            
-      uint32_t pixel = [key unsignedIntValue];
+    // since that compresses better. But, we need to update each pixel value in the
+    // hash table since these values include a 0xFF alpha channel value.
+
+    uint32_t *oldPixels = m_hashPixels;
+    uint64_t *oldCounts = m_hashCounts;
+    uint32_t oldCapacity = m_hashCapacity;
+
+    m_hashPixels = NULL;
+    m_hashCounts = NULL;
+    m_hashCapacity = 0;
+    m_hashNumEntries = 0;
+
+    [self resizeHashTable:oldCapacity];
+
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+      if (oldCounts[i] == 0) {
+        continue;
+      }
+      uint32_t pixel = oldPixels[i];
       assert((pixel >> 24) == 0xFF || (pixel >> 24) == 0x0);
-      pixel = pixel & 0xFFFFFF;
-
-      key = [NSNumber numberWithUnsignedInt:pixel];
-      
-      [self.allPixelOccurances setObject:countThisPixel forKey:key];
-      
-      // Remove the previous key to value mapping after adding the new mapping
-      // so that the value object is not deallocated.
-      
-      [self.allPixelOccurances removeObjectForKey:key];
+      add_pixel32_count(self, pixel & 0xFFFFFF, oldCounts[i]);
     }
+
+    free(oldPixels);
+    free(oldCounts);
   }
-  
+
   // Once all pixel are ready, sort the pixel by the number of times each
-  // is found in the file to create a list of keys sorted by frequency.
-  
-  // Now iterate over the sorted counts from largest to smallest to see the values in terms
-  // of the most frequently used pixels.
-  
-  NSArray *pixelsSortedByDescendingCount = [self sortPixelOccurances:self.allPixelOccurances];
-  NSAssert([pixelsSortedByDescendingCount count] > 0, @"pixelsSortedByDescendingCount");
-  
+  // is found in the file and log the most frequently used pixels.
+
+  NSData *sortedPixelCounts = [self sortedPixelCounts];
+
+  NSUInteger numEntries = [sortedPixelCounts length] / sizeof(MvidPixelCount);
+  NSAssert(numEntries > 0, @"sortedPixelCounts");
+
+  NSLog(@"pixelsSortedByDescendingCount table has %d entries", (int)numEntries);
+
+  const MvidPixelCount *entries = (const MvidPixelCount *) [sortedPixelCounts bytes];
+
+  for (NSUInteger i = 0; i < MIN(numEntries, 256); i++) {
+    if (self.bpp == 16) {
+      NSLog(@"pixel 0x%.04X, %llu", entries[i].pixel, entries[i].count);
+    } else {
+      NSLog(@"pixel 0x%.06X, %llu", entries[i].pixel, entries[i].count);
+    }
+  }
+
   return;
 }
 
 - (void) foundPixel32:(uint32_t)pixel
 {
-  if (self.allPixelOccurances == nil) {
-    self.allPixelOccurances = [NSMutableDictionary dictionaryWithCapacity:(1024*4)*1024];
-  }
-  
-  NSNumber *pixelNum = [NSNumber numberWithUnsignedInt:pixel];
-  
-  NSNumber *countThisPixel = [self.allPixelOccurances objectForKey:pixelNum];
-  
-  if (countThisPixel == nil) {
-    // First time this pixel has been seen
-    
-    countThisPixel = [NSNumber numberWithUnsignedInt:1];
-  } else {
-    // Add 1 to the existing pixel count
-    
-    uint32_t currentCount = [countThisPixel unsignedIntValue];
-    
-    currentCount++;
-    
-    countThisPixel =[NSNumber numberWithUnsignedInt:currentCount];
-  }
-  
-  [self.allPixelOccurances setObject:countThisPixel forKey:pixelNum];
+  add_pixel32_count(self, pixel, 1);
+  m_numPixelsRecorded++;
 }
 
 - (void) foundPixel16:(uint16_t)pixel
 {
-  if (self.allPixelOccurances == nil) {
-    self.allPixelOccurances = [NSMutableDictionary dictionaryWithCapacity:(1024*4)*1024];
-  }
-  
-  NSNumber *pixelNum = [NSNumber numberWithUnsignedShort:pixel];
-  
-  NSNumber *countThisPixel = [self.allPixelOccurances objectForKey:pixelNum];
-  
-  if (countThisPixel == nil) {
-    // First time this pixel has been seen
-    
-    countThisPixel = [NSNumber numberWithUnsignedInt:1];
-  } else {
-    // Add 1 to the existing pixel count
-    
-    uint32_t currentCount = [countThisPixel unsignedIntValue];
-    
-    currentCount++;
-    
-    countThisPixel =[NSNumber numberWithUnsignedInt:currentCount];
-  }
-  
-  [self.allPixelOccurances setObject:countThisPixel forKey:pixelNum];
+  add_pixel16_count(self, pixel, 1);
+  m_numPixelsRecorded++;
 }
 
-// Sort pixels in a dictionary of pixel value (NSNumber) to occurance count (NSNumber).
-// The sort order is always descending, so that the list of returned keys indicates
-// the pixel values in terms of most to least number of pixels in the table.
+// Animation frames often contain long runs of the same pixel value, so a run
+// is counted with a single table update. The run scan compares 4 pixels at a
+// time when the next 4 pixels are all the same as the current run value.
 
-- (NSArray*) sortPixelOccurances:(NSDictionary*)dict
+- (void) foundPixels32:(const uint32_t*)pixels numPixels:(NSUInteger)numPixels
 {
-  NSMutableArray *pixelsSortedByDescendingCount = nil;
-  
-  @autoreleasepool {
-    NSArray *allKeys = [self.allPixelOccurances allKeys];
-    NSAssert(allKeys, @"must be at least 1 pixel in allPixelOccurances");
-    
-    NSArray *allValues = [self.allPixelOccurances allValues];
-    
-    // Sort the values in the table in terms of descending count number
-    
-    NSArray *sortedValues = [allValues sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
-      NSNumber *first = (NSNumber*)a;
-      NSNumber *second = (NSNumber*)b;
-      return [second compare:first];
-    }];
-    
-    // Create a new table that maps the pixel count to an array of pixel
-    // values for this specific count.
-    
-    NSMutableDictionary *countToPixels = [NSMutableDictionary dictionaryWithCapacity:[allKeys count]];
-    
-    for (NSNumber *key in allKeys) {
-      NSNumber *countThisPixel = [self.allPixelOccurances objectForKey:key];
-      
-      NSMutableArray *arrayOfPixels = [countToPixels objectForKey:countThisPixel];
-      
-      if (arrayOfPixels == nil) {
-        arrayOfPixels = [NSMutableArray array];
-      }
-      
-      // Add this pixel to the list of pixels for this count
-      [arrayOfPixels addObject:key];
-      
-      [countToPixels setObject:arrayOfPixels forKey:countThisPixel];
+  NSUInteger i = 0;
+
+  while (i < numPixels) {
+    uint32_t pixel = pixels[i];
+    NSUInteger runEnd = i + 1;
+
+    while ((runEnd + 4) <= numPixels &&
+           ((pixels[runEnd] ^ pixel) | (pixels[runEnd+1] ^ pixel) |
+            (pixels[runEnd+2] ^ pixel) | (pixels[runEnd+3] ^ pixel)) == 0) {
+      runEnd += 4;
     }
-    
-    // Now iterate over the sorted counts from largest to smallest to see the values in terms
-    // of the most frequently used pixels.
-    
-    pixelsSortedByDescendingCount = [[NSMutableArray alloc] initWithCapacity:[allKeys count]];
-    
-    for (NSNumber *sortedValue in sortedValues) {
-      NSMutableArray *arrayOfPixels = [countToPixels objectForKey:sortedValue];
-      
-      //uint32_t count = [sortedValue unsignedIntValue];
-      
-      // Note that we need to empty out the pixel array after seeing it once
-      // to avoid duplicates for the same count number.
-      
-      if ([arrayOfPixels count] > 0) {
-        //NSLog(@"Count: %d, pixels %@", count, arrayOfPixels);
-        
-        for (NSNumber *pixelKey in arrayOfPixels) {
-          [pixelsSortedByDescendingCount addObject:pixelKey];
-        }
-        
-        [arrayOfPixels removeAllObjects];
-      }
+    while (runEnd < numPixels && pixels[runEnd] == pixel) {
+      runEnd++;
     }
-    
-    // Finally we have a deduped list of keys in descending sorted order
-    
-    NSLog(@"pixelsSortedByDescendingCount table has %d entries", (int)[pixelsSortedByDescendingCount count]);
-    
-    for (NSNumber *pixelKey in pixelsSortedByDescendingCount) {
-      NSNumber *countThisPixel = [self.allPixelOccurances objectForKey:pixelKey];
-      uint32_t count = [countThisPixel unsignedIntValue];
-      
-      if (self.bpp == 16) {
-        uint32_t pixel16 = [pixelKey unsignedShortValue];
-        NSLog(@"pixel 0x%.04X, %d", pixel16, count);
-      } else {
-        uint32_t pixel32 = [pixelKey unsignedIntValue];
-        NSLog(@"pixel 0x%.06X, %d", pixel32, count);
+
+    add_pixel32_count(self, pixel, runEnd - i);
+    i = runEnd;
+  }
+
+  m_numPixelsRecorded += numPixels;
+}
+
+- (void) foundPixels16:(const uint16_t*)pixels numPixels:(NSUInteger)numPixels
+{
+  if (m_pixelCounts16 == NULL) {
+    m_pixelCounts16 = calloc(0x10000, sizeof(uint64_t));
+    assert(m_pixelCounts16);
+  }
+
+  uint64_t *counts = m_pixelCounts16;
+
+  for (NSUInteger i = 0; i < numPixels; i++) {
+    counts[pixels[i]]++;
+  }
+
+  m_numPixelsRecorded += numPixels;
+}
+
+static
+int compare_pixel_count_descending(const void *a, const void *b)
+{
+  const MvidPixelCount *first = (const MvidPixelCount *) a;
+  const MvidPixelCount *second = (const MvidPixelCount *) b;
+
+  if (first->count != second->count) {
+    return (first->count < second->count) ? 1 : -1;
+  }
+  return (first->pixel < second->pixel) ? -1 : (first->pixel > second->pixel);
+}
+
+// Collect each pixel value and count into a buffer of MvidPixelCount records sorted
+// in terms of descending count, so that the pixel values at the front of the
+// buffer are the most frequently used.
+
+- (NSData*) sortedPixelCounts
+{
+  NSUInteger numEntries = self.numUniquePixels;
+
+  NSMutableData *data = [NSMutableData dataWithLength:(numEntries * sizeof(MvidPixelCount))];
+  MvidPixelCount *entries = (MvidPixelCount *) [data mutableBytes];
+
+  NSUInteger offset = 0;
+
+  if (m_pixelCounts16) {
+    for (uint32_t i = 0; i < 0x10000; i++) {
+      if (m_pixelCounts16[i] != 0) {
+        entries[offset].pixel = i;
+        entries[offset].count = m_pixelCounts16[i];
+        offset++;
       }
     }
   }
-  
-  return [pixelsSortedByDescendingCount autorelease];
+
+  for (uint32_t i = 0; i < m_hashCapacity; i++) {
+    if (m_hashCounts[i] != 0) {
+      entries[offset].pixel = m_hashPixels[i];
+      entries[offset].count = m_hashCounts[i];
+      offset++;
+    }
+  }
+
+  assert(offset == numEntries);
+
+  qsort(entries, numEntries, sizeof(MvidPixelCount), compare_pixel_count_descending);
+
+  return data;
 }
 
 @end
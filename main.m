@@ -1,5 +1,13 @@
 #import <Cocoa/Cocoa.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <zlib.h>
+
 #import "CGFrameBuffer.h"
 
 #import "AVFrame.h"
@@ -26,11 +34,40 @@
 
 #import "MvidFileMetaData.h"
 
-CGSize _movieDimensions;
+// The frame size and previous frame state used by process_frame_file() are
+// thread local so that segments of a movie can be encoded on worker threads.
+
+__thread CGSize _movieDimensions;
 
 NSString *movie_prefix;
 
-CGFrameBuffer *prevFrameBuffer = nil;
+__thread CGFrameBuffer *prevFrameBuffer = nil;
+
+// Framebuffers rendered by the encoder are checked out of a shared pool so that
+// a long encode reuses a few warm buffers instead of allocating and zero filling
+// a new buffer for each frame. A buffer is returned to the pool once it is no
+// longer the previous frame.
+
+static
+CGFrameBufferPool* frameBufferPool()
+{
+  static CGFrameBufferPool *pool = nil;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    pool = [[CGFrameBufferPool alloc] init];
+  });
+  return pool;
+}
+
+// Print pool stats once an encode is finished and release the pooled buffers
+
+static
+void printFrameBufferPoolStats()
+{
+  CGFrameBufferPool *pool = frameBufferPool();
+  fprintf(stdout, "framebuffers: %d allocated, %d reused\n", (int)pool.numAllocated, (int)pool.numReused);
+  [pool removeAllFrameBuffers];
+}
 
 // Define this symbol to create a -test option that can be run from the command line.
 #define TESTMODE
@@ -103,7 +140,7 @@ static
 char *usageArray =
 "usage: mvidmoviemaker FIRSTFRAME.png OUTFILE.mvid ?OPTIONS?" "\n"
 "or   : mvidmoviemaker -extract FILE.mvid ?FILEPREFIX?" "\n"
-"or   : mvidmoviemaker -info movie.mvid" "\n"
+"or   : mvidmoviemaker -info movie.mvid|DIRECTORY" "\n"
 "or   : mvidmoviemaker -crop \"X Y WIDTH HEIGHT\" INFILE.mvid OUTFILE.mvid" "\n"
 "or   : mvidmoviemaker -resize OPTIONS_RESIZE INFILE.mvid OUTFILE.mvid" "\n"
 #if defined(SPLITALPHA)
@@ -114,17 +151,28 @@ char *usageArray =
 "or   : mvidmoviemaker -mixstraight RGB.mvid ALPHA.mvid MIXED.mvid" "\n"
 #endif
 "options that are less commonly used" "\n"
-"or   : mvidmoviemaker -flatten INORIG.mvid FLAT.png" "\n"
+"or   : mvidmoviemaker -flatten INORIG.mvid FLAT.png ?COLUMNS|AUTO?" "\n"
 "or   : mvidmoviemaker -unflatten INORIG.mvid FLAT.png OUT.mvid" "\n"
 "or   : mvidmoviemaker -upgrade FILE.mvid ?OUTFILE.mvid?" "\n"
+"or   : mvidmoviemaker -concat FIRST.mvid SECOND.mvid OUTFILE.mvid" "\n"
+"or   : mvidmoviemaker -trim START END INFILE.mvid OUTFILE.mvid" "\n"
 "or   : mvidmoviemaker -4up INFILE.mvid" "\n"
-"or   : mvidmoviemaker -pixels movie.mvid" "\n"
+"or   : mvidmoviemaker -pixels movie.mvid ?SUMMARY?" "\n"
 "or   : mvidmoviemaker -extractpixels FILE.mvid ?FILEPREFIX?" "\n"
 "or   : mvidmoviemaker -extractcodec FILE.mvid ?FILEPREFIX?" "\n"
 "or   : mvidmoviemaker -alphamap FILE.mvid OUTFILE.mvid MAPSPEC" "\n"
 "or   : mvidmoviemaker -rdelta INORIG.mvid INMOD.mvid OUTFILE.mvid" "\n"
 "or   : mvidmoviemaker -adler movie.mvid" "\n"
+"or   : mvidmoviemaker -verify movie.mvid|DIRECTORY" "\n"
 "or   : mvidmoviemaker -fps movie.mvid" "\n"
+"or   : mvidmoviemaker -setfps FPS movie.mvid|DIRECTORY" "\n"
+"or   : mvidmoviemaker -setflags movie.mvid|DIRECTORY" "\n"
+"or   : mvidmoviemaker -benchdecode ?-pread|-nocache? movie.mvid" "\n"
+"or   : mvidmoviemaker -benchshared NUM_DECODERS movie.mvid" "\n"
+"or   : mvidmoviemaker -benchreverse ?CHECKPOINT_SPACING? movie.mvid" "\n"
+"or   : mvidmoviemaker -benchskip movie.mvid" "\n"
+"or   : mvidmoviemaker -benchresize OPTIONS_RESIZE movie.mvid" "\n"
+"or   : mvidmoviemaker -benchwrite ?WIDTH HEIGHT? OUTFILE.mvid" "\n"
 "OPTIONS:\n"
 "-fps FLOAT : required when creating .mvid from a series of images\n"
 "-framerate FLOAT : alternative way to indicate 1.0/fps\n"
@@ -133,8 +181,10 @@ char *usageArray =
 #if MV_ENABLE_DELTAS
 "-deltas BOOL : 1 or true to enable frame deltas mode\n"
 #endif // MV_ENABLE_DELTAS
+"-threads INTEGER : number of worker threads, may follow any command, defaults to number of CPUs\n"
 "OPTIONS_RESIZE:\n"
 "\"WIDTH HEIGHT\" : pass integer width and height to scale to specific dimensions\n"
+"\"WIDTH HEIGHT FILTER\" : resample with the BOX, BICUBIC, or LANCZOS filter, defaults to LANCZOS\n"
 "DOUBLE : resize to 2x input width and height with special 4up pixel copy logic\n"
 "HALF : resize to 1/2 input width and height\n"
 ;
@@ -232,6 +282,7 @@ AVMvidFileWriter* makeMVidWriter(
   
   mvidWriter.genAdler = TRUE;
   mvidWriter.genV3 = TRUE;
+  mvidWriter.writeBehind = TRUE;
   
   BOOL worked = [mvidWriter open];
   if (worked == FALSE) {
@@ -336,7 +387,11 @@ int process_frame_file(AVMvidFileWriter *mvidWriter,
     exit(2);
   }
   
-  CGFrameBuffer *cgBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bppNum width:imageWidth height:imageHeight];
+  // A pooled buffer may contain pixels from a previous frame, clear it since
+  // rendering composites the image over the existing pixels.
+  
+  CGFrameBuffer *cgBuffer = [frameBufferPool() checkoutFrameBufferWithBppDimensions:bppNum width:imageWidth height:imageHeight];
+  [cgBuffer clear];
   
   // Query the colorspace used in the input image. Note that if no ICC tag was used then we assume sRGB.
   
@@ -472,30 +527,23 @@ int process_frame_file(AVMvidFileWriter *mvidWriter,
     
     BOOL allOpaque = TRUE;
     
-    for (int i=0; i < numPixels; i++) {
-      uint32_t currentPixel = currentPixels[i];
-      
-      // ABGR non-opaque pixel detection
-      uint8_t alpha = (currentPixel >> 24) & 0xFF;
-      if (alpha != 0xFF) {
-        allOpaque = FALSE;
+    if (checkAlphaChannel) {
+      for (int i=0; i < numPixels; i++) {
+        uint32_t currentPixel = currentPixels[i];
         
-        if (!recordFramePixelValues) {
+        // ABGR non-opaque pixel detection
+        uint8_t alpha = (currentPixel >> 24) & 0xFF;
+        if (alpha != 0xFF) {
+          allOpaque = FALSE;
           break;
         }
       }
-      
-      // Store pixel value in the next available slot
-      // in a global hashtable of pixel values mapped
-      // to a usage 32 bit integer.
-      
-      if (recordFramePixelValues) {
-        if (prevFrameBuffer.bitsPerPixel == 16) {
-          assert(0);
-        } else {
-          [mvidFileMetaData foundPixel32:currentPixel];
-        }
-      }
+    }
+    
+    // Count each pixel value in the frame with one bulk call
+    
+    if (recordFramePixelValues) {
+      [mvidFileMetaData foundPixels32:currentPixels numPixels:numPixels];
     }
     
     if (allOpaque == FALSE && checkAlphaChannel) {
@@ -508,10 +556,7 @@ int process_frame_file(AVMvidFileWriter *mvidWriter,
     int height = (int) cgBuffer.height;
     int numPixels = (width * height);
     
-    for (int i=0; i < numPixels; i++) {
-      uint16_t currentPixel = currentPixels[i];
-      [mvidFileMetaData foundPixel16:currentPixel];
-    }
+    [mvidFileMetaData foundPixels16:currentPixels numPixels:numPixels];
   }
   
   // Emit either regular or delta data depending on mode
@@ -523,9 +568,12 @@ int process_frame_file(AVMvidFileWriter *mvidWriter,
     {
       CGFrameBuffer *emptyInitialFrameBuffer = nil;
       if (frameIndex == 0) {
-        emptyInitialFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bppNum width:imageWidth height:imageHeight];
+        emptyInitialFrameBuffer = [frameBufferPool() checkoutFrameBufferWithBppDimensions:bppNum width:imageWidth height:imageHeight];
+        [emptyInitialFrameBuffer clear];
       }
       process_frame_file_write_deltas(isKeyframe, cgBuffer, emptyInitialFrameBuffer, mvidWriter);
+      
+      // The empty initial framebuffer is now prevFrameBuffer and is returned below
     } else
 #endif // MV_ENABLE_DELTAS
     {
@@ -537,6 +585,7 @@ int process_frame_file(AVMvidFileWriter *mvidWriter,
   
   if (TRUE) {
     if (prevFrameBuffer) {
+      [frameBufferPool() returnFrameBuffer:prevFrameBuffer];
       [prevFrameBuffer release];
     }
     prevFrameBuffer = cgBuffer;
@@ -835,9 +884,60 @@ typedef enum
   EXTRACT_FRAMES_TYPE_CODEC
 } ExtractFramesType;
 
+// Write the decoded pixels for one frame as a PNG or as a "*.pixels" file.
+// This function can be invoked from a worker thread since it only reads
+// from the framebuffer that is passed in.
+
+static
+void writeExtractedFrame(CGFrameBuffer *cgFrameBuffer,
+                         NSString *outFilename,
+                         ExtractFramesType type)
+{
+  if (type == EXTRACT_FRAMES_TYPE_PNG) {
+    NSData *pngData = [cgFrameBuffer formatAsPNG];
+    assert(pngData);
+    
+    [pngData writeToFile:outFilename atomically:NO];
+  } else if (type == EXTRACT_FRAMES_TYPE_PIXELS) {
+    // Write data as "*.pixels" with format {WIDTH HEIGHT PIXEL0 PIXEL1 ...}
+    
+    FILE *outfd = fopen((char*)[outFilename UTF8String], "wb");
+    assert(outfd);
+    
+    uint32_t width = (uint32_t)cgFrameBuffer.width;
+    uint32_t height = (uint32_t)cgFrameBuffer.height;
+    
+    int result;
+    
+    result = (int)fwrite(&width, sizeof(uint32_t), 1, outfd);
+    assert(result == 1);
+    result = (int)fwrite(&height, sizeof(uint32_t), 1, outfd);
+    assert(result == 1);
+    
+    uint32_t size = sizeof(uint32_t);
+    if (cgFrameBuffer.bitsPerPixel == 16) {
+      size = sizeof(uint16_t);
+    }
+    
+    result = (int)fwrite(cgFrameBuffer.pixels, size * width * height, 1, outfd);
+    assert(result == 1);
+    
+    fclose(outfd);
+  } else {
+    assert(0);
+  }
+}
+
+// When writing PNG or pixel files, frames are decoded on the calling thread and
+// then a copy of each framebuffer is handed off to one of numThreads worker
+// queues that does the PNG compression and file write. The number of copied
+// framebuffers waiting to be written is bounded so that memory use does not
+// grow with the length of the movie.
+
 void extractFramesFromMvidMain(char *mvidFilename,
                                char *extractFramesPrefix,
-                               ExtractFramesType type) {
+                               ExtractFramesType type,
+                               int numThreads) {
 	BOOL worked;
   
   AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
@@ -859,6 +959,29 @@ void extractFramesFromMvidMain(char *mvidFilename,
 
   int isV3 = (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_THREE);
   
+  BOOL useWorkers = (numThreads > 1) && (type != EXTRACT_FRAMES_TYPE_CODEC);
+  
+  NSMutableArray *workerQueues = nil;
+  dispatch_group_t workerGroup = NULL;
+  dispatch_semaphore_t pendingSemaphore = NULL;
+  
+  if (useWorkers) {
+    workerQueues = [NSMutableArray arrayWithCapacity:numThreads];
+    for (int i = 0; i < numThreads; i++) {
+      dispatch_queue_t queue = dispatch_queue_create("mvidmoviemaker.extract", DISPATCH_QUEUE_SERIAL);
+      [workerQueues addObject:(id)queue];
+      dispatch_release(queue);
+    }
+    workerGroup = dispatch_group_create();
+    pendingSemaphore = dispatch_semaphore_create(numThreads * 2);
+  }
+  
+  // A duplicate frame can share the copy made for the previous frame
+  
+  CGFrameBuffer *lastCopiedFrameBuffer = nil;
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
@@ -879,40 +1002,51 @@ void extractFramesFromMvidMain(char *mvidFilename,
 
     NSString *outFilename;
     
-    if (type == EXTRACT_FRAMES_TYPE_PNG) {
-      NSData *pngData = [cgFrameBuffer formatAsPNG];
-      assert(pngData);
-      
-      outFilename = [NSString stringWithFormat:@"%s%0.4d%s", extractFramesPrefix, (int)frameIndex+1, ".png"];
-      
-      [pngData writeToFile:outFilename atomically:NO];
-    } else if (type == EXTRACT_FRAMES_TYPE_PIXELS) {
-      // Write data as "*.pixels" with format {WIDTH HEIGHT PIXEL0 PIXEL1 ...}
-
-      outFilename = [NSString stringWithFormat:@"%s%0.4d%s", extractFramesPrefix, (int)frameIndex+1, ".pixels"];
-      
-      FILE *outfd = fopen((char*)[outFilename UTF8String], "wb");
-      assert(outfd);
-      
-      uint32_t width = (uint32_t)cgFrameBuffer.width;
-      uint32_t height = (uint32_t)cgFrameBuffer.height;
-      
-      int result;
+    NSString *dupString = @"";
+    if (frame.isDuplicate) {
+      dupString = @" (duplicate)";
+    }
+    
+    if ((type == EXTRACT_FRAMES_TYPE_PNG) || (type == EXTRACT_FRAMES_TYPE_PIXELS)) {
+      NSString *suffix = (type == EXTRACT_FRAMES_TYPE_PNG) ? @".png" : @".pixels";
       
-      result = (int)fwrite(&width, sizeof(uint32_t), 1, outfd);
-      assert(result == 1);
-      result = (int)fwrite(&height, sizeof(uint32_t), 1, outfd);
-      assert(result == 1);
+      outFilename = [NSString stringWithFormat:@"%s%0.4d%@", extractFramesPrefix, (int)frameIndex+1, suffix];
       
-      uint32_t size = sizeof(uint32_t);
-      if (cgFrameBuffer.bitsPerPixel == 16) {
-        size = sizeof(uint16_t);
+      if (useWorkers) {
+        // The decoder will reuse its framebuffers, so the worker gets a copy
+        
+        if (!frame.isDuplicate || (lastCopiedFrameBuffer == nil)) {
+          [lastCopiedFrameBuffer release];
+          
+          lastCopiedFrameBuffer = [[CGFrameBuffer alloc] initWithBppDimensions:cgFrameBuffer.bitsPerPixel
+                                                                         width:cgFrameBuffer.width
+                                                                        height:cgFrameBuffer.height];
+          lastCopiedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+          [lastCopiedFrameBuffer memcopyPixels:cgFrameBuffer];
+        }
+        
+        CGFrameBuffer *workerFrameBuffer = lastCopiedFrameBuffer;
+        
+        dispatch_semaphore_wait(pendingSemaphore, DISPATCH_TIME_FOREVER);
+        
+        dispatch_queue_t queue = (dispatch_queue_t) [workerQueues objectAtIndex:(frameIndex % numThreads)];
+        
+        dispatch_group_async(workerGroup, queue, ^{
+          NSAutoreleasePool *workerPool = [[NSAutoreleasePool alloc] init];
+          
+          writeExtractedFrame(workerFrameBuffer, outFilename, type);
+          
+          fprintf(stdout, "wrote %s%s\n", [outFilename UTF8String], [dupString UTF8String]);
+          
+          [workerPool drain];
+          
+          dispatch_semaphore_signal(pendingSemaphore);
+        });
+      } else {
+        writeExtractedFrame(cgFrameBuffer, outFilename, type);
+        
+        fprintf(stdout, "wrote %s%s\n", [outFilename UTF8String], [dupString UTF8String]);
       }
-      
-      result = (int)fwrite(cgFrameBuffer.pixels, size * width * height, 1, outfd);
-      assert(result == 1);
-      
-      fclose(outfd);
     } else if (type == EXTRACT_FRAMES_TYPE_CODEC && !isV3) {
       // Read the frame data encoded with codec specific word values.
       // Format: {WIDTH HEIGHT IS_DELTA WORD0 WORD1 ...}
@@ -1020,19 +1154,29 @@ void extractFramesFromMvidMain(char *mvidFilename,
     } else {
       assert(0);
     }
-        
-    NSString *dupString = @"";
-    if (frame.isDuplicate) {
-      dupString = @" (duplicate)";
-    }
     
-    fprintf(stdout, "wrote %s%s\n", [outFilename UTF8String], [dupString UTF8String]);
+    if (type == EXTRACT_FRAMES_TYPE_CODEC) {
+      fprintf(stdout, "wrote %s%s\n", [outFilename UTF8String], [dupString UTF8String]);
+    }
     
     [pool drain];
   }
+  
+  if (useWorkers) {
+    dispatch_group_wait(workerGroup, DISPATCH_TIME_FOREVER);
+    dispatch_release(workerGroup);
+    dispatch_release(pendingSemaphore);
+    [lastCopiedFrameBuffer release];
+  }
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
 
   [frameDecoder close];
   
+  fprintf(stdout, "extracted %d frames in %.2f seconds (%.2f frames/sec) with %d thread(s)\n",
+          (int)numFrames, elapsedTime, (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0,
+          useWorkers ? numThreads : 1);
+  
 	return;
 }
 
@@ -1046,355 +1190,798 @@ BOOL fileExists(NSString *filePath) {
   }
 }
 
-// Entry point for logic that encodes a .mvid from a series of frames.
+// Invoke process_frame_file() for each frame path in the indicated range. The keyframe
+// decision is based on the frame index in the whole movie, while the frame index passed
+// to process_frame_file() is relative to the start of the range. Pass NULL as the writer
+// to only scan the frames.
 
-void encodeMvidFromFramesMain(char *mvidFilenameCstr,
-                              char *firstFilenameCstr,
-                              MovieOptions *optionsPtr)
+static
+void encodeFramesInRange(AVMvidFileWriter *mvidWriter,
+                         NSArray *inFramePaths,
+                         NSRange range,
+                         MvidFileMetaData *mvidFileMetaData,
+                         int keyframeNum,
+                         MovieOptions *optionsPtr)
 {
-  NSString *mvidFilename = [NSString stringWithUTF8String:mvidFilenameCstr];
-  
-  BOOL isMvid = [mvidFilename hasSuffix:@".mvid"];
-  
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
-    exit(1);
+  for (NSUInteger i = 0; i < range.length; i++) {
+    NSString *framePath = [inFramePaths objectAtIndex:(range.location + i)];
+    int frameIndex = (int) (range.location + i);
+    
+    //fprintf(stdout, "saved %s as frame %d\n", [framePath UTF8String], frameIndex+1);
+    //fflush(stdout);
+    
+    BOOL isKeyframe = FALSE;
+    if (frameIndex == 0 || i == 0) {
+      isKeyframe = TRUE;
+    }
+    if (keyframeNum == 0) {
+      // All frames are key frames
+      isKeyframe = TRUE;
+    } else if ((keyframeNum > 0) && ((frameIndex % keyframeNum) == 0)) {
+      // Keyframe every N frames
+      isKeyframe = TRUE;
+    }
+    
+    process_frame_file(mvidWriter, framePath, NULL, (int)i, mvidFileMetaData, isKeyframe, optionsPtr);
   }
+}
+
+// Split a movie into about numThreads segments of frames that each begin on a
+// keyframe, so that each segment can be encoded without looking at the frames
+// before it. Returns an array of NSValue ranges. Each segment contains at
+// least 2 frames since that is the minimum size of a .mvid file.
+
+static
+NSArray* splitFramesIntoSegments(int numFrames, int keyframeNum, int numThreads)
+{
+  NSMutableArray *segmentRanges = [NSMutableArray array];
   
-  // Given the first frame image filename, build and array of filenames
-  // by checking to see if files exist up until we find one that does not.
-  // This makes it possible to pass the 25th frame ofa 50 frame animation
-  // and generate an animation 25 frames in duration.
+  // Frames between keyframes must stay together, when all frames are
+  // keyframes then any frame can start a segment.
   
-  NSString *firstFilename = [NSString stringWithUTF8String:firstFilenameCstr];
+  int unit = (keyframeNum == 0) ? 1 : keyframeNum;
+  int numUnits = (numFrames + unit - 1) / unit;
+  int unitsPerSegment = (numUnits + numThreads - 1) / numThreads;
+  int framesPerSegment = unitsPerSegment * unit;
   
-  if (fileExists(firstFilename) == FALSE) {
-    fprintf(stderr, "error: first filename \"%s\" does not exist\n", firstFilenameCstr);
-    exit(1);
+  if (framesPerSegment < 2) {
+    framesPerSegment = 2;
   }
   
-  NSString *firstFilenameExt = [firstFilename pathExtension];
+  for (int start = 0; start < numFrames; start += framesPerSegment) {
+    int length = MIN(framesPerSegment, numFrames - start);
     
-  // Find first numerical character in the [0-9] range starting at the end of the filename string.
-  // A frame filename like "Frame0001.png" would be an example input. Note that the last frame
-  // number must be the last character before the extension.
-  
-  NSArray *upToLastPathComponent = [firstFilename pathComponents];
-  NSRange upToLastPathComponentRange;
-  upToLastPathComponentRange.location = 0;
-  upToLastPathComponentRange.length = [upToLastPathComponent count] - 1;
-  upToLastPathComponent = [upToLastPathComponent subarrayWithRange:upToLastPathComponentRange];
-  NSString *upToLastPathComponentPath = [NSString pathWithComponents:upToLastPathComponent];
-  
-  NSString *firstFilenameTail = [firstFilename lastPathComponent];
-  NSString *firstFilenameTailNoExtension = [firstFilenameTail stringByDeletingPathExtension];
-  
-  int numericStartIndex = -1;
-  BOOL foundNonAlpha = FALSE;
-  
-  for (int i = (int)[firstFilenameTailNoExtension length] - 1; i > 0; i--) {
-    unichar c = [firstFilenameTailNoExtension characterAtIndex:i];
-    if ((c >= '0') && (c <= '9') && (foundNonAlpha == FALSE)) {
-      numericStartIndex = i;
+    if (length < 2) {
+      // Append a trailing single frame to the previous segment
+      NSRange prevRange = [[segmentRanges lastObject] rangeValue];
+      prevRange.length += length;
+      [segmentRanges replaceObjectAtIndex:([segmentRanges count] - 1) withObject:[NSValue valueWithRange:prevRange]];
     } else {
-      foundNonAlpha = TRUE;
+      [segmentRanges addObject:[NSValue valueWithRange:NSMakeRange(start, length)]];
     }
   }
-  if (numericStartIndex == -1 || numericStartIndex == 0) {
-    fprintf(stderr, "error: could not find frame number in first filename \"%s\"\n", firstFilenameCstr);
-    exit(1);
+  
+  return segmentRanges;
+}
+
+// Copy length bytes from inFd at inOffset to outFd at outOffset. Where the
+// system provides copy_file_range() the kernel copies the data without moving
+// it through user space, otherwise the bytes are copied with pread()/pwrite().
+// The file offsets of both descriptors are not modified.
+
+static
+BOOL copyFileBytes(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length)
+{
+#if defined(__linux__)
+  while (length > 0) {
+    loff_t inOff = inOffset;
+    loff_t outOff = outOffset;
+    ssize_t numCopied = copy_file_range(inFd, &inOff, outFd, &outOff, (size_t)length, 0);
+    if (numCopied <= 0) {
+      break;
+    }
+    inOffset += numCopied;
+    outOffset += numCopied;
+    length -= numCopied;
   }
   
-  // Extract the numeric portion of the first frame filename
+  if (length == 0) {
+    return TRUE;
+  }
+  // Fall back to a plain copy, for example across file systems
+#endif // __linux__
   
-  NSString *namePortion = [firstFilenameTailNoExtension substringToIndex:numericStartIndex];
-  NSString *numberPortion = [firstFilenameTailNoExtension substringFromIndex:numericStartIndex];
+  const size_t copyBufferSize = 1024 * 1024;
+  char *copyBuffer = malloc(copyBufferSize);
+  assert(copyBuffer);
   
-  if ([namePortion length] < 1 || [numberPortion length] == 0) {
-    fprintf(stderr, "error: could not find frame number in first filename \"%s\"\n", firstFilenameCstr);
-    exit(1);
+  BOOL worked = TRUE;
+  
+  while (length > 0) {
+    size_t numBytes = (size_t) MIN((off_t)copyBufferSize, length);
+    ssize_t numRead = pread(inFd, copyBuffer, numBytes, inOffset);
+    if (numRead <= 0) {
+      worked = FALSE;
+      break;
+    }
+    ssize_t numWritten = pwrite(outFd, copyBuffer, numRead, outOffset);
+    if (numWritten != numRead) {
+      worked = FALSE;
+      break;
+    }
+    inOffset += numRead;
+    outOffset += numRead;
+    length -= numRead;
   }
   
-  // Convert number with leading zeros to a simple integer
+  free(copyBuffer);
   
-  NSMutableArray *inFramePaths = [NSMutableArray arrayWithCapacity:1024];
+  return worked;
+}
+
+// Join V3 .mvid files that each begin with a keyframe into one .mvid file. The frame data
+// in each input file starts on the first page after the frame table and it is copied as is,
+// each file is placed at the next page bound in the output so the frame offsets only need
+// to be adjusted by a whole number of pages. Keyframes stay page aligned and the output is
+// the same as what would have been written by encoding all the frames in one pass.
+
+BOOL stitchMvidFiles(NSArray *inMvidPaths, NSString *outMvidPath)
+{
+  int numFiles = (int) [inMvidPaths count];
+  assert(numFiles > 0);
   
-  int formatWidth = (int) [numberPortion length];
-  int startingFrameNumber = [numberPortion intValue];
-  int endingFrameNumber = -1;
+  MVFileHeader *inHeaders = calloc(numFiles, sizeof(MVFileHeader));
+  assert(inHeaders);
   
-#define CRAZY_MAX_FRAMES 9999999
-#define CRAZY_MAX_DIGITS 7
+  // Read and validate the headers of all the input files
   
-  // Note that we include the first frame in this loop just so that it gets added to inFramePaths.
+  uint32_t totalNumFrames = 0;
+  BOOL isAllKeyframes = TRUE;
   
-  for (int i = startingFrameNumber; i < CRAZY_MAX_FRAMES; i++) {
-    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (int i = 0; i < numFiles; i++) {
+    char *inPathCstr = (char*) [[inMvidPaths objectAtIndex:i] UTF8String];
     
-    NSMutableString *frameNumberWithLeadingZeros = [NSMutableString string];
-    [frameNumberWithLeadingZeros appendFormat:@"%07d", i];
-    if ([frameNumberWithLeadingZeros length] > formatWidth) {
-      int numToDelete = (int) [frameNumberWithLeadingZeros length] - formatWidth;
-      NSRange delRange;
-      delRange.location = 0;
-      delRange.length = numToDelete;
-      [frameNumberWithLeadingZeros deleteCharactersInRange:delRange];
-      assert([frameNumberWithLeadingZeros length] == formatWidth);
+    FILE *inFile = fopen(inPathCstr, "rb");
+    if (inFile == NULL) {
+      fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", inPathCstr);
+      free(inHeaders);
+      return FALSE;
     }
-    [frameNumberWithLeadingZeros appendString:@"."];
-    [frameNumberWithLeadingZeros appendString:firstFilenameExt];
-    [frameNumberWithLeadingZeros insertString:namePortion atIndex:0];
-    NSString *framePathWithNumber = [upToLastPathComponentPath stringByAppendingPathComponent:frameNumberWithLeadingZeros];
     
-    if (fileExists(framePathWithNumber)) {
-      // Found frame at indicated path, add it to array of known frame filenames
-      
-      [inFramePaths addObject:framePathWithNumber];
-      endingFrameNumber = i;
-    } else {
-      // Frame filename with indicated frame number not found, done scanning for frame files
-      [pool drain];
-      break;
+    MVFileHeader *inHeader = &inHeaders[i];
+    size_t numRead = fread(inHeader, sizeof(MVFileHeader), 1, inFile);
+    fclose(inFile);
+    
+    if ((numRead != 1) || (inHeader->magic != MV_FILE_MAGIC)) {
+      fprintf(stderr, "error: invalid mvid header in \"%s\"\n", inPathCstr);
+      free(inHeaders);
+      return FALSE;
     }
     
-    [pool drain];
-  }
-
-  if ([inFramePaths count] <= 1) {
-    fprintf(stderr, "error: at least 2 input frames are required\n");
-    exit(1);    
+    if (maxvid_file_version(inHeader) != MV_FILE_VERSION_THREE) {
+      fprintf(stderr, "error: mvid file \"%s\" must be version 3, use -upgrade first\n", inPathCstr);
+      free(inHeaders);
+      return FALSE;
+    }
+    
+    if (maxvid_file_is_deltas(inHeader)) {
+      fprintf(stderr, "error: mvid file \"%s\" was encoded with -deltas and can't be joined\n", inPathCstr);
+      free(inHeaders);
+      return FALSE;
+    }
+    
+    if ((inHeader->width != inHeaders[0].width) ||
+        (inHeader->height != inHeaders[0].height) ||
+        (inHeader->bpp != inHeaders[0].bpp)) {
+      fprintf(stderr, "error: mvid file \"%s\" size %d x %d at %dBPP does not match %d x %d at %dBPP\n",
+              inPathCstr,
+              inHeader->width, inHeader->height, inHeader->bpp,
+              inHeaders[0].width, inHeaders[0].height, inHeaders[0].bpp);
+      free(inHeaders);
+      return FALSE;
+    }
+    
+    totalNumFrames += inHeader->numFrames;
+    
+    if (!maxvid_file_is_all_keyframes(inHeader)) {
+      isAllKeyframes = FALSE;
+    }
   }
   
-  if ((startingFrameNumber == endingFrameNumber) || (endingFrameNumber == CRAZY_MAX_FRAMES-1)) {
-    fprintf(stderr, "error: could not find last frame number\n");
-    exit(1);
+  char *outPathCstr = (char*) [outMvidPath UTF8String];
+  
+  FILE *outFile = fopen(outPathCstr, "wb");
+  if (outFile == NULL) {
+    fprintf(stderr, "error: cannot open output mvid filename \"%s\"\n", outPathCstr);
+    free(inHeaders);
+    return FALSE;
   }
   
-  // FRAMERATE is a floating point number that indicates the delay between frames.
-  // This framerate value is a constant that does not change over the course of the
-  // movie, though it is possible that a certain frame could repeat a number of times.
+  // The output header is based on the first file, the magic number is written last
   
-  float framerateNum = optionsPtr->framerate;
-
-  if (framerateNum <= 0.0f) {
-    fprintf(stderr, "error: -framerate or -fps is required\n");
-    exit(1);
+  MVFileHeader outHeader = inHeaders[0];
+  outHeader.magic = 0;
+  outHeader.numFrames = totalNumFrames;
+  outHeader.versionAndFlags &= ~MV_FILE_ALL_KEYFRAMES;
+  if (isAllKeyframes) {
+    maxvid_file_set_all_keyframes(&outHeader);
   }
   
-  // KEYFRAME : integer that indicates a keyframe should be emitted every N frames
+  uint32_t outFramesNumBytes = sizeof(MVV3Frame) * totalNumFrames;
+  MVV3Frame *outFrames = calloc(1, outFramesNumBytes);
+  assert(outFrames);
   
-  int keyframeNum = optionsPtr->keyframe;
-  if (keyframeNum == 0 || keyframeNum == 1) {
-    // All frames as stored as keyframes. This takes up more space but the frames can
-    // be blitted into graphics memory directly from mapped memory at runtime.
-    keyframeNum = 0;
-  } else if (keyframeNum < 0) {
-    // Just revert to the default
-    keyframeNum = 10000;
-  }
+  off_t outOffset = sizeof(MVFileHeader) + outFramesNumBytes;
   
-  // BITSPERPIXEL : 16, 24, or 32 BPP.
-  //
-  // Determine the BPP that the output movie will be written as, when reading from image
-  // files 16BPP input data would automatically be converted to 24BPP before the data
-  // could be read, so this logic only needs to determine the setting for the check alpha
-  // logic.
+  uint32_t outFrameIndex = 0;
   
-  BOOL checkAlphaChannel;
-  int renderAtBpp;
+  char zeroPage[MV_PAGESIZE];
+  memset(zeroPage, 0, sizeof(zeroPage));
   
-  if (optionsPtr->bpp == -1) {
-    // No -bpp option given on the command line, detect either 24BPP or 32BPP depending
-    // on the pixel data read from the image frames.
+  BOOL worked = TRUE;
+  
+  for (int i = 0; worked && (i < numFiles); i++) {
+    char *inPathCstr = (char*) [[inMvidPaths objectAtIndex:i] UTF8String];
+    MVFileHeader *inHeader = &inHeaders[i];
     
-    renderAtBpp = 24;
-    checkAlphaChannel = TRUE;
-  } else {
-    // When -bpp is explicitly set on the command line, checkAlphaChannel is always FALSE
-    checkAlphaChannel = FALSE;
+    FILE *inFile = fopen(inPathCstr, "rb");
+    assert(inFile);
     
-    if (optionsPtr->bpp == 16) {
-      renderAtBpp = 16;
-    } else if (optionsPtr->bpp == 24) {
-      renderAtBpp = 24;
-    } else {
-      renderAtBpp = 32;
+    uint32_t inFramesNumBytes = sizeof(MVV3Frame) * inHeader->numFrames;
+    MVV3Frame *inFrames = &outFrames[outFrameIndex];
+    
+    if ((fseeko(inFile, sizeof(MVFileHeader), SEEK_SET) != 0) ||
+        (fread(inFrames, inFramesNumBytes, 1, inFile) != 1)) {
+      fprintf(stderr, "error: cannot read frames from \"%s\"\n", inPathCstr);
+      worked = FALSE;
+      fclose(inFile);
+      break;
+    }
+    
+    // Frame data in the input file begins at the first page bound after the frame table,
+    // write zeros up to the next page bound in the output file.
+    
+    off_t inDataOffset = sizeof(MVFileHeader) + inFramesNumBytes;
+    inDataOffset = ((inDataOffset + MV_PAGESIZE - 1) / MV_PAGESIZE) * MV_PAGESIZE;
+    
+    off_t outDataOffset = ((outOffset + MV_PAGESIZE - 1) / MV_PAGESIZE) * MV_PAGESIZE;
+    
+    if (fseeko(outFile, outOffset, SEEK_SET) != 0) {
+      worked = FALSE;
+    }
+    while (worked && (outOffset < outDataOffset)) {
+      size_t numBytes = (size_t) MIN((off_t)sizeof(zeroPage), outDataOffset - outOffset);
+      if (fwrite(zeroPage, numBytes, 1, outFile) != 1) {
+        worked = FALSE;
+      }
+      outOffset += numBytes;
+    }
+    
+    for (uint32_t frameIndex = 0; worked && (frameIndex < inHeader->numFrames); frameIndex++) {
+      MVV3Frame *frame = &inFrames[frameIndex];
+      uint64_t frameOffset = maxvid_v3_frame_offset(frame);
+      
+      if (frameOffset < inDataOffset) {
+        fprintf(stderr, "error: frame %d in \"%s\" has an invalid offset\n", frameIndex+1, inPathCstr);
+        worked = FALSE;
+        break;
+      }
+      
+      maxvid_v3_frame_setoffset(frame, frameOffset - inDataOffset + outDataOffset);
+    }
+    
+    // Copy the frame data from the input file to the end of the output file
+    
+    struct stat inStat;
+    
+    if (worked && ((fflush(outFile) != 0) || (fstat(fileno(inFile), &inStat) != 0))) {
+      worked = FALSE;
+    }
+    
+    if (worked && (inStat.st_size > inDataOffset)) {
+      off_t numBytes = inStat.st_size - inDataOffset;
+      worked = copyFileBytes(fileno(inFile), inDataOffset, fileno(outFile), outOffset, numBytes);
+      outOffset += numBytes;
     }
+    
+    if (worked && (fseeko(outFile, outOffset, SEEK_SET) != 0)) {
+      worked = FALSE;
+    }
+    
+    fclose(inFile);
+    
+    outFrameIndex += inHeader->numFrames;
   }
-
-  // Stage 1: scan all the pixels in all the frames to figure out key info like the BPP
-  // of output pixels. We cannot know certain key info about the input data until it
-  // has all been scanned.
   
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = renderAtBpp;
-  mvidFileMetaData.checkAlphaChannel = checkAlphaChannel;
-  //mvidFileMetaData.recordFramePixelValues = TRUE;
+  // Write the header and frame table, then the magic number
   
-  int frameIndex;
-  
-  frameIndex = 0;
-  for (NSString *framePath in inFramePaths) {
-    //fprintf(stdout, "saved %s as frame %d\n", [framePath UTF8String], frameIndex+1);
-    //fflush(stdout);
+  if (worked) {
+    (void)fseek(outFile, 0L, SEEK_SET);
     
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
+    if ((fwrite(&outHeader, sizeof(MVFileHeader), 1, outFile) != 1) ||
+        (fwrite(outFrames, outFramesNumBytes, 1, outFile) != 1)) {
+      worked = FALSE;
     }
-    if (keyframeNum == 0) {
-      // All frames are key frames
-      isKeyframe = TRUE;
-    } else if ((keyframeNum > 0) && ((frameIndex % keyframeNum) == 0)) {
-      // Keyframe every N frames
-      isKeyframe = TRUE;
+  }
+  
+  if (worked) {
+    (void)fseek(outFile, 0L, SEEK_SET);
+    
+    uint32_t magic = MV_FILE_MAGIC;
+    if (fwrite(&magic, sizeof(uint32_t), 1, outFile) != 1) {
+      worked = FALSE;
     }
-        
-    process_frame_file(NULL, framePath, NULL, frameIndex, mvidFileMetaData, isKeyframe, optionsPtr);
-    frameIndex++;
   }
   
-  // Stage 2: once scanning all the input pixels is completed, we can loop over all the frames
-  // again but this time we actually write the output at the correct BPP. The scan step takes
-  // extra time, but it means that we do not need to write twice in the common case where
-  // input is all 24 BPP pixels, so this logic is a win.
+  if (fclose(outFile) != 0) {
+    worked = FALSE;
+  }
   
-  if (mvidFileMetaData.recordFramePixelValues) {
-    [mvidFileMetaData doneRecordingFramePixelValues];
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot write mvid file \"%s\"\n", outPathCstr);
   }
+  
+  free(outFrames);
+  free(inHeaders);
+  
+  return worked;
+}
 
-  renderAtBpp = (int) mvidFileMetaData.bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+// Encode each segment of frames into a temporary .mvid file on a worker queue and
+// then stitch the segments together. Both the scan pass and the write pass run in
+// parallel, the scan results are combined so that every segment is written at the
+// same BPP.
+
+static
+void encodeMvidSegmentsInParallel(NSString *mvidFilename,
+                                  NSArray *inFramePaths,
+                                  NSArray *segmentRanges,
+                                  MvidFileMetaData *mvidFileMetaData,
+                                  float framerateNum,
+                                  int keyframeNum,
+                                  int numThreads,
+                                  MovieOptions *optionsPtr)
+{
+  int numSegments = (int) [segmentRanges count];
   
-  AVMvidFileWriter *mvidWriter;
-  mvidWriter = makeMVidWriter(mvidFilename, renderAtBpp, framerateNum, [inFramePaths count]);
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   
-  fprintf(stdout, "writing %d frames to %s\n", (int)[inFramePaths count], [[mvidFilename lastPathComponent] UTF8String]);
-  fflush(stdout);
+  NSMutableArray *workerQueues = [NSMutableArray arrayWithCapacity:numThreads];
+  for (int i = 0; i < numThreads; i++) {
+    dispatch_queue_t queue = dispatch_queue_create("mvidmoviemaker.encode", DISPATCH_QUEUE_SERIAL);
+    [workerQueues addObject:(id)queue];
+    dispatch_release(queue);
+  }
   
-  // We now know the start and end integer values of the frame filename range.
+  dispatch_group_t workerGroup = dispatch_group_create();
   
-  frameIndex = 0;
-  for (NSString *framePath in inFramePaths) {
-    //fprintf(stdout, "saved %s as frame %d\n", [framePath UTF8String], frameIndex+1);
-    //fflush(stdout);
+  // Stage 1: scan each segment with its own metadata object
+  
+  NSMutableArray *segmentMetaData = [NSMutableArray arrayWithCapacity:numSegments];
+  
+  for (int i = 0; i < numSegments; i++) {
+    MvidFileMetaData *metaData = [MvidFileMetaData mvidFileMetaData];
+    metaData.bpp = mvidFileMetaData.bpp;
+    metaData.checkAlphaChannel = mvidFileMetaData.checkAlphaChannel;
+    [segmentMetaData addObject:metaData];
     
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
-    }
-    if (keyframeNum == 0) {
-      // All frames are key frames
-      isKeyframe = TRUE;
-    } else if ((keyframeNum > 0) && ((frameIndex % keyframeNum) == 0)) {
-      // Keyframe every N frames
-      isKeyframe = TRUE;
-    }
+    NSRange range = [[segmentRanges objectAtIndex:i] rangeValue];
+    dispatch_queue_t queue = (dispatch_queue_t) [workerQueues objectAtIndex:(i % numThreads)];
     
-    process_frame_file(mvidWriter, framePath, NULL, frameIndex, mvidFileMetaData, isKeyframe, optionsPtr);
-    frameIndex++;
+    dispatch_group_async(workerGroup, queue, ^{
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      encodeFramesInRange(NULL, inFramePaths, range, metaData, keyframeNum, optionsPtr);
+      
+      [prevFrameBuffer release];
+      prevFrameBuffer = nil;
+      
+      [pool drain];
+    });
   }
   
-  // Done writing .mvid file
+  dispatch_group_wait(workerGroup, DISPATCH_TIME_FOREVER);
   
-  [mvidWriter rewriteHeader];
+  // If any segment contains non-opaque pixels, then all segments are written at 32BPP
   
-  [mvidWriter close];
-    
-  fprintf(stdout, "done writing %d frames to %s\n", frameIndex, mvidFilenameCstr);
+  for (MvidFileMetaData *metaData in segmentMetaData) {
+    if (metaData.bpp == 32) {
+      mvidFileMetaData.bpp = 32;
+    }
+  }
+  
+  int renderAtBpp = (int) mvidFileMetaData.bpp;
+  
+  fprintf(stdout, "writing %d frames to %s in %d segments\n", (int)[inFramePaths count], [[mvidFilename lastPathComponent] UTF8String], numSegments);
   fflush(stdout);
   
-  // cleanup
+  // Stage 2: write each segment to a temp file
   
-  if (prevFrameBuffer) {
-    [prevFrameBuffer release];
+  NSMutableArray *segmentPaths = [NSMutableArray arrayWithCapacity:numSegments];
+  
+  for (int i = 0; i < numSegments; i++) {
+    NSString *segmentFilename = [NSString stringWithFormat:@"mvidmoviemaker_%d_segment%d.mvid", (int)getpid(), i];
+    NSString *segmentPath = [NSTemporaryDirectory() stringByAppendingPathComponent:segmentFilename];
+    [segmentPaths addObject:segmentPath];
+    
+    MvidFileMetaData *metaData = [segmentMetaData objectAtIndex:i];
+    metaData.bpp = renderAtBpp;
+    metaData.checkAlphaChannel = FALSE;
+    
+    NSRange range = [[segmentRanges objectAtIndex:i] rangeValue];
+    dispatch_queue_t queue = (dispatch_queue_t) [workerQueues objectAtIndex:(i % numThreads)];
+    
+    dispatch_group_async(workerGroup, queue, ^{
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      AVMvidFileWriter *mvidWriter = makeMVidWriter(segmentPath, renderAtBpp, framerateNum, range.length);
+      
+      encodeFramesInRange(mvidWriter, inFramePaths, range, metaData, keyframeNum, optionsPtr);
+      
+      if ([mvidWriter rewriteHeader] == FALSE) {
+        fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [segmentPath UTF8String]);
+        exit(1);
+      }
+      [mvidWriter close];
+      
+      [prevFrameBuffer release];
+      prevFrameBuffer = nil;
+      
+      [pool drain];
+    });
   }
+  
+  dispatch_group_wait(workerGroup, DISPATCH_TIME_FOREVER);
+  dispatch_release(workerGroup);
+  
+  BOOL worked = stitchMvidFiles(segmentPaths, mvidFilename);
+  
+  for (NSString *segmentPath in segmentPaths) {
+    [[NSFileManager defaultManager] removeItemAtPath:segmentPath error:nil];
+  }
+  
+  if (worked == FALSE) {
+    exit(1);
+  }
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  fprintf(stdout, "done writing %d frames to %s in %.2f seconds with %d thread(s)\n",
+          (int)[inFramePaths count], [mvidFilename UTF8String], elapsedTime, numThreads);
+  printFrameBufferPoolStats();
+  fflush(stdout);
 }
 
-void fprintStdoutFixedWidth(char *label)
-{
-  fprintf(stdout, "%-20s", label);
-}
-
-// Entry point for movie info printing logic. This will print the headers of the file
-// and some encoding info.
+// Entry point for logic that encodes a .mvid from a series of frames. When more than one
+// thread is available and frame deltas are not being generated, the frames are split into
+// segments at keyframe bounds and the segments are encoded in parallel.
 
-void printMovieHeaderInfo(char *mvidFilenameCstr) {
+void encodeMvidFromFramesMain(char *mvidFilenameCstr,
+                              char *firstFilenameCstr,
+                              MovieOptions *optionsPtr,
+                              int numThreads)
+{
   NSString *mvidFilename = [NSString stringWithUTF8String:mvidFilenameCstr];
-
-  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
   
-  BOOL worked = [frameDecoder openForReading:mvidFilename];
+  BOOL isMvid = [mvidFilename hasSuffix:@".mvid"];
   
-  if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", mvidFilenameCstr);
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
     exit(1);
   }
   
-  //worked = [frameDecoder allocateDecodeResources];
-  //assert(worked);
+  // Given the first frame image filename, build and array of filenames
+  // by checking to see if files exist up until we find one that does not.
+  // This makes it possible to pass the 25th frame ofa 50 frame animation
+  // and generate an animation 25 frames in duration.
   
-  NSUInteger numFrames = [frameDecoder numFrames];
-  assert(numFrames > 0);
-
-  float frameDuration = [frameDecoder frameDuration];
-  float movieDuration = frameDuration * numFrames;
+  NSString *firstFilename = [NSString stringWithUTF8String:firstFilenameCstr];
   
-  int bpp = [frameDecoder header]->bpp;
+  if (fileExists(firstFilename) == FALSE) {
+    fprintf(stderr, "error: first filename \"%s\" does not exist\n", firstFilenameCstr);
+    exit(1);
+  }
   
-  // Format left side in fixed 20 space width
+  NSString *firstFilenameExt = [firstFilename pathExtension];
+    
+  // Find first numerical character in the [0-9] range starting at the end of the filename string.
+  // A frame filename like "Frame0001.png" would be an example input. Note that the last frame
+  // number must be the last character before the extension.
   
-  fprintStdoutFixedWidth("MVID:");
-  fprintf(stdout, "%s\n", [[mvidFilename lastPathComponent] UTF8String]);
+  NSArray *upToLastPathComponent = [firstFilename pathComponents];
+  NSRange upToLastPathComponentRange;
+  upToLastPathComponentRange.location = 0;
+  upToLastPathComponentRange.length = [upToLastPathComponent count] - 1;
+  upToLastPathComponent = [upToLastPathComponent subarrayWithRange:upToLastPathComponentRange];
+  NSString *upToLastPathComponentPath = [NSString pathWithComponents:upToLastPathComponent];
   
-  fprintStdoutFixedWidth("Version:");
-  int version = maxvid_file_version([frameDecoder header]);
-  fprintf(stdout, "%d\n", version);
-
-  fprintStdoutFixedWidth("Width:");
-  fprintf(stdout, "%d\n", (int)[frameDecoder width]);
+  NSString *firstFilenameTail = [firstFilename lastPathComponent];
+  NSString *firstFilenameTailNoExtension = [firstFilenameTail stringByDeletingPathExtension];
   
-  fprintStdoutFixedWidth("Height:");
-  fprintf(stdout, "%d\n", (int)[frameDecoder height]);
-
-  fprintStdoutFixedWidth("BitsPerPixel:");
-  fprintf(stdout, "%d\n", bpp);
-
-  // Note that pixels stored in .mvid file are always in the sRGB colorspace.
-  // If any conversions are needed to convert from some other colorspace, they
-  // would need to have been executed when writing the .mvid file.
+  int numericStartIndex = -1;
+  BOOL foundNonAlpha = FALSE;
   
-  fprintStdoutFixedWidth("ColorSpace:");
-  if (TRUE) {
-    fprintf(stdout, "%s\n", "sRGB");
-  } else {
-    fprintf(stdout, "%s\n", "RGB");    
+  for (int i = (int)[firstFilenameTailNoExtension length] - 1; i > 0; i--) {
+    unichar c = [firstFilenameTailNoExtension characterAtIndex:i];
+    if ((c >= '0') && (c <= '9') && (foundNonAlpha == FALSE)) {
+      numericStartIndex = i;
+    } else {
+      foundNonAlpha = TRUE;
+    }
+  }
+  if (numericStartIndex == -1 || numericStartIndex == 0) {
+    fprintf(stderr, "error: could not find frame number in first filename \"%s\"\n", firstFilenameCstr);
+    exit(1);
   }
   
-  fprintStdoutFixedWidth("Duration:");
-  fprintf(stdout, "%.4fs\n", movieDuration);
-
-  fprintStdoutFixedWidth("FrameDuration:");
-  fprintf(stdout, "%.4fs\n", frameDuration);
-
-  fprintStdoutFixedWidth("FPS:");
-  fprintf(stdout, "%.4f\n", (1.0f / frameDuration));
-
-  fprintStdoutFixedWidth("Frames:");
-  fprintf(stdout, "%d\n", (int)numFrames);
+  // Extract the numeric portion of the first frame filename
   
-  // If the "all keyframes" bit is set then print TRUE for this element
+  NSString *namePortion = [firstFilenameTailNoExtension substringToIndex:numericStartIndex];
+  NSString *numberPortion = [firstFilenameTailNoExtension substringFromIndex:numericStartIndex];
   
-  fprintStdoutFixedWidth("AllKeyFrames:");
-  fprintf(stdout, "%s\n", [frameDecoder isAllKeyframes] ? "TRUE" : "FALSE");
+  if ([namePortion length] < 1 || [numberPortion length] == 0) {
+    fprintf(stderr, "error: could not find frame number in first filename \"%s\"\n", firstFilenameCstr);
+    exit(1);
+  }
   
-#if MV_ENABLE_DELTAS
+  // Convert number with leading zeros to a simple integer
   
-  // If the "deltas" bit is set, then print TRUE to indicate that all
-  // pixel values are deltas and all frames are deltas.
-
-  fprintStdoutFixedWidth("Deltas:");
-  fprintf(stdout, "%s\n", [frameDecoder isDeltas] ? "TRUE" : "FALSE");
+  NSMutableArray *inFramePaths = [NSMutableArray arrayWithCapacity:1024];
+  
+  int formatWidth = (int) [numberPortion length];
+  int startingFrameNumber = [numberPortion intValue];
+  int endingFrameNumber = -1;
+  
+#define CRAZY_MAX_FRAMES 9999999
+#define CRAZY_MAX_DIGITS 7
+  
+  // Note that we include the first frame in this loop just so that it gets added to inFramePaths.
+  
+  for (int i = startingFrameNumber; i < CRAZY_MAX_FRAMES; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    NSMutableString *frameNumberWithLeadingZeros = [NSMutableString string];
+    [frameNumberWithLeadingZeros appendFormat:@"%07d", i];
+    if ([frameNumberWithLeadingZeros length] > formatWidth) {
+      int numToDelete = (int) [frameNumberWithLeadingZeros length] - formatWidth;
+      NSRange delRange;
+      delRange.location = 0;
+      delRange.length = numToDelete;
+      [frameNumberWithLeadingZeros deleteCharactersInRange:delRange];
+      assert([frameNumberWithLeadingZeros length] == formatWidth);
+    }
+    [frameNumberWithLeadingZeros appendString:@"."];
+    [frameNumberWithLeadingZeros appendString:firstFilenameExt];
+    [frameNumberWithLeadingZeros insertString:namePortion atIndex:0];
+    NSString *framePathWithNumber = [upToLastPathComponentPath stringByAppendingPathComponent:frameNumberWithLeadingZeros];
+    
+    if (fileExists(framePathWithNumber)) {
+      // Found frame at indicated path, add it to array of known frame filenames
+      
+      [inFramePaths addObject:framePathWithNumber];
+      endingFrameNumber = i;
+    } else {
+      // Frame filename with indicated frame number not found, done scanning for frame files
+      [pool drain];
+      break;
+    }
+    
+    [pool drain];
+  }
+
+  if ([inFramePaths count] <= 1) {
+    fprintf(stderr, "error: at least 2 input frames are required\n");
+    exit(1);    
+  }
+  
+  if ((startingFrameNumber == endingFrameNumber) || (endingFrameNumber == CRAZY_MAX_FRAMES-1)) {
+    fprintf(stderr, "error: could not find last frame number\n");
+    exit(1);
+  }
+  
+  // FRAMERATE is a floating point number that indicates the delay between frames.
+  // This framerate value is a constant that does not change over the course of the
+  // movie, though it is possible that a certain frame could repeat a number of times.
+  
+  float framerateNum = optionsPtr->framerate;
+
+  if (framerateNum <= 0.0f) {
+    fprintf(stderr, "error: -framerate or -fps is required\n");
+    exit(1);
+  }
+  
+  // KEYFRAME : integer that indicates a keyframe should be emitted every N frames
+  
+  int keyframeNum = optionsPtr->keyframe;
+  if (keyframeNum == 0 || keyframeNum == 1) {
+    // All frames as stored as keyframes. This takes up more space but the frames can
+    // be blitted into graphics memory directly from mapped memory at runtime.
+    keyframeNum = 0;
+  } else if (keyframeNum < 0) {
+    // Just revert to the default
+    keyframeNum = 10000;
+  }
+  
+  // BITSPERPIXEL : 16, 24, or 32 BPP.
+  //
+  // Determine the BPP that the output movie will be written as, when reading from image
+  // files 16BPP input data would automatically be converted to 24BPP before the data
+  // could be read, so this logic only needs to determine the setting for the check alpha
+  // logic.
+  
+  BOOL checkAlphaChannel;
+  int renderAtBpp;
+  
+  if (optionsPtr->bpp == -1) {
+    // No -bpp option given on the command line, detect either 24BPP or 32BPP depending
+    // on the pixel data read from the image frames.
+    
+    renderAtBpp = 24;
+    checkAlphaChannel = TRUE;
+  } else {
+    // When -bpp is explicitly set on the command line, checkAlphaChannel is always FALSE
+    checkAlphaChannel = FALSE;
+    
+    if (optionsPtr->bpp == 16) {
+      renderAtBpp = 16;
+    } else if (optionsPtr->bpp == 24) {
+      renderAtBpp = 24;
+    } else {
+      renderAtBpp = 32;
+    }
+  }
+
+  // Stage 1: scan all the pixels in all the frames to figure out key info like the BPP
+  // of output pixels. We cannot know certain key info about the input data until it
+  // has all been scanned.
+  
+  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
+  mvidFileMetaData.bpp = renderAtBpp;
+  mvidFileMetaData.checkAlphaChannel = checkAlphaChannel;
+  //mvidFileMetaData.recordFramePixelValues = TRUE;
+  
+  NSArray *segmentRanges = nil;
+  
+#if MV_ENABLE_DELTAS
+  if (optionsPtr->deltas != 1)
+#endif // MV_ENABLE_DELTAS
+  {
+    segmentRanges = splitFramesIntoSegments((int)[inFramePaths count], keyframeNum, numThreads);
+  }
+  
+  if ([segmentRanges count] > 1) {
+    encodeMvidSegmentsInParallel(mvidFilename, inFramePaths, segmentRanges,
+                                 mvidFileMetaData, framerateNum, keyframeNum,
+                                 numThreads, optionsPtr);
+    return;
+  }
+  
+  encodeFramesInRange(NULL, inFramePaths, NSMakeRange(0, [inFramePaths count]), mvidFileMetaData, keyframeNum, optionsPtr);
+  
+  // Stage 2: once scanning all the input pixels is completed, we can loop over all the frames
+  // again but this time we actually write the output at the correct BPP. The scan step takes
+  // extra time, but it means that we do not need to write twice in the common case where
+  // input is all 24 BPP pixels, so this logic is a win.
+  
+  if (mvidFileMetaData.recordFramePixelValues) {
+    [mvidFileMetaData doneRecordingFramePixelValues];
+  }
+
+  renderAtBpp = (int) mvidFileMetaData.bpp;
+  mvidFileMetaData.checkAlphaChannel = FALSE;
+  
+  AVMvidFileWriter *mvidWriter;
+  mvidWriter = makeMVidWriter(mvidFilename, renderAtBpp, framerateNum, [inFramePaths count]);
+  
+  fprintf(stdout, "writing %d frames to %s\n", (int)[inFramePaths count], [[mvidFilename lastPathComponent] UTF8String]);
+  fflush(stdout);
+  
+  // We now know the start and end integer values of the frame filename range.
+  
+  encodeFramesInRange(mvidWriter, inFramePaths, NSMakeRange(0, [inFramePaths count]), mvidFileMetaData, keyframeNum, optionsPtr);
+  
+  // Done writing .mvid file
+  
+  if ([mvidWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", mvidFilenameCstr);
+    exit(1);
+  }
+  
+  [mvidWriter close];
+    
+  fprintf(stdout, "done writing %d frames to %s\n", (int)[inFramePaths count], mvidFilenameCstr);
+  printFrameBufferPoolStats();
+  fflush(stdout);
+  
+  // cleanup
+  
+  if (prevFrameBuffer) {
+    [prevFrameBuffer release];
+  }
+}
+
+void fprintStdoutFixedWidth(char *label)
+{
+  fprintf(stdout, "%-20s", label);
+}
+
+// Entry point for movie info printing logic. This will print the headers of the file
+// and some encoding info. Only the header is read, the frame table is not needed.
+
+void printMovieHeaderInfo(NSString *mvidFilename) {
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  BOOL worked = [frameDecoder openHeaderForReading:mvidFilename];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
+    exit(1);
+  }
+  
+  //worked = [frameDecoder allocateDecodeResources];
+  //assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+
+  float frameDuration = [frameDecoder frameDuration];
+  float movieDuration = frameDuration * numFrames;
+  
+  int bpp = [frameDecoder header]->bpp;
+  
+  // Format left side in fixed 20 space width
+  
+  fprintStdoutFixedWidth("MVID:");
+  fprintf(stdout, "%s\n", [[mvidFilename lastPathComponent] UTF8String]);
+  
+  fprintStdoutFixedWidth("Version:");
+  int version = maxvid_file_version([frameDecoder header]);
+  fprintf(stdout, "%d\n", version);
+
+  fprintStdoutFixedWidth("Width:");
+  fprintf(stdout, "%d\n", (int)[frameDecoder width]);
+  
+  fprintStdoutFixedWidth("Height:");
+  fprintf(stdout, "%d\n", (int)[frameDecoder height]);
+
+  fprintStdoutFixedWidth("BitsPerPixel:");
+  fprintf(stdout, "%d\n", bpp);
+
+  // Note that pixels stored in .mvid file are always in the sRGB colorspace.
+  // If any conversions are needed to convert from some other colorspace, they
+  // would need to have been executed when writing the .mvid file.
+  
+  fprintStdoutFixedWidth("ColorSpace:");
+  if (TRUE) {
+    fprintf(stdout, "%s\n", "sRGB");
+  } else {
+    fprintf(stdout, "%s\n", "RGB");    
+  }
+  
+  fprintStdoutFixedWidth("Duration:");
+  fprintf(stdout, "%.4fs\n", movieDuration);
+
+  fprintStdoutFixedWidth("FrameDuration:");
+  fprintf(stdout, "%.4fs\n", frameDuration);
+
+  fprintStdoutFixedWidth("FPS:");
+  fprintf(stdout, "%.4f\n", (1.0f / frameDuration));
+
+  fprintStdoutFixedWidth("Frames:");
+  fprintf(stdout, "%d\n", (int)numFrames);
+  
+  // If the "all keyframes" bit is set then print TRUE for this element
+  
+  fprintStdoutFixedWidth("AllKeyFrames:");
+  fprintf(stdout, "%s\n", [frameDecoder isAllKeyframes] ? "TRUE" : "FALSE");
+  
+#if MV_ENABLE_DELTAS
+  
+  // If the "deltas" bit is set, then print TRUE to indicate that all
+  // pixel values are deltas and all frames are deltas.
+
+  fprintStdoutFixedWidth("Deltas:");
+  fprintf(stdout, "%s\n", [frameDecoder isDeltas] ? "TRUE" : "FALSE");
   
 #endif // MV_ENABLE_DELTAS
   
@@ -2564,25 +3151,111 @@ void testmode()
 
 #if defined(SPLITALPHA)
 
-void
-splitalpha(char *mvidFilenameCstr)
-{
-	NSString *mvidPath = [NSString stringWithUTF8String:mvidFilenameCstr];
-  
-  BOOL isMvid = [mvidPath hasSuffix:@".mvid"];
-  
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
-    exit(1);
-  }
+// State for one output encoder that runs on its own serial queue. The
+// previous frame is tracked here instead of in the thread local
+// prevFrameBuffer since a serial queue may run blocks on different threads.
 
-  // Create "xyz_rgb.mvid" and "xyz_alpha.mvid" output filenames
-  
-  NSString *mvidFilename = [mvidPath lastPathComponent];
-  NSString *mvidFilenameNoExtension = [mvidFilename stringByDeletingPathExtension];
+typedef struct {
+  AVMvidFileWriter *writer;
+  CGFrameBuffer *prev;
+  dispatch_queue_t queue;
+} AlphaFrameEncoder;
 
-  NSString *rgbFilename = [NSString stringWithFormat:@"%@_rgb.mvid", mvidFilenameNoExtension];
-  NSString *alphaFilename = [NSString stringWithFormat:@"%@_alpha.mvid", mvidFilenameNoExtension];
+// Write one frame on the encoder queue, pass nil to write a nop frame.
+// The semaphore is signaled once the frame has been written so that the
+// caller can bound the number of frames waiting to be encoded.
+
+static
+void alpha_encoder_write_async(AlphaFrameEncoder *encoder,
+                               dispatch_group_t group,
+                               dispatch_semaphore_t inFlightSemaphore,
+                               CGFrameBuffer *frameBuffer,
+                               BOOL isKeyframe)
+{
+  dispatch_semaphore_wait(inFlightSemaphore, DISPATCH_TIME_FOREVER);
+  
+  dispatch_group_async(group, encoder->queue, ^{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    if (frameBuffer == nil) {
+      [encoder->writer writeNopFrame];
+    } else {
+      if (!isKeyframe) {
+        prevFrameBuffer = [encoder->prev retain];
+      }
+      
+      process_frame_file_write_nodeltas(isKeyframe, frameBuffer, encoder->writer);
+      
+      [prevFrameBuffer release];
+      prevFrameBuffer = nil;
+      
+      [frameBufferPool() returnFrameBuffer:encoder->prev];
+      [encoder->prev release];
+      encoder->prev = [frameBuffer retain];
+    }
+    
+    [pool drain];
+    
+    dispatch_semaphore_signal(inFlightSemaphore);
+  });
+}
+
+// Split premultiplied BGRA pixels into unpremultiplied 24BPP RGB pixels and 24BPP
+// alpha pixels. When alphaAsGrayscale is FALSE the alpha is written as R = transparent,
+// G = partial transparency, B = opaque.
+
+static
+void split_alpha_pixels(const uint32_t *inPixels,
+                        uint32_t *rgbPixels,
+                        uint32_t *alphaPixels,
+                        NSUInteger numPixels,
+                        BOOL alphaAsGrayscale)
+{
+  unpremultiply_frame(inPixels, rgbPixels, (uint32_t)numPixels);
+  
+  for (NSUInteger pixeli = 0; pixeli < numPixels; pixeli++) {
+    uint32_t pixel = rgbPixels[pixeli];
+    uint32_t alpha = (pixel >> 24) & 0xFF;
+    
+    rgbPixels[pixeli] = pixel & 0xFFFFFF;
+    
+    uint32_t alphaPixel;
+    if (alphaAsGrayscale) {
+      alphaPixel = (alpha << 16) | (alpha << 8) | alpha;
+    } else {
+      uint8_t red = 0x0, green = 0x0, blue = 0x0;
+      if (alpha == 0xFF) {
+        blue = 0xFF;
+      } else if (alpha == 0x0) {
+        red = 0xFF;
+      } else {
+        green = alpha;
+      }
+      alphaPixel = rgba_to_bgra(red, green, blue, 0xFF) & 0xFFFFFF;
+    }
+    alphaPixels[pixeli] = alphaPixel;
+  }
+}
+
+void
+splitalpha(char *mvidFilenameCstr)
+{
+	NSString *mvidPath = [NSString stringWithUTF8String:mvidFilenameCstr];
+  
+  BOOL isMvid = [mvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  // Create "xyz_rgb.mvid" and "xyz_alpha.mvid" output filenames
+  
+  NSString *mvidFilename = [mvidPath lastPathComponent];
+  NSString *mvidFilenameNoExtension = [mvidFilename stringByDeletingPathExtension];
+
+  NSString *rgbFilename = [NSString stringWithFormat:@"%@_rgb.mvid", mvidFilenameNoExtension];
+  NSString *alphaFilename = [NSString stringWithFormat:@"%@_alpha.mvid", mvidFilenameNoExtension];
   
   // Reconstruct the fully qualified path for the RGB and ALPHA filenames
   
@@ -2651,171 +3324,102 @@ splitalpha(char *mvidFilenameCstr)
     
   fprintf(stdout, "Split %s RGB+A as %s and %s\n", [mvidFilename UTF8String], [rgbFilename UTF8String], [alphaFilename UTF8String]);
   
-  // Writer that will write the RGB values
+  // Each input frame is decoded once and split into RGB and ALPHA framebuffers
+  // with a direct pixel kernel. The two output files are encoded at the same
+  // time on their own serial queues while the next frame is being decoded.
   
-  MvidFileMetaData *mvidFileMetaDataRGB = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaDataRGB.bpp = 24;
-  mvidFileMetaDataRGB.checkAlphaChannel = FALSE;
-  
-  AVMvidFileWriter *fileWriter;
-  fileWriter = makeMVidWriter(rgbPath, 24, frameDuration, numFrames);
+  // If alphaAsGrayscale is TRUE, then emit grayscale RGB values where all the componenets are equal.
+  // If alphaAsGrayscale is FASLE, then emit componenet RGB values that are able to make use of
+  // threshold RGB values to further correct Alpha values when decoding.
   
-  {
-    CGFrameBuffer *rgbFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:24 width:width height:height];
-    
-    // Loop over all the frame data and emit RGB values without the alpha channel
-    
-    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-      
-      AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
-      assert(frame);
-      
-      // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-      frame.image = nil;
-      
-      CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-      assert(cgFrameBuffer);
-      
-      if (frameIndex == 0) {
-        rgbFrameBuffer.colorspace = cgFrameBuffer.colorspace;
-      }
-      
-      NSUInteger numPixels = cgFrameBuffer.width * cgFrameBuffer.height;
-      uint32_t *pixels = (uint32_t*)cgFrameBuffer.pixels;
-      uint32_t *rgbPixels = (uint32_t*)rgbFrameBuffer.pixels;
-      
-      for (NSUInteger pixeli = 0; pixeli < numPixels; pixeli++) {
-        uint32_t pixel = pixels[pixeli];
-        
-        // First reverse the premultiply logic so that the color of the pixel is disconnected from
-        // the specific alpha value it will be displayed with.
-        
-        uint32_t rgbPixel = unpremultiply_bgra(pixel);
-        
-        // Now toss out the alpha value entirely and emit the pixel by itself in 24BPP mode
-        
-        rgbPixel = rgbPixel & 0xFFFFFF;
-        
-        rgbPixels[pixeli] = rgbPixel;
-      }
-      
-      // Copy RGB data into a CGImage and apply frame delta compression to output
-      
-      CGImageRef frameImage = [rgbFrameBuffer createCGImageRef];
-      
-      BOOL isKeyframe = FALSE;
-      if (frameIndex == 0) {
-        isKeyframe = TRUE;
-      }
-      
-      process_frame_file(fileWriter, NULL, (int)frameImage, (int)frameIndex, mvidFileMetaDataRGB, isKeyframe, NULL);
-      
-      if (frameImage) {
-        CGImageRelease(frameImage);
-      }
-      
-      [pool release];
-    }
-    
-    [fileWriter rewriteHeader];
-    [fileWriter close];
-  }
+  const BOOL alphaAsGrayscale = TRUE;
   
-  // Now process each of the alpha channel pixels and save to another file.
+  premultiply_init();
   
-  [frameDecoder rewind];
+  AlphaFrameEncoder rgbEncoder;
+  rgbEncoder.writer = makeMVidWriter(rgbPath, 24, frameDuration, numFrames);
+  rgbEncoder.writer.movieSize = CGSizeMake(width, height);
+  rgbEncoder.prev = nil;
+  rgbEncoder.queue = dispatch_queue_create("mvidmoviemaker.splitalpha.rgb", DISPATCH_QUEUE_SERIAL);
   
-  fileWriter = makeMVidWriter(alphaPath, 24, frameDuration, numFrames);
+  AlphaFrameEncoder alphaEncoder;
+  alphaEncoder.writer = makeMVidWriter(alphaPath, 24, frameDuration, numFrames);
+  alphaEncoder.writer.movieSize = CGSizeMake(width, height);
+  alphaEncoder.prev = nil;
+  alphaEncoder.queue = dispatch_queue_create("mvidmoviemaker.splitalpha.alpha", DISPATCH_QUEUE_SERIAL);
   
-  // If alphaAsGrayscale is TRUE, then emit grayscale RGB values where all the componenets are equal.
-  // If alphaAsGrayscale is FASLE, then emit componenet RGB values that are able to make use of
-  // threshold RGB values to further correct Alpha values when decoding.
+  AlphaFrameEncoder *rgbEncoderPtr = &rgbEncoder;
+  AlphaFrameEncoder *alphaEncoderPtr = &alphaEncoder;
   
-  const BOOL alphaAsGrayscale = TRUE;
+  dispatch_group_t encodeGroup = dispatch_group_create();
+  dispatch_semaphore_t inFlightSemaphore = dispatch_semaphore_create(4);
   
-  MvidFileMetaData *mvidFileMetaDataAlpha = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaDataAlpha.bpp = 24;
-  mvidFileMetaDataAlpha.checkAlphaChannel = FALSE;
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   
-  {
-    CGFrameBuffer *alphaFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:24 width:width height:height];
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
-    // Loop over all the frame data and emit RGB values without the alpha channel
+    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+    assert(frame);
     
-    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-      
-      AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
-      assert(frame);
-      
-      // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-      frame.image = nil;
-      
-      CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-      assert(cgFrameBuffer);
-      
-      if (frameIndex == 0) {
-        alphaFrameBuffer.colorspace = cgFrameBuffer.colorspace;
-      }
-      
-      NSUInteger numPixels = cgFrameBuffer.width * cgFrameBuffer.height;
-      uint32_t *pixels = (uint32_t*)cgFrameBuffer.pixels;
-      uint32_t *alphaPixels = (uint32_t*)alphaFrameBuffer.pixels;
-      
-      for (NSUInteger pixeli = 0; pixeli < numPixels; pixeli++) {
-        uint32_t pixel = pixels[pixeli];
-        uint32_t alpha = (pixel >> 24) & 0xFF;
-        uint32_t alphaPixel;
-        if (alphaAsGrayscale) {
-          alphaPixel = (alpha << 16) | (alpha << 8) | alpha;
-        } else {
-          // R = transparent, G = partial transparency, B = opaque.
-          // This logic uses the green channel to map partial transparency
-          // values since the human visual system is able to descern more
-          // precision in the green values and so H264 encoders are more
-          // likely to store green with more precision.
-          
-          uint8_t red = 0x0, green = 0x0, blue = 0x0;
-          if (alpha == 0xFF) {
-            // Fully opaque pixel
-            blue = 0xFF;
-          } else if (alpha == 0x0) {
-            // Fully transparent pixel
-            red = 0xFF;
-          } else {
-            // Partial transparency
-            green = alpha;
-          }
-          alphaPixel = rgba_to_bgra(red, green, blue, 0xFF);
-        }
-        alphaPixels[pixeli] = alphaPixel;
-      }
-      
-      // Copy RGB data into a CGImage and apply frame delta compression to output
-      
-      CGImageRef frameImage = [alphaFrameBuffer createCGImageRef];
-      
-      BOOL isKeyframe = FALSE;
-      if (frameIndex == 0) {
-        isKeyframe = TRUE;
-      }
-      
-      process_frame_file(fileWriter, NULL, (int)frameImage, (int)frameIndex, mvidFileMetaDataAlpha, isKeyframe, NULL);
-      
-      if (frameImage) {
-        CGImageRelease(frameImage);
-      }
-      
-      [pool release];
+    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
+    frame.image = nil;
+    
+    BOOL isKeyframe = (frameIndex == 0);
+    
+    if (!isKeyframe && frame.isDuplicate) {
+      alpha_encoder_write_async(rgbEncoderPtr, encodeGroup, inFlightSemaphore, nil, FALSE);
+      alpha_encoder_write_async(alphaEncoderPtr, encodeGroup, inFlightSemaphore, nil, FALSE);
+      [pool drain];
+      continue;
     }
     
-    [fileWriter rewriteHeader];
-    [fileWriter close];
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
+    
+    CGFrameBuffer *rgbFrameBuffer = [frameBufferPool() checkoutFrameBufferWithBppDimensions:24 width:width height:height];
+    CGFrameBuffer *alphaFrameBuffer = [frameBufferPool() checkoutFrameBufferWithBppDimensions:24 width:width height:height];
+    
+    split_alpha_pixels((const uint32_t*)cgFrameBuffer.pixels,
+                       (uint32_t*)rgbFrameBuffer.pixels,
+                       (uint32_t*)alphaFrameBuffer.pixels,
+                       cgFrameBuffer.width * cgFrameBuffer.height,
+                       alphaAsGrayscale);
+    
+    alpha_encoder_write_async(rgbEncoderPtr, encodeGroup, inFlightSemaphore, rgbFrameBuffer, isKeyframe);
+    alpha_encoder_write_async(alphaEncoderPtr, encodeGroup, inFlightSemaphore, alphaFrameBuffer, isKeyframe);
+    
+    [pool drain];
+  }
+  
+  dispatch_group_wait(encodeGroup, DISPATCH_TIME_FOREVER);
+  dispatch_release(encodeGroup);
+  dispatch_release(inFlightSemaphore);
+  dispatch_release(rgbEncoder.queue);
+  dispatch_release(alphaEncoder.queue);
+  [rgbEncoder.prev release];
+  [alphaEncoder.prev release];
+  
+  if ([rgbEncoder.writer rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [rgbEncoder.writer.mvidPath UTF8String]);
+    exit(1);
+  }
+  [rgbEncoder.writer close];
+  
+  if ([alphaEncoder.writer rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [alphaEncoder.writer.mvidPath UTF8String]);
+    exit(1);
   }
+  [alphaEncoder.writer close];
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
   
   fprintf(stdout, "Wrote %s\n", [rgbPath UTF8String]);
   fprintf(stdout, "Wrote %s\n", [alphaPath UTF8String]);
+  if (elapsedTime > 0.0) {
+    fprintf(stdout, "Split %d frames in %.3f sec (%.1f frames/sec)\n", (int)numFrames, elapsedTime, numFrames / elapsedTime);
+  }
+  printFrameBufferPoolStats();
   
   return;
 }
@@ -2963,42 +3567,66 @@ joinalpha(char *mvidFilenameCstr)
   
   const BOOL alphaAsGrayscale = TRUE;
   
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = 32;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+  // Create output file writer object, frames are encoded on a serial queue
+  // while the next RGB and ALPHA frames are being decoded.
   
-  // Create output file writer object
+  AlphaFrameEncoder encoder;
+  encoder.writer = makeMVidWriter(mvidPath, 32, frameRate, numFrames);
+  encoder.writer.movieSize = size;
+  encoder.prev = nil;
+  encoder.queue = dispatch_queue_create("mvidmoviemaker.joinalpha", DISPATCH_QUEUE_SERIAL);
   
-  AVMvidFileWriter *fileWriter = makeMVidWriter(mvidPath, 32, frameRate, numFrames);
-
-  fileWriter.movieSize = size;
+  AlphaFrameEncoder *encoderPtr = &encoder;
   
-  CGFrameBuffer *combinedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:32 width:width height:height];
+  dispatch_group_t encodeGroup = dispatch_group_create();
+  dispatch_semaphore_t inFlightSemaphore = dispatch_semaphore_create(4);
+  
+  // The ALPHA frame is decoded on another queue at the same time as the RGB frame
+  
+  dispatch_queue_t alphaDecodeQueue = dispatch_queue_create("mvidmoviemaker.joinalpha.decode", DISPATCH_QUEUE_SERIAL);
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
+    __block AVFrame *frameAlpha = nil;
+    
+    dispatch_group_t decodeGroup = dispatch_group_create();
+    dispatch_group_async(decodeGroup, alphaDecodeQueue, ^{
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      frameAlpha = [[frameDecoderAlpha advanceToFrame:frameIndex] retain];
+      [pool drain];
+    });
+    
     AVFrame *frameRGB = [frameDecoderRGB advanceToFrame:frameIndex];
     assert(frameRGB);
-
-    AVFrame *frameAlpha = [frameDecoderAlpha advanceToFrame:frameIndex];
+    
+    dispatch_group_wait(decodeGroup, DISPATCH_TIME_FOREVER);
+    dispatch_release(decodeGroup);
+    
     assert(frameAlpha);
+    [frameAlpha autorelease];
     
     // Release the NSImage ref inside the frame since we will operate on the image data directly.
     frameRGB.image = nil;
     frameAlpha.image = nil;
     
+    BOOL isKeyframe = (frameIndex == 0);
+    
+    if (!isKeyframe && frameRGB.isDuplicate && frameAlpha.isDuplicate) {
+      alpha_encoder_write_async(encoderPtr, encodeGroup, inFlightSemaphore, nil, FALSE);
+      [pool drain];
+      continue;
+    }
+    
     CGFrameBuffer *cgFrameBufferRGB = frameRGB.cgFrameBuffer;
     assert(cgFrameBufferRGB);
     
     CGFrameBuffer *cgFrameBufferAlpha = frameAlpha.cgFrameBuffer;
     assert(cgFrameBufferAlpha);
     
-    // sRGB
-    
-    if (frameIndex == 0) {
-      combinedFrameBuffer.colorspace = cgFrameBufferRGB.colorspace;
-    }
+    CGFrameBuffer *combinedFrameBuffer = [frameBufferPool() checkoutFrameBufferWithBppDimensions:32 width:width height:height];
     
     // Join RGB and ALPHA
     
@@ -3052,41 +3680,41 @@ joinalpha(char *mvidFilenameCstr)
       // RGB componenets are 24 BPP non pre multiplied values
       
       uint32_t pixelRGB = rgbPixels[pixeli];
-      uint32_t pixelRed = (pixelRGB >> 16) & 0xFF;
-      uint32_t pixelGreen = (pixelRGB >> 8) & 0xFF;
-      uint32_t pixelBlue = (pixelRGB >> 0) & 0xFF;
-      
-      // Create BGRA pixel that is not premultiplied
       
-      uint32_t combinedPixel = premultiply_bgra_inline(pixelRed, pixelGreen, pixelBlue, pixelAlpha);
+      // Create BGRA pixel that is not premultiplied, the whole frame is premultiplied below
       
-      combinedPixels[pixeli] = combinedPixel;
+      combinedPixels[pixeli] = (pixelAlpha << 24) | (pixelRGB & 0xFFFFFF);
     }
     
-    // Write combined RGBA pixles
-    
-    // Copy RGB data into a CGImage and apply frame delta compression to output
-    
-    CGImageRef frameImage = [combinedFrameBuffer createCGImageRef];
-    
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
-    }
+    premultiply_frame(combinedPixels, combinedPixels, (uint32_t)numPixels);
     
-    process_frame_file(fileWriter, NULL, (int)frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
+    // Write combined RGBA pixels with frame delta compression
     
-    if (frameImage) {
-      CGImageRelease(frameImage);
-    }
+    alpha_encoder_write_async(encoderPtr, encodeGroup, inFlightSemaphore, combinedFrameBuffer, isKeyframe);
     
     [pool drain];
   }
   
-  [fileWriter rewriteHeader];
-  [fileWriter close];
+  dispatch_group_wait(encodeGroup, DISPATCH_TIME_FOREVER);
+  dispatch_release(encodeGroup);
+  dispatch_release(inFlightSemaphore);
+  dispatch_release(alphaDecodeQueue);
+  dispatch_release(encoder.queue);
+  [encoder.prev release];
   
-  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
+  if ([encoder.writer rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [encoder.writer.mvidPath UTF8String]);
+    exit(1);
+  }
+  [encoder.writer close];
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  fprintf(stdout, "Wrote %s\n", [encoder.writer.mvidPath UTF8String]);
+  if (elapsedTime > 0.0) {
+    fprintf(stdout, "Joined %d frames in %.3f sec (%.1f frames/sec)\n", (int)numFrames, elapsedTime, numFrames / elapsedTime);
+  }
+  printFrameBufferPoolStats();
   return;
 }
 
@@ -3105,6 +3733,8 @@ mixalpha(char *mvidFilenameCstr)
     exit(1);
   }
   
+  premultiply_init();
+  
   // Create "xyz_mix.mvid" as output filenames
   
   NSString *mvidFilename = [mvidPath lastPathComponent];
@@ -3216,19 +3846,15 @@ mixalpha(char *mvidFilenameCstr)
       uint32_t *pixels = (uint32_t*)cgFrameBuffer.pixels;
       uint32_t *rgbPixels = (uint32_t*)rgbFrameBuffer.pixels;
       
+      // First reverse the premultiply logic so that the color of the pixel is disconnected from
+      // the specific alpha value it will be displayed with.
+      
+      unpremultiply_frame(pixels, rgbPixels, (uint32_t)numPixels);
+      
+      // Now toss out the alpha value entirely and emit the pixel by itself in 24BPP mode
+      
       for (NSUInteger pixeli = 0; pixeli < numPixels; pixeli++) {
-        uint32_t pixel = pixels[pixeli];
-        
-        // First reverse the premultiply logic so that the color of the pixel is disconnected from
-        // the specific alpha value it will be displayed with.
-        
-        uint32_t rgbPixel = unpremultiply_bgra(pixel);
-        
-        // Now toss out the alpha value entirely and emit the pixel by itself in 24BPP mode
-        
-        rgbPixel = rgbPixel & 0xFFFFFF;
-        
-        rgbPixels[pixeli] = rgbPixel;
+        rgbPixels[pixeli] &= 0xFFFFFF;
       }
       
       // Copy RGB data into a CGImage and apply frame delta compression to output
@@ -3287,7 +3913,10 @@ mixalpha(char *mvidFilenameCstr)
       [pool release];
     }
     
-    [fileWriter rewriteHeader];
+    if ([fileWriter rewriteHeader] == FALSE) {
+      fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+      exit(1);
+    }
     [fileWriter close];
   }
   
@@ -3478,17 +4107,14 @@ unmixalpha(char *mvidFilenameCstr)
       // RGB componenets are 24 BPP non pre multiplied values
       
       uint32_t pixelRGB = rgbPixels[pixeli];
-      uint32_t pixelRed = (pixelRGB >> 16) & 0xFF;
-      uint32_t pixelGreen = (pixelRGB >> 8) & 0xFF;
-      uint32_t pixelBlue = (pixelRGB >> 0) & 0xFF;
-      
-      // Create BGRA pixel that is not premultiplied
       
-      uint32_t combinedPixel = premultiply_bgra_inline(pixelRed, pixelGreen, pixelBlue, pixelAlpha);
+      // Create BGRA pixel that is not premultiplied, the whole frame is premultiplied below
       
-      combinedPixels[pixeli] = combinedPixel;
+      combinedPixels[pixeli] = (pixelAlpha << 24) | (pixelRGB & 0xFFFFFF);
     }
     
+    premultiply_frame(combinedPixels, combinedPixels, (uint32_t)numPixels);
+    
     // Write combined RGBA pixles
     
     // Copy RGB data into a CGImage and apply frame delta compression to output
@@ -3509,7 +4135,10 @@ unmixalpha(char *mvidFilenameCstr)
     [pool drain];
   }
   
-  [fileWriter rewriteHeader];
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
   [fileWriter close];
   
   fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
@@ -3686,7 +4315,10 @@ mixstraight(char *rgbMvidFilenameCstr, char *alphaMvidFilenameCstr, char *mixedM
   
   assert(numOutputFrames == outFrameIndex);
   
-  [fileWriter rewriteHeader];
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
   [fileWriter close];
   
   fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
@@ -3805,16 +4437,39 @@ cropMvidMovie(char *cropSpecCstr, char *inMvidFilenameCstr, char *outMvidFilenam
     exit(1);
   }
   
-  // Writer that will write the RGB values. Note that invoking process_frame_file()
-  // will define the output width/height based on the size of the image passed in.
+  // Frames are cropped with a row copy and written directly. Delta frames in a
+  // V3 file with 24 or 32 BPP pixels are written by translating the c4 codes of
+  // the input delta to the crop window, so that the pixels do not need to be
+  // compared to the previous frame again. Other frames are compared to the
+  // previous cropped frame.
   
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+  BOOL translateDeltas = (bpp != 16) &&
+    (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_THREE) &&
+    ([frameDecoder isDeltas] == FALSE);
+  
+  int inFd = -1;
+  
+  if (translateDeltas) {
+    inFd = open([inMvidPath UTF8String], O_RDONLY);
+    if (inFd == -1) {
+      fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", [inMvidPath UTF8String]);
+      exit(1);
+    }
+  }
   
   AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  fileWriter.movieSize = CGSizeMake(cropW, cropH);
   
   CGFrameBuffer *croppedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:cropW height:cropH];
+  CGFrameBuffer *prevCroppedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:cropW height:cropH];
+  
+  [prevFrameBuffer release];
+  prevFrameBuffer = nil;
+  
+  NSMutableData *deltaData = [NSMutableData data];
+  
+  int numNopFrames = 0;
+  int numTranslatedFrames = 0;
   
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
@@ -3825,56 +4480,238 @@ cropMvidMovie(char *cropSpecCstr, char *inMvidFilenameCstr, char *outMvidFilenam
     // Release the NSImage ref inside the frame since we will operate on the CG image directly.
     frame.image = nil;
     
-    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-    assert(cgFrameBuffer);
-        
-    // sRGB support
+    BOOL isKeyframe = (frameIndex == 0);
     
-    if (frameIndex == 0) {
-      croppedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+    if (!isKeyframe && frame.isDuplicate) {
+      [fileWriter writeNopFrame];
+      numNopFrames++;
+      [pool drain];
+      continue;
     }
     
-    // Copy cropped area into the croppedFrameBuffer
-    
-    BOOL worked;
-    CGImageRef frameImage = nil;
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
     
-    // Crop pixels from cgFrameBuffer while doing a copy into croppedFrameBuffer. Note that this
-    // API currently assumes that input and output are the same BPP.
+    // Copy cropped area into the croppedFrameBuffer
     
     [croppedFrameBuffer cropCopyPixels:cgFrameBuffer cropX:cropX cropY:cropY];
     
-    frameImage = [croppedFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
+    BOOL written = FALSE;
     
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
+    if (!isKeyframe && translateDeltas) {
+      MVV3Frame *mvFrame = maxvid_v3_file_frame(frameDecoder.mvFrames, (uint32_t)frameIndex);
+      
+      if (!maxvid_v3_frame_iskeyframe(mvFrame) && !maxvid_v3_frame_iscompressed(mvFrame)) {
+        uint32_t numBytes = maxvid_v3_frame_length(mvFrame);
+        [deltaData setLength:numBytes];
+        
+        ssize_t numRead = pread(inFd, [deltaData mutableBytes], numBytes, maxvid_v3_frame_offset(mvFrame));
+        if (numRead != numBytes) {
+          fprintf(stderr, "error: cannot read delta frame %d from \"%s\"\n", (int)frameIndex+1, [inMvidPath UTF8String]);
+          exit(1);
+        }
+        
+        BOOL isValid;
+        NSData *croppedCodes = maxvid_crop_c4_codes32((const uint32_t*)[deltaData bytes],
+                                                      numBytes / sizeof(uint32_t),
+                                                      width, height,
+                                                      (uint32_t)cropX, (uint32_t)cropY,
+                                                      (uint32_t)cropW, (uint32_t)cropH,
+                                                      &isValid);
+        
+        if (isValid == FALSE) {
+          fprintf(stderr, "error: invalid delta frame %d in \"%s\"\n", (int)frameIndex+1, [inMvidPath UTF8String]);
+          exit(1);
+        } else if (croppedCodes == nil) {
+          // No pixels inside the crop window changed
+          
+          [fileWriter writeNopFrame];
+          numNopFrames++;
+        } else {
+          worked = maxvid_write_delta_pixels(fileWriter,
+                                             croppedCodes,
+                                             croppedFrameBuffer.pixels,
+                                             (uint32_t)croppedFrameBuffer.numBytes,
+                                             cropW * cropH,
+                                             0);
+          
+          if (worked == FALSE) {
+            fprintf(stderr, "cannot write deltaframe data to mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+            exit(1);
+          }
+          
+          numTranslatedFrames++;
+        }
+        
+        written = TRUE;
+      }
     }
     
-    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
-    
-    if (frameImage) {
-      CGImageRelease(frameImage);
+    if (!written) {
+      if (!isKeyframe) {
+        prevFrameBuffer = [prevCroppedFrameBuffer retain];
+      }
+      
+      process_frame_file_write_nodeltas(isKeyframe, croppedFrameBuffer, fileWriter);
+      
+      [prevFrameBuffer release];
+      prevFrameBuffer = nil;
     }
-        
+    
+    CGFrameBuffer *tmp = prevCroppedFrameBuffer;
+    prevCroppedFrameBuffer = croppedFrameBuffer;
+    croppedFrameBuffer = tmp;
+    
     [pool drain];
   }
   
-  [fileWriter rewriteHeader];
+  if (inFd != -1) {
+    close(inFd);
+  }
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
   [fileWriter close];
   
+  if (translateDeltas) {
+    fprintf(stdout, "Translated %d delta frames, %d nop frames\n", numTranslatedFrames, numNopFrames);
+  }
+  
   fprintf(stdout, "Wrote: %s\n", [fileWriter.mvidPath UTF8String]);
   return;
 }
 
+// Parse a RESIZE spec into the output dimensions and the resample filter. The
+// spec is "WIDTH HEIGHT" with an optional filter name, or DOUBLE or HALF. Returns
+// TRUE for DOUBLE, since that case copies each input pixel into 4 output pixels.
+
+static
+BOOL parseResizeSpec(char *resizeSpecCstr,
+                     int width,
+                     int height,
+                     NSInteger *resizeWPtr,
+                     NSInteger *resizeHPtr,
+                     ResampleFilter *filterPtr)
+{
+	NSString *resizeSpec = [NSString stringWithUTF8String:resizeSpecCstr];
+  
+  if ([resizeSpec isEqualToString:@"DOUBLE"]) {
+    // Enable 1 -> 4 pixel logic for DOUBLE resize, a filtered resample would produce
+    // pixel values that are not identical when resized back to half the size.
+    
+    *resizeWPtr = width * 2;
+    *resizeHPtr = height * 2;
+    *filterPtr = RESAMPLE_FILTER_BOX;
+    return TRUE;
+  } else if ([resizeSpec isEqualToString:@"HALF"]) {
+    // Shortcut so that half size operation need not pass the exact sizes, they can be
+    // calculated from input movie. The BOX filter averages each 2x2 block of pixels.
+    
+    *resizeWPtr = width / 2;
+    *resizeHPtr = height / 2;
+    *filterPtr = RESAMPLE_FILTER_BOX;
+    return FALSE;
+  }
+  
+  NSArray *elements  = [resizeSpec componentsSeparatedByString:@" "];
+  
+  if ([elements count] != 2 && [elements count] != 3) {
+    fprintf(stderr, "RESIZE specification must be WIDTH HEIGHT ?FILTER? : not %s\n", resizeSpecCstr);
+    exit(1);
+  }
+  
+  NSInteger resizeW = [((NSString*)[elements objectAtIndex:0]) intValue];
+  NSInteger resizeH = [((NSString*)[elements objectAtIndex:1]) intValue];
+  
+  if (resizeW <= 0 || resizeH <= 0) {
+    fprintf(stderr, "RESIZE specification must be WIDTH HEIGHT ?FILTER? : not %s\n", resizeSpecCstr);
+    exit(1);
+  }
+  
+  ResampleFilter filter = RESAMPLE_FILTER_LANCZOS3;
+  
+  if ([elements count] == 3) {
+    NSString *filterName = [elements objectAtIndex:2];
+    
+    if ([filterName isEqualToString:@"BOX"]) {
+      filter = RESAMPLE_FILTER_BOX;
+    } else if ([filterName isEqualToString:@"BICUBIC"]) {
+      filter = RESAMPLE_FILTER_BICUBIC;
+    } else if ([filterName isEqualToString:@"LANCZOS"]) {
+      filter = RESAMPLE_FILTER_LANCZOS3;
+    } else {
+      fprintf(stderr, "RESIZE filter must be BOX, BICUBIC, or LANCZOS : not %s\n", [filterName UTF8String]);
+      exit(1);
+    }
+  }
+  
+  *resizeWPtr = resizeW;
+  *resizeHPtr = resizeH;
+  *filterPtr = filter;
+  return FALSE;
+}
+
+// Resample the pixels in inFrameBuffer into outFrameBuffer using filter tables
+// created for the dimensions of the two buffers. Bands of output rows are
+// resampled concurrently when more than 1 thread is available.
+
+#define RESAMPLE_ROWS_PER_BAND 16
+
+static
+void resampleFrameBuffer(const ResampleTables *tables,
+                         CGFrameBuffer *inFrameBuffer,
+                         CGFrameBuffer *outFrameBuffer,
+                         int numThreads)
+{
+  assert(inFrameBuffer.bitsPerPixel == outFrameBuffer.bitsPerPixel);
+  assert(inFrameBuffer.bitsPerPixel > 16);
+  assert(inFrameBuffer.width == tables->inWidth && inFrameBuffer.height == tables->inHeight);
+  assert(outFrameBuffer.width == tables->outWidth && outFrameBuffer.height == tables->outHeight);
+  
+  const uint32_t *inPixels = (const uint32_t *) inFrameBuffer.pixels;
+  uint32_t *outPixels = (uint32_t *) outFrameBuffer.pixels;
+  const int isOpaque = (inFrameBuffer.bitsPerPixel == 24);
+  const uint32_t outHeight = tables->outHeight;
+  
+  if (numThreads <= 1) {
+    resample_rows(tables, inPixels, outPixels, 0, outHeight, isOpaque);
+    return;
+  }
+  
+  size_t numBands = (outHeight + RESAMPLE_ROWS_PER_BAND - 1) / RESAMPLE_ROWS_PER_BAND;
+  
+  dispatch_apply(numBands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t band){
+    uint32_t rowStart = (uint32_t)band * RESAMPLE_ROWS_PER_BAND;
+    uint32_t rowEnd = MIN(rowStart + RESAMPLE_ROWS_PER_BAND, outHeight);
+    resample_rows(tables, inPixels, outPixels, rowStart, rowEnd, isOpaque);
+  });
+}
+
+// Scale with a CoreGraphics render, this is used for 16 BPP pixels.
+
+static
+void resizeFrameBufferWithRender(CGFrameBuffer *inFrameBuffer,
+                                 CGFrameBuffer *outFrameBuffer)
+{
+  CGImageRef frameImage = [inFrameBuffer createCGImageRef];
+  BOOL worked = (frameImage != nil);
+  assert(worked);
+  
+  [outFrameBuffer clear];
+  [outFrameBuffer renderCGImage:frameImage];
+  
+  CGImageRelease(frameImage);
+  assert(inFrameBuffer.isLockedByDataProvider == FALSE);
+}
+
 // This -resize option provides a very handy command line operation that is able to resize
 // a movie and write the result to a new file. Any width and height could be set as the
 // output dimensions.
 
 void
-resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFilenameCstr)
+resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFilenameCstr, int numThreads)
 {
   NSString *inMvidPath = [NSString stringWithUTF8String:inMvidFilenameCstr];
   NSString *outMvidPath = [NSString stringWithUTF8String:outMvidFilenameCstr];
@@ -3895,48 +4732,6 @@ resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFil
     exit(1);
   }
   
-  // Check the RESIZE spec, it should be 2 integer values that indicate the W H
-  // for the output movie. This parameter could also be DOUBLE or HALF to indicate
-  // a "double size" operation or a "half size" operation. Note that there is a
-  // special case when using "DOUBLE" in that it writes pixels directly to the double
-  // size, while indicating the size explicitly will use the core graphics scale op.
-  
-	NSString *resizeSpec = [NSString stringWithUTF8String:resizeSpecCstr];
-  
-  NSInteger resizeW = -1;
-  NSInteger resizeH = -1;
-  
-  BOOL doubleSizeFlag = FALSE;
-  BOOL halfSizeFlag = FALSE;
-  
-  if ([resizeSpec isEqualToString:@"DOUBLE"]) {
-    // Enable 1 -> 4 pixel logic for DOUBLE resize, the CG render will resample and produce some very strange
-    // results that do not produce the identical pixel values when resized back to half the size.
-    
-    doubleSizeFlag = TRUE;
-  } else if ([resizeSpec isEqualToString:@"HALF"]) {
-    // Shortcut so that half size operation need not pass the exact sizes, they can be calculated from input movie
-    
-    halfSizeFlag = TRUE;
-  }
-  
-  if ((doubleSizeFlag == FALSE) && (halfSizeFlag == FALSE)) {
-    NSArray *elements  = [resizeSpec componentsSeparatedByString:@" "];
-    
-    if ([elements count] != 2) {
-      fprintf(stderr, "RESIZE specification must be WIDTH HEIGHT : not %s\n", resizeSpecCstr);
-      exit(1);
-    }
-    
-    resizeW = [((NSString*)[elements objectAtIndex:0]) intValue];
-    resizeH = [((NSString*)[elements objectAtIndex:1]) intValue];
-    
-    if (resizeW <= 0 || resizeH <= 0) {
-      fprintf(stderr, "RESIZE specification must be WIDTH HEIGHT : not %s\n", resizeSpecCstr);
-      exit(1);
-    }    
-  }
-  
   // Read in existing file into from the input file and create an output file
   // that has exactly the same options.
   
@@ -3964,18 +4759,20 @@ resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFil
   assert(width > 0);
   assert(height > 0);
   
-  if (doubleSizeFlag) {
-    resizeW = width * 2;
-    resizeH = height * 2;
-  }
+  // Check the RESIZE spec, it should be 2 integer values that indicate the W H
+  // for the output movie. This parameter could also be DOUBLE or HALF to indicate
+  // a "double size" operation or a "half size" operation.
   
-  if (halfSizeFlag) {
-    resizeW = width / 2;
-    resizeH = height / 2;
-  }
+  NSInteger resizeW = -1;
+  NSInteger resizeH = -1;
+  ResampleFilter filter;
   
-  assert(resizeW != -1);
-  assert(resizeH != -1);
+  BOOL doubleSizeFlag = parseResizeSpec(resizeSpecCstr, width, height, &resizeW, &resizeH, &filter);
+  
+  if (resizeW <= 0 || resizeH <= 0) {
+    fprintf(stderr, "error: invalid -resize specification \"%s\" for movie with dimensions \"%d x %d\"\n", resizeSpecCstr, width, height);
+    exit(1);
+  }
   
   // Writer that will write the RGB values. Note that invoking process_frame_file()
   // will define the output width/height based on the size of the image passed in.
@@ -3988,15 +4785,22 @@ resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFil
   
   CGFrameBuffer *resizedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:resizeW height:resizeH];
   
-  // Resize input image to some other size. Ignore the case where the input is exactly
-  // the same size as the output. If the HALF size resize is indicated, use the default
-  // interpolation which results in exact half size pixel rendering. Otherwise, use
-  // the high quality interpolation.
+  // 24 and 32 BPP pixels are resampled with filter tables that are computed once
+  // for the whole movie. 16 BPP pixels are scaled with a CoreGraphics render,
+  // the high quality interpolation is used unless the HALF size resize is
+  // indicated since the default interpolation results in exact half size pixels.
+  
+  ResampleTables *resampleTables = NULL;
   
-  if (halfSizeFlag == FALSE) {
+  if (doubleSizeFlag == FALSE && bpp != 16) {
+    resampleTables = resample_tables_create(width, height, (uint32_t)resizeW, (uint32_t)resizeH, filter);
+    assert(resampleTables);
+  } else if (doubleSizeFlag == FALSE && filter != RESAMPLE_FILTER_BOX) {
     resizedFrameBuffer.useHighQualityInterpolation = TRUE;
   }
   
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
@@ -4055,20 +4859,10 @@ resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFil
         
         outColumn += 1;
       }
+    } else if (resampleTables != NULL) {
+      resampleFrameBuffer(resampleTables, cgFrameBuffer, resizedFrameBuffer, numThreads);
     } else {
-      // USe CG layer to double size and scale the pixels in the original image
-      
-      frameImage = [cgFrameBuffer createCGImageRef];
-      worked = (frameImage != nil);
-      assert(worked);
-      
-      [resizedFrameBuffer clear];
-      [resizedFrameBuffer renderCGImage:frameImage];
-      
-      if (frameImage) {
-        CGImageRelease(frameImage);
-        assert(cgFrameBuffer.isLockedByDataProvider == FALSE);
-      }
+      resizeFrameBufferWithRender(cgFrameBuffer, resizedFrameBuffer);
     }
   
     frameImage = [resizedFrameBuffer createCGImageRef];
@@ -4089,10 +4883,150 @@ resizeMvidMovie(char *resizeSpecCstr, char *inMvidFilenameCstr, char *outMvidFil
     [pool drain];
   }
   
-  [fileWriter rewriteHeader];
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  resample_tables_free(resampleTables);
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
   [fileWriter close];
   
-  fprintf(stdout, "Wrote: %s\n", [fileWriter.mvidPath UTF8String]);
+  fprintf(stdout, "Wrote: %s (%.2f frames/sec)\n", [fileWriter.mvidPath UTF8String],
+          (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0);
+  printFrameBufferPoolStats();
+  return;
+}
+
+// Resize each frame of a movie with both the CoreGraphics render and the filter
+// table resample and print the throughput of each along with how much the
+// resampled pixels differ from the rendered ones. No output file is written.
+
+void benchmarkMvidResize(char *resizeSpecCstr, NSString *mvidFilename, int numThreads)
+{
+  BOOL worked;
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  worked = [frameDecoder openForReading:mvidFilename];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
+    exit(1);
+  }
+  
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+  
+  int bpp = [frameDecoder header]->bpp;
+  int width = (int)[frameDecoder width];
+  int height = (int)[frameDecoder height];
+  
+  if (bpp == 16) {
+    fprintf(stderr, "error: -benchresize requires 24 or 32 BPP pixels\n");
+    exit(1);
+  }
+  
+  NSInteger resizeW = -1;
+  NSInteger resizeH = -1;
+  ResampleFilter filter;
+  
+  BOOL doubleSizeFlag = parseResizeSpec(resizeSpecCstr, width, height, &resizeW, &resizeH, &filter);
+  
+  if (doubleSizeFlag || resizeW <= 0 || resizeH <= 0) {
+    fprintf(stderr, "error: invalid -benchresize specification \"%s\" for movie with dimensions \"%d x %d\"\n", resizeSpecCstr, width, height);
+    exit(1);
+  }
+  
+  CGFrameBuffer *renderedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:resizeW height:resizeH];
+  CGFrameBuffer *resampledFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:resizeW height:resizeH];
+  
+  if (filter != RESAMPLE_FILTER_BOX) {
+    renderedFrameBuffer.useHighQualityInterpolation = TRUE;
+  }
+  
+  ResampleTables *resampleTables = resample_tables_create(width, height, (uint32_t)resizeW, (uint32_t)resizeH, filter);
+  assert(resampleTables);
+  
+  CFAbsoluteTime renderTime = 0.0;
+  CFAbsoluteTime resampleTime = 0.0;
+  
+  uint32_t maxDelta = 0;
+  uint64_t sumDelta = 0;
+  uint64_t numDifferentPixels = 0;
+  
+  const uint32_t numOutputPixels = (uint32_t) (resizeW * resizeH);
+  const uint32_t componentMask = (bpp == 24) ? 0x00FFFFFF : 0xFFFFFFFF;
+  
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+    assert(frame);
+    
+    frame.image = nil;
+    
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
+    
+    if (frameIndex == 0) {
+      renderedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+      resampledFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+    }
+    
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    resizeFrameBufferWithRender(cgFrameBuffer, renderedFrameBuffer);
+    renderTime += CFAbsoluteTimeGetCurrent() - startTime;
+    
+    startTime = CFAbsoluteTimeGetCurrent();
+    resampleFrameBuffer(resampleTables, cgFrameBuffer, resampledFrameBuffer, numThreads);
+    resampleTime += CFAbsoluteTimeGetCurrent() - startTime;
+    
+    const uint32_t *renderedPixels = (const uint32_t *) renderedFrameBuffer.pixels;
+    const uint32_t *resampledPixels = (const uint32_t *) resampledFrameBuffer.pixels;
+    
+    for (uint32_t i = 0; i < numOutputPixels; i++) {
+      uint32_t p1 = renderedPixels[i] & componentMask;
+      uint32_t p2 = resampledPixels[i] & componentMask;
+      
+      if (p1 == p2) {
+        continue;
+      }
+      
+      numDifferentPixels++;
+      
+      for (int shift = 0; shift < 32; shift += 8) {
+        int c1 = (p1 >> shift) & 0xFF;
+        int c2 = (p2 >> shift) & 0xFF;
+        uint32_t delta = (uint32_t) abs(c1 - c2);
+        maxDelta = MAX(maxDelta, delta);
+        sumDelta += delta;
+      }
+    }
+    
+    [pool drain];
+  }
+  
+  resample_tables_free(resampleTables);
+  
+  [frameDecoder close];
+  
+  uint64_t numComponents = (uint64_t)numOutputPixels * numFrames * ((bpp == 24) ? 3 : 4);
+  
+  fprintf(stdout, "resized %d frames from %d x %d to %d x %d\n",
+          (int)numFrames, width, height, (int)resizeW, (int)resizeH);
+  fprintf(stdout, "render   : %.4f seconds (%.2f FPS)\n",
+          renderTime, (renderTime > 0.0) ? (numFrames / renderTime) : 0.0);
+  fprintf(stdout, "resample : %.4f seconds (%.2f FPS) with %d threads\n",
+          resampleTime, (resampleTime > 0.0) ? (numFrames / resampleTime) : 0.0, numThreads);
+  fprintf(stdout, "pixels that differ : %llu of %llu, max component delta %d, mean component delta %.4f\n",
+          numDifferentPixels, (uint64_t)numOutputPixels * numFrames, maxDelta,
+          (double)sumDelta / numComponents);
+  
   return;
 }
 
@@ -4257,7 +5191,10 @@ fourupMvidMovie(char *inMvidFilenameCstr)
   for (int i = 0; i < 4; i++) {
     AVMvidFileWriter *fileWriter = writerArr[i];
     
-    [fileWriter rewriteHeader];
+    if ([fileWriter rewriteHeader] == FALSE) {
+      fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+      exit(1);
+    }
     [fileWriter close];
     
     fprintf(stdout, "Wrote: %s\n", [fileWriter.mvidPath UTF8String]);
@@ -4267,14 +5204,15 @@ fourupMvidMovie(char *inMvidFilenameCstr)
 }
 
 // This method provides an easy command line operation that will upgrade from
-// v1 to v2. This change is a nasty one because the file format changed in
-// a way that makes it impossible to support loading the old format. The
-// code that needed to change was duplicated so that only the upgrade
-// operation would need to deal with this horror show. The
-// new file will be written with the most recent version number. If specific
-// file format changes are needed, then will be implemented when the new file
-// is written. This method writes to a tmp file and then the existing mvid
-// file is replace by the tmp file once the operation is complete.
+// v0, v1, or v2 to v3. The encoded frame data is the same in each version, the
+// changes are in the header, the frame table, and the page alignment of keyframes.
+// So, each keyframe and delta frame payload is copied byte for byte into the new
+// layout without decoding. The only exception is a version 0 file with an odd
+// number of pixels, a delta frame adler in that version does not include the
+// zero padding pixel so those frames are decoded to calculate a new adler. The
+// new file will be written with the most recent version number. This method
+// writes to a tmp file and then the existing mvid file is replace by the tmp
+// file once the operation is complete.
 
 void
 upgradeMvidMovie(char *inMvidFilenameCstr, char *optionalMvidFilenameCstr)
@@ -4322,75 +5260,129 @@ upgradeMvidMovie(char *inMvidFilenameCstr, char *optionalMvidFilenameCstr)
     exit(1);
   }
   
-  // Check for upgrade from version 1 or 0 to version 2.
+  // Check for upgrade from version 0, 1, or 2 to version 3.
   
   MVFileHeader *header = [frameDecoder header];
   int version = maxvid_file_version(header);
-  if (version == MV_FILE_VERSION_ZERO || version == MV_FILE_VERSION_ONE) {
+  if (version == MV_FILE_VERSION_ZERO || version == MV_FILE_VERSION_ONE || version == MV_FILE_VERSION_TWO) {
     // Success
   } else {
-    fprintf(stderr, "error: cannot upgrade mvid file version %d to version 2\n", version);
+    fprintf(stderr, "error: cannot upgrade mvid file version %d to version 3\n", version);
     exit(1);
   }
   
-  worked = [frameDecoder allocateDecodeResources];
-  assert(worked);
-  
   NSUInteger numFrames = [frameDecoder numFrames];
   assert(numFrames > 0);
   
   float frameDuration = [frameDecoder frameDuration];
   
-  int bpp = [frameDecoder header]->bpp;
+  int bpp = header->bpp;
   
-  //int width = [frameDecoder width];
-  //int height = [frameDecoder height];
+  int width = (int)[frameDecoder width];
+  int height = (int)[frameDecoder height];
   
-  // Writer that will write the RGB values. Note that invoking process_frame_file()
-  // will define the width/height on the output.
+  // A version 0 delta frame adler must be recalculated when the framebuffer has an
+  // odd number of pixels, this requires decoding each frame.
   
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+  BOOL recalculateDeltaAdler = (version == MV_FILE_VERSION_ZERO) && (((width * height) % 2) != 0);
+  
+  if (recalculateDeltaAdler) {
+    worked = [frameDecoder allocateDecodeResources];
+    assert(worked);
+  }
+  
+  int inFd = open([inMvidPath UTF8String], O_RDONLY);
+  if (inFd == -1) {
+    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", [inMvidPath UTF8String]);
+    exit(1);
+  }
   
   AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  fileWriter.movieSize = CGSizeMake(width, height);
+  
+#if MV_ENABLE_DELTAS
+  fileWriter.isDeltas = [frameDecoder isDeltas];
+#endif // MV_ENABLE_DELTAS
+  
+  NSMutableData *frameData = [NSMutableData data];
+  
+  int numKeyframes = 0;
+  int numDeltaFrames = 0;
+  int numNopFrames = 0;
+  uint64_t numBytesCopied = 0;
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
-    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
-    assert(frame);
+    MVFrame *frame = maxvid_file_frame(frameDecoder.mvFrames, (uint32_t)frameIndex);
     
-    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-    frame.image = nil;
+    if (maxvid_frame_isnopframe(frame)) {
+#if MV_ENABLE_DELTAS
+      if (frameIndex == 0) {
+        [fileWriter writeInitialNopFrame];
+      } else
+#endif // MV_ENABLE_DELTAS
+      {
+        [fileWriter writeNopFrame];
+      }
+      numNopFrames++;
+      [pool drain];
+      continue;
+    }
     
-    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-    assert(cgFrameBuffer);
-        
-    BOOL worked;
-    CGImageRef frameImage = nil;
-        
-    frameImage = [cgFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
+    uint32_t numBytes = maxvid_frame_length(frame);
+    [frameData setLength:numBytes];
     
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
+    ssize_t numRead = pread(inFd, [frameData mutableBytes], numBytes, maxvid_frame_offset(frame));
+    if (numRead != numBytes) {
+      fprintf(stderr, "error: cannot read frame %d from \"%s\"\n", (int)frameIndex+1, [inMvidPath UTF8String]);
+      exit(1);
     }
     
-    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
+    if (maxvid_frame_iskeyframe(frame)) {
+      worked = [fileWriter writeKeyframe:[frameData mutableBytes] bufferSize:numBytes adler:frame->adler isCompressed:FALSE];
+      numKeyframes++;
+    } else {
+      uint32_t adler = frame->adler;
+      
+      if (recalculateDeltaAdler && (adler != 0)) {
+        AVFrame *decodedFrame = [frameDecoder advanceToFrame:frameIndex];
+        assert(decodedFrame);
+        CGFrameBuffer *cgFrameBuffer = decodedFrame.cgFrameBuffer;
+        adler = maxvid_adler32(0, (unsigned char*)cgFrameBuffer.pixels, (uint32_t)cgFrameBuffer.numBytes);
+      }
+      
+      worked = [fileWriter writeDeltaframe:[frameData mutableBytes] bufferSize:numBytes adler:adler];
+      numDeltaFrames++;
+    }
     
-    if (frameImage) {
-      CGImageRelease(frameImage);
+    if (worked == FALSE) {
+      fprintf(stderr, "error: cannot write frame %d to \"%s\"\n", (int)frameIndex+1, [outMvidPath UTF8String]);
+      exit(1);
     }
     
+    numBytesCopied += numBytes;
+    
     [pool drain];
   }
   
-  [fileWriter rewriteHeader];
+  close(inFd);
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
   [fileWriter close];
-
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  fprintf(stdout, "Copied %d keyframes, %d delta frames, %d nop frames (%.2f MB/sec)%s\n",
+          numKeyframes, numDeltaFrames, numNopFrames,
+          (elapsedTime > 0.0) ? ((numBytesCopied / (1024.0 * 1024.0)) / elapsedTime) : 0.0,
+          recalculateDeltaAdler ? ", recalculated version 0 delta adler" : "");
+  
   // tmp file is written now, remove the original (old) .mvid and replace it with the upgraded file.
   
   if (writingToOptionalFile == FALSE) {
@@ -4493,108 +5485,230 @@ void printMvidFPS(NSString *mvidFilename)
   return;
 }
 
-// Adler for each frame of video
+// Parse a -fps value like "24", "0.5", or "30000/1001" and return the frame
+// duration in seconds. Returns zero if the value is not valid. The rate must be
+// below 90 FPS, this is the same limit that -framerate enforces.
 
-void printMvidFrameAdler(NSString *mvidFilename)
+static
+float parseFramerateSpec(char *fpsCstr)
 {
-	BOOL worked;
+  NSString *fpsInputStr = [[NSString stringWithUTF8String:fpsCstr] stringByReplacingOccurrencesOfString:@" " withString:@""];
+  NSArray *values = [fpsInputStr componentsSeparatedByString:@"/"];
   
-  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  if (values.count == 2) {
+    float frames = [values[0] floatValue];
+    float seconds = [values[1] floatValue];
+    
+    if (frames <= 0.0f || seconds <= 0.0f || (frames / seconds) >= 90.0f) {
+      return 0.0f;
+    }
+    
+    return seconds / frames;
+  } else if (values.count == 1) {
+    float fps = [fpsInputStr floatValue];
+    
+    if ((fps <= 0.0f) || (fps >= 90.0f)) {
+      return 0.0f;
+    }
+    
+    return 1.0f / fps;
+  }
   
-  worked = [frameDecoder openForReading:mvidFilename];
+  return 0.0f;
+}
+
+typedef enum {
+  MVID_HEADER_EDIT_FPS = 0,
+  MVID_HEADER_EDIT_FLAGS
+} MvidHeaderEdit;
+
+// Edit the header of an existing .mvid file in place. The MVFileHeader is a
+// fixed 64 byte struct at the start of the file, so the frameDuration and the
+// file flags can be changed without copying any frame data. The flags edit
+// scans the frame table and sets or clears MV_FILE_ALL_KEYFRAMES to match the
+// frames actually in the file. The new header is written with a single pwrite
+// that is then synced to disk. Returns FALSE after printing an error message
+// if the file can't be read or is not valid.
+
+static
+BOOL editMvidHeaderInPlace(NSString *mvidPath, MvidHeaderEdit edit, float frameDuration, BOOL *changedPtr)
+{
+  const char *pathCstr = [mvidPath UTF8String];
   
-  if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
-    exit(1);
+  int fd = open(pathCstr, O_RDWR);
+  
+  if (fd == -1) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", pathCstr);
+    return FALSE;
   }
   
-  worked = [frameDecoder allocateDecodeResources];
-  assert(worked);
+  MVFileHeader header;
   
-  NSUInteger numFrames = [frameDecoder numFrames];
-  assert(numFrames > 0);
+  if (pread(fd, &header, sizeof(MVFileHeader), 0) != sizeof(MVFileHeader) ||
+      header.magic != MV_FILE_MAGIC ||
+      (header.bpp != 16 && header.bpp != 24 && header.bpp != 32) ||
+      header.numFrames == 0 ||
+      maxvid_file_version(&header) > MV_FILE_VERSION_THREE) {
+    fprintf(stderr, "error: invalid mvid header in \"%s\"\n", pathCstr);
+    close(fd);
+    return FALSE;
+  }
   
-  int isV3 = (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_THREE);
+  MVFileHeader newHeader = header;
   
-  //fprintf(stdout, "%s\n", [[mvidFilename lastPathComponent] UTF8String]);
+  if (edit == MVID_HEADER_EDIT_FPS) {
+    newHeader.frameDuration = frameDuration;
+  } else {
+    // Read the frame table that follows the header. A file is all keyframes
+    // when no frame other than a nop is a delta frame.
+    
+    int isV3 = (maxvid_file_version(&header) == MV_FILE_VERSION_THREE);
+    size_t frameSize = isV3 ? sizeof(MVV3Frame) : sizeof(MVFrame);
+    size_t numBytes = frameSize * header.numFrames;
+    
+    void *frames = malloc(numBytes);
+    assert(frames);
+    
+    if (pread(fd, frames, numBytes, sizeof(MVFileHeader)) != (ssize_t)numBytes) {
+      fprintf(stderr, "error: cannot read frame table in \"%s\"\n", pathCstr);
+      free(frames);
+      close(fd);
+      return FALSE;
+    }
+    
+    BOOL isAllKeyframes = TRUE;
+    
+    for (uint32_t i = 0; isAllKeyframes && (i < header.numFrames); i++) {
+      if (isV3) {
+        MVV3Frame *frame = maxvid_v3_file_frame(frames, i);
+        if (!maxvid_v3_frame_isnopframe(frame) && !maxvid_v3_frame_iskeyframe(frame)) {
+          isAllKeyframes = FALSE;
+        }
+      } else {
+        MVFrame *frame = maxvid_file_frame(frames, i);
+        if (!maxvid_frame_isnopframe(frame) && !maxvid_frame_iskeyframe(frame)) {
+          isAllKeyframes = FALSE;
+        }
+      }
+    }
+    
+    free(frames);
+    
+    newHeader.versionAndFlags &= ~(MV_FILE_ALL_KEYFRAMES << 8);
+    
+    if (isAllKeyframes) {
+      maxvid_file_set_all_keyframes(&newHeader);
+    }
+  }
   
-  uint32_t lastAdler = 0x0;
+  BOOL changed = (memcmp(&header, &newHeader, sizeof(MVFileHeader)) != 0);
   
-  if (isV3) {
-    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-      
-      MVV3Frame *frame = maxvid_v3_file_frame(frameDecoder.mvFrames, (int)frameIndex);
-      assert(frame);
-      
-      uint32_t currentAdler = frame->adler;
-      
-#if MV_ENABLE_DELTAS
-      if (frameIndex == 0 && [frameDecoder isDeltas]) {
-        // A nop delta frame is a special case in that it contains an adler
-        // that corresponds to all black pixels.
-        
-        lastAdler = currentAdler;
-      } else // note that the else/if here is only enabled in deltas mode
-#endif // MV_ENABLE_DELTAS
-        if (maxvid_v3_frame_isnopframe(frame)) {
-          currentAdler = lastAdler;
-        } else {
-          lastAdler = currentAdler;
-        }
-      
-      fprintf(stdout, "0x%X\n", currentAdler);
-      
-      [pool drain];
+  if (changed) {
+    if (pwrite(fd, &newHeader, sizeof(MVFileHeader), 0) != sizeof(MVFileHeader) || fsync(fd) != 0) {
+      fprintf(stderr, "error: cannot write mvid header to \"%s\"\n", pathCstr);
+      close(fd);
+      return FALSE;
+    }
+  }
+  
+  close(fd);
+  
+  if (changedPtr) {
+    *changedPtr = changed;
+  }
+  
+  return TRUE;
+}
+
+// Return an array that contains the path itself when pathCstr is a .mvid file,
+// or the sorted paths of the .mvid files when pathCstr is a directory.
+
+static
+NSArray* mvidPathsInFileOrDirectory(char *pathCstr)
+{
+  NSString *path = [NSString stringWithUTF8String:pathCstr];
+  NSMutableArray *mvidPaths = [NSMutableArray array];
+  
+  BOOL isDirectory = FALSE;
+  
+  if ([[NSFileManager defaultManager] fileExistsAtPath:path isDirectory:&isDirectory] && isDirectory) {
+    NSArray *filenames = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:path error:nil];
+    
+    for (NSString *filename in [filenames sortedArrayUsingSelector:@selector(compare:)]) {
+      if ([filename hasSuffix:@".mvid"]) {
+        [mvidPaths addObject:[path stringByAppendingPathComponent:filename]];
+      }
     }
+  } else if ([path hasSuffix:@".mvid"]) {
+    [mvidPaths addObject:path];
   } else {
-    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-      
-      MVFrame *frame = maxvid_file_frame(frameDecoder.mvFrames, (int)frameIndex);
-      assert(frame);
-      
-      uint32_t currentAdler = frame->adler;
-      
-#if MV_ENABLE_DELTAS
-      if (frameIndex == 0 && [frameDecoder isDeltas]) {
-        // A nop delta frame is a special case in that it contains an adler
-        // that corresponds to all black pixels.
-        
-        lastAdler = currentAdler;
-      } else // note that the else/if here is only enabled in deltas mode
-#endif // MV_ENABLE_DELTAS
-        if (maxvid_frame_isnopframe(frame)) {
-          currentAdler = lastAdler;
-        } else {
-          lastAdler = currentAdler;
-        }
-      
-      fprintf(stdout, "0x%X\n", currentAdler);
-      
-      [pool drain];
+    fprintf(stderr, "error: FILENAME must be a .mvid file or a directory : %s\n", pathCstr);
+    exit(1);
+  }
+  
+  return mvidPaths;
+}
+
+// Invoked for -setfps and -setflags, the path can be a single .mvid file or a
+// directory, in which case every .mvid file in the directory is edited.
+
+void editMvidHeaders(char *pathCstr, MvidHeaderEdit edit, float frameDuration)
+{
+  NSArray *mvidPaths = mvidPathsInFileOrDirectory(pathCstr);
+  
+  int numChanged = 0;
+  int numFailed = 0;
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  
+  for (NSString *mvidPath in mvidPaths) {
+    BOOL changed = FALSE;
+    
+    if (editMvidHeaderInPlace(mvidPath, edit, frameDuration, &changed) == FALSE) {
+      numFailed++;
+    } else if (changed) {
+      numChanged++;
     }
   }
   
-  [frameDecoder close];
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
   
-	return;
+  fprintf(stdout, "Updated %d of %d files in %.4f seconds\n", numChanged, (int)[mvidPaths count], elapsedTime);
+  
+  if (numFailed > 0) {
+    exit(1);
+  }
+  
+  return;
 }
 
-// This method will iterate over each frame, then each row and print the
-// pixel values as hex and decoded RGB values. This is useful when debugging
-// RGB conversion logic.
+// Decode every frame in a movie and report the decode speed. This is useful to
+// measure the effect of decoder changes on a given clip, for example a clip where
+// only a few lines change from one frame to the next. The readMode selects how
+// frame data is read, run once with each mode to compare the frame latency and
+// peak resident memory of the mmap and pread paths.
 
-void printMvidPixels(NSString *mvidPath)
+typedef enum {
+  BENCHMARK_READ_MMAP = 0,
+  BENCHMARK_READ_PREAD,
+  BENCHMARK_READ_PREAD_NOCACHE
+} BenchmarkReadMode;
+
+void benchmarkMvidDecode(NSString *mvidFilename, BenchmarkReadMode readMode)
 {
-	BOOL worked;
+  BOOL worked;
   
   AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
   
-  worked = [frameDecoder openForReading:mvidPath];
+  if (readMode != BENCHMARK_READ_MMAP) {
+    frameDecoder.readWithPread = TRUE;
+    frameDecoder.readNoCache = (readMode == BENCHMARK_READ_PREAD_NOCACHE);
+  }
+  
+  worked = [frameDecoder openForReading:mvidFilename];
   
   if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidPath UTF8String]);
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
     exit(1);
   }
   
@@ -4604,198 +5718,138 @@ void printMvidPixels(NSString *mvidPath)
   NSUInteger numFrames = [frameDecoder numFrames];
   assert(numFrames > 0);
   
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  CFAbsoluteTime maxFrameTime = 0.0;
+  
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
+    CFAbsoluteTime frameStartTime = CFAbsoluteTimeGetCurrent();
+    
     AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
     assert(frame);
     
-    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-    frame.image = nil;
+    maxFrameTime = MAX(maxFrameTime, CFAbsoluteTimeGetCurrent() - frameStartTime);
     
-    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-    assert(cgFrameBuffer);
+    [pool drain];
+  }
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  // Note that ru_maxrss is in bytes on MacOSX
+  
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  
+  const char *readModeStr = (readMode == BENCHMARK_READ_MMAP) ? "mmap" :
+    ((readMode == BENCHMARK_READ_PREAD) ? "pread" : "pread nocache");
+  
+  fprintf(stdout, "decoded %d frames in %.4f seconds (%.2f FPS) with %s reads\n",
+          (int)numFrames, elapsedTime, (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0, readModeStr);
+  fprintf(stdout, "frame latency : %.3f ms mean, %.3f ms max\n",
+          (elapsedTime * 1000.0) / numFrames, maxFrameTime * 1000.0);
+  fprintf(stdout, "peak resident memory : %.1f MB\n", usage.ru_maxrss / (1024.0 * 1024.0));
+  fprintf(stdout, "delta copies : %d partial, %d full\n",
+          (int)frameDecoder.numPartialDeltaCopies, (int)frameDecoder.numFullDeltaCopies);
+  fprintf(stdout, "framebuffers : %d in ring, exhausted %d times\n",
+          (int)frameDecoder.cgFrameBuffers.count, (int)frameDecoder.numFramebufferExhaustions);
+  
+  if (readMode != BENCHMARK_READ_MMAP) {
+    fprintf(stdout, "frame reads : %d read ahead, %d blocking\n",
+            (int)frameDecoder.numReadAheadHits, (int)frameDecoder.numSyncReads);
+  }
+  
+  [frameDecoder close];
+  
+  return;
+}
+
+// Play a movie with N decoders in lockstep, as if the same animation was displayed
+// in N places at once. The decoders share a frame cache so that each frame is only
+// decoded once, then the cache hit rate and the number of bytes held are reported.
+
+void benchmarkMvidSharedDecode(NSString *mvidFilename, int numDecoders)
+{
+  if (numDecoders < 1) {
+    fprintf(stderr, "error: -benchshared requires at least 1 decoder\n");
+    exit(1);
+  }
+  
+  AVMvidFrameCache *frameCache = [AVMvidFrameCache aVMvidFrameCache];
+  
+  NSMutableArray *decoders = [NSMutableArray arrayWithCapacity:numDecoders];
+  
+  for (int i = 0; i < numDecoders; i++) {
+    AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
     
-    if (frameIndex == 0) {
-      fprintf(stdout, "File %s, %dBPP, %d FRAMES\n", [[mvidPath lastPathComponent] UTF8String], (int)cgFrameBuffer.bitsPerPixel, (int)numFrames);
+    BOOL worked = [frameDecoder openForReading:mvidFilename];
+    
+    if (worked == FALSE) {
+      fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
+      exit(1);
     }
     
-    if (frame.isDuplicate) {
-      fprintf(stdout, "FRAME %d (duplicate)\n", (int)frameIndex+1);
-    } else {
-      fprintf(stdout, "FRAME %d\n", (int)frameIndex+1);
-      
-      // Iterate over the pixel contents of the framebuffer
-      
-      int numPixels = (int) (cgFrameBuffer.width * cgFrameBuffer.height);
-      
-      uint16_t *pixel16Ptr = (uint16_t*)cgFrameBuffer.pixels;
-      uint32_t *pixel32Ptr = (uint32_t*)cgFrameBuffer.pixels;
-      
-      int row = 0;
-      int column = 0;
-      for (int pixeli = 0; pixeli < numPixels; pixeli++) {
-        
-        if ((pixeli % cgFrameBuffer.width) == 0) {
-          // At the first pixel in a new row
-          column = 0;
-          
-          fprintf(stdout, "ROW %d\n", row);
-          row += 1;
-        }
-        
-        fprintf(stdout, "COLUMN %d: ", column);
-        column += 1;
-        
-        if (cgFrameBuffer.bitsPerPixel == 16) {
-          uint16_t pixel = *pixel16Ptr++;
-          
-#define CG_MAX_5_BITS 0x1F
-          
-          uint8_t red = (pixel >> 10) & CG_MAX_5_BITS;
-          uint8_t green = (pixel >> 5) & CG_MAX_5_BITS;
-          uint8_t blue = pixel & CG_MAX_5_BITS;
-          
-          fprintf(stdout, "HEX 0x%0.4X, RGB = (%d, %d, %d)\n", pixel, red, green, blue);
-        } else if (cgFrameBuffer.bitsPerPixel == 24) {
-          uint32_t pixel = *pixel32Ptr++;
-          
-          uint8_t red = (pixel >> 16) & 0xFF;
-          uint8_t green = (pixel >> 8) & 0xFF;
-          uint8_t blue = pixel & 0xFF;
-          
-          fprintf(stdout, "HEX 0x%0.6X, RGB = (%d, %d, %d)\n", pixel, red, green, blue);
-        } else {
-          uint32_t pixel = *pixel32Ptr++;
-          
-          uint8_t alpha = (pixel >> 24) & 0xFF;
-          uint8_t red = (pixel >> 16) & 0xFF;
-          uint8_t green = (pixel >> 8) & 0xFF;
-          uint8_t blue = pixel & 0xFF;
-          
-          fprintf(stdout, "HEX 0x%0.8X, RGBA = (%d, %d, %d, %d)\n", pixel, red, green, blue, alpha);
-        }
-      }
-    }
+    worked = [frameDecoder allocateDecodeResources];
+    assert(worked);
     
-    fflush(stdout);
+    frameDecoder.frameCache = frameCache;
     
-    [pool drain];
+    [decoders addObject:frameDecoder];
   }
   
-  [frameDecoder close];
-}
-
-// This method will "map" certain alpha values to a new value based on the input
-// specification. This operation is not so easy to implement with 3rd party
-// software though it is conceptually simple. This method would typically be used
-// to "clamp" alpha values near the opaque value to the actual opaque value.
-// For example, if a green screen video was processed in a non-optimal way, pixels
-// that really should have an alpha value of 255 (opaque) might have the values
-// 254, 253, or even 252. This method makes it easy to map these values below
-// the opaque value to the opaque value by passing "252,253,254=255" as
-// the map spec.
-
-void alphaMapMvid(NSString *inMvidPath,
-                  NSString *outMvidPath,
-                  NSString *mapSpecStr)
-{
-  BOOL isMvid;
-  
-  isMvid = [inMvidPath hasSuffix:@".mvid"];
-  
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
-    exit(1);
-  }
+  NSUInteger numFrames = [[decoders objectAtIndex:0] numFrames];
+  assert(numFrames > 0);
   
-  isMvid = [outMvidPath hasSuffix:@".mvid"];
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
   
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
-    exit(1);
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    for (AVMvidFrameDecoder *frameDecoder in decoders) {
+      AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+      assert(frame);
+    }
+    
+    [pool drain];
   }
   
-  // Check the "MAPSPEC". The format is like so:
-  //
-  // 252=255
-  //
-  // NUM=VALUE
-  //
-  // 1 to N
-  //
-  // Could include multiple mappings
-  //
-  // 1=0,2=0,253=255,254=255
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
   
-  NSMutableDictionary *mappings = [NSMutableDictionary dictionary];
+  fprintf(stdout, "played %d frames with %d decoders in %.4f seconds (%.2f FPS per decoder)\n",
+          (int)numFrames, numDecoders, elapsedTime, (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0);
+  fprintf(stdout, "frame cache : %d hits, %d misses, hit rate %.1f%%, %.1f MB held\n",
+          (int)frameCache.numHits, (int)frameCache.numMisses, frameCache.hitRate * 100.0f,
+          frameCache.numBytes / (1024.0 * 1024.0));
   
-  NSArray *elements = [mapSpecStr componentsSeparatedByString:@","];
+  for (AVMvidFrameDecoder *frameDecoder in decoders) {
+    [frameDecoder close];
+  }
   
-  for (NSString *element in elements) {
-    NSArray *singleSpecElements = [element componentsSeparatedByString:@"="];
-    int count = (int)[singleSpecElements count];
-    if (count != 2) {
-      fprintf(stderr, "MAPSPEC must contain 1 to N integer elements of the form IN=OUT, got \"%s\"\n", [element UTF8String]);
-      exit(1);
-    }
-    // Store the input mapping number and the output number it maps to
-    NSString *inNumStr = [singleSpecElements objectAtIndex:0];
-    NSString *outNumStr = [singleSpecElements objectAtIndex:1];
-    
-    NSInteger inInt;
-    NSInteger outInt;
-    
-    if ([inNumStr isEqualToString:@"0"]) {
-      inInt = 0;
-    } else {
-      inInt = [inNumStr integerValue];
-      if (inInt == 0) {
-        inInt = -1;
-      }
-    }
-    
-    if ([outNumStr isEqualToString:@"0"]) {
-      outInt = 0;
-    } else {
-      outInt = [outNumStr integerValue];
-      if (outInt == 0) {
-        outInt = -1;
-      }
-    }
-    
-    if (outInt < 0 || inInt < 0) {
-      fprintf(stderr, "MAPSPEC must contain 1 to N integer elements of the form IN=OUT, got \"%s\"\n", [element UTF8String]);
-      exit(1);
-    }
+  return;
+}
 
-    if (outInt > 255 || inInt > 255) {
-      fprintf(stderr, "MAPSPEC IN=OUT values must be in range 0->255, got \"%s\"\n", [element UTF8String]);
-      exit(1);
-    }
-    
-    NSNumber *inNum = [NSNumber numberWithInteger:inInt];
-    NSNumber *outNum = [NSNumber numberWithInteger:outInt];
-    
-    [mappings setObject:outNum forKey:inNum];
-  }
+// Play a movie forward once and then backward from the last frame to the first,
+// as a scrubbing UI would, and report the backward playback speed. Frames are
+// saved every checkpointSpacing frames during the forward pass, pass a spacing
+// of 0 to measure the cost of decoding each frame from the previous keyframe.
 
-  if ([mappings count] == 0) {
-    fprintf(stderr, "No MAPSPEC elements parsed\n");
+void benchmarkMvidReverseDecode(NSString *mvidFilename, int checkpointSpacing)
+{
+  BOOL worked;
+  
+  if (checkpointSpacing < 0) {
+    fprintf(stderr, "error: invalid -benchreverse checkpoint spacing : %d\n", checkpointSpacing);
     exit(1);
   }
   
-  fprintf(stdout, "processing input file, will apply %d alpha channel mapping(s)\n", (int)[mappings count]);
-  
-  // Read in existing file into from the input file and create an output file
-  // that has exactly the same options.
-  
   AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
   
-  BOOL worked = [frameDecoder openForReading:inMvidPath];
+  frameDecoder.checkpointSpacing = checkpointSpacing;
+  
+  worked = [frameDecoder openForReading:mvidFilename];
   
   if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", [inMvidPath UTF8String]);
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
     exit(1);
   }
   
@@ -4805,265 +5859,1129 @@ void alphaMapMvid(NSString *inMvidPath,
   NSUInteger numFrames = [frameDecoder numFrames];
   assert(numFrames > 0);
   
-  float frameDuration = [frameDecoder frameDuration];
-  
-  int bpp = [frameDecoder header]->bpp;
-  
-  if (bpp != 32) {
-    fprintf(stderr, "-alphamap can only be used on a 32BPP mvid file since an alpha channel is required\n");
-    exit(1);
-  }
-  
-  int width = (int)[frameDecoder width];
-  int height = (int)[frameDecoder height];
-    
-  // Writer that will write the RGB values. Note that invoking process_frame_file()
-  // will define the output width/height based on the size of the image passed in.
-  
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
-  
-  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
-  
-  CGFrameBuffer *mappedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
-  
-  uint32_t numPixelsModified = 0;
-  
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-    
     AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
     assert(frame);
+    [pool drain];
+  }
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  CFAbsoluteTime maxFrameTime = 0.0;
+  
+  for (NSInteger frameIndex = numFrames - 1; frameIndex >= 0; frameIndex--) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
-    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-    frame.image = nil;
-    
-    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-    assert(cgFrameBuffer);
-    
-    // sRGB support
+    CFAbsoluteTime frameStartTime = CFAbsoluteTimeGetCurrent();
     
-    if (frameIndex == 0) {
-      mappedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
-    }
+    AVFrame *frame = [frameDecoder seekToFrame:frameIndex];
+    assert(frame);
     
-    // Copy image area into mappedFrameBuffer
+    maxFrameTime = MAX(maxFrameTime, CFAbsoluteTimeGetCurrent() - frameStartTime);
     
-    BOOL worked;
-    CGImageRef frameImage = nil;
+    [pool drain];
+  }
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  fprintf(stdout, "decoded %d frames backward in %.4f seconds (%.2f FPS) with checkpoint spacing %d\n",
+          (int)numFrames, elapsedTime, (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0, checkpointSpacing);
+  fprintf(stdout, "frame latency : %.3f ms mean, %.3f ms max\n",
+          (elapsedTime * 1000.0) / numFrames, maxFrameTime * 1000.0);
+  fprintf(stdout, "checkpoints : %.1f MB held, limit %.1f MB\n",
+          frameDecoder.checkpointNumBytes / (1024.0 * 1024.0),
+          frameDecoder.maxCheckpointNumBytes / (1024.0 * 1024.0));
+  
+  [frameDecoder close];
+  
+  return;
+}
+
+// Play a movie while skipping ahead 2, 4, and 8 frames at a time, as a player that
+// falls behind would, once with each delta applied in turn and once with the deltas
+// merged before being applied. The two decoders run in lockstep and the output is
+// compared after each skip. The gain is largest on a high motion clip where the
+// same pixels change in each frame.
+
+void benchmarkMvidSkipDecode(NSString *mvidFilename)
+{
+  const int skipCounts[] = { 2, 4, 8 };
+  
+  for (int i = 0; i < (int)(sizeof(skipCounts) / sizeof(skipCounts[0])); i++) {
+    int skipCount = skipCounts[i];
     
-    frameImage = [cgFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
+    AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+    AVMvidFrameDecoder *composeDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
     
-    [mappedFrameBuffer clear];
-    worked = [mappedFrameBuffer renderCGImage:frameImage];
-    assert(worked);
+    composeDecoder.composeDeltas = TRUE;
     
-    if (frameImage) {
-      CGImageRelease(frameImage);
+    for (AVMvidFrameDecoder *decoder in @[frameDecoder, composeDecoder]) {
+      BOOL worked = [decoder openForReading:mvidFilename];
+      
+      if (worked == FALSE) {
+        fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
+        exit(1);
+      }
+      
+      worked = [decoder allocateDecodeResources];
+      assert(worked);
     }
     
-    // Do mapping logic by iterating over all the pixels in mappedFrameBuffer
-    // and then editing the pixels in place if needed.
-    
-    int numPixels = (int)(mappedFrameBuffer.width * mappedFrameBuffer.height);
+    NSUInteger numFrames = [frameDecoder numFrames];
+    assert(numFrames > 0);
     
-    uint32_t *pixel32Ptr = (uint32_t*)mappedFrameBuffer.pixels;
+    CFAbsoluteTime elapsedTime = 0.0;
+    CFAbsoluteTime composeElapsedTime = 0.0;
+    int numSkips = 0;
     
-    for (int pixeli = 0; pixeli < numPixels; pixeli++) {
-      uint32_t pixel = pixel32Ptr[pixeli];
+    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex += skipCount) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
       
-      uint32_t alpha = (pixel >> 24) & 0xFF;
-      uint32_t red = (pixel >> 16) & 0xFF;
-      uint32_t green = (pixel >> 8) & 0xFF;
-      uint32_t blue = pixel & 0xFF;
+      CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+      AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+      elapsedTime += CFAbsoluteTimeGetCurrent() - startTime;
       
-      // Check to see if the alpha value appears in the map
+      startTime = CFAbsoluteTimeGetCurrent();
+      AVFrame *composeFrame = [composeDecoder advanceToFrame:frameIndex];
+      composeElapsedTime += CFAbsoluteTimeGetCurrent() - startTime;
       
-      NSNumber *keyNum = [NSNumber numberWithInteger:(NSInteger)alpha];
-      NSNumber *valueNum = [mappings objectForKey:keyNum];
+      assert(frame && composeFrame);
       
-      if (valueNum != nil) {
-        // This value appears in the mapping, get the new alpha value, combine
-        // it with the existing RGB values and write the pixel back into the framebuffer.
-        
-        NSInteger mappedAlpha = [valueNum integerValue];
-        uint32_t mappedUnsigned = (uint32_t)mappedAlpha;
-        
-        pixel = (mappedUnsigned << 24) | (red << 16) | (green << 8) | blue;
-        
-        pixel32Ptr[pixeli] = pixel;
-        numPixelsModified += 1;
+      CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+      CGFrameBuffer *composeFrameBuffer = composeFrame.cgFrameBuffer;
+      
+      if (memcmp(cgFrameBuffer.pixels, composeFrameBuffer.pixels, cgFrameBuffer.numBytes) != 0) {
+        fprintf(stderr, "error: frame %d differs when deltas are merged\n", (int)frameIndex+1);
+        exit(1);
       }
+      
+      numSkips++;
+      
+      [pool drain];
     }
     
-    // Now create a UIImage so that the result of this operation can be encoded into the output mvid
-    
-    frameImage = [mappedFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
-    
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
-    }
-    
-    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
-    
-    if (frameImage) {
-      CGImageRelease(frameImage);
-    }
+    fprintf(stdout, "skip %d : %d frames, %.3f ms applying each delta, %.3f ms merging deltas (%.2fx), %d deltas merged\n",
+            skipCount, numSkips,
+            (elapsedTime * 1000.0) / numSkips, (composeElapsedTime * 1000.0) / numSkips,
+            (composeElapsedTime > 0.0) ? (elapsedTime / composeElapsedTime) : 0.0,
+            (int)composeDecoder.numComposedDeltas);
     
-    [pool drain];
+    [frameDecoder close];
+    [composeDecoder close];
   }
   
-  [fileWriter rewriteHeader];
-  [fileWriter close];
-
-  fprintf(stdout, "Mapped %d pixels to new values\n", numPixelsModified);
-  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
   return;
 }
 
-// Execute rdelta, this is basically a diff of an original (uncompressed) as compared
-// to a compressed representation. The compressed implementation uses much less space
-// than the original, but how much compression is too much? This logic attempts to
-// visually show which pixels have been changed by the compression. The pixels written
-// to the output mvid are the same ones in the inModifiedMvidPath argument, except that
-// diffs as compared to inOriginalMvidPath will be displayed with a 50% red overlay.
+#define BENCHMARK_WRITE_NUM_FRAMES 120
 
-void rdeltaMvidMovie(char *inOriginalMvidPathCstr,
-                     char *inModifiedMvidPathCstr,
-                     char *outMvidPathCstr)
+// Write an all keyframe movie of uncompressed 24BPP frames and report the write
+// throughput. Each 3840 x 2160 frame fills whole pages, pass a size where the
+// number of pixels is not a multiple of 4096 to also measure the page padding
+// logic. The file is flushed to disk before the timer is stopped.
+
+void benchmarkMvidWrite(NSString *mvidFilename, int width, int height)
 {
-  BOOL isMvid;
+  const int bpp = 24;
+  const NSUInteger numFrames = BENCHMARK_WRITE_NUM_FRAMES;
   
-  NSString *inOriginalMvidPath = [NSString stringWithUTF8String:inOriginalMvidPathCstr];
-  NSString *inModifiedMvidPath = [NSString stringWithUTF8String:inModifiedMvidPathCstr];
-  NSString *outMvidPath = [NSString stringWithUTF8String:outMvidPathCstr];
+  int isSizeOkay = maxvid_v3_frame_check_max_size(width, height, bpp);
+  if (width <= 0 || height <= 0 || isSizeOkay != 0) {
+    fprintf(stderr, "error: invalid -benchwrite frame size : %d x %d\n", width, height);
+    exit(1);
+  }
   
-  isMvid = [inOriginalMvidPath hasSuffix:@".mvid"];
+  CGFrameBuffer *cgBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
   
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
-    exit(1);
+  // Fill the frame with a gradient so that each frame has a distinct adler
+  
+  uint32_t *pixels = (uint32_t*) cgBuffer.pixels;
+  const NSUInteger numPixels = width * height;
+  for (NSUInteger i = 0; i < numPixels; i++) {
+    pixels[i] = (uint32_t)(i * 0x010203) & 0x00FFFFFF;
   }
   
-  isMvid = [inModifiedMvidPath hasSuffix:@".mvid"];
+  AVMvidFileWriter *mvidWriter = makeMVidWriter(mvidFilename, bpp, 1.0/30.0, numFrames);
+  mvidWriter.movieSize = CGSizeMake(width, height);
   
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    pixels[0] = (uint32_t) frameIndex;
+    
+    BOOL worked = [mvidWriter writeKeyframe:(char*)cgBuffer.pixels bufferSize:(int)cgBuffer.numBytes];
+    
+    if (worked == FALSE) {
+      fprintf(stderr, "error: cannot write frame %d to \"%s\"\n", (int)frameIndex, [mvidFilename UTF8String]);
+      exit(1);
+    }
+  }
+  
+  if ([mvidWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [mvidFilename UTF8String]);
     exit(1);
   }
+  [mvidWriter close];
+  
+  int fd = open([mvidFilename UTF8String], O_RDONLY);
+  assert(fd != -1);
+  fsync(fd);
+  
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  struct stat sb;
+  int result = fstat(fd, &sb);
+  assert(result == 0);
+  close(fd);
+  
+  uint64_t numPayloadBytes = (uint64_t)cgBuffer.numBytes * numFrames;
+  
+  fprintf(stdout, "wrote %d keyframes of %d x %d in %.4f seconds (%.2f FPS, %.1f MB/sec)\n",
+          (int)numFrames, width, height, elapsedTime,
+          (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0,
+          (elapsedTime > 0.0) ? (sb.st_size / elapsedTime / (1024.0 * 1024.0)) : 0.0);
+  fprintf(stdout, "file size %lld bytes, %lld bytes of header and padding, %lld bytes allocated on disk\n",
+          (long long)sb.st_size, (long long)(sb.st_size - numPayloadBytes), (long long)sb.st_blocks * 512);
+  
+  return;
+}
 
-  isMvid = [outMvidPath hasSuffix:@".mvid"];
+// Adler for each frame of video
+
+void printMvidFrameAdler(NSString *mvidFilename)
+{
+	BOOL worked;
   
-  if (isMvid == FALSE) {
-    fprintf(stderr, "%s", USAGE);
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  worked = [frameDecoder openForReading:mvidFilename];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
     exit(1);
   }
-    
-  // Read in existing original and compressed files
   
-  AVMvidFrameDecoder *frameDecoderOriginal = [AVMvidFrameDecoder aVMvidFrameDecoder];
-  AVMvidFrameDecoder *frameDecoderCompressed = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+  
+  int isV3 = (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_THREE);
+  
+  //fprintf(stdout, "%s\n", [[mvidFilename lastPathComponent] UTF8String]);
+  
+  uint32_t lastAdler = 0x0;
   
+  if (isV3) {
+    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      MVV3Frame *frame = maxvid_v3_file_frame(frameDecoder.mvFrames, (int)frameIndex);
+      assert(frame);
+      
+      uint32_t currentAdler = frame->adler;
+      
+#if MV_ENABLE_DELTAS
+      if (frameIndex == 0 && [frameDecoder isDeltas]) {
+        // A nop delta frame is a special case in that it contains an adler
+        // that corresponds to all black pixels.
+        
+        lastAdler = currentAdler;
+      } else // note that the else/if here is only enabled in deltas mode
+#endif // MV_ENABLE_DELTAS
+        if (maxvid_v3_frame_isnopframe(frame)) {
+          currentAdler = lastAdler;
+        } else {
+          lastAdler = currentAdler;
+        }
+      
+      fprintf(stdout, "0x%X\n", currentAdler);
+      
+      [pool drain];
+    }
+  } else {
+    for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      MVFrame *frame = maxvid_file_frame(frameDecoder.mvFrames, (int)frameIndex);
+      assert(frame);
+      
+      uint32_t currentAdler = frame->adler;
+      
+#if MV_ENABLE_DELTAS
+      if (frameIndex == 0 && [frameDecoder isDeltas]) {
+        // A nop delta frame is a special case in that it contains an adler
+        // that corresponds to all black pixels.
+        
+        lastAdler = currentAdler;
+      } else // note that the else/if here is only enabled in deltas mode
+#endif // MV_ENABLE_DELTAS
+        if (maxvid_frame_isnopframe(frame)) {
+          currentAdler = lastAdler;
+        } else {
+          lastAdler = currentAdler;
+        }
+      
+      fprintf(stdout, "0x%X\n", currentAdler);
+      
+      [pool drain];
+    }
+  }
+  
+  [frameDecoder close];
+  
+	return;
+}
+
+// Decode every frame in a movie and compare the adler32 of each decoded
+// framebuffer to the adler stored in the frame table. The frames are split into
+// segments that each begin on a keyframe so that each segment can be decoded
+// by its own decoder on a worker thread. Nop frames are not checked since the
+// framebuffer does not change. Returns the number of frames that do not match,
+// or -1 when the file can't be verified because the header is invalid or the
+// file must be upgraded first.
+
+int verifyMvidFrameAdler(NSString *mvidFilename, int numThreads)
+{
   BOOL worked;
-  worked = [frameDecoderOriginal openForReading:inOriginalMvidPath];
   
-  if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", inOriginalMvidPathCstr);
-    exit(1);
+  // Read the header before opening the decoder, the decoder asserts on an
+  // invalid header and on a version 0 or 1 file that has not been upgraded.
+  
+  MVFileHeader fileHeader;
+  FILE *inFile = fopen([mvidFilename UTF8String], "rb");
+  size_t numRead = 0;
+  if (inFile != NULL) {
+    numRead = fread(&fileHeader, sizeof(MVFileHeader), 1, inFile);
+    fclose(inFile);
   }
   
-  worked = [frameDecoderCompressed openForReading:inModifiedMvidPath];
+  if ((numRead != 1) || (fileHeader.magic != MV_FILE_MAGIC) ||
+      !((fileHeader.bpp == 16) || (fileHeader.bpp == 24) || (fileHeader.bpp == 32))) {
+    fprintf(stdout, "%s : invalid mvid header\n", [[mvidFilename lastPathComponent] UTF8String]);
+    return -1;
+  }
+  
+  if (maxvid_file_version(&fileHeader) < MV_FILE_VERSION_TWO) {
+    fprintf(stdout, "%s : mvid file version %d needs -upgrade\n",
+            [[mvidFilename lastPathComponent] UTF8String], maxvid_file_version(&fileHeader));
+    return -1;
+  }
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  worked = [frameDecoder openForReading:mvidFilename];
   
   if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", inModifiedMvidPathCstr);
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidFilename UTF8String]);
     exit(1);
   }
   
-  worked = [frameDecoderOriginal allocateDecodeResources];
-  assert(worked);
-
-  worked = [frameDecoderCompressed allocateDecodeResources];
-  assert(worked);
-  
-  NSUInteger numFrames = [frameDecoderOriginal numFrames];
+  const int numFrames = (int) [frameDecoder numFrames];
   assert(numFrames > 0);
   
-  NSUInteger compressedNumFrames = [frameDecoderCompressed numFrames];
-  if (numFrames != compressedNumFrames) {
-    fprintf(stderr, "rdelta failed: original mvid contains %d frames while compressed mvid contains %d frames\n", (int)numFrames, (int)compressedNumFrames);
-    exit(1);    
+  const int isV3 = (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_THREE);
+  
+  // Copy the expected adler for each frame and find the keyframes. A nop frame
+  // is recorded with a zero adler so that it is skipped.
+  
+  uint32_t *expectedAdlers = malloc(numFrames * sizeof(uint32_t));
+  uint32_t *decodedAdlers = calloc(numFrames, sizeof(uint32_t));
+  assert(expectedAdlers && decodedAdlers);
+  
+  NSMutableArray *segmentStarts = [NSMutableArray array];
+  const int framesPerSegment = MAX(2, (numFrames + numThreads - 1) / numThreads);
+  int lastSegmentStart = -framesPerSegment;
+  
+  for (int frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    BOOL isNop;
+    BOOL isKeyframe;
+    
+    if (isV3) {
+      MVV3Frame *frame = maxvid_v3_file_frame(frameDecoder.mvFrames, frameIndex);
+      isNop = maxvid_v3_frame_isnopframe(frame);
+      isKeyframe = maxvid_v3_frame_iskeyframe(frame);
+      expectedAdlers[frameIndex] = isNop ? 0 : frame->adler;
+    } else {
+      MVFrame *frame = maxvid_file_frame(frameDecoder.mvFrames, frameIndex);
+      isNop = maxvid_frame_isnopframe(frame);
+      isKeyframe = maxvid_frame_iskeyframe(frame);
+      expectedAdlers[frameIndex] = isNop ? 0 : frame->adler;
+    }
+    
+    if ((frameIndex == 0) ||
+        (!isNop && isKeyframe && ((frameIndex - lastSegmentStart) >= framesPerSegment))) {
+      [segmentStarts addObject:@(frameIndex)];
+      lastSegmentStart = frameIndex;
+    }
   }
   
-  float frameDuration = [frameDecoderOriginal frameDuration];
-  float compressedFrameDuration = [frameDecoderCompressed frameDuration];
+  [frameDecoder close];
   
-  if (frameDuration != compressedFrameDuration) {
-    fprintf(stderr, "rdelta failed: original mvid framerate %.4f while compressed framerate is %.4f\n", frameDuration, compressedFrameDuration);
-    exit(1);
+  const int numSegments = (int) [segmentStarts count];
+  
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  
+  CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+  
+  for (int segment = 0; segment < numSegments; segment++) {
+    const int segmentStart = [[segmentStarts objectAtIndex:segment] intValue];
+    const int segmentEnd = (segment == (numSegments - 1)) ? numFrames : [[segmentStarts objectAtIndex:segment+1] intValue];
+    
+    [mvidFilename retain];
+    
+    dispatch_group_async(group, queue, ^{
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      AVMvidFrameDecoder *segmentDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+      
+      // A mismatch is reported below from the decoded adler, so the decoder
+      // must not assert on it.
+      
+      segmentDecoder.reportAdlerMismatches = TRUE;
+      
+      BOOL worked = [segmentDecoder openForReading:mvidFilename];
+      assert(worked);
+      worked = [segmentDecoder allocateDecodeResources];
+      assert(worked);
+      
+      for (int frameIndex = segmentStart; frameIndex < segmentEnd; frameIndex++) {
+        NSAutoreleasePool *innerPool = [[NSAutoreleasePool alloc] init];
+        
+        // Advancing to the first frame of a segment decodes from that keyframe
+        
+        AVFrame *frame = [segmentDecoder advanceToFrame:frameIndex];
+        assert(frame);
+        
+        if (expectedAdlers[frameIndex] != 0) {
+          CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+          decodedAdlers[frameIndex] = maxvid_adler32(0, (unsigned char*)cgFrameBuffer.pixels, (uint32_t)cgFrameBuffer.numBytes);
+        }
+        
+        [innerPool drain];
+      }
+      
+      [segmentDecoder close];
+      [mvidFilename release];
+      
+      [pool drain];
+    });
   }
   
-  int bpp = [frameDecoderOriginal header]->bpp;
-  int compressedBpp = [frameDecoderCompressed header]->bpp;
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  dispatch_release(group);
   
-  if (bpp != compressedBpp) {
-    fprintf(stderr, "rdelta failed: original mvid bpp %d while compressed bpp is %d\n", bpp, compressedBpp);
-    exit(1);
+  CFAbsoluteTime elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+  
+  int numVerified = 0;
+  int numMismatched = 0;
+  int numNoAdler = 0;
+  
+  for (int frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    uint32_t expectedAdler = expectedAdlers[frameIndex];
+    
+    if (expectedAdler == 0) {
+      numNoAdler++;
+    } else if (expectedAdler == decodedAdlers[frameIndex]) {
+      numVerified++;
+    } else {
+      fprintf(stdout, "frame %d : adler mismatch, expected 0x%X but decoded 0x%X\n",
+              frameIndex+1, expectedAdler, decodedAdlers[frameIndex]);
+      numMismatched++;
+    }
   }
   
-  int width = (int) [frameDecoderOriginal width];
-  int height = (int) [frameDecoderOriginal height];
+  free(expectedAdlers);
+  free(decodedAdlers);
   
-  int compressedWidth = (int) [frameDecoderCompressed width];
-  int compressedHeight = (int) [frameDecoderCompressed height];
+  fprintf(stdout, "%s : %d frames verified, %d mismatched, %d nop or without adler (%d segments, %.2f FPS)\n",
+          [[mvidFilename lastPathComponent] UTF8String],
+          numVerified, numMismatched, numNoAdler, numSegments,
+          (elapsedTime > 0.0) ? (numFrames / elapsedTime) : 0.0);
   
-  if ((compressedWidth != width) || (compressedHeight != height)) {
-    fprintf(stderr, "rdelta failed: original mvid width x height %d x %d while compressed mvid width x height %d x %d\n", width, height, compressedWidth, compressedHeight);
+  return numMismatched;
+}
+
+// This method will iterate over each frame, then each row and print the
+// pixel values as hex and decoded RGB values. This is useful when debugging
+// RGB conversion logic.
+
+void printMvidPixels(NSString *mvidPath)
+{
+	BOOL worked;
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  worked = [frameDecoder openForReading:mvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidPath UTF8String]);
     exit(1);
   }
   
-  // Writer that will write the RGB values. Note that invoking process_frame_file()
-  // will define the output width/height based on the size of the image passed in.
-  
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+  // Each pixel generates a line of output, so use a large stdout buffer
+  // to avoid a write() for every line.
   
-  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
   
-  CGFrameBuffer *outFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
-  CGFrameBuffer *redFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:32 width:width height:height];
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
   
-  uint32_t numPixelsModified = 0;
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
   
   for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
     
-    AVFrame *originalFrame = [frameDecoderOriginal advanceToFrame:frameIndex];
-    assert(originalFrame);
-
-    AVFrame *compressedFrame = [frameDecoderCompressed advanceToFrame:frameIndex];
-    assert(compressedFrame);
+    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+    assert(frame);
     
     // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-    originalFrame.image = nil;
-    compressedFrame.image = nil;
-    
-    CGFrameBuffer *originalCgFrameBuffer = originalFrame.cgFrameBuffer;
-    assert(originalCgFrameBuffer);
-
-    CGFrameBuffer *compressedCgFrameBuffer = compressedFrame.cgFrameBuffer;
-    assert(originalCgFrameBuffer);
+    frame.image = nil;
     
-    // sRGB support
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
     
     if (frameIndex == 0) {
-      outFrameBuffer.colorspace = compressedCgFrameBuffer.colorspace;
+      fprintf(stdout, "File %s, %dBPP, %d FRAMES\n", [[mvidPath lastPathComponent] UTF8String], (int)cgFrameBuffer.bitsPerPixel, (int)numFrames);
+    }
+    
+    if (frame.isDuplicate) {
+      fprintf(stdout, "FRAME %d (duplicate)\n", (int)frameIndex+1);
+    } else {
+      fprintf(stdout, "FRAME %d\n", (int)frameIndex+1);
+      
+      // Iterate over the pixel contents of the framebuffer
+      
+      int numPixels = (int) (cgFrameBuffer.width * cgFrameBuffer.height);
+      
+      uint16_t *pixel16Ptr = (uint16_t*)cgFrameBuffer.pixels;
+      uint32_t *pixel32Ptr = (uint32_t*)cgFrameBuffer.pixels;
+      
+      int row = 0;
+      int column = 0;
+      for (int pixeli = 0; pixeli < numPixels; pixeli++) {
+        
+        if ((pixeli % cgFrameBuffer.width) == 0) {
+          // At the first pixel in a new row
+          column = 0;
+          
+          fprintf(stdout, "ROW %d\n", row);
+          row += 1;
+        }
+        
+        fprintf(stdout, "COLUMN %d: ", column);
+        column += 1;
+        
+        if (cgFrameBuffer.bitsPerPixel == 16) {
+          uint16_t pixel = *pixel16Ptr++;
+          
+#define CG_MAX_5_BITS 0x1F
+          
+          uint8_t red = (pixel >> 10) & CG_MAX_5_BITS;
+          uint8_t green = (pixel >> 5) & CG_MAX_5_BITS;
+          uint8_t blue = pixel & CG_MAX_5_BITS;
+          
+          fprintf(stdout, "HEX 0x%0.4X, RGB = (%d, %d, %d)\n", pixel, red, green, blue);
+        } else if (cgFrameBuffer.bitsPerPixel == 24) {
+          uint32_t pixel = *pixel32Ptr++;
+          
+          uint8_t red = (pixel >> 16) & 0xFF;
+          uint8_t green = (pixel >> 8) & 0xFF;
+          uint8_t blue = pixel & 0xFF;
+          
+          fprintf(stdout, "HEX 0x%0.6X, RGB = (%d, %d, %d)\n", pixel, red, green, blue);
+        } else {
+          uint32_t pixel = *pixel32Ptr++;
+          
+          uint8_t alpha = (pixel >> 24) & 0xFF;
+          uint8_t red = (pixel >> 16) & 0xFF;
+          uint8_t green = (pixel >> 8) & 0xFF;
+          uint8_t blue = pixel & 0xFF;
+          
+          fprintf(stdout, "HEX 0x%0.8X, RGBA = (%d, %d, %d, %d)\n", pixel, red, green, blue, alpha);
+        }
+      }
+    }
+    
+    fflush(stdout);
+    
+    [pool drain];
+  }
+  
+  [frameDecoder close];
+}
+
+// Print a summary of the pixel values used in a movie instead of every
+// pixel. Each unique frame is counted with one bulk histogram call, then
+// the most frequently used pixels and a histogram of the counts are printed.
+
+void printMvidPixelSummary(NSString *mvidPath)
+{
+	BOOL worked;
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  worked = [frameDecoder openForReading:mvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", [mvidPath UTF8String]);
+    exit(1);
+  }
+  
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+  
+  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
+  
+  int bpp = 0;
+  int numUniqueFrames = 0;
+  
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+    assert(frame);
+    
+    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
+    frame.image = nil;
+    
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
+    
+    if (frameIndex == 0) {
+      bpp = (int)cgFrameBuffer.bitsPerPixel;
+      mvidFileMetaData.bpp = bpp;
+    }
+    
+    if (frame.isDuplicate == FALSE) {
+      NSUInteger numPixels = cgFrameBuffer.width * cgFrameBuffer.height;
+      
+      if (bpp == 16) {
+        [mvidFileMetaData foundPixels16:(const uint16_t*)cgFrameBuffer.pixels numPixels:numPixels];
+      } else {
+        [mvidFileMetaData foundPixels32:(const uint32_t*)cgFrameBuffer.pixels numPixels:numPixels];
+      }
+      
+      numUniqueFrames++;
+    }
+    
+    [pool drain];
+  }
+  
+  [frameDecoder close];
+  
+  NSData *sortedPixelCounts = [mvidFileMetaData sortedPixelCounts];
+  const MvidPixelCount *entries = (const MvidPixelCount *) [sortedPixelCounts bytes];
+  NSUInteger numEntries = [sortedPixelCounts length] / sizeof(MvidPixelCount);
+  uint64_t numPixels = mvidFileMetaData.numPixelsRecorded;
+  
+  fprintf(stdout, "File %s, %dBPP, %d FRAMES (%d unique)\n", [[mvidPath lastPathComponent] UTF8String], bpp, (int)numFrames, numUniqueFrames);
+  fprintf(stdout, "%llu PIXELS, %d UNIQUE PIXEL VALUES\n", numPixels, (int)numEntries);
+  
+  // Most frequently used pixel values
+  
+  const int maxTopPixels = 20;
+  
+  fprintf(stdout, "TOP PIXELS\n");
+  
+  for (NSUInteger i = 0; i < MIN(numEntries, maxTopPixels); i++) {
+    double percent = (numPixels == 0) ? 0.0 : (entries[i].count * 100.0 / numPixels);
+    
+    if (bpp == 16) {
+      fprintf(stdout, "HEX 0x%0.4X, COUNT %llu, %.2f%%\n", entries[i].pixel, entries[i].count, percent);
+    } else if (bpp == 24) {
+      fprintf(stdout, "HEX 0x%0.6X, COUNT %llu, %.2f%%\n", entries[i].pixel, entries[i].count, percent);
+    } else {
+      fprintf(stdout, "HEX 0x%0.8X, COUNT %llu, %.2f%%\n", entries[i].pixel, entries[i].count, percent);
+    }
+  }
+  
+  // Histogram of pixel counts in power of 10 buckets, this shows how many
+  // pixel values are rare as compared to how many are used all over.
+  
+  const int numBuckets = 20;
+  int buckets[numBuckets];
+  memset(buckets, 0, sizeof(buckets));
+  
+  for (NSUInteger i = 0; i < numEntries; i++) {
+    uint64_t count = entries[i].count;
+    int bucket = 0;
+    while (count >= 10 && bucket < (numBuckets - 1)) {
+      count /= 10;
+      bucket++;
+    }
+    buckets[bucket]++;
+  }
+  
+  fprintf(stdout, "COUNT HISTOGRAM\n");
+  
+  uint64_t bucketMin = 1;
+  
+  for (int bucket = 0; bucket < numBuckets; bucket++) {
+    if (buckets[bucket] > 0) {
+      fprintf(stdout, "COUNT >= %llu : %d pixel values\n", bucketMin, buckets[bucket]);
+    }
+    bucketMin *= 10;
+  }
+  
+  fflush(stdout);
+}
+
+// This method will "map" certain alpha values to a new value based on the input
+// specification. This operation is not so easy to implement with 3rd party
+// software though it is conceptually simple. This method would typically be used
+// to "clamp" alpha values near the opaque value to the actual opaque value.
+// For example, if a green screen video was processed in a non-optimal way, pixels
+// that really should have an alpha value of 255 (opaque) might have the values
+// 254, 253, or even 252. This method makes it easy to map these values below
+// the opaque value to the opaque value by passing "252,253,254=255" as
+// the map spec.
+
+void alphaMapMvid(NSString *inMvidPath,
+                  NSString *outMvidPath,
+                  NSString *mapSpecStr)
+{
+  BOOL isMvid;
+  
+  isMvid = [inMvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  
+  isMvid = [outMvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  
+  // Check the "MAPSPEC". The format is like so:
+  //
+  // 252=255
+  //
+  // NUM=VALUE
+  //
+  // 1 to N
+  //
+  // Could include multiple mappings
+  //
+  // 1=0,2=0,253=255,254=255
+  
+  // The MAPSPEC is compiled into a 256 entry alpha lookup table. An alpha value
+  // that does not appear in the spec maps to itself.
+  
+  uint8_t alphaMap[256];
+  BOOL alphaIsMapped[256];
+  
+  for (int i = 0; i < 256; i++) {
+    alphaMap[i] = i;
+    alphaIsMapped[i] = FALSE;
+  }
+  
+  int numMappings = 0;
+  
+  NSArray *elements = [mapSpecStr componentsSeparatedByString:@","];
+  
+  for (NSString *element in elements) {
+    NSArray *singleSpecElements = [element componentsSeparatedByString:@"="];
+    int count = (int)[singleSpecElements count];
+    if (count != 2) {
+      fprintf(stderr, "MAPSPEC must contain 1 to N integer elements of the form IN=OUT, got \"%s\"\n", [element UTF8String]);
+      exit(1);
+    }
+    // Store the input mapping number and the output number it maps to
+    NSString *inNumStr = [singleSpecElements objectAtIndex:0];
+    NSString *outNumStr = [singleSpecElements objectAtIndex:1];
+    
+    NSInteger inInt;
+    NSInteger outInt;
+    
+    if ([inNumStr isEqualToString:@"0"]) {
+      inInt = 0;
+    } else {
+      inInt = [inNumStr integerValue];
+      if (inInt == 0) {
+        inInt = -1;
+      }
+    }
+    
+    if ([outNumStr isEqualToString:@"0"]) {
+      outInt = 0;
+    } else {
+      outInt = [outNumStr integerValue];
+      if (outInt == 0) {
+        outInt = -1;
+      }
+    }
+    
+    if (outInt < 0 || inInt < 0) {
+      fprintf(stderr, "MAPSPEC must contain 1 to N integer elements of the form IN=OUT, got \"%s\"\n", [element UTF8String]);
+      exit(1);
+    }
+
+    if (outInt > 255 || inInt > 255) {
+      fprintf(stderr, "MAPSPEC IN=OUT values must be in range 0->255, got \"%s\"\n", [element UTF8String]);
+      exit(1);
+    }
+    
+    if (alphaIsMapped[inInt] == FALSE) {
+      numMappings++;
+    }
+    
+    alphaMap[inInt] = (uint8_t) outInt;
+    alphaIsMapped[inInt] = TRUE;
+  }
+
+  if (numMappings == 0) {
+    fprintf(stderr, "No MAPSPEC elements parsed\n");
+    exit(1);
+  }
+  
+  // An identity mapping like 255=255 never changes a pixel
+  
+  for (int i = 0; i < 256; i++) {
+    if (alphaMap[i] == i) {
+      alphaIsMapped[i] = FALSE;
+    }
+  }
+  
+  fprintf(stdout, "processing input file, will apply %d alpha channel mapping(s)\n", numMappings);
+  
+  // Pixels are stored premultiplied, so changing the alpha of a pixel means that
+  // each color component must be unpremultiplied with the original alpha and then
+  // premultiplied by the new alpha. Since each mapped alpha value has exactly one
+  // output alpha, this is a table of 256 component values per mapped input alpha.
+  
+  premultiply_init();
+  
+  uint8_t *componentTables = malloc(256 * 256);
+  assert(componentTables);
+  
+  for (int alpha = 0; alpha < 256; alpha++) {
+    if (alphaIsMapped[alpha] == FALSE) {
+      continue;
+    }
+    uint8_t *componentTable = &componentTables[alpha * 256];
+    for (int component = 0; component < 256; component++) {
+      if (component > alpha) {
+        // Not a valid premultiplied value, clamp to the alpha value
+        componentTable[component] = componentTable[alpha];
+        continue;
+      }
+      uint32_t unpremult = unpremultiply_bgra((alpha << 24) | component);
+      uint32_t premult = premultiply_bgra_inline(0, 0, unpremult & 0xFF, alphaMap[alpha]);
+      componentTable[component] = premult & 0xFF;
+    }
+  }
+  
+  // Read in existing file into from the input file and create an output file
+  // that has exactly the same options.
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  BOOL worked = [frameDecoder openForReading:inMvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", [inMvidPath UTF8String]);
+    exit(1);
+  }
+  
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+  
+  float frameDuration = [frameDecoder frameDuration];
+  
+  int bpp = [frameDecoder header]->bpp;
+  
+  if (bpp != 32) {
+    fprintf(stderr, "-alphamap can only be used on a 32BPP mvid file since an alpha channel is required\n");
+    exit(1);
+  }
+  
+  int width = (int)[frameDecoder width];
+  int height = (int)[frameDecoder height];
+  
+  // Frames are remapped directly from the decoded framebuffer into an output
+  // framebuffer and then written, there is no CoreGraphics render step since
+  // the input pixels are already in the output format.
+  
+  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  fileWriter.movieSize = CGSizeMake(width, height);
+  
+  CGFrameBuffer *mappedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
+  CGFrameBuffer *prevMappedFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
+  
+  [prevFrameBuffer release];
+  prevFrameBuffer = nil;
+  
+  uint64_t numPixelsModified = 0;
+  int numNopFrames = 0;
+  
+  NSDate *startDate = [NSDate date];
+  
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+    assert(frame);
+    
+    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
+    frame.image = nil;
+    
+    if (frameIndex > 0 && frame.isDuplicate) {
+      // The remap is a per pixel function, so an unchanged input frame is also
+      // an unchanged output frame.
+      
+      [fileWriter writeNopFrame];
+      numNopFrames++;
+      [pool drain];
+      continue;
+    }
+    
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
+    
+    if (frameIndex == 0) {
+      mappedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+      prevMappedFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+    }
+    
+    // Only the rows that changed in the input need to be remapped, the
+    // other rows are the same as the previous output frame.
+    
+    int firstRow = 0;
+    int lastRow = height;
+    
+    CGRect dirtyRect = frame.dirtyRect;
+    
+    if (frameIndex > 0 && !CGRectIsNull(dirtyRect)) {
+      firstRow = (int) CGRectGetMinY(dirtyRect);
+      lastRow = (int) CGRectGetMaxY(dirtyRect);
+    }
+    
+    const uint32_t *inPixels = (const uint32_t*)cgFrameBuffer.pixels;
+    uint32_t *outPixels = (uint32_t*)mappedFrameBuffer.pixels;
+    const uint32_t *prevOutPixels = (const uint32_t*)prevMappedFrameBuffer.pixels;
+    
+    if (firstRow > 0) {
+      memcpy(outPixels, prevOutPixels, firstRow * width * sizeof(uint32_t));
+    }
+    if (lastRow < height) {
+      memcpy(&outPixels[lastRow * width], &prevOutPixels[lastRow * width], (height - lastRow) * width * sizeof(uint32_t));
+    }
+    
+    const int numPixels = (lastRow - firstRow) * width;
+    const uint32_t *inPtr = &inPixels[firstRow * width];
+    uint32_t *outPtr = &outPixels[firstRow * width];
+    
+    for (int pixeli = 0; pixeli < numPixels; pixeli++) {
+      uint32_t pixel = inPtr[pixeli];
+      uint32_t alpha = pixel >> 24;
+      
+      if (alphaIsMapped[alpha]) {
+        const uint8_t *componentTable = &componentTables[alpha * 256];
+        
+        uint32_t red = componentTable[(pixel >> 16) & 0xFF];
+        uint32_t green = componentTable[(pixel >> 8) & 0xFF];
+        uint32_t blue = componentTable[pixel & 0xFF];
+        
+        pixel = ((uint32_t)alphaMap[alpha] << 24) | (red << 16) | (green << 8) | blue;
+        numPixelsModified += 1;
+      }
+      
+      outPtr[pixeli] = pixel;
+    }
+    
+    // Write as keyframe or delta against the previous output frame, an input delta
+    // that maps to the same output pixels becomes a nop frame.
+    
+    BOOL isKeyframe = (frameIndex == 0);
+    
+    if (!isKeyframe) {
+      prevFrameBuffer = [prevMappedFrameBuffer retain];
+    }
+    
+    process_frame_file_write_nodeltas(isKeyframe, mappedFrameBuffer, fileWriter);
+    
+    [prevFrameBuffer release];
+    prevFrameBuffer = nil;
+    
+    CGFrameBuffer *tmp = prevMappedFrameBuffer;
+    prevMappedFrameBuffer = mappedFrameBuffer;
+    mappedFrameBuffer = tmp;
+    
+    [pool drain];
+  }
+  
+  NSTimeInterval elapsed = [[NSDate date] timeIntervalSinceDate:startDate];
+  
+  free(componentTables);
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
+  [fileWriter close];
+
+  fprintf(stdout, "Mapped %llu pixels to new values\n", numPixelsModified);
+  if (numNopFrames > 0) {
+    fprintf(stdout, "Kept %d unchanged frames as nop frames\n", numNopFrames);
+  }
+  if (elapsed > 0.0) {
+    fprintf(stdout, "Processed %d frames in %.3f sec (%.1f frames/sec)\n", (int)numFrames, elapsed, numFrames / elapsed);
+  }
+  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
+  return;
+}
+
+// Execute rdelta, this is basically a diff of an original (uncompressed) as compared
+// to a compressed representation. The compressed implementation uses much less space
+// than the original, but how much compression is too much? This logic attempts to
+// visually show which pixels have been changed by the compression. The pixels written
+// to the output mvid are the same ones in the inModifiedMvidPath argument, except that
+// diffs as compared to inOriginalMvidPath will be displayed with a 50% red overlay.
+
+void rdeltaMvidMovie(char *inOriginalMvidPathCstr,
+                     char *inModifiedMvidPathCstr,
+                     char *outMvidPathCstr)
+{
+  BOOL isMvid;
+  
+  NSString *inOriginalMvidPath = [NSString stringWithUTF8String:inOriginalMvidPathCstr];
+  NSString *inModifiedMvidPath = [NSString stringWithUTF8String:inModifiedMvidPathCstr];
+  NSString *outMvidPath = [NSString stringWithUTF8String:outMvidPathCstr];
+  
+  isMvid = [inOriginalMvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  
+  isMvid = [inModifiedMvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  isMvid = [outMvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+    
+  // Read in existing original and compressed files
+  
+  AVMvidFrameDecoder *frameDecoderOriginal = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  AVMvidFrameDecoder *frameDecoderCompressed = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  BOOL worked;
+  worked = [frameDecoderOriginal openForReading:inOriginalMvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", inOriginalMvidPathCstr);
+    exit(1);
+  }
+  
+  worked = [frameDecoderCompressed openForReading:inModifiedMvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open input mvid filename \"%s\"\n", inModifiedMvidPathCstr);
+    exit(1);
+  }
+  
+  worked = [frameDecoderOriginal allocateDecodeResources];
+  assert(worked);
+
+  worked = [frameDecoderCompressed allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoderOriginal numFrames];
+  assert(numFrames > 0);
+  
+  NSUInteger compressedNumFrames = [frameDecoderCompressed numFrames];
+  if (numFrames != compressedNumFrames) {
+    fprintf(stderr, "rdelta failed: original mvid contains %d frames while compressed mvid contains %d frames\n", (int)numFrames, (int)compressedNumFrames);
+    exit(1);    
+  }
+  
+  float frameDuration = [frameDecoderOriginal frameDuration];
+  float compressedFrameDuration = [frameDecoderCompressed frameDuration];
+  
+  if (frameDuration != compressedFrameDuration) {
+    fprintf(stderr, "rdelta failed: original mvid framerate %.4f while compressed framerate is %.4f\n", frameDuration, compressedFrameDuration);
+    exit(1);
+  }
+  
+  int bpp = [frameDecoderOriginal header]->bpp;
+  int compressedBpp = [frameDecoderCompressed header]->bpp;
+  
+  if (bpp != compressedBpp) {
+    fprintf(stderr, "rdelta failed: original mvid bpp %d while compressed bpp is %d\n", bpp, compressedBpp);
+    exit(1);
+  }
+  
+  int width = (int) [frameDecoderOriginal width];
+  int height = (int) [frameDecoderOriginal height];
+  
+  int compressedWidth = (int) [frameDecoderCompressed width];
+  int compressedHeight = (int) [frameDecoderCompressed height];
+  
+  if ((compressedWidth != width) || (compressedHeight != height)) {
+    fprintf(stderr, "rdelta failed: original mvid width x height %d x %d while compressed mvid width x height %d x %d\n", width, height, compressedWidth, compressedHeight);
+    exit(1);
+  }
+  
+  // Writer that will write the RGB values. Note that invoking process_frame_file()
+  // will define the output width/height based on the size of the image passed in.
+  
+  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
+  mvidFileMetaData.bpp = bpp;
+  mvidFileMetaData.checkAlphaChannel = FALSE;
+  
+  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  
+  CGFrameBuffer *outFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
+  CGFrameBuffer *redFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:32 width:width height:height];
+  
+  uint32_t numPixelsModified = 0;
+  
+  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    AVFrame *originalFrame = [frameDecoderOriginal advanceToFrame:frameIndex];
+    assert(originalFrame);
+
+    AVFrame *compressedFrame = [frameDecoderCompressed advanceToFrame:frameIndex];
+    assert(compressedFrame);
+    
+    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
+    originalFrame.image = nil;
+    compressedFrame.image = nil;
+    
+    CGFrameBuffer *originalCgFrameBuffer = originalFrame.cgFrameBuffer;
+    assert(originalCgFrameBuffer);
+
+    CGFrameBuffer *compressedCgFrameBuffer = compressedFrame.cgFrameBuffer;
+    assert(originalCgFrameBuffer);
+    
+    // sRGB support
+    
+    if (frameIndex == 0) {
+      outFrameBuffer.colorspace = compressedCgFrameBuffer.colorspace;
       redFrameBuffer.colorspace = compressedCgFrameBuffer.colorspace;
     }
     
@@ -5076,97 +6994,794 @@ void rdeltaMvidMovie(char *inOriginalMvidPathCstr,
     worked = (frameImage != nil);
     assert(worked);
     
-    [outFrameBuffer clear];
-    worked = [outFrameBuffer renderCGImage:frameImage];
-    assert(worked);
+    [outFrameBuffer clear];
+    worked = [outFrameBuffer renderCGImage:frameImage];
+    assert(worked);
+    
+    if (frameImage) {
+      CGImageRelease(frameImage);
+    }
+    
+    // Now iterate over the original and diff pixels and write any diffs to the redFrameBuffer
+    
+    [redFrameBuffer clear];
+    
+    int numPixels = width * height;
+    
+    // FIXME: impl for 16 bpp
+    assert(originalCgFrameBuffer.bitsPerPixel != 16);
+    
+    uint32_t *originalCgFrameBuffer32Ptr = (uint32_t*)originalCgFrameBuffer.pixels;
+    uint32_t *compressedCgFrameBuffer32Ptr = (uint32_t*)compressedCgFrameBuffer.pixels;
+    uint32_t *redCgFrameBuffer32Ptr = (uint32_t*)redFrameBuffer.pixels;
+    
+    for (int pixeli = 0; pixeli < numPixels; pixeli++) {
+      uint32_t originalPixel = originalCgFrameBuffer32Ptr[pixeli];
+      uint32_t compressedPixel = compressedCgFrameBuffer32Ptr[pixeli];
+      
+      /*
+      uint32_t original_alpha = (originalPixel >> 24) & 0xFF;
+      uint32_t original_red = (originalPixel >> 16) & 0xFF;
+      uint32_t original_green = (originalPixel >> 8) & 0xFF;
+      uint32_t original_blue = originalPixel & 0xFF;
+      
+      uint32_t compressed_alpha = (compressedPixel >> 24) & 0xFF;
+      uint32_t compressed_red = (compressedPixel >> 16) & 0xFF;
+      uint32_t compressed_green = (compressedPixel >> 8) & 0xFF;
+      uint32_t compressed_blue = compressedPixel & 0xFF;
+       */
+      
+      if (originalPixel != compressedPixel) {
+        uint32_t redPixel = rgba_to_bgra(0xFF/2, 0, 0, 0xFF/2);
+        redCgFrameBuffer32Ptr[pixeli] = redPixel;
+        numPixelsModified++;
+      }
+    }
+    
+    // Render red pixels over compressed pixels in outFrameBuffer (matte)
+    
+    frameImage = [redFrameBuffer createCGImageRef];
+    worked = (frameImage != nil);
+    assert(worked);
+    
+    worked = [outFrameBuffer renderCGImage:frameImage];
+    assert(worked);
+    
+    if (frameImage) {
+      CGImageRelease(frameImage);
+    }
+    
+    // Now create a UIImage so that the result of this operation can be encoded into the output mvid
+    
+    frameImage = [outFrameBuffer createCGImageRef];
+    worked = (frameImage != nil);
+    assert(worked);
+    
+    BOOL isKeyframe = FALSE;
+    if (frameIndex == 0) {
+      isKeyframe = TRUE;
+    }
+    
+    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
     
     if (frameImage) {
       CGImageRelease(frameImage);
     }
     
-    // Now iterate over the original and diff pixels and write any diffs to the redFrameBuffer
+    [pool drain];
+  }
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
+  [fileWriter close];
+  
+  fprintf(stdout, "Found %d modified pixels\n", numPixelsModified);
+  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
+  return;
+}
+
+// Streaming PNG writer and reader. A flat PNG for a long movie can be far too large to
+// hold in memory as a single image, so rows are deflated into IDAT chunks as they are
+// produced and inflated from IDAT chunks as they are needed. Only 8 bit RGB and RGBA
+// non-interlaced images are supported, the reader returns FALSE from open for any
+// other kind of PNG so that the caller can fall back to ImageIO.
+
+#define PNG_STREAM_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+  FILE *file;
+  z_stream zstream;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bytesPerPixel;
+  uint32_t numRowsWritten;
+  uint8_t *filteredRow;
+  uint8_t *outBuffer;
+  BOOL failed;
+} PNGRowWriter;
+
+typedef struct {
+  FILE *file;
+  z_stream zstream;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bytesPerPixel;
+  uint32_t idatBytesLeft;
+  BOOL isLastIDAT;
+  uint8_t *prevRow;
+  uint8_t *currentRow;
+  uint8_t *inBuffer;
+} PNGRowReader;
+
+static inline
+void png_store_be32(uint8_t *ptr, uint32_t value)
+{
+  ptr[0] = (value >> 24) & 0xFF;
+  ptr[1] = (value >> 16) & 0xFF;
+  ptr[2] = (value >> 8) & 0xFF;
+  ptr[3] = value & 0xFF;
+}
+
+static inline
+uint32_t png_load_be32(const uint8_t *ptr)
+{
+  return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3];
+}
+
+static
+void png_write_chunk(PNGRowWriter *writer, const char *type, const uint8_t *data, uint32_t length)
+{
+  uint8_t header[8];
+  png_store_be32(header, length);
+  memcpy(&header[4], type, 4);
+  
+  uLong crc = crc32(0L, (const Bytef*)type, 4);
+  if (length > 0) {
+    crc = crc32(crc, data, length);
+  }
+  
+  uint8_t crcBytes[4];
+  png_store_be32(crcBytes, (uint32_t)crc);
+  
+  if ((fwrite(header, sizeof(header), 1, writer->file) != 1) ||
+      ((length > 0) && (fwrite(data, length, 1, writer->file) != 1)) ||
+      (fwrite(crcBytes, sizeof(crcBytes), 1, writer->file) != 1)) {
+    writer->failed = TRUE;
+  }
+}
+
+// Run deflate on any pending input and emit an IDAT chunk each time the output buffer fills
+
+static
+void png_writer_deflate(PNGRowWriter *writer, int flush)
+{
+  int status;
+  
+  do {
+    status = deflate(&writer->zstream, flush);
+    assert(status != Z_STREAM_ERROR);
     
-    [redFrameBuffer clear];
+    uint32_t numBytes = PNG_STREAM_BUFFER_SIZE - writer->zstream.avail_out;
     
-    int numPixels = width * height;
+    if ((writer->zstream.avail_out == 0) || ((flush == Z_FINISH) && (numBytes > 0))) {
+      png_write_chunk(writer, "IDAT", writer->outBuffer, numBytes);
+      writer->zstream.next_out = writer->outBuffer;
+      writer->zstream.avail_out = PNG_STREAM_BUFFER_SIZE;
+    }
+  } while ((writer->zstream.avail_in > 0) || ((flush == Z_FINISH) && (status != Z_STREAM_END)));
+}
+
+static
+BOOL png_writer_open(PNGRowWriter *writer, const char *path, uint32_t width, uint32_t height, BOOL hasAlpha)
+{
+  memset(writer, 0, sizeof(PNGRowWriter));
+  
+  writer->file = fopen(path, "wb");
+  if (writer->file == NULL) {
+    return FALSE;
+  }
+  
+  writer->width = width;
+  writer->height = height;
+  writer->bytesPerPixel = hasAlpha ? 4 : 3;
+  
+  writer->filteredRow = malloc(1 + (width * writer->bytesPerPixel));
+  writer->outBuffer = malloc(PNG_STREAM_BUFFER_SIZE);
+  assert(writer->filteredRow && writer->outBuffer);
+  
+  int status = deflateInit(&writer->zstream, Z_DEFAULT_COMPRESSION);
+  assert(status == Z_OK);
+  writer->zstream.next_out = writer->outBuffer;
+  writer->zstream.avail_out = PNG_STREAM_BUFFER_SIZE;
+  
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+  if (fwrite(signature, sizeof(signature), 1, writer->file) != 1) {
+    writer->failed = TRUE;
+  }
+  
+  // IHDR : 8 bits per sample, RGB or RGBA, not interlaced
+  
+  uint8_t ihdr[13];
+  png_store_be32(&ihdr[0], width);
+  png_store_be32(&ihdr[4], height);
+  ihdr[8] = 8;
+  ihdr[9] = hasAlpha ? 6 : 2;
+  ihdr[10] = 0;
+  ihdr[11] = 0;
+  ihdr[12] = 0;
+  png_write_chunk(writer, "IHDR", ihdr, sizeof(ihdr));
+  
+  // Pixels in a .mvid are always sRGB, rendering intent is perceptual
+  
+  uint8_t srgb = 0;
+  png_write_chunk(writer, "sRGB", &srgb, 1);
+  
+  return (writer->failed == FALSE);
+}
+
+// Write one row of RGB or RGBA bytes, the row is stored with the PNG "Sub" filter
+
+static
+void png_writer_write_row(PNGRowWriter *writer, const uint8_t *row)
+{
+  assert(writer->numRowsWritten < writer->height);
+  
+  uint32_t bpp = writer->bytesPerPixel;
+  uint32_t rowNumBytes = writer->width * bpp;
+  uint8_t *filtered = writer->filteredRow;
+  
+  filtered[0] = 1;
+  for (uint32_t i = 0; i < bpp; i++) {
+    filtered[1 + i] = row[i];
+  }
+  for (uint32_t i = bpp; i < rowNumBytes; i++) {
+    filtered[1 + i] = row[i] - row[i - bpp];
+  }
+  
+  writer->zstream.next_in = filtered;
+  writer->zstream.avail_in = 1 + rowNumBytes;
+  png_writer_deflate(writer, Z_NO_FLUSH);
+  
+  writer->numRowsWritten++;
+}
+
+static
+BOOL png_writer_close(PNGRowWriter *writer)
+{
+  if (writer->numRowsWritten != writer->height) {
+    writer->failed = TRUE;
+  }
+  
+  writer->zstream.next_in = NULL;
+  writer->zstream.avail_in = 0;
+  png_writer_deflate(writer, Z_FINISH);
+  deflateEnd(&writer->zstream);
+  
+  png_write_chunk(writer, "IEND", NULL, 0);
+  
+  if (fclose(writer->file) != 0) {
+    writer->failed = TRUE;
+  }
+  writer->file = NULL;
+  
+  free(writer->filteredRow);
+  free(writer->outBuffer);
+  
+  return (writer->failed == FALSE);
+}
+
+static
+void png_reader_close(PNGRowReader *reader)
+{
+  if (reader->file) {
+    fclose(reader->file);
+    reader->file = NULL;
+  }
+  inflateEnd(&reader->zstream);
+  free(reader->prevRow);
+  free(reader->currentRow);
+  free(reader->inBuffer);
+  reader->prevRow = NULL;
+  reader->currentRow = NULL;
+  reader->inBuffer = NULL;
+}
+
+// Read chunk headers until an IDAT chunk is found, returns FALSE at any other critical chunk
+
+static
+BOOL png_reader_next_idat(PNGRowReader *reader)
+{
+  while (1) {
+    uint8_t header[8];
+    if (fread(header, sizeof(header), 1, reader->file) != 1) {
+      return FALSE;
+    }
+    uint32_t length = png_load_be32(header);
     
-    // FIXME: impl for 16 bpp
-    assert(originalCgFrameBuffer.bitsPerPixel != 16);
+    if (memcmp(&header[4], "IDAT", 4) == 0) {
+      reader->idatBytesLeft = length;
+      return TRUE;
+    } else if (memcmp(&header[4], "IEND", 4) == 0) {
+      return FALSE;
+    }
     
-    uint32_t *originalCgFrameBuffer32Ptr = (uint32_t*)originalCgFrameBuffer.pixels;
-    uint32_t *compressedCgFrameBuffer32Ptr = (uint32_t*)compressedCgFrameBuffer.pixels;
-    uint32_t *redCgFrameBuffer32Ptr = (uint32_t*)redFrameBuffer.pixels;
+    // Skip chunk data and CRC
+    
+    if (fseeko(reader->file, (off_t)length + 4, SEEK_CUR) != 0) {
+      return FALSE;
+    }
+  }
+}
+
+static
+BOOL png_reader_open(PNGRowReader *reader, const char *path)
+{
+  memset(reader, 0, sizeof(PNGRowReader));
+  
+  reader->file = fopen(path, "rb");
+  if (reader->file == NULL) {
+    return FALSE;
+  }
+  
+  if (inflateInit(&reader->zstream) != Z_OK) {
+    fclose(reader->file);
+    reader->file = NULL;
+    return FALSE;
+  }
+  
+  uint8_t signature[8];
+  static const uint8_t expectedSignature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+  
+  if ((fread(signature, sizeof(signature), 1, reader->file) != 1) ||
+      (memcmp(signature, expectedSignature, sizeof(signature)) != 0)) {
+    png_reader_close(reader);
+    return FALSE;
+  }
+  
+  // IHDR is always the first chunk
+  
+  uint8_t ihdr[8 + 13 + 4];
+  if ((fread(ihdr, sizeof(ihdr), 1, reader->file) != 1) ||
+      (png_load_be32(ihdr) != 13) || (memcmp(&ihdr[4], "IHDR", 4) != 0)) {
+    png_reader_close(reader);
+    return FALSE;
+  }
+  
+  reader->width = png_load_be32(&ihdr[8]);
+  reader->height = png_load_be32(&ihdr[12]);
+  uint8_t bitDepth = ihdr[16];
+  uint8_t colorType = ihdr[17];
+  uint8_t interlace = ihdr[20];
+  
+  if ((bitDepth != 8) || ((colorType != 2) && (colorType != 6)) || (interlace != 0)) {
+    png_reader_close(reader);
+    return FALSE;
+  }
+  
+  reader->bytesPerPixel = (colorType == 6) ? 4 : 3;
+  
+  // Chunks before the image data. An embedded color profile that is not sRGB means
+  // that ImageIO has to convert colors, so this reader does not handle it.
+  
+  while (1) {
+    uint8_t header[8];
+    if (fread(header, sizeof(header), 1, reader->file) != 1) {
+      png_reader_close(reader);
+      return FALSE;
+    }
+    uint32_t length = png_load_be32(header);
+    
+    if (memcmp(&header[4], "IDAT", 4) == 0) {
+      reader->idatBytesLeft = length;
+      break;
+    }
+    
+    if ((memcmp(&header[4], "iCCP", 4) == 0) || (memcmp(&header[4], "PLTE", 4) == 0)) {
+      char profileName[80];
+      memset(profileName, 0, sizeof(profileName));
+      size_t numBytes = MIN(length, sizeof(profileName) - 1);
+      
+      if ((memcmp(&header[4], "PLTE", 4) == 0) ||
+          (fread(profileName, numBytes, 1, reader->file) != 1) ||
+          (strcasestr(profileName, "sRGB") == NULL)) {
+        png_reader_close(reader);
+        return FALSE;
+      }
+      
+      if (fseeko(reader->file, (off_t)(length - numBytes) + 4, SEEK_CUR) != 0) {
+        png_reader_close(reader);
+        return FALSE;
+      }
+    } else if (fseeko(reader->file, (off_t)length + 4, SEEK_CUR) != 0) {
+      png_reader_close(reader);
+      return FALSE;
+    }
+  }
+  
+  uint32_t rowNumBytes = 1 + (reader->width * reader->bytesPerPixel);
+  reader->prevRow = calloc(1, rowNumBytes);
+  reader->currentRow = calloc(1, rowNumBytes);
+  reader->inBuffer = malloc(PNG_STREAM_BUFFER_SIZE);
+  assert(reader->prevRow && reader->currentRow && reader->inBuffer);
+  
+  return TRUE;
+}
+
+static inline
+uint8_t png_paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  } else if (pb <= pc) {
+    return b;
+  } else {
+    return c;
+  }
+}
+
+// Inflate and unfilter the next row, returns a pointer to the RGB or RGBA bytes
+// for the row or NULL on error. The pointer is valid until the next call.
+
+static
+uint8_t* png_reader_read_row(PNGRowReader *reader)
+{
+  uint32_t bpp = reader->bytesPerPixel;
+  uint32_t rowNumBytes = reader->width * bpp;
+  
+  reader->zstream.next_out = reader->currentRow;
+  reader->zstream.avail_out = 1 + rowNumBytes;
+  
+  while (reader->zstream.avail_out > 0) {
+    if (reader->zstream.avail_in == 0) {
+      if (reader->idatBytesLeft == 0) {
+        // Skip CRC of the finished chunk and find the next IDAT
+        
+        if ((fseeko(reader->file, 4, SEEK_CUR) != 0) || (png_reader_next_idat(reader) == FALSE)) {
+          return NULL;
+        }
+      }
+      
+      uint32_t numBytes = MIN(reader->idatBytesLeft, PNG_STREAM_BUFFER_SIZE);
+      if ((numBytes > 0) && (fread(reader->inBuffer, numBytes, 1, reader->file) != 1)) {
+        return NULL;
+      }
+      reader->idatBytesLeft -= numBytes;
+      reader->zstream.next_in = reader->inBuffer;
+      reader->zstream.avail_in = numBytes;
+    }
+    
+    int status = inflate(&reader->zstream, Z_NO_FLUSH);
+    
+    if (status == Z_STREAM_END) {
+      if (reader->zstream.avail_out > 0) {
+        return NULL;
+      }
+    } else if ((status != Z_OK) && (status != Z_BUF_ERROR)) {
+      return NULL;
+    }
+  }
+  
+  uint8_t filter = reader->currentRow[0];
+  uint8_t *row = &reader->currentRow[1];
+  uint8_t *prev = &reader->prevRow[1];
+  
+  switch (filter) {
+    case 0: {
+      break;
+    }
+    case 1: {
+      for (uint32_t i = bpp; i < rowNumBytes; i++) {
+        row[i] += row[i - bpp];
+      }
+      break;
+    }
+    case 2: {
+      for (uint32_t i = 0; i < rowNumBytes; i++) {
+        row[i] += prev[i];
+      }
+      break;
+    }
+    case 3: {
+      for (uint32_t i = 0; i < rowNumBytes; i++) {
+        int left = (i >= bpp) ? row[i - bpp] : 0;
+        row[i] += (uint8_t) ((left + prev[i]) >> 1);
+      }
+      break;
+    }
+    case 4: {
+      for (uint32_t i = 0; i < rowNumBytes; i++) {
+        int left = (i >= bpp) ? row[i - bpp] : 0;
+        int upLeft = (i >= bpp) ? prev[i - bpp] : 0;
+        row[i] += png_paeth(left, prev[i], upLeft);
+      }
+      break;
+    }
+    default: {
+      return NULL;
+    }
+  }
+  
+  // The current row becomes the previous row for the next call
+  
+  uint8_t *tmp = reader->prevRow;
+  reader->prevRow = reader->currentRow;
+  reader->currentRow = tmp;
+  
+  return row;
+}
+
+// Convert the pixels in one row of a framebuffer to RGB or RGBA bytes as stored in a PNG.
+// 32BPP pixels are premultiplied, so the alpha is divided out. 16BPP pixels are expanded
+// to 8 bits per component.
+
+static
+void flatten_convert_row(CGFrameBuffer *cgFrameBuffer, int row, uint8_t *outPtr)
+{
+  int width = (int) cgFrameBuffer.width;
+  int bpp = (int) cgFrameBuffer.bitsPerPixel;
+  
+  if (bpp == 16) {
+    uint16_t *inPtr = ((uint16_t*)cgFrameBuffer.pixels) + (row * width);
+    
+    for (int i = 0; i < width; i++) {
+      uint16_t pixel = inPtr[i];
+      
+      // rgb555 to rgb888
+      
+      uint32_t red = (pixel >> 10) & 0x1F;
+      uint32_t green = (pixel >> 5) & 0x1F;
+      uint32_t blue = pixel & 0x1F;
+      
+      *outPtr++ = (uint8_t) ((red * 255 + 15) / 31);
+      *outPtr++ = (uint8_t) ((green * 255 + 15) / 31);
+      *outPtr++ = (uint8_t) ((blue * 255 + 15) / 31);
+    }
+  } else {
+    uint32_t *inPtr = ((uint32_t*)cgFrameBuffer.pixels) + (row * width);
+    
+    // Unpremultiply a chunk of the row at a time into a small buffer
+    
+    uint32_t chunkPixels[64];
+    
+    for (int chunki = 0; chunki < width; chunki += 64) {
+      int numChunkPixels = MIN(64, width - chunki);
+      
+      if (bpp == 32) {
+        unpremultiply_frame(&inPtr[chunki], chunkPixels, numChunkPixels);
+      } else {
+        memcpy(chunkPixels, &inPtr[chunki], numChunkPixels * sizeof(uint32_t));
+      }
+      
+      for (int i = 0; i < numChunkPixels; i++) {
+        uint32_t pixel = chunkPixels[i];
+        
+        *outPtr++ = (pixel >> 16) & 0xFF;
+        *outPtr++ = (pixel >> 8) & 0xFF;
+        *outPtr++ = pixel & 0xFF;
+        
+        if (bpp == 32) {
+          *outPtr++ = (pixel >> 24) & 0xFF;
+        }
+      }
+    }
+  }
+}
+
+// Open an unnamed scratch file in the temp dir. An atlas row of frames is staged
+// in this file one frame sized tile at a time so that flatten and unflatten only
+// hold one frame of pixels in memory, no matter how many columns the atlas has.
+
+static
+int open_atlas_scratch_file()
+{
+  NSString *templatePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"mvidatlas.XXXXXX"];
+  char *pathCstr = strdup([templatePath fileSystemRepresentation]);
+  assert(pathCstr);
+  
+  int fd = mkstemp(pathCstr);
+  
+  if (fd == -1) {
+    fprintf(stderr, "error: cannot create scratch file \"%s\"\n", pathCstr);
+    exit(1);
+  }
+  
+  unlink(pathCstr);
+  free(pathCstr);
+  return fd;
+}
+
+static
+void atlas_scratch_pwrite(int fd, const void *buffer, size_t numBytes, off_t offset)
+{
+  if (pwrite(fd, buffer, numBytes, offset) != (ssize_t)numBytes) {
+    fprintf(stderr, "error: cannot write to scratch file : %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+static
+void atlas_scratch_pread(int fd, void *buffer, size_t numBytes, off_t offset)
+{
+  if (pread(fd, buffer, numBytes, offset) != (ssize_t)numBytes) {
+    fprintf(stderr, "error: cannot read from scratch file : %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+// Flatten will read all of the frames from a movie and write all the frames
+// into a single PNG image. By default, the output image will be a multiple of
+// the original image height based on the number of frames in the movie. When
+// numColumns is larger than 1, frames are laid out left to right in an atlas
+// so that the output image stays within common image dimension limits. Pass 0
+// to choose a square-ish atlas. Each decoded frame is converted into a tile
+// in a scratch file, then the PNG rows for that row of frames are assembled
+// from the tiles, so memory use is bounded by one frame.
+
+void
+flattenMvidMovie(char *inOriginalMvidFilename, char *outFlatPNGFilename, int numColumns)
+{
+  NSString *mvidPath = [NSString stringWithUTF8String:inOriginalMvidFilename];
+  
+  BOOL isMvid = [mvidPath hasSuffix:@".mvid"];
+  
+  if (isMvid == FALSE) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  
+  premultiply_init();
+  
+  AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  BOOL worked = [frameDecoder openForReading:mvidPath];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", inOriginalMvidFilename);
+    exit(1);
+  }
+  
+  worked = [frameDecoder allocateDecodeResources];
+  assert(worked);
+  
+  NSUInteger numFrames = [frameDecoder numFrames];
+  assert(numFrames > 0);
+  
+  //float frameDuration = [frameDecoder frameDuration];
+  
+  int bpp = [frameDecoder header]->bpp;
+  
+  int width = (int) [frameDecoder width];
+  int height = (int) [frameDecoder height];
+  
+  // Verify that the input color data has been mapped to the sRGB colorspace.
+  
+  if (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_ZERO) {
+    fprintf(stderr, "%s\n", "-flatten on MVID is not supported for an old MVID file version 0.");
+    exit(1);
+  }
+  
+  if (numColumns == 0) {
+    numColumns = (int) ceil(sqrt((double)numFrames));
+  }
+  if (numColumns > numFrames) {
+    numColumns = (int) numFrames;
+  }
+  
+  int numRows = (int) ((numFrames + numColumns - 1) / numColumns);
+  
+  uint32_t outWidth = width * numColumns;
+  uint32_t outHeight = height * numRows;
+  
+  PNGRowWriter pngWriter;
+  
+  worked = png_writer_open(&pngWriter, outFlatPNGFilename, outWidth, outHeight, (bpp == 32));
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot write PNG filename \"%s\"\n", outFlatPNGFilename);
+    exit(1);
+  }
+  
+  // Converted pixels for one frame, and one PNG row. Empty cells in the last
+  // row of the atlas are left as zero.
+  
+  uint32_t frameRowNumBytes = width * pngWriter.bytesPerPixel;
+  uint32_t tileNumBytes = frameRowNumBytes * height;
+  uint32_t outRowNumBytes = outWidth * pngWriter.bytesPerPixel;
+  uint8_t *tilePixels = malloc(tileNumBytes);
+  uint8_t *outRowPixels = malloc(outRowNumBytes);
+  assert(tilePixels && outRowPixels);
+  
+  int scratchFd = (numColumns > 1) ? open_atlas_scratch_file() : -1;
+  
+  NSUInteger frameIndex = 0;
+  
+  for (int atlasRow = 0; atlasRow < numRows; atlasRow++) {
+    int numColumnsThisRow = 0;
     
-    for (int pixeli = 0; pixeli < numPixels; pixeli++) {
-      uint32_t originalPixel = originalCgFrameBuffer32Ptr[pixeli];
-      uint32_t compressedPixel = compressedCgFrameBuffer32Ptr[pixeli];
+    for (int atlasColumn = 0; (atlasColumn < numColumns) && (frameIndex < numFrames); atlasColumn++, frameIndex++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
       
-      /*
-      uint32_t original_alpha = (originalPixel >> 24) & 0xFF;
-      uint32_t original_red = (originalPixel >> 16) & 0xFF;
-      uint32_t original_green = (originalPixel >> 8) & 0xFF;
-      uint32_t original_blue = originalPixel & 0xFF;
+      AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
+      assert(frame);
       
-      uint32_t compressed_alpha = (compressedPixel >> 24) & 0xFF;
-      uint32_t compressed_red = (compressedPixel >> 16) & 0xFF;
-      uint32_t compressed_green = (compressedPixel >> 8) & 0xFF;
-      uint32_t compressed_blue = compressedPixel & 0xFF;
-       */
+      // Release the NSImage ref inside the frame since we will operate on the CG image directly.
+      frame.image = nil;
       
-      if (originalPixel != compressedPixel) {
-        uint32_t redPixel = rgba_to_bgra(0xFF/2, 0, 0, 0xFF/2);
-        redCgFrameBuffer32Ptr[pixeli] = redPixel;
-        numPixelsModified++;
+      CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+      assert(cgFrameBuffer);
+      
+      for (int row = 0; row < height; row++) {
+        flatten_convert_row(cgFrameBuffer, row, tilePixels + (row * frameRowNumBytes));
       }
+      
+      if (scratchFd != -1) {
+        atlas_scratch_pwrite(scratchFd, tilePixels, tileNumBytes, (off_t)atlasColumn * tileNumBytes);
+      }
+      
+      numColumnsThisRow++;
+      
+      [pool drain];
     }
     
-    // Render red pixels over compressed pixels in outFrameBuffer (matte)
-    
-    frameImage = [redFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
-    
-    worked = [outFrameBuffer renderCGImage:frameImage];
-    assert(worked);
-    
-    if (frameImage) {
-      CGImageRelease(frameImage);
-    }
-    
-    // Now create a UIImage so that the result of this operation can be encoded into the output mvid
-    
-    frameImage = [outFrameBuffer createCGImageRef];
-    worked = (frameImage != nil);
-    assert(worked);
-    
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
+    if (scratchFd == -1) {
+      for (int row = 0; row < height; row++) {
+        png_writer_write_row(&pngWriter, tilePixels + (row * frameRowNumBytes));
+      }
+      continue;
     }
     
-    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
+    memset(outRowPixels, 0, outRowNumBytes);
     
-    if (frameImage) {
-      CGImageRelease(frameImage);
+    for (int row = 0; row < height; row++) {
+      for (int atlasColumn = 0; atlasColumn < numColumnsThisRow; atlasColumn++) {
+        atlas_scratch_pread(scratchFd, outRowPixels + (atlasColumn * frameRowNumBytes), frameRowNumBytes,
+                            ((off_t)atlasColumn * tileNumBytes) + (row * frameRowNumBytes));
+      }
+      png_writer_write_row(&pngWriter, outRowPixels);
     }
-    
-    [pool drain];
   }
   
-  [fileWriter rewriteHeader];
-  [fileWriter close];
+  if (scratchFd != -1) {
+    close(scratchFd);
+  }
+  
+  free(tilePixels);
+  free(outRowPixels);
+  
+  worked = png_writer_close(&pngWriter);
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot write PNG filename \"%s\"\n", outFlatPNGFilename);
+    exit(1);
+  }
+  
+  [frameDecoder close];
+  
+  if (numColumns > 1) {
+    fprintf(stdout, "Wrote %s with size %d x %d (%d x %d frames)\n", outFlatPNGFilename, (int)outWidth, (int)outHeight, numColumns, numRows);
+  } else {
+    fprintf(stdout, "Wrote %s with size %d x %d\n", outFlatPNGFilename, (int)outWidth, (int)outHeight);
+  }
   
-  fprintf(stdout, "Found %d modified pixels\n", numPixelsModified);
-  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
   return;
 }
 
-// Flatten will read all of the frames from a movie and write all the frames
-// into a single PNG image. The output image will be a multiple of the original
-// image height based on the number of frames in the movie.
+// Reverse a flatten operation by reading the framerate and BPP info from a MVID
+// reading the new image data from a flat PNG, and then writing the pixels from
+// the PNG to and output MVID. The atlas layout is determined from the size of the
+// PNG. When the PNG is in a format the streaming reader supports, each row of
+// frames is read row by row into frame sized tiles in a scratch file, then one
+// tile at a time is encoded, so memory use is bounded by one frame. Otherwise the
+// whole image is loaded with ImageIO.
 
 void
-flattenMvidMovie(char *inOriginalMvidFilename, char *outFlatPNGFilename)
+unflattenMvidMovie(char *inOriginalMvidFilename, char *inFlatPNGFilename, char *outMvidFilename)
 {
   NSString *mvidPath = [NSString stringWithUTF8String:inOriginalMvidFilename];
   
@@ -5177,6 +7792,8 @@ flattenMvidMovie(char *inOriginalMvidFilename, char *outFlatPNGFilename)
     exit(1);
   }
   
+  // Open original MVID for reading of header data
+  
   AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
   
   BOOL worked = [frameDecoder openForReading:mvidPath];
@@ -5192,222 +7809,508 @@ flattenMvidMovie(char *inOriginalMvidFilename, char *outFlatPNGFilename)
   NSUInteger numFrames = [frameDecoder numFrames];
   assert(numFrames > 0);
   
-  //float frameDuration = [frameDecoder frameDuration];
+  float frameDuration = [frameDecoder frameDuration];
   
   int bpp = [frameDecoder header]->bpp;
   
-  int width = (int) [frameDecoder width];
-  int height = (int) [frameDecoder height];
+  int width = (int)[frameDecoder width];
+  int height = (int)[frameDecoder height];
   
   // Verify that the input color data has been mapped to the sRGB colorspace.
   
   if (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_ZERO) {
-    fprintf(stderr, "%s\n", "-mixalpha on MVID is not supported for an old MVID file version 0.");
+    fprintf(stderr, "%s\n", "-unflatten on MVID is not supported for an old MVID file version 0.");
     exit(1);
   }
   
-  // Allocate framebuffer large enought to hold all the output frames in a single image
+  // Read the size of the input PNG, either with the streaming reader or with ImageIO
   
-  int outHeight = (int)(height * numFrames);
+  PNGRowReader pngReader;
+  BOOL isStreaming = png_reader_open(&pngReader, inFlatPNGFilename);
   
-  CGFrameBuffer *outFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:outHeight];
-  uint32_t *outPixelsPtr = (uint32_t*)outFrameBuffer.pixels;
+  CGImageRef imageRef = NULL;
+  int inWidth, inHeight;
   
-  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-    
-    AVFrame *frame = [frameDecoder advanceToFrame:frameIndex];
-    assert(frame);
+  if (isStreaming) {
+    inWidth = (int) pngReader.width;
+    inHeight = (int) pngReader.height;
+  } else {
+    NSString *inFlatPNGFilenameStr = [NSString stringWithFormat:@"%s", inFlatPNGFilename];
+    imageRef = createImageFromFile(inFlatPNGFilenameStr);
     
-    // Release the NSImage ref inside the frame since we will operate on the CG image directly.
-    frame.image = nil;
+    if (imageRef == NULL) {
+      fprintf(stderr, "error: cannot open flat PNG filename \"%s\"\n", inFlatPNGFilename);
+      exit(1);
+    }
     
-    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
-    assert(cgFrameBuffer);
+    inWidth = (int) CGImageGetWidth(imageRef);
+    inHeight = (int) CGImageGetHeight(imageRef);
+  }
+  
+  // Verify size of PNG, it must contain whole frames and the last row of frames
+  // in an atlas must contain at least one frame.
+  
+  int numColumns = inWidth / width;
+  int numRows = inHeight / height;
+  
+  if ((numColumns < 1) || ((numColumns * width) != inWidth) || (numColumns > numFrames)) {
+    fprintf(stderr, "error: input flat PNG filename \"%s\" must contain image of width %d or a multiple of %d, not %d\n", inFlatPNGFilename, width, width, inWidth);
+    exit(1);
+  }
+  
+  int expectedNumRows = (int) ((numFrames + numColumns - 1) / numColumns);
+  
+  if ((numRows * height) != inHeight || numRows != expectedNumRows) {
+    fprintf(stderr, "error: input flat PNG filename \"%s\" must contain image of height %d not %d\n", inFlatPNGFilename, expectedNumRows * height, inHeight);
+    exit(1);
+  }
+  
+  // When the image could not be streamed, render it all into a framebuffer
+  
+  CGFrameBuffer *inFrameBuffer = nil;
+  
+  if (!isStreaming) {
+    inFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:inWidth height:inHeight];
     
-    if (frameIndex == 0) {
-      outFrameBuffer.colorspace = cgFrameBuffer.colorspace;
+    // Explicitly use sRGB
+    {
+      CGColorSpaceRef colorSpace = NULL;
+      colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+      assert(colorSpace);
+      inFrameBuffer.colorspace = colorSpace;
+      CGColorSpaceRelease(colorSpace);
     }
     
-    NSUInteger numPixels = cgFrameBuffer.width * cgFrameBuffer.height;
-    uint32_t *pixels = (uint32_t*)cgFrameBuffer.pixels;
-    
-    // Append pixels to outFrameBuffer
+    [inFrameBuffer renderCGImage:imageRef];
+    CGImageRelease(imageRef);
+  }
+  
+  // Open output MVID and duplicate the header settings from the original MVID
+  
+  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
+  mvidFileMetaData.bpp = bpp;
+  mvidFileMetaData.checkAlphaChannel = FALSE;
+  
+  NSString *outMvidPath = [NSString stringWithFormat:@"%s", outMvidFilename];
+  
+  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  
+  fileWriter.movieSize = CGSizeMake(width, height);
+  
+  // Allocate framebuffer for one frame from the input PNG
+  
+  CGFrameBuffer *currentFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
+  assert(currentFrameBuffer);
+  
+  // Explicitly use sRGB
+  
+  CGColorSpaceRef sRGBColorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+  assert(sRGBColorSpace);
+  currentFrameBuffer.colorspace = sRGBColorSpace;
+  
+  // Streamed PNG bytes for one frame. With more than one column, the rows of
+  // each frame are gathered in a scratch file.
+  
+  uint32_t bytesPerPixel = isStreaming ? pngReader.bytesPerPixel : 0;
+  uint32_t frameRowNumBytes = width * bytesPerPixel;
+  uint32_t tileNumBytes = frameRowNumBytes * height;
+  uint8_t *tilePixels = NULL;
+  int scratchFd = -1;
+  
+  if (isStreaming) {
+    tilePixels = malloc(tileNumBytes);
+    assert(tilePixels);
     
-    int numBytes = (int) (numPixels * sizeof(uint32_t));
-    memcpy(outPixelsPtr, pixels, numBytes);
-    outPixelsPtr += numPixels;
+    if (numColumns > 1) {
+      scratchFd = open_atlas_scratch_file();
+    }
+  }
+  
+  NSUInteger frameIndex = 0;
+  
+  for (int atlasRow = 0; atlasRow < numRows; atlasRow++) {
+    if (isStreaming) {
+      for (int row = 0; row < height; row++) {
+        uint8_t *rowPtr = png_reader_read_row(&pngReader);
+        
+        if (rowPtr == NULL) {
+          fprintf(stderr, "error: cannot read row %d of flat PNG filename \"%s\"\n", (atlasRow * height) + row, inFlatPNGFilename);
+          exit(1);
+        }
+        
+        if (scratchFd == -1) {
+          memcpy(tilePixels + (row * frameRowNumBytes), rowPtr, frameRowNumBytes);
+          continue;
+        }
+        
+        for (int atlasColumn = 0; atlasColumn < numColumns; atlasColumn++) {
+          atlas_scratch_pwrite(scratchFd, rowPtr + (atlasColumn * frameRowNumBytes), frameRowNumBytes,
+                               ((off_t)atlasColumn * tileNumBytes) + (row * frameRowNumBytes));
+        }
+      }
+    }
     
-    [pool release];
+    for (int atlasColumn = 0; (atlasColumn < numColumns) && (frameIndex < numFrames); atlasColumn++, frameIndex++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      
+      CGImageRef frameImage;
+      
+      if (isStreaming) {
+        // Wrap the non-premultiplied PNG bytes for this frame in an image without
+        // copying them, rendering the image converts to the framebuffer pixel format
+        // just as it would for an image loaded with ImageIO. The image is released
+        // before the tile buffer is reused for the next frame.
+        
+        if (scratchFd != -1) {
+          atlas_scratch_pread(scratchFd, tilePixels, tileNumBytes, (off_t)atlasColumn * tileNumBytes);
+        }
+        
+        CGDataProviderRef dataProvider = CGDataProviderCreateWithData(NULL, tilePixels, tileNumBytes, NULL);
+        
+        CGBitmapInfo bitmapInfo = (bytesPerPixel == 4) ? kCGImageAlphaLast : kCGImageAlphaNone;
+        
+        frameImage = CGImageCreate(width, height, 8, bytesPerPixel * 8, frameRowNumBytes,
+                                   sRGBColorSpace, bitmapInfo, dataProvider, NULL, FALSE,
+                                   kCGRenderingIntentDefault);
+        
+        CGDataProviderRelease(dataProvider);
+      } else {
+        size_t pixelNumBytes = currentFrameBuffer.bytesPerPixel;
+        char *currentPixelsPtr = currentFrameBuffer.pixels;
+        char *inPixelsPtr = inFrameBuffer.pixels;
+        
+        for (int row = 0; row < height; row++) {
+          memcpy(currentPixelsPtr + (row * width * pixelNumBytes),
+                 inPixelsPtr + (((((atlasRow * height) + row) * inWidth) + (atlasColumn * width)) * pixelNumBytes),
+                 width * pixelNumBytes);
+        }
+        
+        frameImage = [currentFrameBuffer createCGImageRef];
+      }
+      
+      BOOL isKeyframe = FALSE;
+      if (frameIndex == 0) {
+        isKeyframe = TRUE;
+      }
+      
+      // When original video is marked as "all keyframes" then retain this property in the output MVID
+      
+      if (frameDecoder.isAllKeyframes) {
+        isKeyframe = TRUE;
+      }
+      
+      process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
+      
+      if (frameImage) {
+        CGImageRelease(frameImage);
+      }
+      
+      [pool drain];
+    }
+  }
+  
+  if (isStreaming) {
+    if (scratchFd != -1) {
+      close(scratchFd);
+    }
+    free(tilePixels);
+    png_reader_close(&pngReader);
+  }
+  
+  CGColorSpaceRelease(sRGBColorSpace);
+  
+  if ([fileWriter rewriteHeader] == FALSE) {
+    fprintf(stderr, "error: cannot write .mvid file \"%s\"\n", [fileWriter.mvidPath UTF8String]);
+    exit(1);
+  }
+  [fileWriter close];
+  
+  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
+  return;
+}
+
+// Join two .mvid files into one without decoding any frames. The frame data
+// of each file is copied as is, see stitchMvidFiles().
+
+void
+concatMvidMovies(char *firstMvidFilename, char *secondMvidFilename, char *outMvidFilename)
+{
+  NSString *firstMvidPath = [NSString stringWithUTF8String:firstMvidFilename];
+  NSString *secondMvidPath = [NSString stringWithUTF8String:secondMvidFilename];
+  NSString *outMvidPath = [NSString stringWithUTF8String:outMvidFilename];
+  
+  if (![firstMvidPath hasSuffix:@".mvid"] || ![secondMvidPath hasSuffix:@".mvid"] || ![outMvidPath hasSuffix:@".mvid"]) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  
+  // The frame duration is not checked by stitchMvidFiles()
+  
+  AVMvidFrameDecoder *firstDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  AVMvidFrameDecoder *secondDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
+  
+  if ([firstDecoder openForReading:firstMvidPath] == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", firstMvidFilename);
+    exit(1);
+  }
+  if ([secondDecoder openForReading:secondMvidPath] == FALSE) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", secondMvidFilename);
+    exit(1);
+  }
+  
+  if ([firstDecoder header]->frameDuration != [secondDecoder header]->frameDuration) {
+    fprintf(stderr, "error: framerate of \"%s\" does not match framerate of \"%s\"\n", secondMvidFilename, firstMvidFilename);
+    exit(1);
   }
   
-  NSString *pngPath = [NSString stringWithFormat:@"%s", outFlatPNGFilename];
+  [firstDecoder close];
+  [secondDecoder close];
   
-  NSData *pngData = [outFrameBuffer formatAsPNG];
+  NSArray *inMvidPaths = [NSArray arrayWithObjects:firstMvidPath, secondMvidPath, nil];
   
-  [pngData writeToFile:pngPath atomically:NO];
-  
-  fprintf(stdout, "Wrote %s with size %d x %d\n", outFlatPNGFilename, (int)outFrameBuffer.width, (int)outFrameBuffer.height);
+  if (stitchMvidFiles(inMvidPaths, outMvidPath) == FALSE) {
+    exit(1);
+  }
   
-  return;
+  fprintf(stdout, "Wrote %s\n", outMvidFilename);
 }
 
-// Reverse a flatten operation by reading the framerate and BPP info from a MVID
-// reading the new image data from a flat PNG, and then writing the pixels from
-// the PNG to and output MVID.
+// Write the frames START to END (inclusive, starting at 1) of a .mvid file to a new
+// .mvid file. The frame data after the first frame is copied with one file range
+// copy, only the frame table offsets are adjusted. The first frame is copied as is
+// when it is a keyframe, otherwise it is decoded and written as a new keyframe. The
+// deltas that follow still apply since the pixels of the first frame do not change.
 
 void
-unflattenMvidMovie(char *inOriginalMvidFilename, char *inFlatPNGFilename, char *outMvidFilename)
+trimMvidMovie(char *startFrameCstr, char *endFrameCstr, char *inMvidFilename, char *outMvidFilename)
 {
-  NSString *mvidPath = [NSString stringWithUTF8String:inOriginalMvidFilename];
+  NSString *inMvidPath = [NSString stringWithUTF8String:inMvidFilename];
+  NSString *outMvidPath = [NSString stringWithUTF8String:outMvidFilename];
   
-  BOOL isMvid = [mvidPath hasSuffix:@".mvid"];
-  
-  if (isMvid == FALSE) {
+  if (![inMvidPath hasSuffix:@".mvid"] || ![outMvidPath hasSuffix:@".mvid"]) {
     fprintf(stderr, "%s", USAGE);
     exit(1);
   }
   
-  // Open original MVID for reading of header data
-  
   AVMvidFrameDecoder *frameDecoder = [AVMvidFrameDecoder aVMvidFrameDecoder];
   
-  BOOL worked = [frameDecoder openForReading:mvidPath];
+  BOOL worked = [frameDecoder openForReading:inMvidPath];
   
   if (worked == FALSE) {
-    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", inOriginalMvidFilename);
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", inMvidFilename);
     exit(1);
   }
   
-  worked = [frameDecoder allocateDecodeResources];
-  assert(worked);
+  MVFileHeader *inHeader = [frameDecoder header];
+  int numFrames = (int) [frameDecoder numFrames];
   
-  NSUInteger numFrames = [frameDecoder numFrames];
-  assert(numFrames > 0);
+  if (maxvid_file_version(inHeader) != MV_FILE_VERSION_THREE) {
+    fprintf(stderr, "error: mvid file \"%s\" must be version 3, use -upgrade first\n", inMvidFilename);
+    exit(1);
+  }
   
-  float frameDuration = [frameDecoder frameDuration];
+  if (maxvid_file_is_deltas(inHeader)) {
+    fprintf(stderr, "error: mvid file \"%s\" was encoded with -deltas and can't be trimmed\n", inMvidFilename);
+    exit(1);
+  }
   
-  int bpp = [frameDecoder header]->bpp;
+  int startFrame = atoi(startFrameCstr);
+  int endFrame = atoi(endFrameCstr);
   
-  int width = (int)[frameDecoder width];
-  int height = (int)[frameDecoder height];
+  if ((startFrame < 1) || (endFrame > numFrames) || (endFrame <= startFrame)) {
+    fprintf(stderr, "error: invalid frame range %s to %s, the movie contains frames 1 to %d and at least 2 frames must be kept\n",
+            startFrameCstr, endFrameCstr, numFrames);
+    exit(1);
+  }
   
-  // Verify that the input color data has been mapped to the sRGB colorspace.
+  int startIndex = startFrame - 1;
+  int outNumFrames = endFrame - startFrame + 1;
   
-  if (maxvid_file_version([frameDecoder header]) == MV_FILE_VERSION_ZERO) {
-    fprintf(stderr, "%s\n", "-unflatten on MVID is not supported for an old MVID file version 0.");
+  MVV3Frame *inFrames = (MVV3Frame*) frameDecoder.mvFrames;
+  
+  uint32_t outFramesNumBytes = sizeof(MVV3Frame) * outNumFrames;
+  MVV3Frame *outFrames = malloc(outFramesNumBytes);
+  assert(outFrames);
+  memcpy(outFrames, &inFrames[startIndex], outFramesNumBytes);
+  
+  int inFd = open(inMvidFilename, O_RDONLY);
+  int outFd = open(outMvidFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  
+  if (inFd == -1 || outFd == -1) {
+    fprintf(stderr, "error: cannot open mvid filename \"%s\"\n", (inFd == -1) ? inMvidFilename : outMvidFilename);
     exit(1);
   }
   
-  // Read input PNG and verify that the size of the input matches the expected size in pixels
+  // The first frame is placed at the first page bound after the frame table
   
-  CGImageRef imageRef = NULL;
+  off_t outOffset = sizeof(MVFileHeader) + outFramesNumBytes;
+  outOffset = ((outOffset + MV_PAGESIZE - 1) / MV_PAGESIZE) * MV_PAGESIZE;
   
-  NSString *inFlatPNGFilenameStr = [NSString stringWithFormat:@"%s", inFlatPNGFilename];
-  imageRef = createImageFromFile(inFlatPNGFilenameStr);
+  MVV3Frame *firstFrame = &outFrames[0];
+  BOOL reencodedFirstFrame = FALSE;
   
-  if (imageRef == NULL) {
-    fprintf(stderr, "error: cannot open flat PNG filename \"%s\"\n", inFlatPNGFilename);
-    exit(1);
+  if (maxvid_v3_frame_iskeyframe(firstFrame) && !maxvid_v3_frame_isnopframe(firstFrame)) {
+    worked = copyFileBytes(inFd, maxvid_v3_frame_offset(firstFrame), outFd, outOffset, maxvid_v3_frame_length(firstFrame));
+    maxvid_v3_frame_setoffset(firstFrame, outOffset);
+  } else {
+    // The first frame starts in the middle of a group of frames that depend on a previous
+    // keyframe, decode it and write the pixels as a keyframe.
+    
+    worked = [frameDecoder allocateDecodeResources];
+    assert(worked);
+    
+    AVFrame *frame = [frameDecoder advanceToFrame:startIndex];
+    assert(frame);
+    
+    CGFrameBuffer *cgFrameBuffer = frame.cgFrameBuffer;
+    assert(cgFrameBuffer);
+    
+    uint32_t length = (uint32_t) cgFrameBuffer.numBytes;
+    
+    worked = (pwrite(outFd, cgFrameBuffer.pixels, length, outOffset) == length);
+    
+    firstFrame->offset64 = outOffset;
+    firstFrame->length = length;
+    firstFrame->flags = MV_FRAME_IS_KEYFRAME;
+    firstFrame->adler = maxvid_adler32(0, (unsigned char*)cgFrameBuffer.pixels, length);
+    firstFrame->dirtyRect = 0;
+    
+    reencodedFirstFrame = TRUE;
   }
   
-  assert(imageRef);
+  outOffset += maxvid_v3_frame_length(firstFrame);
+  outOffset = ((outOffset + MV_PAGESIZE - 1) / MV_PAGESIZE) * MV_PAGESIZE;
   
-  // Copy all pixels in input to a framebuffer
+  // Find the range of frame data used by the rest of the frames. Nop frames are skipped since
+  // they refer to the data of the frame before them.
   
-  int inHeight = (int)(height * numFrames);
+  uint64_t inDataStart = 0;
+  uint64_t inDataEnd = 0;
+  BOOL lastIsKeyframe = TRUE;
   
-  // Verify height of PNG
-
-  if (CGImageGetHeight(imageRef) != inHeight) {
-    fprintf(stderr, "error: input flat PNG filename \"%s\" must contain image of height %d not %d\n", inFlatPNGFilename, inHeight, (int)CGImageGetHeight(imageRef));
-    exit(1);
+  for (int i = 1; i < outNumFrames; i++) {
+    MVV3Frame *frame = &outFrames[i];
+    
+    if (maxvid_v3_frame_isnopframe(frame)) {
+      continue;
+    }
+    
+    if (inDataEnd == 0) {
+      inDataStart = maxvid_v3_frame_offset(frame);
+    }
+    inDataEnd = maxvid_v3_frame_offset(frame) + maxvid_v3_frame_length(frame);
+    lastIsKeyframe = maxvid_v3_frame_iskeyframe(frame);
   }
   
-  if (CGImageGetWidth(imageRef) != width) {
-    fprintf(stderr, "error: input flat PNG filename \"%s\" must contain image of width %d not %d\n", inFlatPNGFilename, width, (int)CGImageGetWidth(imageRef));
-    exit(1);
+  // The data is placed at the same offset within a page as in the input file, so that
+  // keyframes stay page aligned when all offsets are moved by the same number of pages.
+  
+  uint64_t inPageStart = (inDataStart / MV_PAGESIZE) * MV_PAGESIZE;
+  int64_t shift = (int64_t)outOffset - (int64_t)inPageStart;
+  
+  if (worked && (inDataEnd > 0)) {
+    worked = copyFileBytes(inFd, inDataStart, outFd, inDataStart + shift, inDataEnd - inDataStart);
+    outOffset = inDataEnd + shift;
   }
   
-  CGFrameBuffer *inFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:inHeight];
+  BOOL isAllKeyframes = TRUE;
+  MVV3Frame *prevFrame = firstFrame;
   
-  // Explicitly use sRGB
-  {
-    CGColorSpaceRef colorSpace = NULL;
-    colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
-    assert(colorSpace);
-    inFrameBuffer.colorspace = colorSpace;
-    CGColorSpaceRelease(colorSpace);
+  for (int i = 1; i < outNumFrames; i++) {
+    MVV3Frame *frame = &outFrames[i];
+    
+    if (maxvid_v3_frame_isnopframe(frame)) {
+      // Same as the previous frame, like AVMvidFileWriter.writeNopFrame
+      frame->offset64 = prevFrame->offset64;
+      frame->length = prevFrame->length;
+      frame->flags = MV_FRAME_IS_NOPFRAME | (prevFrame->flags & MV_FRAME_IS_KEYFRAME);
+      frame->adler = 0;
+      frame->dirtyRect = 0;
+    } else {
+      maxvid_v3_frame_setoffset(frame, maxvid_v3_frame_offset(frame) + shift);
+      prevFrame = frame;
+      
+      if (!maxvid_v3_frame_iskeyframe(frame)) {
+        isAllKeyframes = FALSE;
+      }
+    }
   }
-
-  [inFrameBuffer renderCGImage:imageRef];
-  CGImageRelease(imageRef);
-
-  uint32_t *inPixelsPtr = (uint32_t*)inFrameBuffer.pixels;
   
-  // Open output MVID and duplicate the header settings from the original MVID
+  // A keyframe is always followed by zero padding up to the next page bound
   
-  MvidFileMetaData *mvidFileMetaData = [MvidFileMetaData mvidFileMetaData];
-  mvidFileMetaData.bpp = bpp;
-  mvidFileMetaData.checkAlphaChannel = FALSE;
+  if (lastIsKeyframe) {
+    outOffset = ((outOffset + MV_PAGESIZE - 1) / MV_PAGESIZE) * MV_PAGESIZE;
+  }
   
-  NSString *outMvidPath = [NSString stringWithFormat:@"%s", outMvidFilename];
+  if (worked && (ftruncate(outFd, outOffset) != 0)) {
+    worked = FALSE;
+  }
   
-  AVMvidFileWriter *fileWriter = makeMVidWriter(outMvidPath, bpp, frameDuration, numFrames);
+  // Write the header and frame table, then the magic number
   
-  fileWriter.movieSize = CGSizeMake(width, height);
+  MVFileHeader outHeader = *inHeader;
+  outHeader.magic = 0;
+  outHeader.numFrames = outNumFrames;
+  outHeader.versionAndFlags &= ~MV_FILE_ALL_KEYFRAMES;
+  if (isAllKeyframes) {
+    maxvid_file_set_all_keyframes(&outHeader);
+  }
   
-  // Allocate framebuffer for one frame from the input PNG
+  if (worked) {
+    worked = (pwrite(outFd, &outHeader, sizeof(MVFileHeader), 0) == sizeof(MVFileHeader)) &&
+      (pwrite(outFd, outFrames, outFramesNumBytes, sizeof(MVFileHeader)) == outFramesNumBytes);
+  }
   
-  CGFrameBuffer *currentFrameBuffer = [CGFrameBuffer cGFrameBufferWithBppDimensions:bpp width:width height:height];
-  assert(currentFrameBuffer);
+  if (worked) {
+    uint32_t magic = MV_FILE_MAGIC;
+    worked = (pwrite(outFd, &magic, sizeof(uint32_t), 0) == sizeof(uint32_t));
+  }
   
-  // Explicitly use sRGB
-  {
-    CGColorSpaceRef colorSpace = NULL;
-    colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
-    assert(colorSpace);
-    currentFrameBuffer.colorspace = colorSpace;
-    CGColorSpaceRelease(colorSpace);
+  close(inFd);
+  
+  if (close(outFd) != 0) {
+    worked = FALSE;
   }
   
-  uint32_t *currentPixelsPtr = (uint32_t*)currentFrameBuffer.pixels;
+  free(outFrames);
   
-  for (NSUInteger frameIndex = 0; frameIndex < numFrames; frameIndex++) {
-    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-    
-    int numBytes = width * height * sizeof(uint32_t);
-    memcpy(currentPixelsPtr, inPixelsPtr, numBytes);
-    
-    inPixelsPtr += (width * height);
-    
-    CGImageRef frameImage = [currentFrameBuffer createCGImageRef];
-    
-    BOOL isKeyframe = FALSE;
-    if (frameIndex == 0) {
-      isKeyframe = TRUE;
-    }
-    
-    // When original video is marked as "all keyframes" then retain this property in the output MVID
-    
-    if (frameDecoder.isAllKeyframes) {
-      isKeyframe = TRUE;
-    }
-    
-    process_frame_file(fileWriter, NULL, frameImage, (int)frameIndex, mvidFileMetaData, isKeyframe, NULL);
+  [frameDecoder close];
+  
+  if (worked == FALSE) {
+    fprintf(stderr, "error: cannot write mvid file \"%s\"\n", outMvidFilename);
+    exit(1);
+  }
+  
+  fprintf(stdout, "Wrote %s (frames %d to %d%s)\n", outMvidFilename, startFrame, endFrame,
+          reencodedFirstFrame ? ", first frame written as a keyframe" : "");
+}
+
+// The optional "-threads N" arguments can appear at the end of any command line.
+// If found, the arguments are removed from argv and the thread count is returned.
+// The default is to use one thread for each active CPU.
+
+static
+int parseThreadsOption(int *argcPtr, const char * argv[])
+{
+  int argc = *argcPtr;
+  int numThreads = (int) [[NSProcessInfo processInfo] activeProcessorCount];
+  
+  if ((argc >= 3) && (strcmp(argv[argc-2], "-threads") == 0)) {
+    numThreads = atoi(argv[argc-1]);
     
-    if (frameImage) {
-      CGImageRelease(frameImage);
+    if (numThreads <= 0) {
+      fprintf(stderr, "error: -threads must be a positive integer : %s\n", argv[argc-1]);
+      exit(1);
     }
     
-    [pool drain];
+    *argcPtr = argc - 2;
   }
   
-  [fileWriter rewriteHeader];
-  [fileWriter close];
+  if (numThreads <= 0) {
+    numThreads = 1;
+  }
   
-  fprintf(stdout, "Wrote %s\n", [fileWriter.mvidPath UTF8String]);
-  return;
+  return numThreads;
 }
 
 // main() Entry Point
@@ -5415,6 +8318,8 @@ unflattenMvidMovie(char *inOriginalMvidFilename, char *inFlatPNGFilename, char *
 int main (int argc, const char * argv[]) {
 	NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
   
+  int numThreads = parseThreadsOption(&argc, argv);
+  
 	if ((argc == 3 || argc == 4) && (strcmp(argv[1], "-extract") == 0)) {
 		// mvidmoviemaker -extract FILE.mvid ?FILEPREFIX?
 
@@ -5427,7 +8332,7 @@ int main (int argc, const char * argv[]) {
       framesFilePrefix = (char*)argv[3];
     }
     
-		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_PNG);
+		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_PNG, numThreads);
 	} else if ((argc == 3 || argc == 4) && (strcmp(argv[1], "-extractpixels") == 0)) {
 		// mvidmoviemaker -extractpixels FILE.mvid ?FILEPREFIX?
 
@@ -5440,7 +8345,7 @@ int main (int argc, const char * argv[]) {
       framesFilePrefix = (char*)argv[3];
     }
     
-		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_PIXELS);
+		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_PIXELS, numThreads);
 	} else if ((argc == 3 || argc == 4) && (strcmp(argv[1], "-extractcodec") == 0)) {
 		// mvidmoviemaker -extractcodec FILE.mvid ?FILEPREFIX?
     
@@ -5453,7 +8358,7 @@ int main (int argc, const char * argv[]) {
       framesFilePrefix = (char*)argv[3];
     }
     
-		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_CODEC);
+		extractFramesFromMvidMain(mvidFilename, framesFilePrefix, EXTRACT_FRAMES_TYPE_CODEC, numThreads);
 	} else if ((argc == 5) && (strcmp(argv[1], "-crop") == 0)) {
     // mvidmoviemaker -crop "X Y WIDTH HEIGHT" INMOVIE.mvid OUTMOVIE.mvid
     
@@ -5469,7 +8374,7 @@ int main (int argc, const char * argv[]) {
     char *inMvidFilename = (char *)argv[3];
     char *outMvidFilename = (char *)argv[4];
     
-    resizeMvidMovie(resizeSpec, inMvidFilename, outMvidFilename);
+    resizeMvidMovie(resizeSpec, inMvidFilename, outMvidFilename, numThreads);
 	} else if ((argc == 3) && (strcmp(argv[1], "-4up") == 0)) {
     // mvidmoviemaker -4up INMOVIE.mvid
 
@@ -5493,13 +8398,27 @@ int main (int argc, const char * argv[]) {
     }
     
     upgradeMvidMovie(inMvidFilename, optionalMvidFilename);
-  } else if ((argc == 4) && (strcmp(argv[1], "-flatten") == 0)) {
-    // mvidmoviemaker -flatten INORIG.mvid FLAT.png
+  } else if ((argc == 4 || argc == 5) && (strcmp(argv[1], "-flatten") == 0)) {
+    // mvidmoviemaker -flatten INORIG.mvid FLAT.png ?COLUMNS?
     
     char *inOriginalMvidFilename = (char *)argv[2];
     char *outFlatPNGFilename = (char *)argv[3];
+    int numColumns = 1;
+    
+    if (argc == 5) {
+      if (strcmp(argv[4], "AUTO") == 0) {
+        numColumns = 0;
+      } else {
+        numColumns = atoi(argv[4]);
+        
+        if (numColumns < 1) {
+          fprintf(stderr, "error: COLUMNS must be a positive integer or AUTO : %s\n", argv[4]);
+          exit(1);
+        }
+      }
+    }
     
-    flattenMvidMovie(inOriginalMvidFilename, outFlatPNGFilename);
+    flattenMvidMovie(inOriginalMvidFilename, outFlatPNGFilename, numColumns);
 
   } else if ((argc == 5) && (strcmp(argv[1], "-unflatten") == 0)) {
     // mvidmoviemaker -unflatten INORIG.mvid FLAT.png OUT.mvid
@@ -5510,11 +8429,42 @@ int main (int argc, const char * argv[]) {
     
     unflattenMvidMovie(inOriginalMvidFilename, inFlatPNGFilename, outMvidFilename);
 	} else if ((argc == 3) && (strcmp(argv[1], "-info") == 0)) {
+    // Print the header of a .mvid file, or of each .mvid file in a directory
+    //
     // mvidmoviemaker -info movie.mvid
     
-    char *mvidFilename = (char *)argv[2];
+    NSArray *mvidPaths = mvidPathsInFileOrDirectory((char*)argv[2]);
+    
+    for (NSString *mvidPath in mvidPaths) {
+      NSAutoreleasePool *innerPool = [[NSAutoreleasePool alloc] init];
+      
+      if (mvidPath != [mvidPaths objectAtIndex:0]) {
+        fprintf(stdout, "\n");
+      }
+      
+      printMovieHeaderInfo(mvidPath);
+      
+      [innerPool drain];
+    }
+	} else if ((argc == 3) && (strcmp(argv[1], "-verify") == 0)) {
+    // Decode every frame and compare to the stored adler, the path can
+    // be a single .mvid file or a directory of .mvid files.
+    //
+    // mvidmoviemaker -verify movie.mvid
+    
+    int numFilesMismatched = 0;
+    
+    for (NSString *mvidPath in mvidPathsInFileOrDirectory((char*)argv[2])) {
+      NSAutoreleasePool *innerPool = [[NSAutoreleasePool alloc] init];
+      
+      if (verifyMvidFrameAdler(mvidPath, numThreads) != 0) {
+        numFilesMismatched++;
+      }
+      
+      [innerPool drain];
+    }
     
-    printMovieHeaderInfo(mvidFilename);
+    exit((numFilesMismatched > 0) ? 1 : 0);
 	} else if ((argc == 3) && (strcmp(argv[1], "-adler") == 0)) {
     // mvidmoviemaker -info movie.mvid
     
@@ -5541,20 +8491,58 @@ int main (int argc, const char * argv[]) {
     char *mapSpecCstr = (char*)argv[4];
     NSString *mapSpecStr = [NSString stringWithUTF8String:mapSpecCstr];
     alphaMapMvid(firstFilenameStr, secondFilenameStr, mapSpecStr);
-	} else if ((argc == 3) && (strcmp(argv[1], "-pixels") == 0)) {
-    // mvidmoviemaker -pixels movie.mvid
+	} else if ((argc == 3 || argc == 4) && (strcmp(argv[1], "-pixels") == 0)) {
+    // mvidmoviemaker -pixels movie.mvid ?SUMMARY?
     
     char *firstFilenameCstr = (char*)argv[2];
     NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
     
+    BOOL summary = FALSE;
+    
+    if (argc == 4) {
+      if (strcmp(argv[3], "SUMMARY") == 0) {
+        summary = TRUE;
+      } else {
+        fprintf(stderr, "error: unsupported -pixels option : %s\n", argv[3]);
+        exit(1);
+      }
+    }
+    
     if ([firstFilenameStr hasSuffix:@".mvid"])
     {
-      printMvidPixels(firstFilenameStr);
+      if (summary) {
+        printMvidPixelSummary(firstFilenameStr);
+      } else {
+        printMvidPixels(firstFilenameStr);
+      }
       exit(0);
     } else {
       fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
       exit(1);
     }
+  } else if ((argc == 4) && (strcmp(argv[1], "-setfps") == 0)) {
+    // Set the framerate in the header of a movie or of every movie in a directory
+    // without writing the frame data again.
+    //
+    // mvidmoviemaker -setfps 30000/1001 movie.mvid
+    
+    float frameDuration = parseFramerateSpec((char*)argv[2]);
+    
+    if (frameDuration <= 0.0f) {
+      fprintf(stderr, "error: -setfps \"%s\" is invalid, must be a number or FRAMES/SECONDS below 90 FPS\n", argv[2]);
+      exit(1);
+    }
+    
+    editMvidHeaders((char*)argv[3], MVID_HEADER_EDIT_FPS, frameDuration);
+    exit(0);
+  } else if ((argc == 3) && (strcmp(argv[1], "-setflags") == 0)) {
+    // Recalculate the all keyframes flag in the header of a movie or of every
+    // movie in a directory from the frame table.
+    //
+    // mvidmoviemaker -setflags movie.mvid
+    
+    editMvidHeaders((char*)argv[2], MVID_HEADER_EDIT_FLAGS, 0.0f);
+    exit(0);
   } else if ((argc == 3) && (strcmp(argv[1], "-fps") == 0)) {
     // Return a FRAME/SEC specification that most closely matches the
     // exact framerate of the video for known values.
@@ -5572,6 +8560,147 @@ int main (int argc, const char * argv[]) {
       fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
       exit(1);
     }
+  } else if ((argc == 5) && (strcmp(argv[1], "-concat") == 0)) {
+    // Join two movies without decoding frames
+    //
+    // mvidmoviemaker -concat FIRST.mvid SECOND.mvid OUTFILE.mvid
+    
+    concatMvidMovies((char*)argv[2], (char*)argv[3], (char*)argv[4]);
+    exit(0);
+  } else if ((argc == 6) && (strcmp(argv[1], "-trim") == 0)) {
+    // Keep frames START to END of a movie, frame numbers start at 1
+    //
+    // mvidmoviemaker -trim START END INFILE.mvid OUTFILE.mvid
+    
+    trimMvidMovie((char*)argv[2], (char*)argv[3], (char*)argv[4], (char*)argv[5]);
+    exit(0);
+  } else if ((argc == 4) && (strcmp(argv[1], "-benchresize") == 0)) {
+    // Resize all the frames in a movie with CoreGraphics and with the resampler,
+    // then print the speed of each and how much the results differ
+    //
+    // mvidmoviemaker -benchresize OPTIONS_RESIZE movie.mvid
+    
+    char *resizeSpec = (char *)argv[2];
+    char *firstFilenameCstr = (char*)argv[3];
+    NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
+    
+    if ([firstFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidResize(resizeSpec, firstFilenameStr, numThreads);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
+      exit(1);
+    }
+  } else if (((argc == 3) || (argc == 5)) && (strcmp(argv[1], "-benchwrite") == 0)) {
+    // Write an all keyframe movie and print the write speed, 3840 x 2160 by default
+    //
+    // mvidmoviemaker -benchwrite ?WIDTH HEIGHT? OUTFILE.mvid
+    
+    int width = 3840;
+    int height = 2160;
+    
+    if (argc == 5) {
+      width = atoi(argv[2]);
+      height = atoi(argv[3]);
+    }
+    
+    char *outFilenameCstr = (char*)argv[argc-1];
+    NSString *outFilenameStr = [NSString stringWithUTF8String:outFilenameCstr];
+    
+    if ([outFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidWrite(outFilenameStr, width, height);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", outFilenameCstr);
+      exit(1);
+    }
+  } else if (((argc == 3) || (argc == 4)) && (strcmp(argv[1], "-benchreverse") == 0)) {
+    // Play a movie backward using saved frames, 16 frames apart by default
+    //
+    // mvidmoviemaker -benchreverse ?CHECKPOINT_SPACING? movie.mvid
+    
+    int checkpointSpacing = 16;
+    
+    if (argc == 4) {
+      checkpointSpacing = atoi(argv[2]);
+    }
+    
+    char *firstFilenameCstr = (char*)argv[argc-1];
+    NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
+    
+    if ([firstFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidReverseDecode(firstFilenameStr, checkpointSpacing);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
+      exit(1);
+    }
+  } else if ((argc == 3) && (strcmp(argv[1], "-benchskip") == 0)) {
+    // Skip ahead 2, 4, and 8 frames with and without merged deltas
+    //
+    // mvidmoviemaker -benchskip movie.mvid
+    
+    char *firstFilenameCstr = (char*)argv[2];
+    NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
+    
+    if ([firstFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidSkipDecode(firstFilenameStr);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
+      exit(1);
+    }
+  } else if ((argc == 4) && (strcmp(argv[1], "-benchshared") == 0)) {
+    // Play a movie with N decoders that share decoded frames
+    //
+    // mvidmoviemaker -benchshared NUM_DECODERS movie.mvid
+    
+    int numDecoders = atoi(argv[2]);
+    char *firstFilenameCstr = (char*)argv[3];
+    NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
+    
+    if ([firstFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidSharedDecode(firstFilenameStr, numDecoders);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
+      exit(1);
+    }
+  } else if (((argc == 3) || (argc == 4)) && (strcmp(argv[1], "-benchdecode") == 0)) {
+    // Decode all the frames in a movie and print the decode speed, frame data
+    // is memory mapped unless -pread or -nocache is passed.
+    //
+    // mvidmoviemaker -benchdecode ?-pread|-nocache? movie.mvid
+    
+    BenchmarkReadMode readMode = BENCHMARK_READ_MMAP;
+    
+    if (argc == 4) {
+      if (strcmp(argv[2], "-pread") == 0) {
+        readMode = BENCHMARK_READ_PREAD;
+      } else if (strcmp(argv[2], "-nocache") == 0) {
+        readMode = BENCHMARK_READ_PREAD_NOCACHE;
+      } else {
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+      }
+    }
+    
+    char *firstFilenameCstr = (char*)argv[argc-1];
+    NSString *firstFilenameStr = [NSString stringWithUTF8String:firstFilenameCstr];
+    
+    if ([firstFilenameStr hasSuffix:@".mvid"])
+    {
+      benchmarkMvidDecode(firstFilenameStr, readMode);
+      exit(0);
+    } else {
+      fprintf(stderr, "error: FILENAME must be a .mvid file : %s\n", firstFilenameCstr);
+      exit(1);
+    }
 #if defined(TESTMODE)
 	} else if (argc == 2 && (strcmp(argv[1], "-test") == 0)) {
     testmode();
@@ -5677,42 +8806,15 @@ int main (int argc, const char * argv[]) {
           // -fps 24
           // -fps 0.5  (1 frame every 2 seconds)
           // -fps 24/1 (24 frames per second)
-
-          NSString *fpsInputStr = [valueStr stringByReplacingOccurrencesOfString:@" " withString:@""];
-          NSString *fpsPairStr = [fpsInputStr stringByReplacingOccurrencesOfString:@"/" withString:@" "];
           
-          float fps = 0.0;
+          float framerate = parseFramerateSpec(valueCstr);
           
-          if ([fpsPairStr isEqualToString:fpsInputStr] == FALSE) {
-            // -fps "24/1" -> "24/1"
-            
-            NSArray *values = [fpsInputStr componentsSeparatedByString:@"/"];
-            
-            if (values.count != 2) {
-              fprintf(stderr, "-fps \"%s\" is invalid, must be an int value or FRAMES/SECONDS", (char*)[optionStr UTF8String]);
-              exit(1);
-            }
-            
-            float frames = [values[0] floatValue];
-            float second = [values[1] floatValue];
-            
-            if (frames == 0.0f) {
-              fprintf(stderr, "-fps \"%s\" is zero", (char*)[optionStr UTF8String]);
-              exit(1);
-            }
-            
-            float framerate = second / frames;
-            options.framerate = framerate;
-          } else {
-            fps = [valueStr floatValue];
-            
-            if ((fps <= 0.0f) || (fps >= 90.0f)) {
-              fprintf(stderr, "%s", USAGE);
-              exit(1);
-            }
-            
-            options.framerate = 1.0f / fps;
+          if (framerate <= 0.0f) {
+            fprintf(stderr, "error: -fps \"%s\" is invalid, must be a number or FRAMES/SECONDS below 90 FPS\n", valueCstr);
+            exit(1);
           }
+          
+          options.framerate = framerate;
         } else if ([optionStr isEqualToString:@"-framerate"]) {
           // Valid input:
           // -framerate 0.0417 (24 FPS)
@@ -5794,10 +8896,11 @@ int main (int argc, const char * argv[]) {
       
       encodeMvidFromFramesMain(mvidFilenameCstr,
                                firstFilenameCstr,
-                               &options);
+                               &options,
+                               numThreads);
       
       if (TRUE) {
-        printMovieHeaderInfo(mvidFilenameCstr);
+        printMovieHeaderInfo([NSString stringWithUTF8String:mvidFilenameCstr]);
       }
     }
 	} else {
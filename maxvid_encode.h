@@ -213,6 +213,23 @@ maxvid_encode_generic_delta_pixels32(const uint32_t * restrict prevInputBuffer32
                                      BOOL *emitKeyframeAnyway,
                                      uint32_t encodeFlags);
 
+// Translate the 24/32 bpp c4 codes for a delta frame into generic codes that describe
+// the same change limited to the crop window. Pixels outside the window are dropped and
+// offsets are rebased to the cropped frame size. Returns nil if no pixel inside the
+// crop window is changed by the delta. Also returns nil and sets *isValidPtr to FALSE
+// when the codes are malformed, for example a truncated DUP or COPY.
+
+NSData*
+maxvid_crop_c4_codes32(const uint32_t * restrict inputBuffer32,
+                       const uint32_t inputBufferNumWords,
+                       uint32_t width,
+                       uint32_t height,
+                       uint32_t cropX,
+                       uint32_t cropY,
+                       uint32_t cropWidth,
+                       uint32_t cropHeight,
+                       BOOL *isValidPtr);
+
 // This method will convert maxvid codes to the final output format, calculate an adler
 // checksum for the frame data and then write the data to the mvidWriter.
 
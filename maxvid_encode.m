@@ -1929,6 +1929,209 @@ maxvid_encode_generic_delta_pixels32(const uint32_t * restrict prevInputBuffer32
   return [NSData dataWithData:mData];
 }
 
+// State used while emitting generic codes for a cropped delta. SKIP pixels
+// are accumulated so that adjacent skips become one code.
+
+typedef struct {
+  NSMutableData *mData;
+  uint32_t pendingSkip;
+  uint32_t numPixelsEmitted;
+  uint32_t numChangedPixels;
+} CropCodeWriter;
+
+static inline
+void crop_writer_flush_skip(CropCodeWriter *writer)
+{
+  uint32_t skipCountLeft = writer->pendingSkip;
+  
+  while (skipCountLeft > 0) {
+    uint32_t skipCountThisLoop = MIN(skipCountLeft, MV_MAX_22_BITS);
+    uint32_t code = maxvid32_code(SKIP, skipCountThisLoop);
+    [writer->mData appendBytes:&code length:sizeof(uint32_t)];
+    skipCountLeft -= skipCountThisLoop;
+  }
+  
+  writer->numPixelsEmitted += writer->pendingSkip;
+  writer->pendingSkip = 0;
+}
+
+// Emit a changed run at the indicated output offset, pixels is either
+// numPixels values for a COPY or a single value when isDup is TRUE.
+
+static
+void crop_writer_emit_run(CropCodeWriter *writer,
+                          uint32_t outOffset,
+                          BOOL isDup,
+                          const uint32_t *pixels,
+                          uint32_t numPixels)
+{
+  uint32_t emittedOffset = writer->numPixelsEmitted + writer->pendingSkip;
+  assert(outOffset >= emittedOffset);
+  writer->pendingSkip += (outOffset - emittedOffset);
+  
+  crop_writer_flush_skip(writer);
+  
+  if (isDup && numPixels > 1) {
+    uint32_t dupCountLeft = numPixels;
+    
+    while (dupCountLeft > 0) {
+      uint32_t dupCountThisLoop = MIN(dupCountLeft, MV_MAX_22_BITS);
+      
+      if ((dupCountLeft - dupCountThisLoop) == 1) {
+        // A DUP must cover at least 2 pixels, so leave 2 for the next loop
+        dupCountThisLoop -= 1;
+      }
+      
+      uint32_t code = maxvid32_code(DUP, dupCountThisLoop);
+      [writer->mData appendBytes:&code length:sizeof(uint32_t)];
+      [writer->mData appendBytes:pixels length:sizeof(uint32_t)];
+      
+      dupCountLeft -= dupCountThisLoop;
+    }
+  } else {
+    uint32_t copyCountLeft = numPixels;
+    
+    while (copyCountLeft > 0) {
+      uint32_t copyCountThisLoop = MIN(copyCountLeft, MV_MAX_22_BITS);
+      uint32_t code = maxvid32_code(COPY, copyCountThisLoop);
+      [writer->mData appendBytes:&code length:sizeof(uint32_t)];
+      
+      if (isDup) {
+        [writer->mData appendBytes:pixels length:sizeof(uint32_t)];
+      } else {
+        [writer->mData appendBytes:pixels length:copyCountThisLoop * sizeof(uint32_t)];
+        pixels += copyCountThisLoop;
+      }
+      
+      copyCountLeft -= copyCountThisLoop;
+    }
+  }
+  
+  writer->numPixelsEmitted += numPixels;
+  writer->numChangedPixels += numPixels;
+}
+
+// Clip one input run to the rows and columns of the crop window. Each row
+// the run covers can produce one output run.
+
+static
+void crop_writer_clip_run(CropCodeWriter *writer,
+                          uint32_t offset,
+                          uint32_t numPixels,
+                          BOOL isDup,
+                          const uint32_t *pixels,
+                          uint32_t width,
+                          uint32_t cropX,
+                          uint32_t cropY,
+                          uint32_t cropWidth,
+                          uint32_t cropHeight)
+{
+  const uint32_t cropX2 = cropX + cropWidth;
+  const uint32_t cropY2 = cropY + cropHeight;
+  
+  uint32_t endOffset = offset + numPixels;
+  
+  while (offset < endOffset) {
+    uint32_t row = offset / width;
+    uint32_t col = offset % width;
+    uint32_t rowEnd = MIN(endOffset, (row + 1) * width);
+    uint32_t colEnd = col + (rowEnd - offset);
+    
+    if (row >= cropY2) {
+      return;
+    }
+    
+    if (row >= cropY) {
+      uint32_t x1 = MAX(col, cropX);
+      uint32_t x2 = MIN(colEnd, cropX2);
+      
+      if (x1 < x2) {
+        uint32_t outOffset = ((row - cropY) * cropWidth) + (x1 - cropX);
+        const uint32_t *runPixels = isDup ? pixels : (pixels + (x1 - col));
+        crop_writer_emit_run(writer, outOffset, isDup, runPixels, x2 - x1);
+      }
+    }
+    
+    if (!isDup) {
+      pixels += (rowEnd - offset);
+    }
+    offset = rowEnd;
+  }
+}
+
+NSData*
+maxvid_crop_c4_codes32(const uint32_t * restrict inputBuffer32,
+                       const uint32_t inputBufferNumWords,
+                       uint32_t width,
+                       uint32_t height,
+                       uint32_t cropX,
+                       uint32_t cropY,
+                       uint32_t cropWidth,
+                       uint32_t cropHeight,
+                       BOOL *isValidPtr)
+{
+  *isValidPtr = FALSE;
+  
+  assert((cropX + cropWidth) <= width);
+  assert((cropY + cropHeight) <= height);
+  
+  const uint32_t *inputBuffer32Max = inputBuffer32 + inputBufferNumWords;
+  const uint32_t numPixels = width * height;
+  
+  CropCodeWriter writer;
+  writer.mData = [NSMutableData data];
+  writer.pendingSkip = 0;
+  writer.numPixelsEmitted = 0;
+  writer.numChangedPixels = 0;
+  
+  uint32_t offset = 0;
+  
+  while (inputBuffer32 < inputBuffer32Max) {
+    uint32_t inword = *inputBuffer32++;
+    MV32_PARSE_OP_NUM_SKIP(inword, opCode, num, skipAfter);
+    
+    if (opCode == DONE) {
+      break;
+    } else if (opCode == SKIP) {
+      offset += num;
+    } else if (opCode == DUP) {
+      if (inputBuffer32 >= inputBuffer32Max) {
+        return nil;
+      }
+      crop_writer_clip_run(&writer, offset, num, TRUE, inputBuffer32, width, cropX, cropY, cropWidth, cropHeight);
+      inputBuffer32 += 1;
+      offset += num + skipAfter;
+    } else {
+      if ((inputBuffer32 + num) > inputBuffer32Max) {
+        return nil;
+      }
+      crop_writer_clip_run(&writer, offset, num, FALSE, inputBuffer32, width, cropX, cropY, cropWidth, cropHeight);
+      inputBuffer32 += num;
+      offset += num + skipAfter;
+    }
+    
+    if (offset > numPixels) {
+      return nil;
+    }
+  }
+  
+  *isValidPtr = TRUE;
+  
+  if (writer.numChangedPixels == 0) {
+    return nil;
+  }
+  
+  // Skip to the end of the cropped frame and emit the DONE code
+  
+  writer.pendingSkip += (cropWidth * cropHeight) - (writer.numPixelsEmitted + writer.pendingSkip);
+  crop_writer_flush_skip(&writer);
+  
+  uint32_t doneCode = maxvid32_code(DONE, 0);
+  [writer.mData appendBytes:&doneCode length:sizeof(uint32_t)];
+  
+  return [NSData dataWithData:writer.mData];
+}
+
 // Emit a DUP code for a specific run of pixels with all the same value
 
 static
@@ -2287,6 +2490,103 @@ maxvid_calculate_delta_pixels(NSArray *deltaPixels,
   return TRUE;
 }
 
+// Scan a buffer of generic maxvid codes and calculate the bounding box of the
+// pixels written by DUP and COPY codes. A run that wraps from one row to the
+// next covers the whole width. The x2 and y2 values are exclusive. Returns
+// FALSE if the codes do not write any pixels.
+
+static
+BOOL
+maxvid_generic_codes_dirty_rect(const uint32_t *inputBuffer32,
+                                const uint32_t inputBufferNumWords,
+                                const int bpp,
+                                const uint32_t width,
+                                uint32_t *xPtr,
+                                uint32_t *yPtr,
+                                uint32_t *x2Ptr,
+                                uint32_t *y2Ptr)
+{
+  const uint32_t *inputBuffer32Max = inputBuffer32 + inputBufferNumWords;
+  
+  uint32_t minX = width;
+  uint32_t minY = MV_MAX_32_BITS;
+  uint32_t maxX = 0;
+  uint32_t maxY = 0;
+  uint32_t pixelOffset = 0;
+  BOOL found = FALSE;
+  
+  while (inputBuffer32 < inputBuffer32Max) {
+    uint32_t inword = *inputBuffer32++;
+    uint32_t opCode;
+    uint32_t numPixels;
+    uint32_t numCopyWords;
+    
+    if (bpp == 16) {
+      MV16_READ_OP_VAL_NUM(inword, opVal, valVal, numVal);
+      opCode = opVal;
+      numPixels = numVal;
+      // Two 16 bit pixels are packed into each COPY word
+      numCopyWords = (numVal + 1) >> 1;
+    } else {
+      MV32_PARSE_OP_NUM_SKIP(inword, opVal, numVal, skipVal);
+      opCode = opVal;
+      numPixels = numVal;
+      numCopyWords = numVal;
+    }
+    
+    if (opCode == DONE) {
+      break;
+    } else if (opCode == SKIP) {
+      pixelOffset += numPixels;
+      continue;
+    } else if (opCode == DUP) {
+      inputBuffer32 += 1;
+    } else {
+      inputBuffer32 += numCopyWords;
+    }
+    
+    assert(numPixels > 0);
+    
+    uint32_t lastOffset = pixelOffset + numPixels - 1;
+    uint32_t y1 = pixelOffset / width;
+    uint32_t y2 = lastOffset / width;
+    uint32_t x1, x2;
+    
+    if (y1 == y2) {
+      x1 = pixelOffset % width;
+      x2 = lastOffset % width;
+    } else {
+      x1 = 0;
+      x2 = width - 1;
+    }
+    
+    if (x1 < minX) {
+      minX = x1;
+    }
+    if (x2 > maxX) {
+      maxX = x2;
+    }
+    if (y1 < minY) {
+      minY = y1;
+    }
+    if (y2 > maxY) {
+      maxY = y2;
+    }
+    found = TRUE;
+    
+    pixelOffset += numPixels;
+  }
+  
+  if (found) {
+    *xPtr = minX;
+    *yPtr = minY;
+    *x2Ptr = maxX + 1;
+    *y2Ptr = maxY + 1;
+  }
+  
+  return found;
+}
+
 // Write generic maxvid codes to output AVMvidFileWriter.
 // Returns TRUE if successful, FALSE otherwise.
 
@@ -2325,10 +2625,24 @@ maxvid_write_delta_pixels(AVMvidFileWriter *mvidWriter,
     assert(FALSE);
   }
   
+  // Record the bounding box of the changed pixels so that a decoder can
+  // limit texture uploads to the region that a delta actually modified.
+  
+  CGRect dirtyRect = CGRectNull;
+  
+  if (retcode == 0) {
+    uint32_t x, y, x2, y2;
+    uint32_t width = (uint32_t) mvidWriter.movieSize.width;
+    
+    if ((width > 0) && maxvid_generic_codes_dirty_rect(maxvidCodeBuffer, numMaxvidCodeWords, bpp, width, &x, &y, &x2, &y2)) {
+      dirtyRect = CGRectMake(x, y, x2 - x, y2 - y);
+    }
+  }
+  
   if (retcode == 0) {
     // Write codes to mvid file
     
-    BOOL worked = [mvidWriter writeDeltaframe:(void*)mC4Data.bytes bufferSize:(int)mC4Data.length adler:adler];
+    BOOL worked = [mvidWriter writeDeltaframe:(void*)mC4Data.bytes bufferSize:(int)mC4Data.length adler:adler dirtyRect:dirtyRect];
     
     if (worked == FALSE) {
       retcode = MV_ERROR_CODE_WRITE_FAILED;
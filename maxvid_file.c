@@ -56,3 +56,289 @@ uint32_t maxvid_adler32(
   
 	return result;
 }
+
+// Delta composition
+
+void maxvid_delta_composition_reset(MVDeltaComposition *composition)
+{
+  composition->numRuns = 0;
+  composition->numDeltas = 0;
+}
+
+void maxvid_delta_composition_free(MVDeltaComposition *composition)
+{
+  free(composition->runs);
+  free(composition->inputRuns);
+  free(composition->mergeRuns);
+  memset(composition, 0, sizeof(MVDeltaComposition));
+}
+
+static inline
+void maxvid_delta_runs_reserve(MVDeltaRun **runsPtr, uint32_t *capacityPtr, uint32_t numRuns)
+{
+  if (numRuns <= *capacityPtr) {
+    return;
+  }
+  uint32_t capacity = (*capacityPtr == 0) ? 256 : *capacityPtr;
+  while (capacity < numRuns) {
+    capacity *= 2;
+  }
+  *runsPtr = realloc(*runsPtr, capacity * sizeof(MVDeltaRun));
+  assert(*runsPtr);
+  *capacityPtr = capacity;
+}
+
+// Remove n pixels from the front of a run
+
+static inline
+void maxvid_delta_run_trim(MVDeltaRun *run, uint32_t n)
+{
+  run->offset += n;
+  run->numPixels -= n;
+  if (!run->isDup) {
+    run->pixels += n;
+  }
+}
+
+// Parse c4 codes into a list of runs sorted by offset
+
+static
+uint32_t maxvid_delta_parse_c4_sample32(MVDeltaComposition *composition,
+                                        const uint32_t *inputBuffer32,
+                                        const uint32_t inputBuffer32NumWords,
+                                        const uint32_t frameBufferSize,
+                                        uint32_t *numRunsPtr)
+{
+  const uint32_t *inputBuffer32Max = inputBuffer32 + inputBuffer32NumWords;
+  uint32_t offset = 0;
+  uint32_t numRuns = 0;
+  
+  while (inputBuffer32 < inputBuffer32Max) {
+    uint32_t inword = *inputBuffer32++;
+    MV32_PARSE_OP_NUM_SKIP(inword, opCode, num, skipAfter);
+    
+    if (opCode == DONE) {
+      *numRunsPtr = numRuns;
+      return 0;
+    } else if (opCode == SKIP) {
+      offset += num;
+    } else {
+      uint32_t numWords = (opCode == DUP) ? 1 : num;
+      
+      if (num == 0 || (inputBuffer32 + numWords) > inputBuffer32Max || (offset + num) > frameBufferSize) {
+        return MV_ERROR_CODE_INVALID_INPUT;
+      }
+      
+      maxvid_delta_runs_reserve(&composition->inputRuns, &composition->inputRunsCapacity, numRuns + 1);
+      
+      MVDeltaRun *run = &composition->inputRuns[numRuns++];
+      run->offset = offset;
+      run->numPixels = num;
+      run->pixels = inputBuffer32;
+      run->isDup = (opCode == DUP);
+      
+      inputBuffer32 += numWords;
+      offset += num + skipAfter;
+    }
+    
+    if (offset > frameBufferSize) {
+      return MV_ERROR_CODE_INVALID_INPUT;
+    }
+  }
+  
+  // No DONE code found
+  
+  return MV_ERROR_CODE_INVALID_INPUT;
+}
+
+uint32_t
+maxvid_delta_composition_add_c4_sample32(MVDeltaComposition *composition,
+                                         const uint32_t *inputBuffer32,
+                                         const uint32_t inputBuffer32NumWords,
+                                         const uint32_t frameBufferSize)
+{
+  uint32_t numInputRuns = 0;
+  
+  uint32_t status = maxvid_delta_parse_c4_sample32(composition, inputBuffer32, inputBuffer32NumWords,
+                                                   frameBufferSize, &numInputRuns);
+  if (status != 0) {
+    return status;
+  }
+  
+  composition->numDeltas++;
+  
+  // Merge the earlier runs in A with the later runs in B. Each run in B can split
+  // at most one run in A into two parts, so the output needs nA + 2*nB runs at most.
+  
+  MVDeltaRun *runsA = composition->runs;
+  const uint32_t nA = composition->numRuns;
+  const MVDeltaRun *runsB = composition->inputRuns;
+  const uint32_t nB = numInputRuns;
+  
+  maxvid_delta_runs_reserve(&composition->mergeRuns, &composition->mergeRunsCapacity, nA + (2 * nB) + 1);
+  
+  MVDeltaRun *out = composition->mergeRuns;
+  uint32_t numOut = 0;
+  uint32_t i = 0;
+  uint32_t j = 0;
+  
+  while (i < nA || j < nB) {
+    if (j == nB) {
+      out[numOut++] = runsA[i++];
+      continue;
+    }
+    
+    const MVDeltaRun *b = &runsB[j];
+    const uint32_t bEnd = b->offset + b->numPixels;
+    
+    if (i == nA) {
+      out[numOut++] = *b;
+      j++;
+      continue;
+    }
+    
+    MVDeltaRun *a = &runsA[i];
+    const uint32_t aEnd = a->offset + a->numPixels;
+    
+    if (aEnd <= b->offset) {
+      // A ends before B starts
+      out[numOut++] = *a;
+      i++;
+    } else if (a->offset < b->offset) {
+      // Emit the part of A before B, the rest of A overlaps B
+      MVDeltaRun *head = &out[numOut++];
+      *head = *a;
+      head->numPixels = b->offset - a->offset;
+      maxvid_delta_run_trim(a, head->numPixels);
+    } else if (a->offset >= bEnd) {
+      // A starts after B ends
+      out[numOut++] = *b;
+      j++;
+    } else if (aEnd <= bEnd) {
+      // B writes over all of A
+      i++;
+    } else {
+      // B writes over the front of A
+      maxvid_delta_run_trim(a, bEnd - a->offset);
+    }
+  }
+  
+  // The merged runs become the composition, the old runs become the next scratch space
+  
+  composition->mergeRuns = runsA;
+  composition->runs = out;
+  
+  uint32_t capacity = composition->runsCapacity;
+  composition->runsCapacity = composition->mergeRunsCapacity;
+  composition->mergeRunsCapacity = capacity;
+  
+  composition->numRuns = numOut;
+  
+  return 0;
+}
+
+uint32_t
+maxvid_delta_composition_apply32(const MVDeltaComposition *composition,
+                                 uint32_t *frameBuffer32)
+{
+  uint32_t numPixelsWritten = 0;
+  
+  for (uint32_t i = 0; i < composition->numRuns; i++) {
+    const MVDeltaRun *run = &composition->runs[i];
+    uint32_t *outPtr = frameBuffer32 + run->offset;
+    
+    if (run->isDup) {
+      const uint32_t pixel = *run->pixels;
+      for (uint32_t count = run->numPixels; count > 0; count--) {
+        *outPtr++ = pixel;
+      }
+    } else {
+      memcpy(outPtr, run->pixels, run->numPixels * sizeof(uint32_t));
+    }
+    
+    numPixelsWritten += run->numPixels;
+  }
+  
+  return numPixelsWritten;
+}
+
+// Append one word to the encoded output, the word is only counted when the output is full
+
+static inline
+void maxvid_delta_emit_word(uint32_t *outputBuffer32, const uint32_t outputBuffer32NumWords,
+                            uint32_t *numWordsPtr, uint32_t word)
+{
+  if (outputBuffer32 != NULL && *numWordsPtr < outputBuffer32NumWords) {
+    outputBuffer32[*numWordsPtr] = word;
+  }
+  *numWordsPtr += 1;
+}
+
+static inline
+void maxvid_delta_emit_skip(uint32_t *outputBuffer32, const uint32_t outputBuffer32NumWords,
+                            uint32_t *numWordsPtr, uint32_t skipNumPixels)
+{
+  while (skipNumPixels > 0) {
+    uint32_t skipCountThisLoop = (skipNumPixels > MV_MAX_22_BITS) ? MV_MAX_22_BITS : skipNumPixels;
+    uint32_t skipCode = (skipCountThisLoop << (8+2)) | (SKIP << 8);
+    maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, numWordsPtr, skipCode);
+    skipNumPixels -= skipCountThisLoop;
+  }
+}
+
+uint32_t
+maxvid_delta_composition_encode_c4_sample32(const MVDeltaComposition *composition,
+                                            uint32_t *outputBuffer32,
+                                            const uint32_t outputBuffer32NumWords,
+                                            const uint32_t frameBufferSize)
+{
+  uint32_t numWords = 0;
+  uint32_t offset = 0;
+  
+  for (uint32_t i = 0; i < composition->numRuns; i++) {
+    const MVDeltaRun *run = &composition->runs[i];
+    
+    maxvid_delta_emit_skip(outputBuffer32, outputBuffer32NumWords, &numWords, run->offset - offset);
+    
+    uint32_t countLeft = run->numPixels;
+    const uint32_t *pixels = run->pixels;
+    
+    if (run->isDup && countLeft > 1) {
+      while (countLeft > 0) {
+        uint32_t countThisLoop = (countLeft > MV_MAX_22_BITS) ? MV_MAX_22_BITS : countLeft;
+        if ((countLeft - countThisLoop) == 1) {
+          // A DUP must cover at least 2 pixels, so leave 2 for the next loop
+          countThisLoop -= 1;
+        }
+        uint32_t dupCode = (countThisLoop << (8+2)) | (DUP << 8);
+        maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, dupCode);
+        maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, *pixels);
+        countLeft -= countThisLoop;
+      }
+    } else {
+      // A COPY, or a DUP that was trimmed down to 1 pixel
+      while (countLeft > 0) {
+        uint32_t countThisLoop = (countLeft > MV_MAX_22_BITS) ? MV_MAX_22_BITS : countLeft;
+        uint32_t copyCode = (countThisLoop << (8+2)) | (COPY << 8);
+        maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, copyCode);
+        for (uint32_t count = 0; count < countThisLoop; count++) {
+          maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, *pixels);
+          if (!run->isDup) {
+            pixels++;
+          }
+        }
+        countLeft -= countThisLoop;
+      }
+    }
+    
+    offset = run->offset + run->numPixels;
+  }
+  
+  // Skip to the end of the framebuffer, then DONE is followed by a zero word
+  
+  maxvid_delta_emit_skip(outputBuffer32, outputBuffer32NumWords, &numWords, frameBufferSize - offset);
+  maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, (DONE << 8));
+  maxvid_delta_emit_word(outputBuffer32, outputBuffer32NumWords, &numWords, 0);
+  
+  return numWords;
+}
@@ -93,7 +93,7 @@ typedef struct {
   uint32_t length; // length in bytes
   uint32_t flags; // flags for frame
   uint32_t adler; // adler32 checksum of the decoded framebuffer
-  uint32_t dummy; // zero to fill out to double word length
+  uint32_t dirtyRect; // bounding box of changed pixels for a delta frame, zero if not known
 } MVV3Frame;
 
 static inline
@@ -190,6 +190,61 @@ uint32_t maxvid_v3_frame_length(MVV3Frame *mvFrame) {
   return mvFrame->length;
 }
 
+// A V3 delta frame can record the bounding box of the pixels it modifies in the
+// dirtyRect word. The box is stored in terms of square tiles so that the x, y
+// and the exclusive x2, y2 corners each fit into 8 bits. The tile size is the
+// smallest power of 2 (at least 16 pixels) that covers the larger frame dimension
+// in 255 tiles, so it depends only on the frame width and height. A zero word
+// means no box was recorded (keyframes, nop frames, older files) and the whole
+// frame must be treated as changed.
+
+static inline
+uint32_t maxvid_v3_dirtyrect_tilesize(uint32_t width, uint32_t height) {
+  uint32_t maxDim = (width > height) ? width : height;
+  uint32_t tileSize = 16;
+  while (((maxDim + tileSize - 1) / tileSize) > MV_MAX_8_BITS) {
+    tileSize <<= 1;
+  }
+  return tileSize;
+}
+
+// Set the dirty rect in terms of pixel coordinates, x2 and y2 are exclusive.
+// The stored box is rounded outward to tile bounds.
+
+static inline
+void maxvid_v3_frame_setdirtyrect(MVV3Frame *mvFrame, uint32_t width, uint32_t height,
+                                  uint32_t x, uint32_t y, uint32_t x2, uint32_t y2) {
+  assert(x < x2 && x2 <= width);
+  assert(y < y2 && y2 <= height);
+  const uint32_t tileSize = maxvid_v3_dirtyrect_tilesize(width, height);
+  uint32_t tx = x / tileSize;
+  uint32_t ty = y / tileSize;
+  uint32_t tx2 = (x2 + tileSize - 1) / tileSize;
+  uint32_t ty2 = (y2 + tileSize - 1) / tileSize;
+  mvFrame->dirtyRect = (tx << 24) | (ty << 16) | (tx2 << 8) | ty2;
+}
+
+static inline
+uint32_t maxvid_v3_frame_hasdirtyrect(MVV3Frame *mvFrame) {
+  return (mvFrame->dirtyRect != 0);
+}
+
+// Get the dirty rect in terms of pixel coordinates clamped to the frame size.
+// The caller must check maxvid_v3_frame_hasdirtyrect() first.
+
+static inline
+void maxvid_v3_frame_dirtyrect(MVV3Frame *mvFrame, uint32_t width, uint32_t height,
+                               uint32_t *xPtr, uint32_t *yPtr, uint32_t *x2Ptr, uint32_t *y2Ptr) {
+  const uint32_t tileSize = maxvid_v3_dirtyrect_tilesize(width, height);
+  const uint32_t word = mvFrame->dirtyRect;
+  uint32_t x2 = ((word >> 8) & MV_MAX_8_BITS) * tileSize;
+  uint32_t y2 = (word & MV_MAX_8_BITS) * tileSize;
+  *xPtr = (word >> 24) * tileSize;
+  *yPtr = ((word >> 16) & MV_MAX_8_BITS) * tileSize;
+  *x2Ptr = (x2 > width) ? width : x2;
+  *y2Ptr = (y2 > height) ? height : y2;
+}
+
 // Return non-zero if the framebuffer is so large that it cannot be stored as a maxvid file.
 // This basically means that the number of bytes is so huge that a 24 bit value cannot hold it.
 
@@ -371,3 +426,65 @@ uint32_t maxvid_adler32(
                         uint32_t adler,
                         unsigned char const *buf,
                         uint32_t len);
+
+// Delta composition
+//
+// When playback skips ahead over a series of delta frames, applying each delta in
+// turn writes a pixel that changes in every frame once per frame. A delta
+// composition collects the changed runs of consecutive 24/32 bpp c4 deltas into a
+// single sorted list of runs, where a run from a later delta replaces the pixels of
+// an earlier one. Applying the composition writes each changed pixel once. Runs
+// point at the pixels in the input buffers, so the input must stay mapped until the
+// composition has been applied or encoded.
+
+typedef struct {
+  uint32_t offset;
+  uint32_t numPixels;
+  // numPixels values for a COPY run, or the single value of a DUP run
+  const uint32_t *pixels;
+  uint32_t isDup;
+} MVDeltaRun;
+
+typedef struct {
+  MVDeltaRun *runs;
+  uint32_t numRuns;
+  uint32_t runsCapacity;
+  // Scratch space used while parsing and merging the next delta
+  MVDeltaRun *inputRuns;
+  uint32_t inputRunsCapacity;
+  MVDeltaRun *mergeRuns;
+  uint32_t mergeRunsCapacity;
+  uint32_t numDeltas;
+} MVDeltaComposition;
+
+// Drop the runs collected so far, buffers are kept for reuse
+
+void maxvid_delta_composition_reset(MVDeltaComposition *composition);
+
+void maxvid_delta_composition_free(MVDeltaComposition *composition);
+
+// Merge the c4 codes of the next delta frame into the composition. Returns 0 on
+// success or MV_ERROR_CODE_INVALID_INPUT if the codes are not valid.
+
+uint32_t
+maxvid_delta_composition_add_c4_sample32(MVDeltaComposition *composition,
+                                         const uint32_t *inputBuffer32,
+                                         const uint32_t inputBuffer32NumWords,
+                                         const uint32_t frameBufferSize);
+
+// Write the pixels of every run to the framebuffer, returns the number of pixels written.
+
+uint32_t
+maxvid_delta_composition_apply32(const MVDeltaComposition *composition,
+                                 uint32_t *frameBuffer32);
+
+// Emit the composition as c4 codes that can be passed to maxvid_decode_c4_sample32().
+// Returns the number of words in the encoded delta, pass a NULL outputBuffer32 to
+// query the size. The output is only complete when outputBuffer32NumWords is at
+// least the returned size.
+
+uint32_t
+maxvid_delta_composition_encode_c4_sample32(const MVDeltaComposition *composition,
+                                            uint32_t *outputBuffer32,
+                                            const uint32_t outputBuffer32NumWords,
+                                            const uint32_t frameBufferSize);
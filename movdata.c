@@ -2373,9 +2373,13 @@ result = (alpha << 24) | (alphaTable[red] << 16) | (alphaTable[green] << 8) | al
 // logic. This method must be invoked in the main thread to
 // avoid a race condition.
 
+static
+void init_unpremultiplyTables();
+
 void premultiply_init()
 {
   init_alphaTables();
+  init_unpremultiplyTables();
 }
 
 static inline
@@ -2459,6 +2463,547 @@ static
 void init_alphaTables() {
 }
 
+// Table that maps a premultiplied component to the unpremultiplied component
+// for each alpha value. Each entry is generated with unpremultiply() so that
+// table results are exactly the same as unpremultiply_bgra(). Note that an
+// invalid premultiplied component larger than the alpha is treated as if it
+// were equal to the alpha.
+
+static
+uint8_t unpremultiplyTables[PREMULT_TABLEMAX*PREMULT_TABLEMAX];
+
+static
+int unpremultiplyTablesReady = 0;
+
+static
+void init_unpremultiplyTables() {
+  if (unpremultiplyTablesReady) {
+    return;
+  }
+  
+  for (uint32_t alpha = 0; alpha < PREMULT_TABLEMAX; alpha++) {
+    uint8_t *table = &unpremultiplyTables[alpha * PREMULT_TABLEMAX];
+    
+    for (uint32_t component = 0; component < PREMULT_TABLEMAX; component++) {
+      uint32_t premultComponent = (component > alpha) ? alpha : component;
+      uint32_t pixel = unpremultiply_bgra((alpha << 24) | premultComponent);
+      table[component] = pixel & 0xFF;
+    }
+  }
+  
+  unpremultiplyTablesReady = 1;
+}
+
+// The premultiply table contains floor(C * A / 255) for each component and alpha.
+// With T = C * A this is computed as (T + (T >> 8) + 1) >> 8, the intermediate
+// values fit in 16 bits so that 8 components can be processed at once.
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+# include <arm_neon.h>
+# define PREMULTIPLY_FRAME_NEON 1
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define PREMULTIPLY_FRAME_SSE2 1
+#endif
+
+void premultiply_frame(const uint32_t *inPixels, uint32_t *outPixels, uint32_t numPixels)
+{
+  uint32_t pixeli = 0;
+  
+#if defined(PREMULTIPLY_FRAME_NEON)
+  const uint16x8_t one = vdupq_n_u16(1);
+  
+  for ( ; (pixeli + 8) <= numPixels; pixeli += 8) {
+    // Deinterleave 8 BGRA pixels into B, G, R, A vectors
+    uint8x8x4_t bgra = vld4_u8((const uint8_t*)&inPixels[pixeli]);
+    uint8x8_t alpha = bgra.val[3];
+    
+    for (int c = 0; c < 3; c++) {
+      uint16x8_t t = vmull_u8(bgra.val[c], alpha);
+      t = vaddq_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), one);
+      bgra.val[c] = vshrn_n_u16(t, 8);
+    }
+    
+    vst4_u8((uint8_t*)&outPixels[pixeli], bgra);
+  }
+#elif defined(PREMULTIPLY_FRAME_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+  
+  for ( ; (pixeli + 4) <= numPixels; pixeli += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)&inPixels[pixeli]);
+    
+    // Widen 2 pixels at a time to 16 bit components and broadcast the alpha
+    __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+    __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+    __m128i loAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+    __m128i hiAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+    
+    __m128i loT = _mm_mullo_epi16(lo, loAlpha);
+    __m128i hiT = _mm_mullo_epi16(hi, hiAlpha);
+    loT = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(loT, _mm_srli_epi16(loT, 8)), one), 8);
+    hiT = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hiT, _mm_srli_epi16(hiT, 8)), one), 8);
+    
+    __m128i result = _mm_packus_epi16(loT, hiT);
+    
+    // Keep the original alpha values
+    result = _mm_or_si128(_mm_andnot_si128(alphaMask, result), _mm_and_si128(alphaMask, pixels));
+    
+    _mm_storeu_si128((__m128i*)&outPixels[pixeli], result);
+  }
+#endif
+  
+  for ( ; pixeli < numPixels; pixeli++) {
+    uint32_t pixel = inPixels[pixeli];
+    uint32_t alpha = (pixel >> 24) & 0xFF;
+    uint32_t red = (pixel >> 16) & 0xFF;
+    uint32_t green = (pixel >> 8) & 0xFF;
+    uint32_t blue = (pixel >> 0) & 0xFF;
+    outPixels[pixeli] = premultiply_bgra_inline(red, green, blue, alpha);
+  }
+}
+
+// Unpremultiply is a table lookup per component. Runs of 4 fully opaque or
+// fully transparent pixels are common and are handled without a lookup.
+
+static inline
+uint32_t unpremultiply_bgra_table(uint32_t pixel)
+{
+  uint32_t alpha = (pixel >> 24) & 0xFF;
+  
+  if (alpha == 0xFF) {
+    return pixel;
+  }
+  
+  const uint8_t* const restrict table = &unpremultiplyTables[alpha * PREMULT_TABLEMAX];
+  uint32_t red = table[(pixel >> 16) & 0xFF];
+  uint32_t green = table[(pixel >> 8) & 0xFF];
+  uint32_t blue = table[(pixel >> 0) & 0xFF];
+  return (alpha << 24) | (red << 16) | (green << 8) | blue;
+}
+
+void unpremultiply_frame(const uint32_t *inPixels, uint32_t *outPixels, uint32_t numPixels)
+{
+  assert(unpremultiplyTablesReady);
+  
+  uint32_t pixeli = 0;
+  
+  for ( ; (pixeli + 4) <= numPixels; pixeli += 4) {
+    uint32_t p0 = inPixels[pixeli];
+    uint32_t p1 = inPixels[pixeli+1];
+    uint32_t p2 = inPixels[pixeli+2];
+    uint32_t p3 = inPixels[pixeli+3];
+    
+    if (((p0 & p1 & p2 & p3) >> 24) == 0xFF) {
+      // Nop
+    } else if (((p0 | p1 | p2 | p3) >> 24) == 0) {
+      p0 = p1 = p2 = p3 = 0;
+    } else {
+      p0 = unpremultiply_bgra_table(p0);
+      p1 = unpremultiply_bgra_table(p1);
+      p2 = unpremultiply_bgra_table(p2);
+      p3 = unpremultiply_bgra_table(p3);
+    }
+    
+    outPixels[pixeli] = p0;
+    outPixels[pixeli+1] = p1;
+    outPixels[pixeli+2] = p2;
+    outPixels[pixeli+3] = p3;
+  }
+  
+  for ( ; pixeli < numPixels; pixeli++) {
+    outPixels[pixeli] = unpremultiply_bgra_table(inPixels[pixeli]);
+  }
+}
+
+// Resampling filter kernels, the argument is the distance from the sample
+// center in units of input pixels (scaled when downsampling).
+
+#define RESAMPLE_WEIGHT_BITS 14
+#define RESAMPLE_WEIGHT_ONE (1 << RESAMPLE_WEIGHT_BITS)
+
+static
+double resample_bicubic(double t)
+{
+  t = fabs(t);
+  if (t < 1.0) {
+    return ((1.5 * t - 2.5) * t * t) + 1.0;
+  } else if (t < 2.0) {
+    return (((-0.5 * t + 2.5) * t - 4.0) * t) + 2.0;
+  }
+  return 0.0;
+}
+
+static
+double resample_sinc(double t)
+{
+  if (t == 0.0) {
+    return 1.0;
+  }
+  t *= M_PI;
+  return sin(t) / t;
+}
+
+static
+double resample_lanczos3(double t)
+{
+  if (fabs(t) < 3.0) {
+    return resample_sinc(t) * resample_sinc(t / 3.0);
+  }
+  return 0.0;
+}
+
+// Fill in the starting input index and the fixed point weights for each output
+// index along one axis. The weights for one output always sum to exactly
+// RESAMPLE_WEIGHT_ONE so that a constant region stays exactly the same.
+
+static
+int resample_axis_init(ResampleAxis *axis, uint32_t inSize, uint32_t outSize, ResampleFilter filter)
+{
+  double scale = (double)inSize / outSize;
+  double filterScale = (scale > 1.0) ? scale : 1.0;
+  double support;
+  
+  if (filter == RESAMPLE_FILTER_BOX) {
+    support = (filterScale * 0.5) + 0.5;
+  } else if (filter == RESAMPLE_FILTER_BICUBIC) {
+    support = 2.0 * filterScale;
+  } else {
+    support = 3.0 * filterScale;
+  }
+  
+  uint32_t span = (uint32_t)ceil(2.0 * support) + 2;
+  uint32_t numTaps = (span < inSize) ? span : inSize;
+  
+  axis->numTaps = numTaps;
+  axis->starts = malloc(outSize * sizeof(int32_t));
+  axis->weights = malloc(outSize * numTaps * sizeof(int16_t));
+  double *fweights = malloc(numTaps * sizeof(double));
+  
+  if (axis->starts == NULL || axis->weights == NULL || fweights == NULL) {
+    free(fweights);
+    return 0;
+  }
+  
+  for (uint32_t outi = 0; outi < outSize; outi++) {
+    double center = (outi + 0.5) * scale;
+    int32_t first = (int32_t)floor(center - support);
+    int32_t start = first;
+    if (start > (int32_t)(inSize - numTaps)) {
+      start = inSize - numTaps;
+    }
+    if (start < 0) {
+      start = 0;
+    }
+    
+    memset(fweights, 0, numTaps * sizeof(double));
+    double sum = 0.0;
+    
+    for (int32_t i = first; i < (first + (int32_t)span); i++) {
+      double w;
+      
+      if (filter == RESAMPLE_FILTER_BOX) {
+        // Area of input pixel i covered by the output pixel
+        double x1 = outi * scale;
+        double x2 = x1 + scale;
+        double lo = (i > x1) ? i : x1;
+        double hi = ((i + 1) < x2) ? (i + 1) : x2;
+        w = (hi > lo) ? (hi - lo) : 0.0;
+      } else {
+        double t = ((i + 0.5) - center) / filterScale;
+        w = (filter == RESAMPLE_FILTER_BICUBIC) ? resample_bicubic(t) : resample_lanczos3(t);
+      }
+      
+      if (w == 0.0) {
+        continue;
+      }
+      
+      int32_t clamped = i;
+      if (clamped < 0) {
+        clamped = 0;
+      } else if (clamped >= (int32_t)inSize) {
+        clamped = inSize - 1;
+      }
+      
+      assert((clamped - start) >= 0 && (clamped - start) < (int32_t)numTaps);
+      fweights[clamped - start] += w;
+      sum += w;
+    }
+    
+    // Normalize and round, any rounding error is added to the largest weight
+    
+    int16_t *weights = &axis->weights[outi * numTaps];
+    int32_t isum = 0;
+    uint32_t largest = 0;
+    
+    for (uint32_t tap = 0; tap < numTaps; tap++) {
+      double w = (sum != 0.0) ? (fweights[tap] / sum) : 0.0;
+      weights[tap] = (int16_t)lround(w * RESAMPLE_WEIGHT_ONE);
+      isum += weights[tap];
+      if (abs(weights[tap]) > abs(weights[largest])) {
+        largest = tap;
+      }
+    }
+    
+    weights[largest] += (RESAMPLE_WEIGHT_ONE - isum);
+    axis->starts[outi] = start;
+  }
+  
+  free(fweights);
+  return 1;
+}
+
+ResampleTables* resample_tables_create(uint32_t inWidth, uint32_t inHeight,
+                                       uint32_t outWidth, uint32_t outHeight,
+                                       ResampleFilter filter)
+{
+  assert(inWidth > 0 && inHeight > 0 && outWidth > 0 && outHeight > 0);
+  
+  ResampleTables *tables = calloc(1, sizeof(ResampleTables));
+  if (tables == NULL) {
+    return NULL;
+  }
+  
+  tables->inWidth = inWidth;
+  tables->inHeight = inHeight;
+  tables->outWidth = outWidth;
+  tables->outHeight = outHeight;
+  
+  if (!resample_axis_init(&tables->horizontal, inWidth, outWidth, filter) ||
+      !resample_axis_init(&tables->vertical, inHeight, outHeight, filter)) {
+    resample_tables_free(tables);
+    return NULL;
+  }
+  
+  return tables;
+}
+
+void resample_tables_free(ResampleTables *tables)
+{
+  if (tables == NULL) {
+    return;
+  }
+  free(tables->horizontal.starts);
+  free(tables->horizontal.weights);
+  free(tables->vertical.starts);
+  free(tables->vertical.weights);
+  free(tables);
+}
+
+// The horizontal pass writes 16 bit components with 6 fractional bits, which
+// leaves room for the overshoot of the BICUBIC and LANCZOS3 filters. The
+// vertical pass removes the 6 + 14 fractional bits and clamps to 8 bits.
+
+#define RESAMPLE_HORIZONTAL_SHIFT (RESAMPLE_WEIGHT_BITS - 6)
+#define RESAMPLE_VERTICAL_SHIFT (RESAMPLE_WEIGHT_BITS + 6)
+
+static inline
+int16_t resample_clamp16(int32_t value)
+{
+  if (value > INT16_MAX) {
+    return INT16_MAX;
+  } else if (value < INT16_MIN) {
+    return INT16_MIN;
+  }
+  return (int16_t)value;
+}
+
+static inline
+uint32_t resample_clamp8(int32_t value)
+{
+  if (value > 0xFF) {
+    return 0xFF;
+  } else if (value < 0) {
+    return 0;
+  }
+  return (uint32_t)value;
+}
+
+static
+void resample_horizontal_row(const ResampleAxis *axis,
+                             const uint32_t *inRow,
+                             int16_t *outRow,
+                             uint32_t outWidth)
+{
+  const uint32_t numTaps = axis->numTaps;
+  const int32_t round = 1 << (RESAMPLE_HORIZONTAL_SHIFT - 1);
+  
+  for (uint32_t x = 0; x < outWidth; x++) {
+    const uint32_t *inPtr = &inRow[axis->starts[x]];
+    const int16_t *weights = &axis->weights[x * numTaps];
+    uint32_t tap = 0;
+    
+#if defined(PREMULTIPLY_FRAME_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    
+    for ( ; (tap + 2) <= numTaps; tap += 2) {
+      // Interleave the components of 2 pixels as B0 B1 G0 G1 R0 R1 A0 A1 so that
+      // a multiply-add with W0 W1 pairs sums both taps for each component.
+      __m128i p0 = _mm_cvtsi32_si128((int)inPtr[tap]);
+      __m128i p1 = _mm_cvtsi32_si128((int)inPtr[tap+1]);
+      __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, p1), zero);
+      __m128i w = _mm_set1_epi32((int)(((uint32_t)(uint16_t)weights[tap+1] << 16) | (uint16_t)weights[tap]));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, w));
+    }
+    
+    if (tap < numTaps) {
+      __m128i p0 = _mm_cvtsi32_si128((int)inPtr[tap]);
+      __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, zero), zero);
+      __m128i w = _mm_set1_epi32((uint16_t)weights[tap]);
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, w));
+      tap++;
+    }
+    
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(round)), RESAMPLE_HORIZONTAL_SHIFT);
+    _mm_storel_epi64((__m128i*)&outRow[x * 4], _mm_packs_epi32(sum, sum));
+#else
+    int32_t sumB = 0, sumG = 0, sumR = 0, sumA = 0;
+    
+    for ( ; tap < numTaps; tap++) {
+      uint32_t pixel = inPtr[tap];
+      int32_t w = weights[tap];
+      sumB += w * (int32_t)(pixel & 0xFF);
+      sumG += w * (int32_t)((pixel >> 8) & 0xFF);
+      sumR += w * (int32_t)((pixel >> 16) & 0xFF);
+      sumA += w * (int32_t)(pixel >> 24);
+    }
+    
+    outRow[x * 4 + 0] = resample_clamp16((sumB + round) >> RESAMPLE_HORIZONTAL_SHIFT);
+    outRow[x * 4 + 1] = resample_clamp16((sumG + round) >> RESAMPLE_HORIZONTAL_SHIFT);
+    outRow[x * 4 + 2] = resample_clamp16((sumR + round) >> RESAMPLE_HORIZONTAL_SHIFT);
+    outRow[x * 4 + 3] = resample_clamp16((sumA + round) >> RESAMPLE_HORIZONTAL_SHIFT);
+#endif
+  }
+}
+
+// Combine numTaps rows of horizontal pass output into one row of pixels
+
+static
+void resample_vertical_row(const int16_t *weights,
+                           uint32_t numTaps,
+                           const int16_t *inRows,
+                           uint32_t inRowStride,
+                           uint32_t *outRow,
+                           uint32_t outWidth,
+                           int isOpaque)
+{
+  const int32_t round = 1 << (RESAMPLE_VERTICAL_SHIFT - 1);
+  const uint32_t numComponents = outWidth * 4;
+  uint32_t i = 0;
+  
+#if defined(PREMULTIPLY_FRAME_SSE2)
+  const __m128i roundVec = _mm_set1_epi32(round);
+  
+  for ( ; (i + 8) <= numComponents; i += 8) {
+    __m128i sumLo = _mm_setzero_si128();
+    __m128i sumHi = _mm_setzero_si128();
+    uint32_t tap = 0;
+    
+    for ( ; (tap + 2) <= numTaps; tap += 2) {
+      __m128i r0 = _mm_loadu_si128((const __m128i*)&inRows[(tap * inRowStride) + i]);
+      __m128i r1 = _mm_loadu_si128((const __m128i*)&inRows[((tap + 1) * inRowStride) + i]);
+      __m128i w = _mm_set1_epi32((int)(((uint32_t)(uint16_t)weights[tap+1] << 16) | (uint16_t)weights[tap]));
+      sumLo = _mm_add_epi32(sumLo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w));
+      sumHi = _mm_add_epi32(sumHi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w));
+    }
+    
+    if (tap < numTaps) {
+      __m128i r0 = _mm_loadu_si128((const __m128i*)&inRows[(tap * inRowStride) + i]);
+      __m128i zero = _mm_setzero_si128();
+      __m128i w = _mm_set1_epi32((uint16_t)weights[tap]);
+      sumLo = _mm_add_epi32(sumLo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, zero), w));
+      sumHi = _mm_add_epi32(sumHi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, zero), w));
+    }
+    
+    sumLo = _mm_srai_epi32(_mm_add_epi32(sumLo, roundVec), RESAMPLE_VERTICAL_SHIFT);
+    sumHi = _mm_srai_epi32(_mm_add_epi32(sumHi, roundVec), RESAMPLE_VERTICAL_SHIFT);
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sumLo, sumHi), _mm_setzero_si128());
+    
+    if (!isOpaque) {
+      // Broadcast each alpha byte to the 4 bytes of its pixel and take the minimum
+      __m128i alpha = _mm_srli_epi32(packed, 24);
+      alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+      alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+      packed = _mm_min_epu8(packed, alpha);
+    }
+    
+    _mm_storel_epi64((__m128i*)&outRow[i / 4], packed);
+  }
+#endif
+  
+  for ( ; i < numComponents; i += 4) {
+    int32_t sums[4] = { 0, 0, 0, 0 };
+    
+    for (uint32_t tap = 0; tap < numTaps; tap++) {
+      const int16_t *in = &inRows[(tap * inRowStride) + i];
+      int32_t w = weights[tap];
+      sums[0] += w * in[0];
+      sums[1] += w * in[1];
+      sums[2] += w * in[2];
+      sums[3] += w * in[3];
+    }
+    
+    uint32_t blue = resample_clamp8((sums[0] + round) >> RESAMPLE_VERTICAL_SHIFT);
+    uint32_t green = resample_clamp8((sums[1] + round) >> RESAMPLE_VERTICAL_SHIFT);
+    uint32_t red = resample_clamp8((sums[2] + round) >> RESAMPLE_VERTICAL_SHIFT);
+    uint32_t alpha = resample_clamp8((sums[3] + round) >> RESAMPLE_VERTICAL_SHIFT);
+    
+    if (!isOpaque) {
+      blue = (blue > alpha) ? alpha : blue;
+      green = (green > alpha) ? alpha : green;
+      red = (red > alpha) ? alpha : red;
+    }
+    
+    outRow[i / 4] = (alpha << 24) | (red << 16) | (green << 8) | blue;
+  }
+}
+
+void resample_rows(const ResampleTables *tables,
+                   const uint32_t *inPixels,
+                   uint32_t *outPixels,
+                   uint32_t outRowStart,
+                   uint32_t outRowEnd,
+                   int isOpaque)
+{
+  assert(outRowStart < outRowEnd && outRowEnd <= tables->outHeight);
+  
+  const ResampleAxis *vertical = &tables->vertical;
+  const uint32_t outWidth = tables->outWidth;
+  const uint32_t numTaps = vertical->numTaps;
+  
+  // The vertical starts increase with the output row, so the input rows needed
+  // for this range of output rows are contiguous.
+  
+  const uint32_t firstInRow = vertical->starts[outRowStart];
+  const uint32_t lastInRow = vertical->starts[outRowEnd - 1] + numTaps;
+  const uint32_t inRowStride = outWidth * 4;
+  
+  int16_t *horizontalRows = malloc((lastInRow - firstInRow) * inRowStride * sizeof(int16_t));
+  assert(horizontalRows);
+  
+  for (uint32_t inRow = firstInRow; inRow < lastInRow; inRow++) {
+    resample_horizontal_row(&tables->horizontal,
+                            &inPixels[inRow * tables->inWidth],
+                            &horizontalRows[(inRow - firstInRow) * inRowStride],
+                            outWidth);
+  }
+  
+  for (uint32_t outRow = outRowStart; outRow < outRowEnd; outRow++) {
+    uint32_t inRow = vertical->starts[outRow];
+    resample_vertical_row(&vertical->weights[outRow * numTaps],
+                          numTaps,
+                          &horizontalRows[(inRow - firstInRow) * inRowStride],
+                          inRowStride,
+                          &outPixels[outRow * outWidth],
+                          outWidth,
+                          isOpaque);
+  }
+  
+  free(horizontalRows);
+}
+
 /*
 
 // This is the old floating point multiplicaiton impl
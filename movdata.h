@@ -58,6 +58,68 @@ uint32_t premultiply_bgra_inline(uint32_t red, uint32_t green, uint32_t blue, ui
 
 uint32_t unpremultiply_bgra(uint32_t premultPixelBGRA);
 
+// Frame level premultiply and unpremultiply of numPixels BGRA pixels. These
+// functions operate on a whole buffer at a time, so the premultiply can make
+// use of vector instructions. premultiply_frame() returns exactly the same
+// results as premultiply_bgra_inline(). unpremultiply_frame() returns exactly
+// the same results as unpremultiply_bgra() for valid premultiplied input, where
+// no component is larger than the alpha. An invalid component that is larger
+// than the alpha is clamped to the alpha before it is unpremultiplied. The in
+// and out pointers can be the same buffer. Note that premultiply_init() must be
+// invoked before calling either function.
+
+void premultiply_frame(const uint32_t *inPixels, uint32_t *outPixels, uint32_t numPixels);
+
+void unpremultiply_frame(const uint32_t *inPixels, uint32_t *outPixels, uint32_t numPixels);
+
+// Separable resampling of premultiplied BGRA pixels. The filter weights for
+// each output column and row are computed once by resample_tables_create()
+// and stored as 1.14 fixed point values, so that the same tables can be used
+// for every frame of a movie. The BOX filter averages the input pixels covered
+// by each output pixel (an exact 2x2 average for a half size resize), the
+// BICUBIC filter is Catmull-Rom and LANCZOS3 uses a 3 lobe windowed sinc.
+// Edge pixels are repeated past the borders of the input image.
+
+typedef enum {
+  RESAMPLE_FILTER_BOX = 0,
+  RESAMPLE_FILTER_BICUBIC,
+  RESAMPLE_FILTER_LANCZOS3
+} ResampleFilter;
+
+typedef struct {
+  uint32_t numTaps;
+  int32_t *starts;
+  int16_t *weights;
+} ResampleAxis;
+
+typedef struct {
+  uint32_t inWidth;
+  uint32_t inHeight;
+  uint32_t outWidth;
+  uint32_t outHeight;
+  ResampleAxis horizontal;
+  ResampleAxis vertical;
+} ResampleTables;
+
+ResampleTables* resample_tables_create(uint32_t inWidth, uint32_t inHeight,
+                                       uint32_t outWidth, uint32_t outHeight,
+                                       ResampleFilter filter);
+
+void resample_tables_free(ResampleTables *tables);
+
+// Resample output rows in the range [outRowStart, outRowEnd). Each call reads
+// only the input rows that contribute to the indicated output rows, so that
+// distinct row ranges can be processed on different threads at the same time.
+// When isOpaque is zero the color components are clamped to the alpha value
+// so that filter overshoot cannot produce an invalid premultiplied pixel.
+
+void resample_rows(const ResampleTables *tables,
+                   const uint32_t *inPixels,
+                   uint32_t *outPixels,
+                   uint32_t outRowStart,
+                   uint32_t outRowEnd,
+                   int isOpaque);
+
 // Contains specific data about a sample. A sample contains
 // info that tells the system how to decompress movie data
 // for a specific frame. But, multiple frames could map to